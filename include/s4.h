@@ -24,6 +24,7 @@ typedef enum {
 	S4_NEW    = 1 << 0,
 	S4_EXISTS = 1 << 1,
 	S4_MEMORY = 1 << 2,
+	S4_INCREMENTAL = 1 << 3,
 } s4_open_flag_t;
 
 /**
@@ -31,6 +32,7 @@ typedef enum {
  */
 typedef enum {
 	S4_TRANS_READONLY = 1 << 0,
+	S4_TRANS_NOSYNC = 1 << 1,
 } s4_transaction_flag_t;
 
 /**
@@ -50,6 +52,7 @@ typedef enum {
 	S4E_EXECUTE, /**< One of the operations in the transaction failed */
 	S4E_LOGFULL, /**< Not enough room in the log for the transaction. */
 	S4E_READONLY, /**< Tried to use s4_add or s4_del on a read-only transaction */
+	S4E_BULK, /**< Tried to begin a transaction while a bulk load is open */
 } s4_errno_t;
 
 typedef enum {
@@ -59,6 +62,7 @@ typedef enum {
 } s4_cmp_mode_t;
 
 typedef struct s4_St s4_t;
+typedef struct s4_options_St s4_options_t;
 
 /* val.c */
 typedef struct s4_val_St s4_val_t;
@@ -79,10 +83,95 @@ int s4_val_cmp (const s4_val_t *v1, const s4_val_t *v2, s4_cmp_mode_t mode);
 
 /* s4.c */
 s4_t *s4_open (const char *name, const char **indices, int flags);
+s4_t *s4_open_with_options (const char *name, const char **indices, int flags,
+		const s4_options_t *opts);
 int s4_close (s4_t *s4);
 void s4_sync (s4_t *s4);
+void s4_flush_log (s4_t *s4);
 s4_errno_t s4_errno (void);
 
+/* options.c */
+#define S4_LOG_DEFAULT_SIZE (2*1024*1024)
+#define S4_LOG_MIN_SIZE (64*1024)
+#define S4_LOG_MAX_SIZE (256*1024*1024)
+#define S4_LOG_DEFAULT_FLUSH_INTERVAL 200
+
+s4_options_t *s4_options_create (void);
+void s4_options_free (s4_options_t *opts);
+void s4_options_set_log_size (s4_options_t *opts, int32_t size);
+void s4_options_set_flush_interval (s4_options_t *opts, int msec);
+void s4_options_set_query_threads (s4_options_t *opts, int threads);
+void s4_options_set_sort_keys (s4_options_t *opts, int enable);
+void s4_options_set_token_index (s4_options_t *opts, int enable);
+void s4_options_set_query_cache (s4_options_t *opts, int size);
+void s4_options_set_compact_strings (s4_options_t *opts, int enable);
+
+/* bulk.c */
+typedef struct s4_bulk_St s4_bulk_t;
+
+s4_bulk_t *s4_bulk_begin (s4_t *s4);
+int s4_bulk_add (s4_bulk_t *bulk,
+		const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b,
+		const char *src);
+int s4_bulk_finish (s4_bulk_t *bulk);
+void s4_bulk_abort (s4_bulk_t *bulk);
+
+/* index.c */
+#define S4_INDEX_HISTOGRAM_SIZE 16
+
+/**
+ * Statistics about an index
+ */
+typedef struct {
+	int values; /**< The number of distinct values */
+	int entries; /**< The number of value-entry pairs */
+	/** histogram[i] is the number of values with 2^i to 2^(i+1)-1
+	 * entries. The last bucket also counts the values with more */
+	int histogram[S4_INDEX_HISTOGRAM_SIZE];
+	int depth; /**< The number of levels in the tree */
+	int leaves; /**< The number of leaves in the tree */
+} s4_index_stats_t;
+
+int s4_index_get_stats (s4_t *s4, const char *key, int parent, s4_index_stats_t *stats);
+
+/* stats.c */
+#define S4_STATS_HISTOGRAM_SIZE 24
+
+/**
+ * How long something took, every time it happened
+ */
+typedef struct {
+	int64_t count; /**< The number of times it happened */
+	int64_t usec; /**< The total time in microseconds */
+	/** histogram[i] is the number of times it took 2^i to 2^(i+1)-1
+	 * microseconds. The first bucket also counts times under a
+	 * microsecond, and the last bucket longer times */
+	int64_t histogram[S4_STATS_HISTOGRAM_SIZE];
+} s4_stats_timer_t;
+
+/**
+ * What a database has been doing since it was opened
+ */
+typedef struct {
+	s4_stats_timer_t lock_wait; /**< Waits for locks held by other transactions */
+	int64_t deadlocks; /**< Lock waits given up because they would deadlock */
+	s4_stats_timer_t log_fsync; /**< Syncs of the log to disk */
+	int64_t log_full; /**< Commits that did not fit in the log */
+	int32_t log_used; /**< Bytes of the log written since the last checkpoint */
+	int32_t log_size; /**< The size of the log */
+	s4_stats_timer_t sync; /**< Writes of the database file */
+	s4_stats_timer_t query; /**< Queries run with s4_query */
+	int64_t query_cache_hits; /**< Queries answered by the query cache */
+	int64_t plan_indexed; /**< Queries that found their candidates in indices */
+	int64_t plan_scanned; /**< Queries that had to check every entry */
+	int64_t rows_examined; /**< Candidates checked by s4_query */
+	int64_t rows_returned; /**< Rows returned by s4_query */
+	s4_stats_timer_t recovery; /**< Redoing the log after opening the database */
+	int64_t recovered; /**< Transactions redone from the log after opening */
+} s4_stats_t;
+
+void s4_get_stats (s4_t *s4, s4_stats_t *stats);
 
 /* uuid.c */
 void s4_create_uuid (unsigned char uuid[16]);
@@ -197,10 +286,19 @@ int s4_resultset_get_row (const s4_resultset_t *set, int row_no, const s4_result
 const s4_result_t *s4_resultset_get_result (const s4_resultset_t *set, int row, int col);
 int s4_resultset_get_colcount (const s4_resultset_t *set);
 int s4_resultset_get_rowcount (const s4_resultset_t *set);
+
+/**
+ * Resultsets are reference counted, and start out with one reference
+ * held by whoever created or queried them. s4_resultset_free drops a
+ * reference just like s4_resultset_unref, so it only frees the set once
+ * every s4_resultset_ref is matched. Call one of the two exactly once
+ * for every set you got, plus once for every s4_resultset_ref.
+ */
 void s4_resultset_free (s4_resultset_t *set);
 s4_resultset_t *s4_resultset_ref (s4_resultset_t *set);
 void s4_resultset_unref (s4_resultset_t *set);
 void s4_resultset_sort (s4_resultset_t *set, s4_order_t *order);
+void s4_resultset_sort_limit (s4_resultset_t *set, s4_order_t *order, int limit);
 void s4_resultset_shuffle (s4_resultset_t *set);
 
 typedef enum {
@@ -219,6 +317,7 @@ typedef struct s4_pattern_St s4_pattern_t;
 
 s4_pattern_t *s4_pattern_create (const char *pattern, int normalize);
 int s4_pattern_match (const s4_pattern_t *p, const s4_val_t *val);
+const char *s4_pattern_get_prefix (const s4_pattern_t *p);
 void s4_pattern_free (s4_pattern_t *pattern);
 
 /* string.c */
@@ -241,5 +340,28 @@ int s4_del (s4_transaction_t *trans,
 s4_resultset_t *s4_query (s4_transaction_t *trans,
 		s4_fetchspec_t *fs, s4_condition_t *cond);
 
+typedef struct s4_cursor_St s4_cursor_t;
+s4_cursor_t *s4_query_cursor (s4_transaction_t *trans,
+		s4_fetchspec_t *fs, s4_condition_t *cond, int offset, int limit);
+int s4_cursor_next (s4_cursor_t *cursor, const s4_resultrow_t **row);
+void s4_cursor_free (s4_cursor_t *cursor);
+s4_resultset_t *s4_query_ordered (s4_transaction_t *trans,
+		s4_fetchspec_t *fs, s4_condition_t *cond,
+		s4_order_t *order, int offset, int limit);
+
+typedef enum {
+	S4_AGGREGATE_COUNT,
+	S4_AGGREGATE_SUM,
+	S4_AGGREGATE_MIN,
+	S4_AGGREGATE_MAX
+} s4_aggregate_t;
+
+int s4_query_count (s4_transaction_t *trans, s4_condition_t *cond);
+s4_resultset_t *s4_query_distinct (s4_transaction_t *trans,
+		s4_condition_t *cond, const char *key, s4_sourcepref_t *sp);
+s4_resultset_t *s4_query_group (s4_transaction_t *trans, s4_condition_t *cond,
+		const char *group_key, s4_sourcepref_t *group_sp,
+		s4_aggregate_t type, const char *key, s4_sourcepref_t *sp);
+
 
 #endif /* _S4_H */
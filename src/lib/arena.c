@@ -0,0 +1,155 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+
+/**
+ *
+ * @internal
+ * @defgroup Arena Arena
+ * @ingroup S4
+ * @brief Memory that is freed all at once.
+ *
+ * Queries allocate their rows and results from an arena, so a
+ * resultset is a handful of large allocations instead of one for
+ * every value. Nothing allocated in an arena is freed on its own,
+ * everything goes when the last reference to the arena is dropped.
+ *
+ * An arena is not thread safe, but references can be taken
+ * and dropped from any thread.
+ *
+ * @{
+ */
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct arena_chunk_St {
+	struct arena_chunk_St *next;
+	size_t used, size;
+} arena_chunk_t;
+
+/* Where the memory of a chunk starts, aligned for anything we store */
+#define CHUNK_HEADER ((sizeof (arena_chunk_t) + 7) & ~(size_t)7)
+#define CHUNK_DATA(c) ((char*)(c) + CHUNK_HEADER)
+
+struct s4_arena_St {
+	gint ref_count;
+	/* The chunk allocations are taken from, followed by the full ones */
+	arena_chunk_t *chunks;
+};
+
+static arena_chunk_t *_chunk_new (size_t size)
+{
+	arena_chunk_t *chunk = malloc (CHUNK_HEADER + size);
+
+	chunk->next = NULL;
+	chunk->used = 0;
+	chunk->size = size;
+
+	return chunk;
+}
+
+/**
+ * Creates a new arena.
+ *
+ * @return A new arena with one reference
+ */
+s4_arena_t *_arena_new (void)
+{
+	s4_arena_t *arena = malloc (sizeof (s4_arena_t));
+
+	arena->ref_count = 1;
+	arena->chunks = NULL;
+
+	return arena;
+}
+
+/**
+ * Allocates memory in an arena.
+ *
+ * @param arena The arena to allocate in
+ * @param size The number of bytes to allocate
+ * @return The memory, aligned to 8 bytes. It is freed with the arena.
+ */
+void *_arena_alloc (s4_arena_t *arena, size_t size)
+{
+	arena_chunk_t *chunk = arena->chunks;
+	void *ret;
+
+	size = (size + 7) & ~(size_t)7;
+
+	/* Big allocations get their own chunk behind the current one */
+	if (size > ARENA_CHUNK_SIZE / 4) {
+		chunk = _chunk_new (size);
+		chunk->used = size;
+
+		if (arena->chunks == NULL) {
+			arena->chunks = chunk;
+		} else {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		}
+
+		return CHUNK_DATA (chunk);
+	}
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk = _chunk_new (ARENA_CHUNK_SIZE);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	ret = CHUNK_DATA (chunk) + chunk->used;
+	chunk->used += size;
+
+	return ret;
+}
+
+/**
+ * References an arena.
+ *
+ * @param arena The arena
+ * @return The arena given
+ */
+s4_arena_t *_arena_ref (s4_arena_t *arena)
+{
+	g_atomic_int_inc (&arena->ref_count);
+	return arena;
+}
+
+/**
+ * Unreferences an arena. When the last reference is dropped
+ * the arena and everything allocated in it is freed.
+ *
+ * @param arena The arena
+ */
+void _arena_unref (s4_arena_t *arena)
+{
+	arena_chunk_t *chunk, *next;
+
+	if (!g_atomic_int_dec_and_test (&arena->ref_count))
+		return;
+
+	for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free (chunk);
+	}
+
+	free (arena);
+}
+
+/**
+ * @}
+ */
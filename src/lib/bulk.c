@@ -0,0 +1,193 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @defgroup Bulk Bulk loading
+ * @ingroup S4
+ * @brief Adds many relations at once, without transactions.
+ *
+ * Relations added to a bulk load are collected and only inserted
+ * when the load finishes. They are then sorted by key A and value A,
+ * so every entry is looked up and created once and the a-indexes are
+ * filled in order. Nothing is locked and nothing is written to the
+ * log, instead a full checkpoint is written when the load is done.
+ *
+ * No transaction may run on the database between s4_bulk_begin and
+ * s4_bulk_finish. s4_begin fails with S4E_BULK while a load is open,
+ * but transactions begun before the load must be done before it
+ * begins. Relations that were not checkpointed yet are lost if the
+ * program crashes while loading.
+ *
+ * @{
+ */
+
+typedef struct {
+	const char *key_a;
+	const s4_val_t *val_a;
+	const char *key_b;
+	const s4_val_t *val_b;
+	const char *src;
+	/* The casefolded string of val_a, NULL if it is an integer */
+	const char *fold_a;
+} bulk_relation_t;
+
+struct s4_bulk_St {
+	s4_t *s4;
+	GArray *relations;
+};
+
+/**
+ * Sorts relations by key A and value A. Relations with equal
+ * values that are still different values are kept apart, as
+ * they belong to different entries. The values are constants,
+ * so relations of the same entry have the same value, and strings
+ * are compared by the casefolded string found when they were added.
+ */
+static int _relation_cmp (const void *a, const void *b)
+{
+	const bulk_relation_t *ra = a, *rb = b;
+	int ret;
+
+	if (ra->key_a != rb->key_a) {
+		return ((char*)ra->key_a > (char*)rb->key_a) - ((char*)ra->key_a < (char*)rb->key_a);
+	}
+	if (ra->val_a == rb->val_a) {
+		return 0;
+	}
+
+	if (ra->fold_a != NULL && rb->fold_a != NULL) {
+		ret = strcmp (ra->fold_a, rb->fold_a);
+	} else {
+		ret = s4_val_cmp (ra->val_a, rb->val_a, S4_CMP_CASELESS);
+	}
+	if (ret == 0) {
+		ret = ((char*)ra->val_a > (char*)rb->val_a) - ((char*)ra->val_a < (char*)rb->val_a);
+	}
+
+	return ret;
+}
+
+/**
+ * Starts a bulk load. Until it is finished or aborted
+ * no transaction can begin on the database.
+ *
+ * @param s4 The database to load into
+ * @return A new bulk load
+ */
+s4_bulk_t *s4_bulk_begin (s4_t *s4)
+{
+	s4_bulk_t *bulk = malloc (sizeof (s4_bulk_t));
+
+	g_atomic_int_inc (&s4->bulk_loads);
+
+	bulk->s4 = s4;
+	bulk->relations = g_array_new (FALSE, FALSE, sizeof (bulk_relation_t));
+
+	return bulk;
+}
+
+/**
+ * Adds a relation to a bulk load.
+ * The relation is not visible until the load is finished.
+ *
+ * @param bulk The bulk load
+ * @param key_a Key A.
+ * @param val_a Value A.
+ * @param key_b Key B.
+ * @param val_b Value B.
+ * @param src Source.
+ * @return 0 on error (and sets s4_errno to S4E_EXECUTE),
+ * non-zero on success.
+ */
+int s4_bulk_add (s4_bulk_t *bulk,
+		const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b,
+		const char *src)
+{
+	bulk_relation_t rel;
+
+	if (bulk == NULL || key_a == NULL || val_a == NULL
+			|| key_b == NULL || val_b == NULL || src == NULL) {
+		s4_set_errno (S4E_EXECUTE);
+		return 0;
+	}
+
+	rel.key_a = _string_lookup (bulk->s4, key_a);
+	rel.val_a = _const_lookup (bulk->s4, val_a);
+	rel.key_b = _string_lookup (bulk->s4, key_b);
+	rel.val_b = _const_lookup (bulk->s4, val_b);
+	rel.src = _string_lookup (bulk->s4, src);
+	if (!s4_val_get_casefolded_str (rel.val_a, &rel.fold_a))
+		rel.fold_a = NULL;
+
+	g_array_append_val (bulk->relations, rel);
+
+	return 1;
+}
+
+/**
+ * Throws away a bulk load without adding anything.
+ *
+ * @param bulk The bulk load to free
+ */
+void s4_bulk_abort (s4_bulk_t *bulk)
+{
+	g_atomic_int_add (&bulk->s4->bulk_loads, -1);
+	g_array_free (bulk->relations, TRUE);
+	free (bulk);
+}
+
+/**
+ * Adds everything in a bulk load to the database, writes
+ * a checkpoint, and frees the bulk load.
+ *
+ * @param bulk The bulk load
+ * @return 0 on error, non-zero on success. If the checkpoint could
+ * not be written s4_errno is set to S4E_OPEN, the relations are
+ * still added but will be lost when the database is closed.
+ */
+int s4_bulk_finish (s4_bulk_t *bulk)
+{
+	s4_t *s4 = bulk->s4;
+	bulk_relation_t *rels = (bulk_relation_t*)bulk->relations->data;
+	int i, ret = 1;
+
+	qsort (rels, bulk->relations->len, sizeof (bulk_relation_t), _relation_cmp);
+
+	for (i = 0; i < bulk->relations->len; i++) {
+		_s4_add_internal (s4, rels[i].key_a, rels[i].val_a,
+				rels[i].key_b, rels[i].val_b, rels[i].src);
+	}
+
+	if (s4->query_cache != NULL)
+		_query_cache_clear (s4->query_cache);
+
+	if (!(s4->open_flags & S4_MEMORY) && !_write_full_file (s4)) {
+		s4_set_errno (S4E_OPEN);
+		ret = 0;
+	}
+
+	/* Transactions can begin again once the relations are written */
+	s4_bulk_abort (bulk);
+
+	return ret;
+}
+
+/**
+ * @}
+ */
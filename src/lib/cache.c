@@ -0,0 +1,358 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+
+/**
+ *
+ * @internal
+ * @defgroup QueryCache Query cache
+ * @ingroup S4
+ * @brief Keeps the results of recent queries.
+ *
+ * Results are cached by the condition and fetchspec that made them,
+ * compared by what they contain, not by pointer. A result remembers
+ * the snapshot it was computed in and the keys it depends on: the keys
+ * of its filters and of its fetchspec. A commit that changes a
+ * relation with one of those keys as key A or key B drops the result.
+ * Results of conditions that filter on every key or use S4_COMBINE_NOT
+ * can change when any key changes, and are dropped on every commit.
+ *
+ * Every commit stamps the database while holding the version lock
+ * (see _entry_stamp_versions), and drops results before releasing it.
+ * Results are only added under the same lock, and only if nothing was
+ * stamped after the snapshot they were computed in, so a cached result
+ * is what a query would find for every snapshot from its own on.
+ *
+ * @{
+ */
+
+typedef struct cache_entry_St {
+	guint hash;
+	/* Copies of what the query was made with */
+	s4_condition_t *cond;
+	s4_fetchspec_t *fs;
+	s4_resultset_t *set;
+
+	/* The snapshot the result was computed in */
+	guint64 snapshot;
+	/* The interned keys the result depends on, NULL for every key */
+	GPtrArray *keys;
+
+	/* Least recently used order, newest first */
+	struct cache_entry_St *prev, *next;
+} cache_entry_t;
+
+struct s4_query_cache_St {
+	GMutex lock;
+	int size;
+	GHashTable *entries;
+	cache_entry_t *newest, *oldest;
+};
+
+static guint _entry_hash (gconstpointer p)
+{
+	return ((const cache_entry_t*)p)->hash;
+}
+
+static gboolean _entry_equal (gconstpointer a, gconstpointer b)
+{
+	const cache_entry_t *ea = a, *eb = b;
+
+	return ea->hash == eb->hash &&
+		s4_cond_equal (ea->cond, eb->cond) &&
+		s4_fetchspec_equal (ea->fs, eb->fs);
+}
+
+static void _entry_unlink (s4_query_cache_t *cache, cache_entry_t *entry)
+{
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		cache->newest = entry->next;
+
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache->oldest = entry->prev;
+}
+
+static void _entry_link_newest (s4_query_cache_t *cache, cache_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->newest;
+
+	if (cache->newest != NULL)
+		cache->newest->prev = entry;
+	else
+		cache->oldest = entry;
+	cache->newest = entry;
+}
+
+/* Removes an entry from the cache and frees it */
+static void _entry_remove (s4_query_cache_t *cache, cache_entry_t *entry)
+{
+	g_hash_table_remove (cache->entries, entry);
+	_entry_unlink (cache, entry);
+
+	s4_cond_unref (entry->cond);
+	s4_fetchspec_unref (entry->fs);
+	s4_resultset_unref (entry->set);
+	if (entry->keys != NULL)
+		g_ptr_array_free (entry->keys, TRUE);
+	free (entry);
+}
+
+/**
+ * Adds the keys a condition depends on to an array.
+ *
+ * @param cond The condition
+ * @param keys The array to add to
+ * @return 0 if the condition depends on every key, non-zero otherwise
+ */
+static int _cond_keys (s4_condition_t *cond, GPtrArray *keys)
+{
+	s4_condition_t *op;
+	int i;
+
+	if (s4_cond_is_filter (cond)) {
+		if (s4_cond_get_key (cond) == NULL)
+			return 0;
+		g_ptr_array_add (keys, (void*)s4_cond_get_key (cond));
+		return 1;
+	}
+
+	/* NOT matches entries that have none of the keys it checks */
+	if (s4_cond_get_combiner_type (cond) == S4_COMBINE_NOT)
+		return 0;
+
+	for (i = 0; (op = s4_cond_get_operand (cond, i)) != NULL; i++) {
+		if (!_cond_keys (op, keys))
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Finds the keys a query depends on
+ *
+ * @param cond The condition of the query, with interned keys
+ * @param fs The fetchspec of the query, with interned keys
+ * @return The keys, or NULL if the query depends on every key
+ */
+static GPtrArray *_query_keys (s4_condition_t *cond, s4_fetchspec_t *fs)
+{
+	GPtrArray *keys = g_ptr_array_new ();
+	int i;
+
+	if (!_cond_keys (cond, keys))
+		goto every_key;
+
+	for (i = 0; i < s4_fetchspec_size (fs); i++) {
+		if (s4_fetchspec_get_key (fs, i) == NULL)
+			goto every_key;
+		g_ptr_array_add (keys, (void*)s4_fetchspec_get_key (fs, i));
+	}
+
+	return keys;
+
+every_key:
+	g_ptr_array_free (keys, TRUE);
+	return NULL;
+}
+
+/**
+ * Creates a new query cache.
+ *
+ * @param size The largest number of results to keep
+ * @return The new cache
+ */
+s4_query_cache_t *_query_cache_new (int size)
+{
+	s4_query_cache_t *cache = malloc (sizeof (s4_query_cache_t));
+
+	g_mutex_init (&cache->lock);
+	cache->size = size;
+	cache->entries = g_hash_table_new (_entry_hash, _entry_equal);
+	cache->newest = cache->oldest = NULL;
+
+	return cache;
+}
+
+/**
+ * Drops every result in a cache.
+ *
+ * @param cache The cache to clear
+ */
+void _query_cache_clear (s4_query_cache_t *cache)
+{
+	g_mutex_lock (&cache->lock);
+	while (cache->newest != NULL)
+		_entry_remove (cache, cache->newest);
+	g_mutex_unlock (&cache->lock);
+}
+
+/**
+ * Frees a query cache and the results in it.
+ *
+ * @param cache The cache to free
+ */
+void _query_cache_free (s4_query_cache_t *cache)
+{
+	_query_cache_clear (cache);
+	g_hash_table_destroy (cache->entries);
+	g_mutex_clear (&cache->lock);
+	free (cache);
+}
+
+/**
+ * Looks up the result of a query.
+ *
+ * @param cache The cache to look in
+ * @param snapshot The snapshot the query runs in
+ * @param cond The condition of the query
+ * @param fs The fetchspec of the query
+ * @return A copy of the result that shares its rows with the cached
+ * one, or NULL if it is not cached or was computed in a later snapshot
+ */
+s4_resultset_t *_query_cache_lookup (s4_query_cache_t *cache, guint64 snapshot,
+		s4_condition_t *cond, s4_fetchspec_t *fs)
+{
+	cache_entry_t key, *entry;
+	s4_resultset_t *ret = NULL;
+
+	key.hash = s4_cond_hash (cond) * 31 + s4_fetchspec_hash (fs);
+	key.cond = cond;
+	key.fs = fs;
+
+	g_mutex_lock (&cache->lock);
+	entry = g_hash_table_lookup (cache->entries, &key);
+	if (entry != NULL && entry->snapshot <= snapshot) {
+		_entry_unlink (cache, entry);
+		_entry_link_newest (cache, entry);
+		ret = s4_resultset_ref (entry->set);
+	}
+	g_mutex_unlock (&cache->lock);
+
+	/* The caller may sort its result, so it gets its own order */
+	if (ret != NULL) {
+		s4_resultset_t *set = ret;
+
+		ret = _resultset_copy (set);
+		s4_resultset_unref (set);
+	}
+
+	return ret;
+}
+
+/**
+ * Adds the result of a query to the cache. The caller must hold the
+ * version lock and make sure nothing was stamped after snapshot.
+ * The least recently used result is dropped if the cache is full.
+ *
+ * @param cache The cache to add to
+ * @param snapshot The snapshot the query ran in
+ * @param cond The condition of the query, with interned keys
+ * @param fs The fetchspec of the query, with interned keys
+ * @param set The result, the cache keeps a copy of it
+ */
+void _query_cache_insert (s4_query_cache_t *cache, guint64 snapshot,
+		s4_condition_t *cond, s4_fetchspec_t *fs, s4_resultset_t *set)
+{
+	cache_entry_t key, *entry;
+	s4_resultset_t *copy = _resultset_copy (set);
+
+	key.hash = s4_cond_hash (cond) * 31 + s4_fetchspec_hash (fs);
+	key.cond = cond;
+	key.fs = fs;
+
+	g_mutex_lock (&cache->lock);
+
+	entry = g_hash_table_lookup (cache->entries, &key);
+	if (entry != NULL && entry->snapshot >= snapshot) {
+		g_mutex_unlock (&cache->lock);
+		s4_resultset_unref (copy);
+		return;
+	} else if (entry != NULL) {
+		_entry_remove (cache, entry);
+	}
+
+	if (g_hash_table_size (cache->entries) >= cache->size)
+		_entry_remove (cache, cache->oldest);
+
+	entry = malloc (sizeof (cache_entry_t));
+	entry->hash = key.hash;
+	entry->cond = s4_cond_copy (cond);
+	entry->fs = s4_fetchspec_copy (fs);
+	entry->set = copy;
+	entry->snapshot = snapshot;
+	entry->keys = _query_keys (cond, fs);
+
+	g_hash_table_insert (cache->entries, entry, entry);
+	_entry_link_newest (cache, entry);
+
+	g_mutex_unlock (&cache->lock);
+}
+
+/**
+ * Drops the results a committing transaction may change.
+ * Must be called with the version lock held, after the
+ * transaction is stamped.
+ *
+ * @param cache The cache
+ * @param ops The operations of the transaction, NULL to drop everything
+ */
+void _query_cache_invalidate (s4_query_cache_t *cache, oplist_t *ops)
+{
+	GHashTable *touched;
+	cache_entry_t *entry, *next;
+	const char *key_a, *key_b, *src;
+	const s4_val_t *val_a, *val_b;
+	int i;
+
+	if (ops == NULL) {
+		_query_cache_clear (cache);
+		return;
+	}
+
+	touched = g_hash_table_new (NULL, NULL);
+	for (_oplist_first (ops); _oplist_next (ops);) {
+		if (_oplist_get_add (ops, &key_a, &val_a, &key_b, &val_b, &src) ||
+				_oplist_get_del (ops, &key_a, &val_a, &key_b, &val_b, &src)) {
+			g_hash_table_insert (touched, (void*)key_a, (void*)key_a);
+			g_hash_table_insert (touched, (void*)key_b, (void*)key_b);
+		}
+	}
+
+	g_mutex_lock (&cache->lock);
+	for (entry = cache->newest; entry != NULL; entry = next) {
+		int drop = entry->keys == NULL;
+
+		next = entry->next;
+		for (i = 0; !drop && i < entry->keys->len; i++)
+			drop = g_hash_table_lookup (touched, g_ptr_array_index (entry->keys, i)) != NULL;
+
+		if (drop)
+			_entry_remove (cache, entry);
+	}
+	g_mutex_unlock (&cache->lock);
+
+	g_hash_table_destroy (touched);
+}
+
+/**
+ * @}
+ */
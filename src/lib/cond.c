@@ -43,6 +43,10 @@ struct s4_condition_St {
 			int flags;
 			int monotonic;
 			int const_key;
+			/* The id of key once it is constant, see s4_cond_update_key */
+			int32_t ikey;
+			/* The value the filter was created with, NULL for custom filters */
+			s4_val_t *val;
 		} filter;
 	} u;
 };
@@ -435,6 +439,8 @@ s4_condition_t *s4_cond_new_filter (s4_filter_type_t type,
 	cond->u.filter.flags = flags;
 	cond->u.filter.cmp_mode = cmp_mode;
 	cond->u.filter.const_key = 0;
+	cond->u.filter.ikey = 0;
+	cond->u.filter.val = (value == NULL)?NULL:s4_val_copy (value);
 
 	if (sourcepref != NULL) {
 		cond->u.filter.sp = s4_sourcepref_ref (sourcepref);
@@ -479,6 +485,8 @@ s4_condition_t *s4_cond_new_custom_filter (filter_function_t func, void *userdat
 	cond->u.filter.monotonic = monotonic;
 	cond->u.filter.cmp_mode = cmp_mode;
 	cond->u.filter.const_key = 0;
+	cond->u.filter.ikey = 0;
+	cond->u.filter.val = NULL;
 
 	if (sourcepref != NULL) {
 		cond->u.filter.sp = s4_sourcepref_ref (sourcepref);
@@ -543,6 +551,29 @@ const char *s4_cond_get_key (s4_condition_t *cond)
 	return cond->u.filter.key;
 }
 
+/**
+ * Gets the id of the key of a condition.
+ * Only known after s4_cond_update_key has been called.
+ *
+ * @param cond The condition to get the key id of
+ * @return The key id, or 0 if the key is NULL
+ */
+int32_t s4_cond_get_ikey (s4_condition_t *cond)
+{
+	return cond->u.filter.ikey;
+}
+
+/**
+ * Sets the id of the key of a condition.
+ *
+ * @param cond The condition to set the key id of
+ * @param ikey The new key id
+ */
+void s4_cond_set_ikey (s4_condition_t *cond, int32_t ikey)
+{
+	cond->u.filter.ikey = ikey;
+}
+
 /**
  * Gets the source preference that should be used
  *
@@ -565,6 +596,200 @@ void *s4_cond_get_funcdata (s4_condition_t *cond)
 	return cond->u.filter.funcdata;
 }
 
+/**
+ * Gets the token a token filter would find in a token index.
+ * Tokens in the index are words without whitespace, casefolded,
+ * so this is only possible when the filter can not match anything
+ * that is not a word or a prefix of one. Numbers must be written
+ * the way the integers they match are.
+ *
+ * @param cond The condition to get the token of
+ * @param prefix Set to non-zero if the filter matches every token
+ * starting with the returned one, 0 if it matches the token only
+ * @return The casefolded token, to be freed with g_free. NULL if cond is
+ * not a token filter, or the token index can not be used to find it.
+ */
+char *s4_cond_get_token (s4_condition_t *cond, int *prefix)
+{
+	const char *token, *star;
+	char *end, num[12];
+	size_t len;
+	long j;
+
+	if (cond->type != S4_COND_FILTER || cond->u.filter.type != S4_FILTER_TOKEN)
+		return NULL;
+
+	token = cond->u.filter.funcdata;
+	star = strchr (token, '*');
+	len = (star == NULL)?strlen (token):(size_t)(star - token);
+	*prefix = star != NULL;
+
+	/* An empty token also matches values that end in whitespace */
+	if (len == 0)
+		return NULL;
+	for (j = 0; j < len; j++) {
+		if (isspace (token[j]))
+			return NULL;
+	}
+
+	/* Integers are matched by number, token_filter accepts "05" for 5
+	 * and "0*" for everything, but the index only has "5"
+	 */
+	j = strtol (token, &end, 10);
+	if (end != token && (*end == '\0' || *end == '*')) {
+		if (j <= 0 && *end == '*')
+			return NULL;
+		if (j < G_MININT32 || j > G_MAXINT32)
+			return NULL;
+		sprintf (num, "%li", j);
+		if (strlen (num) != end - token || strncmp (num, token, end - token))
+			return NULL;
+	}
+
+	return g_utf8_casefold (token, len);
+}
+
+/**
+ * Checks if a condition has custom filters or combiners.
+ *
+ * @param cond The condition to check
+ * @return non-zero if cond or one of its operands is custom, 0 otherwise
+ */
+int s4_cond_is_custom (s4_condition_t *cond)
+{
+	int i;
+
+	if (cond->type == S4_COND_FILTER)
+		return cond->u.filter.type == S4_FILTER_CUSTOM;
+	if (cond->u.combine.type == S4_COMBINE_CUSTOM)
+		return 1;
+
+	for (i = 0; i < cond->u.combine.operands->len; i++) {
+		if (s4_cond_is_custom (g_ptr_array_index (cond->u.combine.operands, i)))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Copies a condition that has no custom filters or combiners.
+ *
+ * @param cond The condition to copy
+ * @return A new condition equal to cond
+ */
+s4_condition_t *s4_cond_copy (s4_condition_t *cond)
+{
+	s4_condition_t *ret;
+	int i;
+
+	if (cond->type == S4_COND_FILTER) {
+		return s4_cond_new_filter (cond->u.filter.type, cond->u.filter.key,
+				cond->u.filter.val, cond->u.filter.sp,
+				cond->u.filter.cmp_mode, cond->u.filter.flags);
+	}
+
+	ret = s4_cond_new_combiner (cond->u.combine.type);
+	for (i = 0; i < cond->u.combine.operands->len; i++) {
+		s4_condition_t *op = s4_cond_copy (g_ptr_array_index (cond->u.combine.operands, i));
+
+		s4_cond_add_operand (ret, op);
+		s4_cond_unref (op);
+	}
+
+	return ret;
+}
+
+/**
+ * Hashes a condition. Conditions that are s4_cond_equal have
+ * the same hash.
+ *
+ * @param cond The condition to hash
+ * @return The hash
+ */
+guint s4_cond_hash (s4_condition_t *cond)
+{
+	guint hash;
+	const char *s;
+	int32_t i;
+
+	if (cond->type == S4_COND_COMBINER) {
+		hash = cond->u.combine.type + 1;
+		for (i = 0; i < cond->u.combine.operands->len; i++)
+			hash = hash * 31 + s4_cond_hash (g_ptr_array_index (cond->u.combine.operands, i));
+		return hash;
+	}
+
+	hash = (cond->u.filter.type + 1) * 7 + cond->u.filter.flags * 3 + cond->u.filter.cmp_mode;
+	hash = hash * 31 + GPOINTER_TO_UINT (cond->u.filter.sp);
+	if (cond->u.filter.key != NULL)
+		hash = hash * 31 + g_str_hash (cond->u.filter.key);
+	if (cond->u.filter.val == NULL) {
+		hash = hash * 31;
+	} else if (s4_val_get_int (cond->u.filter.val, &i)) {
+		hash = hash * 31 + i;
+	} else if (s4_val_get_str (cond->u.filter.val, &s)) {
+		hash = hash * 31 + g_str_hash (s);
+	}
+
+	return hash;
+}
+
+/**
+ * Checks if two conditions are the same. Filters are the same if they
+ * have the same type, key, value, comparison mode and flags, and the
+ * same sourcepref object. Custom filters and combiners are only the
+ * same as themselves.
+ *
+ * @param a The first condition
+ * @param b The second condition
+ * @return non-zero if they are the same, 0 otherwise
+ */
+int s4_cond_equal (s4_condition_t *a, s4_condition_t *b)
+{
+	GPtrArray *ops_a, *ops_b;
+	int i;
+
+	if (a == b)
+		return 1;
+	if (a->type != b->type)
+		return 0;
+
+	if (a->type == S4_COND_COMBINER) {
+		ops_a = a->u.combine.operands;
+		ops_b = b->u.combine.operands;
+
+		if (a->u.combine.type != b->u.combine.type ||
+				a->u.combine.type == S4_COMBINE_CUSTOM ||
+				ops_a->len != ops_b->len)
+			return 0;
+
+		for (i = 0; i < ops_a->len; i++) {
+			if (!s4_cond_equal (g_ptr_array_index (ops_a, i), g_ptr_array_index (ops_b, i)))
+				return 0;
+		}
+
+		return 1;
+	}
+
+	if (a->u.filter.type != b->u.filter.type ||
+			a->u.filter.type == S4_FILTER_CUSTOM ||
+			a->u.filter.flags != b->u.filter.flags ||
+			a->u.filter.cmp_mode != b->u.filter.cmp_mode ||
+			a->u.filter.sp != b->u.filter.sp)
+		return 0;
+
+	if ((a->u.filter.key == NULL) != (b->u.filter.key == NULL) ||
+			(a->u.filter.key != NULL && strcmp (a->u.filter.key, b->u.filter.key)))
+		return 0;
+
+	if (a->u.filter.val == NULL || b->u.filter.val == NULL)
+		return a->u.filter.val == b->u.filter.val;
+
+	return s4_val_is_int (a->u.filter.val) == s4_val_is_int (b->u.filter.val) &&
+		!s4_val_cmp (a->u.filter.val, b->u.filter.val, S4_CMP_BINARY);
+}
+
 /**
  * Frees a condition and operands recursively
  *
@@ -580,6 +805,8 @@ void s4_cond_free (s4_condition_t *cond)
 			cond->u.filter.free_func (cond->u.filter.funcdata);
 		if (cond->u.filter.sp != NULL)
 			s4_sourcepref_unref (cond->u.filter.sp);
+		if (cond->u.filter.val != NULL)
+			s4_val_free (cond->u.filter.val);
 		if (!cond->u.filter.const_key && cond->u.filter.key != NULL)
 			free ((char*)cond->u.filter.key);
 		free (cond);
@@ -666,7 +893,10 @@ int s4_cond_get_cmp_mode (s4_condition_t *cond)
 }
 
 /**
- * Change the key with a constant key for faster checking
+ * Change the key with a constant key for faster checking.
+ * The collated and casefolded strings of the value the filter compares
+ * with are filled in as well, so the filter does not change when
+ * several threads check it.
  *
  * @param s4 The database to optimize for
  * @param cond The condition to update
@@ -677,10 +907,27 @@ void s4_cond_update_key (s4_condition_t *cond, s4_t *s4)
 		g_ptr_array_foreach (cond->u.combine.operands, (GFunc)s4_cond_update_key, s4);
 	} else if (cond->type == S4_COND_FILTER) {
 		const char *new_key = _string_lookup (s4, cond->u.filter.key);
+		const char *s;
+
 		if (!cond->u.filter.const_key)
 			free ((void*)cond->u.filter.key);
 		cond->u.filter.key = new_key;
 		cond->u.filter.const_key = 1;
+		cond->u.filter.ikey = _string_id (s4, new_key);
+
+		switch (cond->u.filter.type) {
+			case S4_FILTER_EQUAL:
+			case S4_FILTER_NOTEQUAL:
+			case S4_FILTER_GREATER:
+			case S4_FILTER_SMALLER:
+			case S4_FILTER_GREATEREQ:
+			case S4_FILTER_SMALLEREQ:
+				s4_val_get_collated_str (cond->u.filter.funcdata, &s);
+				s4_val_get_casefolded_str (cond->u.filter.funcdata, &s);
+				break;
+			default:
+				break;
+		}
 	}
 }
 
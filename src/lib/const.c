@@ -14,6 +14,7 @@
 
 #include "s4_priv.h"
 #include <stdlib.h>
+#include <string.h>
 
 /**
  *
@@ -22,60 +23,242 @@
  * @ingroup S4
  * @brief Handles constant values in S4
  *
+ * Every constant value also gets a 32-bit id, so entries can refer
+ * to keys, values and sources by id instead of by pointer. Ids are
+ * handed out from 1 and never reused, 0 means no value. The table
+ * mapping ids back to values is split into chunks that never move,
+ * so ids can be looked up without taking a lock. The chunks, and the
+ * directories pointing at them, are only allocated once an id in them
+ * is handed out.
+ *
+ * The tables are split into shards with a lock each, picked by the
+ * hash of what is looked up, so threads looking up different things
+ * rarely wait for each other.
+ *
  * @{
  */
 
-struct s4_const_data_St {
-	GStringChunk *strings;
-	GHashTable *strings_table;
-	GMutex strings_lock;
+#define ID_CHUNK_BITS 12
+#define ID_CHUNK_SIZE (1 << ID_CHUNK_BITS)
+#define ID_DIR_BITS 10
+#define ID_DIR_SIZE (1 << ID_DIR_BITS)
+#define ID_DIRS (1 << (31 - ID_DIR_BITS - ID_CHUNK_BITS))
 
-	GHashTable *int_table;
-	GMutex int_lock;
+#define CONST_SHARD_BITS 4
+#define CONST_SHARDS (1 << CONST_SHARD_BITS)
 
-	GHashTable *coll_table;
-	GMutex coll_lock;
-	GHashTable *case_table;
-	GMutex case_lock;
+typedef struct {
+	GHashTable *table;
+	GMutex lock;
+	/* Where new strings are copied to, only used by the string shards */
+	GStringChunk *strings;
+} const_shard_t;
+
+struct s4_const_data_St {
+	const_shard_t strings[CONST_SHARDS];
+	const_shard_t ints[CONST_SHARDS];
+	const_shard_t coll[CONST_SHARDS];
+	const_shard_t casefold[CONST_SHARDS];
+
+	GList *mappings;
+	GMutex mappings_lock;
+
+	/* ID_DIRS pointers to directories of ID_DIR_SIZE pointers
+	 * to chunks of ID_CHUNK_SIZE values
+	 */
+	const s4_val_t ***ids[ID_DIRS];
+	gint next_id;
 };
 
+static void _shards_init (const_shard_t *shards, GHashFunc hash_func,
+		GEqualFunc equal_func, GDestroyNotify value_free, int strings)
+{
+	int i;
+
+	for (i = 0; i < CONST_SHARDS; i++) {
+		shards[i].table = g_hash_table_new_full (hash_func, equal_func, NULL, value_free);
+		shards[i].strings = strings?g_string_chunk_new (8192):NULL;
+		g_mutex_init (&shards[i].lock);
+	}
+}
+
+static void _shards_clear (const_shard_t *shards)
+{
+	int i;
+
+	for (i = 0; i < CONST_SHARDS; i++) {
+		g_hash_table_destroy (shards[i].table);
+		if (shards[i].strings != NULL)
+			g_string_chunk_free (shards[i].strings);
+		g_mutex_clear (&shards[i].lock);
+	}
+}
+
+/**
+ * Picks the shard for a hash. The hash is mixed first, as the
+ * shard tables use the low bits of the same hash themselves.
+ */
+static const_shard_t *_shard_get (const_shard_t *shards, guint hash)
+{
+	return shards + ((hash * 2654435769U) >> (32 - CONST_SHARD_BITS));
+}
+
+static const_shard_t *_shard_get_ptr (const_shard_t *shards, const void *p)
+{
+	return _shard_get (shards, (guint)(((gsize)p) >> 3));
+}
+
+/**
+ * Picks the shard for a string. The shard table hashes the whole
+ * string again, so this only looks at the length and the first and
+ * last few bytes.
+ */
+static const_shard_t *_shard_get_str (const_shard_t *shards, const char *str)
+{
+	size_t len = strlen (str);
+	guint hash = len;
+	int i;
+
+	for (i = 0; i < 4 && i < len; i++) {
+		hash = hash * 31 + str[i];
+		hash = hash * 31 + str[len - i - 1];
+	}
+
+	return _shard_get (shards, hash);
+}
+
 s4_const_data_t *_const_create_data ()
 {
 	s4_const_data_t *data = malloc (sizeof (s4_const_data_t));
 
-	data->strings = g_string_chunk_new (8192);
+	_shards_init (data->strings, g_str_hash, g_str_equal, (GDestroyNotify)s4_val_free, 1);
+	_shards_init (data->ints, NULL, NULL, (GDestroyNotify)s4_val_free, 0);
+	_shards_init (data->coll, NULL, NULL, NULL, 0);
+	_shards_init (data->casefold, NULL, NULL, NULL, 0);
 
-	data->strings_table = g_hash_table_new_full (g_str_hash, g_str_equal,
-	                                             NULL, (GDestroyNotify)s4_val_free);
-	data->int_table = g_hash_table_new_full (NULL, NULL,
-	                                         NULL, (GDestroyNotify)s4_val_free);
-	data->coll_table = g_hash_table_new (NULL, NULL);
-	data->case_table = g_hash_table_new (NULL, NULL);
+	data->mappings = NULL;
+	g_mutex_init (&data->mappings_lock);
 
-	g_mutex_init (&data->strings_lock);
-	g_mutex_init (&data->int_lock);
-	g_mutex_init (&data->coll_lock);
-	g_mutex_init (&data->case_lock);
+	memset (data->ids, 0, sizeof (data->ids));
+	data->next_id = 1;
 
 	return data;
 }
 
 void _const_free_data (s4_const_data_t *data)
 {
-	g_hash_table_destroy (data->coll_table);
-	g_hash_table_destroy (data->case_table);
-	g_hash_table_destroy (data->strings_table);
-	g_hash_table_destroy (data->int_table);
-	g_string_chunk_free (data->strings);
+	int i, j;
+
+	for (i = 0; i < ID_DIRS && data->ids[i] != NULL; i++) {
+		for (j = 0; j < ID_DIR_SIZE && data->ids[i][j] != NULL; j++) {
+			free (data->ids[i][j]);
+		}
+		free (data->ids[i]);
+	}
 
-	g_mutex_clear (&data->strings_lock);
-	g_mutex_clear (&data->case_lock);
-	g_mutex_clear (&data->coll_lock);
-	g_mutex_clear (&data->int_lock);
+	_shards_clear (data->coll);
+	_shards_clear (data->casefold);
+	_shards_clear (data->strings);
+	_shards_clear (data->ints);
+	g_list_free_full (data->mappings, (GDestroyNotify)g_mapped_file_unref);
+	g_mutex_clear (&data->mappings_lock);
 
 	free (data);
 }
 
+/**
+ * Gets a part of the id table, allocating it if it is not there.
+ * Threads racing to allocate it agree on one of them.
+ *
+ * @param slot Where the part is, or should be, pointed at
+ * @param size The size of the part
+ * @return The part
+ */
+static void *_const_get_table (void **slot, size_t size)
+{
+	void *ret = g_atomic_pointer_get (slot);
+
+	if (ret == NULL) {
+		ret = calloc (1, size);
+		if (!g_atomic_pointer_compare_and_exchange (slot, NULL, ret)) {
+			free (ret);
+			ret = g_atomic_pointer_get (slot);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Gives a new constant value the next id.
+ * The caller must hold the lock of the shard the value is inserted in,
+ * the id itself is taken atomically as the shards don't share a lock.
+ *
+ * @param data The constant data of the database
+ * @param val The new constant
+ */
+static void _const_add_id (s4_const_data_t *data, s4_val_t *val)
+{
+	int32_t id = g_atomic_int_add (&data->next_id, 1);
+	const s4_val_t ***dir, **chunk;
+
+	dir = _const_get_table ((void**)&data->ids[id >> (ID_DIR_BITS + ID_CHUNK_BITS)],
+			ID_DIR_SIZE * sizeof (const s4_val_t**));
+	chunk = _const_get_table ((void**)&dir[(id >> ID_CHUNK_BITS) & (ID_DIR_SIZE - 1)],
+			ID_CHUNK_SIZE * sizeof (const s4_val_t*));
+
+	chunk[id & (ID_CHUNK_SIZE - 1)] = val;
+	_val_set_id (val, id);
+}
+
+/**
+ * Gets the constant value with the given id.
+ *
+ * @param s4 The database to look in
+ * @param id The id, as returned by _val_get_id on a constant
+ * @return The value, or NULL if id is 0
+ */
+const s4_val_t *_const_get (s4_t *s4, int32_t id)
+{
+	if (id == 0)
+		return NULL;
+
+	return s4->const_data->ids[id >> (ID_DIR_BITS + ID_CHUNK_BITS)]
+		[(id >> ID_CHUNK_BITS) & (ID_DIR_SIZE - 1)][id & (ID_CHUNK_SIZE - 1)];
+}
+
+/**
+ * Gets the constant string with the given id.
+ *
+ * @param s4 The database to look in
+ * @param id The id of a constant string value
+ * @return The string, or NULL if id is 0
+ */
+const char *_const_get_str (s4_t *s4, int32_t id)
+{
+	const char *ret = NULL;
+
+	if (id != 0)
+		s4_val_get_str (_const_get (s4, id), &ret);
+
+	return ret;
+}
+
+/**
+ * Gets the id of the constant string equal to str.
+ *
+ * @param s4 The database to look in
+ * @param str The string
+ * @return The id, or 0 if str is NULL
+ */
+int32_t _string_id (s4_t *s4, const char *str)
+{
+	if (str == NULL)
+		return 0;
+
+	return _val_get_id (_string_lookup_val (s4, str));
+}
+
 /**
  * Gets a pointer to a constant string that's equal to str.
  * _string_lookup will always return the same pointer for the same string
@@ -108,22 +291,67 @@ const char *_string_lookup (s4_t *s4, const char *str)
  */
 const s4_val_t *_string_lookup_val (s4_t *s4, const char *str)
 {
+	const_shard_t *shard = _shard_get_str (s4->const_data->strings, str);
+	s4_val_t *ret;
+
+	g_mutex_lock (&shard->lock);
+
+	ret = g_hash_table_lookup (shard->table, str);
+	if (ret == NULL) {
+		str = g_string_chunk_insert (shard->strings, str);
+		ret = s4_val_new_internal_string (str, s4);
+		_const_add_id (s4->const_data, ret);
+		g_hash_table_insert (shard->table, (void*)str, ret);
+	}
+
+	g_mutex_unlock (&shard->lock);
+
+	return ret;
+}
+
+/**
+ * Like _string_lookup_val, but does not copy str if it is not found.
+ * str must stay valid for as long as the database is open, see
+ * _const_add_mapping.
+ *
+ * @param s4 The database to look for the string in
+ * @param str The string to find the constant string of
+ * @return A pointer to a string value
+ */
+const s4_val_t *_string_lookup_static_val (s4_t *s4, const char *str)
+{
+	const_shard_t *shard = _shard_get_str (s4->const_data->strings, str);
 	s4_val_t *ret;
 
-	g_mutex_lock (&s4->const_data->strings_lock);
+	g_mutex_lock (&shard->lock);
 
-	ret = g_hash_table_lookup (s4->const_data->strings_table, str);
+	ret = g_hash_table_lookup (shard->table, str);
 	if (ret == NULL) {
-		str = g_string_chunk_insert (s4->const_data->strings, str);
 		ret = s4_val_new_internal_string (str, s4);
-		g_hash_table_insert (s4->const_data->strings_table, (void*)str, ret);
+		_const_add_id (s4->const_data, ret);
+		g_hash_table_insert (shard->table, (void*)str, ret);
 	}
 
-	g_mutex_unlock (&s4->const_data->strings_lock);
+	g_mutex_unlock (&shard->lock);
 
 	return ret;
 }
 
+/**
+ * Lets the database take over a reference to a mapped file.
+ * The file is kept mapped until the database is closed, so strings
+ * in it can be passed to _string_lookup_static_val.
+ *
+ * @param s4 The database
+ * @param file The mapped file
+ */
+void _const_add_mapping (s4_t *s4, GMappedFile *file)
+{
+	g_mutex_lock (&s4->const_data->mappings_lock);
+	s4->const_data->mappings = g_list_prepend (s4->const_data->mappings, file);
+	g_mutex_unlock (&s4->const_data->mappings_lock);
+}
+
 /**
  * Creates a string that orders correctly according to the locale
  *
@@ -147,33 +375,55 @@ char *s4_string_casefold (const char *str)
 }
 
 /**
- * Gets the casefolded string corresponding to str. str must have
- * been obtained by calling _string_lookup.
+ * Gets a string derived from a constant string, like its casefolded
+ * or collated version, computing it the first time it is asked for.
+ * It is computed without holding the lock. If two threads race, both
+ * compute it and get the same constant string.
  *
  * @param s4 The database to look in
- * @param str The string to find the casefold string of
- * @return The casefolded string of str
+ * @param shards The shards mapping str to the derived string
+ * @param str The constant string
+ * @param derive Computes the derived string, freed with g_free
+ * @return The constant derived string
  */
-const char *_string_lookup_casefolded (s4_t *s4, const char *str)
+static const char *_string_lookup_derived (s4_t *s4, const_shard_t *shards,
+		const char *str, char *(*derive)(const char *))
 {
+	const_shard_t *shard = _shard_get_ptr (shards, str);
 	const char *ret;
+	char *tmp;
 
-	g_mutex_lock (&s4->const_data->case_lock);
-	ret = g_hash_table_lookup (s4->const_data->case_table, str);
+	g_mutex_lock (&shard->lock);
+	ret = g_hash_table_lookup (shard->table, str);
+	g_mutex_unlock (&shard->lock);
 
-	if (ret == NULL) {
-		char *tmp = s4_string_casefold (str);
-		ret = _string_lookup (s4, tmp);
-		g_free (tmp);
+	if (ret != NULL)
+		return ret;
 
-		g_hash_table_insert (s4->const_data->case_table, (void*)str, (void*)ret);
-	}
+	tmp = derive (str);
+	ret = _string_lookup (s4, tmp);
+	g_free (tmp);
 
-	g_mutex_unlock (&s4->const_data->case_lock);
+	g_mutex_lock (&shard->lock);
+	g_hash_table_insert (shard->table, (void*)str, (void*)ret);
+	g_mutex_unlock (&shard->lock);
 
 	return ret;
 }
 
+/**
+ * Gets the casefolded string corresponding to str. str must have
+ * been obtained by calling _string_lookup.
+ *
+ * @param s4 The database to look in
+ * @param str The string to find the casefold string of
+ * @return The casefolded string of str
+ */
+const char *_string_lookup_casefolded (s4_t *s4, const char *str)
+{
+	return _string_lookup_derived (s4, s4->const_data->casefold, str, s4_string_casefold);
+}
+
 /**
  * Gets the collated string corresponding to str. str must have
  * been obtained by calling _string_lookup.
@@ -184,37 +434,24 @@ const char *_string_lookup_casefolded (s4_t *s4, const char *str)
  */
 const char *_string_lookup_collated (s4_t *s4, const char *str)
 {
-	const char *ret;
-
-	g_mutex_lock (&s4->const_data->coll_lock);
-	ret = g_hash_table_lookup (s4->const_data->coll_table, str);
-
-	if (ret == NULL) {
-		char *tmp = s4_string_collate (str);
-		ret = _string_lookup (s4, tmp);
-		g_free (tmp);
-
-		g_hash_table_insert (s4->const_data->coll_table, (void*)str, (void*)ret);
-	}
-
-	g_mutex_unlock (&s4->const_data->coll_lock);
-
-	return ret;
+	return _string_lookup_derived (s4, s4->const_data->coll, str, s4_string_collate);
 }
 
 const s4_val_t *_int_lookup_val (s4_t *s4, int32_t i)
 {
-	const s4_val_t *ret;
+	const_shard_t *shard = _shard_get (s4->const_data->ints, (guint)i);
+	s4_val_t *ret;
 
-	g_mutex_lock (&s4->const_data->int_lock);
-	ret = g_hash_table_lookup (s4->const_data->int_table, GINT_TO_POINTER (i));
+	g_mutex_lock (&shard->lock);
+	ret = g_hash_table_lookup (shard->table, GINT_TO_POINTER (i));
 
 	if (ret == NULL) {
 		ret = s4_val_new_int (i);
-		g_hash_table_insert (s4->const_data->int_table, GINT_TO_POINTER (i), (void*)ret);
+		_const_add_id (s4->const_data, ret);
+		g_hash_table_insert (shard->table, GINT_TO_POINTER (i), (void*)ret);
 	}
 
-	g_mutex_unlock (&s4->const_data->int_lock);
+	g_mutex_unlock (&shard->lock);
 
 	return ret;
 }
@@ -22,6 +22,8 @@ typedef struct {
 	s4_sourcepref_t *pref;
 	int flags;
 	int const_key;
+	/* The id of key once it is constant */
+	int32_t ikey;
 } fetch_data_t;
 
 struct s4_fetchspec_St {
@@ -66,6 +68,7 @@ void s4_fetchspec_add (s4_fetchspec_t *spec, const char *key, s4_sourcepref_t *s
 	fetch_data_t data;
 	data.flags = flags;
 	data.const_key = 0;
+	data.ikey = 0;
 	if (key == NULL) {
 		data.key = NULL;
 	} else {
@@ -92,6 +95,7 @@ void s4_fetchspec_update_key (s4_t *s4, s4_fetchspec_t *spec)
 
 		data->key = new_key;
 		data->const_key = 1;
+		data->ikey = _string_id (s4, new_key);
 	}
 }
 
@@ -167,6 +171,22 @@ const char *s4_fetchspec_get_key (s4_fetchspec_t *spec, int index)
 	return g_array_index (spec->array, fetch_data_t, index).key;
 }
 
+/**
+ * Gets the id of the key at a give index.
+ * Only known after s4_fetchspec_update_key has been called.
+ *
+ * @param spec The fetchspec to find the key in
+ * @param index The index of the key
+ * @return The key id, or 0 if the key is NULL or index is out of bounds
+ */
+int32_t s4_fetchspec_get_ikey (s4_fetchspec_t *spec, int index)
+{
+	if (index < 0 || index >= spec->array->len)
+		return 0;
+
+	return g_array_index (spec->array, fetch_data_t, index).ikey;
+}
+
 /**
  * Gets the sourcepref at a give index
  * @param spec The fetchspec to find the sourcepref in
@@ -189,6 +209,81 @@ int s4_fetchspec_get_flags (s4_fetchspec_t *spec, int index)
 	return g_array_index (spec->array, fetch_data_t, index).flags;
 }
 
+
+/**
+ * Copies a fetchspec.
+ *
+ * @param spec The fetchspec to copy
+ * @return A new fetchspec equal to spec
+ */
+s4_fetchspec_t *s4_fetchspec_copy (s4_fetchspec_t *spec)
+{
+	s4_fetchspec_t *ret = s4_fetchspec_create ();
+	int i;
+
+	for (i = 0; i < spec->array->len; i++) {
+		fetch_data_t *data = &g_array_index (spec->array, fetch_data_t, i);
+		s4_fetchspec_add (ret, data->key, data->pref, data->flags);
+	}
+
+	return ret;
+}
+
+/**
+ * Hashes a fetchspec. Fetchspecs that are s4_fetchspec_equal
+ * have the same hash.
+ *
+ * @param spec The fetchspec to hash
+ * @return The hash
+ */
+guint s4_fetchspec_hash (s4_fetchspec_t *spec)
+{
+	guint hash = spec->array->len;
+	int i;
+
+	for (i = 0; i < spec->array->len; i++) {
+		fetch_data_t *data = &g_array_index (spec->array, fetch_data_t, i);
+
+		hash = hash * 31 + data->flags;
+		hash = hash * 31 + GPOINTER_TO_UINT (data->pref);
+		if (data->key != NULL)
+			hash = hash * 31 + g_str_hash (data->key);
+	}
+
+	return hash;
+}
+
+/**
+ * Checks if two fetchspecs fetch the same. They must have the same
+ * keys and flags in the same order, and the same sourcepref objects.
+ *
+ * @param a The first fetchspec
+ * @param b The second fetchspec
+ * @return non-zero if they are the same, 0 otherwise
+ */
+int s4_fetchspec_equal (s4_fetchspec_t *a, s4_fetchspec_t *b)
+{
+	int i;
+
+	if (a == b)
+		return 1;
+	if (a->array->len != b->array->len)
+		return 0;
+
+	for (i = 0; i < a->array->len; i++) {
+		fetch_data_t *da = &g_array_index (a->array, fetch_data_t, i);
+		fetch_data_t *db = &g_array_index (b->array, fetch_data_t, i);
+
+		if (da->flags != db->flags || da->pref != db->pref)
+			return 0;
+		if ((da->key == NULL) != (db->key == NULL) ||
+				(da->key != NULL && strcmp (da->key, db->key)))
+			return 0;
+	}
+
+	return 1;
+}
+
 /**
  * @}
  */
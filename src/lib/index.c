@@ -15,6 +15,7 @@
 #include "s4_priv.h"
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 typedef struct {
 	void *data;
@@ -27,11 +28,50 @@ typedef struct {
 	index_data_t *data;
 } index_t;
 
+/* The number of values in a leaf, and children in an inner node */
+#define NODE_ORDER 32
+
+/* The index is a B+-tree. Values live in the leaves, which are linked
+ * together so range searches can walk them in order.
+ */
+typedef struct {
+	int leaf;
+	int size;
+} node_t;
+
+typedef struct leaf_St leaf_t;
+struct leaf_St {
+	node_t node;
+	leaf_t *prev, *next;
+	index_t items[NODE_ORDER];
+};
+
+/* Every value in children[i] is >= keys[i], keys[0] is not used */
+typedef struct {
+	node_t node;
+	const s4_val_t *keys[NODE_ORDER];
+	node_t *children[NODE_ORDER];
+} inner_t;
+
 struct s4_index_St {
-	int size, alloc;
 	s4_lock_t *lock;
-
-	index_t *data;
+	node_t *root;
+	leaf_t *first;
+	s4_index_stats_t stats;
+
+	/* Held while the tree is read or changed. Writers also hold the
+	 * lock, but read-only transactions read without locking
+	 */
+	GRWLock latch;
+
+	/* The tokens of the values and the data they belong to, NULL if
+	 * the values are not tokenized. It is locked with this index.
+	 */
+	s4_index_t *tokens;
+	/* The values of the tokens. A value is freed when its token is
+	 * no longer in the token index, see _tokens_update
+	 */
+	GHashTable *token_vals;
 };
 
 struct s4_index_data_St {
@@ -169,14 +209,33 @@ GList *_index_get_all_b (s4_t *s4)
 s4_index_t *_index_create ()
 {
 	s4_index_t *ret = malloc (sizeof (s4_index_t));
-	ret->size = 0;
-	ret->alloc = 1;
-	ret->data = malloc (sizeof (index_t) * ret->alloc);
+	ret->first = calloc (1, sizeof (leaf_t));
+	ret->first->node.leaf = 1;
+	ret->root = &ret->first->node;
 	ret->lock = _lock_alloc ();
+	memset (&ret->stats, 0, sizeof (s4_index_stats_t));
+	g_rw_lock_init (&ret->latch);
+	ret->tokens = NULL;
+	ret->token_vals = NULL;
 
 	return ret;
 }
 
+/**
+ * Makes an index keep an index of the tokens in its values, so
+ * S4_FILTER_TOKEN can be looked up instead of checking every value.
+ * Tokens are split on whitespace like token filters do, and are
+ * casefolded. Integer values have one token, the number.
+ * Must be called before anything is inserted.
+ *
+ * @param index The index to tokenize the values of
+ */
+void _index_create_tokens (s4_index_t *index)
+{
+	index->tokens = _index_create ();
+	index->token_vals = g_hash_table_new_full (g_str_hash, g_str_equal,
+	                                           NULL, (GDestroyNotify)s4_val_free);
+}
 /**
  * Adds an index to a database
  *
@@ -204,12 +263,18 @@ static int _data_search (index_t *index, void *data)
 	int lo = 0;
 	int hi = index->size;
 
+	/* Entries are usually created in ascending address order,
+	 * so check if the data belongs at the end first
+	 */
+	if (hi > 0 && index->data[hi - 1].data < data)
+		return hi;
+
 	while ((hi -lo) > 0) {
 		int m = (hi + lo) / 2;
 
 		if (data == index->data[m].data)
 			return m;
-		if (data < index->data[m].data)
+		if (data > index->data[m].data)
 			lo = m + 1;
 		else
 			hi = m;
@@ -218,18 +283,29 @@ static int _data_search (index_t *index, void *data)
 	return lo;
 }
 
-static int _bsearch (s4_index_t *index, index_function_t func, void *funcdata)
+static int _val_cmp (const s4_val_t *v1, const s4_val_t *v2)
+{
+	return s4_val_cmp (v1, v2, S4_CMP_CASELESS);
+}
+
+/**
+ * Finds the first value in a leaf that is not too small.
+ *
+ * @param leaf The leaf to search
+ * @param func The monotonic search function
+ * @param funcdata Data passed as the second argument to func
+ * @return The position of the first value func does not return
+ * a negative number for. leaf->node.size if there is none.
+ */
+static int _leaf_search (leaf_t *leaf, index_function_t func, void *funcdata)
 {
 	int lo = 0;
-	int hi = index->size;
+	int hi = leaf->node.size;
 
-	while ((hi -lo) > 0) {
+	while ((hi - lo) > 0) {
 		int m = (hi + lo) / 2;
-		int c = func (index->data[m].val, funcdata);
 
-		if (c == 0)
-			return m;
-		if (c < 0)
+		if (func (leaf->items[m].val, funcdata) < 0)
 			lo = m + 1;
 		else
 			hi = m;
@@ -238,9 +314,423 @@ static int _bsearch (s4_index_t *index, index_function_t func, void *funcdata)
 	return lo;
 }
 
-static int _val_cmp (const s4_val_t *v1, const s4_val_t *v2)
+/**
+ * Finds the child of an inner node to search in.
+ *
+ * @param inner The node to search
+ * @param func The monotonic search function
+ * @param funcdata Data passed as the second argument to func
+ * @param exact If non-zero the child that holds values equal to funcdata
+ * is returned, otherwise the child that holds the first value that
+ * matches func (or the one before it).
+ * @return The position of the child
+ */
+static int _inner_search (inner_t *inner, index_function_t func, void *funcdata, int exact)
 {
-	return s4_val_cmp (v1, v2, S4_CMP_CASELESS);
+	int lo = 1;
+	int hi = inner->node.size;
+
+	while ((hi - lo) > 0) {
+		int m = (hi + lo) / 2;
+		int c = func (inner->keys[m], funcdata);
+
+		if (c < 0 || (exact && c == 0))
+			lo = m + 1;
+		else
+			hi = m;
+	}
+
+	return lo - 1;
+}
+
+/**
+ * Finds the leaf to look for a value in.
+ *
+ * @param index The index to search
+ * @param func The monotonic search function
+ * @param funcdata Data passed as the second argument to func
+ * @param exact See _inner_search
+ * @return The leaf
+ */
+static leaf_t *_find_leaf (s4_index_t *index, index_function_t func, void *funcdata, int exact)
+{
+	node_t *node = index->root;
+
+	while (!node->leaf) {
+		inner_t *inner = (inner_t*)node;
+		node = inner->children[_inner_search (inner, func, funcdata, exact)];
+	}
+
+	return (leaf_t*)node;
+}
+
+/**
+ * Gets the histogram bucket for a value with size pieces of data.
+ *
+ * @param size The number of pieces of data, > 0
+ * @return floor (log2 (size)), at most S4_INDEX_HISTOGRAM_SIZE - 1
+ */
+static int _stats_bucket (int size)
+{
+	int bucket = 0;
+
+	while (size > 1 && bucket < S4_INDEX_HISTOGRAM_SIZE - 1) {
+		size >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/**
+ * Updates the statistics after the data of a value changed.
+ *
+ * @param index The index the value is in
+ * @param old_size The number of pieces of data before, 0 for a new value
+ * @param new_size The number of pieces of data now, 0 for a removed value
+ */
+static void _stats_update (s4_index_t *index, int old_size, int new_size)
+{
+	s4_index_stats_t *stats = &index->stats;
+
+	if (old_size == new_size)
+		return;
+
+	if (old_size > 0)
+		stats->histogram[_stats_bucket (old_size)]--;
+	else
+		stats->values++;
+
+	if (new_size > 0)
+		stats->histogram[_stats_bucket (new_size)]++;
+	else
+		stats->values--;
+
+	stats->entries += new_size - old_size;
+}
+
+/**
+ * Adds a piece of data to a value.
+ *
+ * @param item The value
+ * @param new_data The data to add
+ */
+static void _item_insert (index_t *item, void *new_data)
+{
+	int j = _data_search (item, new_data);
+
+	if (j >= item->size || new_data != item->data[j].data) {
+		if (item->size >= item->alloc) {
+			item->alloc *= 2;
+			item->data = realloc (item->data, sizeof (index_data_t) * item->alloc);
+		}
+		memmove (item->data + j + 1, item->data + j,
+				(item->size - j) * sizeof (index_data_t));
+		item->data[j].data = new_data;
+		item->data[j].count = 1;
+
+		item->size++;
+	} else {
+		item->data[j].count++;
+	}
+}
+
+/**
+ * Removes a piece of data from a value.
+ *
+ * @param item The value
+ * @param data The data to remove
+ * @return 0 if the data is not found, 1 otherwise
+ */
+static int _item_delete (index_t *item, void *data)
+{
+	int j = _data_search (item, data);
+
+	if (j >= item->size || data != item->data[j].data) {
+		return 0;
+	}
+
+	if (--item->data[j].count <= 0) {
+		memmove (item->data + j, item->data + j + 1,
+				(item->size - j - 1) * sizeof (index_data_t));
+		item->size--;
+	}
+
+	return 1;
+}
+
+static node_t *_node_insert (s4_index_t *index, node_t *node,
+		const s4_val_t *val, void *new_data, const s4_val_t **sep);
+
+/**
+ * Inserts a value-data pair into a leaf.
+ *
+ * @param index The index the leaf belongs to
+ * @param leaf The leaf to insert into
+ * @param val The value
+ * @param new_data The data
+ * @param sep Set to the smallest value in the new leaf if the leaf is split
+ * @return The new leaf to the right of leaf if it was split, otherwise NULL
+ */
+static node_t *_leaf_insert (s4_index_t *index, leaf_t *leaf,
+		const s4_val_t *val, void *new_data, const s4_val_t **sep)
+{
+	leaf_t *new_leaf = NULL, *target = leaf;
+	int i = _leaf_search (leaf, (index_function_t)_val_cmp, (void*)val);
+
+	if (i < leaf->node.size && !_val_cmp (leaf->items[i].val, val)) {
+		int old_size = leaf->items[i].size;
+
+		_item_insert (leaf->items + i, new_data);
+		_stats_update (index, old_size, leaf->items[i].size);
+		return NULL;
+	}
+
+	if (leaf->node.size >= NODE_ORDER) {
+		/* Values read from file are inserted in sorted order.
+		 * Moving only the new value to the new leaf when appending
+		 * to the last leaf keeps the leaves full in that case.
+		 */
+		int split = (i == NODE_ORDER && leaf->next == NULL)?NODE_ORDER:NODE_ORDER / 2;
+
+		new_leaf = calloc (1, sizeof (leaf_t));
+		new_leaf->node.leaf = 1;
+		new_leaf->node.size = NODE_ORDER - split;
+		memcpy (new_leaf->items, leaf->items + split, new_leaf->node.size * sizeof (index_t));
+		leaf->node.size = split;
+
+		new_leaf->prev = leaf;
+		new_leaf->next = leaf->next;
+		if (leaf->next != NULL)
+			leaf->next->prev = new_leaf;
+		leaf->next = new_leaf;
+
+		if (i >= split) {
+			target = new_leaf;
+			i -= split;
+		}
+	}
+
+	memmove (target->items + i + 1, target->items + i, (target->node.size - i) * sizeof (index_t));
+	target->items[i].val = val;
+	target->items[i].size = 0;
+	target->items[i].alloc = 1;
+	target->items[i].data = malloc (sizeof (index_data_t) * target->items[i].alloc);
+	_item_insert (target->items + i, new_data);
+	_stats_update (index, 0, 1);
+	target->node.size++;
+
+	if (new_leaf == NULL)
+		return NULL;
+
+	*sep = new_leaf->items[0].val;
+	return &new_leaf->node;
+}
+
+/**
+ * Inserts a value-data pair below an inner node.
+ *
+ * @param index The index the node belongs to
+ * @param inner The node to insert below
+ * @param val The value
+ * @param new_data The data
+ * @param sep Set to the smallest value below the new node if inner is split
+ * @return The new node to the right of inner if it was split, otherwise NULL
+ */
+static node_t *_inner_insert (s4_index_t *index, inner_t *inner,
+		const s4_val_t *val, void *new_data, const s4_val_t **sep)
+{
+	const s4_val_t *keys[NODE_ORDER + 1], *child_sep;
+	node_t *children[NODE_ORDER + 1], *child;
+	inner_t *new_inner;
+	int n = inner->node.size;
+	int k = _inner_search (inner, (index_function_t)_val_cmp, (void*)val, 1);
+	int split;
+
+	child = _node_insert (index, inner->children[k], val, new_data, &child_sep);
+	if (child == NULL)
+		return NULL;
+
+	/* The new child goes to the right of the one that split */
+	k++;
+	if (n < NODE_ORDER) {
+		memmove (inner->keys + k + 1, inner->keys + k, (n - k) * sizeof (s4_val_t*));
+		memmove (inner->children + k + 1, inner->children + k, (n - k) * sizeof (node_t*));
+		inner->keys[k] = child_sep;
+		inner->children[k] = child;
+		inner->node.size++;
+
+		return NULL;
+	}
+
+	memcpy (keys, inner->keys, k * sizeof (s4_val_t*));
+	memcpy (children, inner->children, k * sizeof (node_t*));
+	keys[k] = child_sep;
+	children[k] = child;
+	memcpy (keys + k + 1, inner->keys + k, (n - k) * sizeof (s4_val_t*));
+	memcpy (children + k + 1, inner->children + k, (n - k) * sizeof (node_t*));
+
+	split = (k == n)?n:(n + 1) / 2;
+
+	new_inner = calloc (1, sizeof (inner_t));
+	new_inner->node.size = n + 1 - split;
+	memcpy (new_inner->keys, keys + split, new_inner->node.size * sizeof (s4_val_t*));
+	memcpy (new_inner->children, children + split, new_inner->node.size * sizeof (node_t*));
+
+	inner->node.size = split;
+	memcpy (inner->keys, keys, split * sizeof (s4_val_t*));
+	memcpy (inner->children, children, split * sizeof (node_t*));
+
+	*sep = keys[split];
+	return &new_inner->node;
+}
+
+static node_t *_node_insert (s4_index_t *index, node_t *node,
+		const s4_val_t *val, void *new_data, const s4_val_t **sep)
+{
+	if (node->leaf)
+		return _leaf_insert (index, (leaf_t*)node, val, new_data, sep);
+
+	return _inner_insert (index, (inner_t*)node, val, new_data, sep);
+}
+
+/**
+ * Gets the value of a token in a token index, creating it if
+ * there is none.
+ *
+ * @param index The index the token index belongs to
+ * @param token The casefolded token
+ * @return The value
+ */
+static const s4_val_t *_token_val (s4_index_t *index, const char *token)
+{
+	s4_val_t *val = g_hash_table_lookup (index->token_vals, token);
+	const char *str;
+
+	if (val == NULL) {
+		val = s4_val_new_string (token);
+		/* The token is casefolded already, but the index compares
+		 * casefolded strings, so make sure it is never computed
+		 * while readers compare with it
+		 */
+		s4_val_get_casefolded_str (val, &str);
+		s4_val_get_str (val, &str);
+		g_hash_table_insert (index->token_vals, (void*)str, val);
+	}
+
+	return val;
+}
+
+/**
+ * Finds the smallest value below a node.
+ *
+ * @param node The node
+ * @return The first value of the leftmost leaf below node
+ */
+static const s4_val_t *_node_first_val (node_t *node)
+{
+	while (!node->leaf)
+		node = ((inner_t*)node)->children[0];
+
+	return ((leaf_t*)node)->items[0].val;
+}
+
+/**
+ * Makes the inner nodes below node stop using val as a key.
+ * Every key that is val is replaced by the first value of its child,
+ * which separates the children just as well once val is gone.
+ *
+ * @param node The node to start at
+ * @param val The value that is going away
+ */
+static void _inner_drop_key (node_t *node, const s4_val_t *val)
+{
+	inner_t *inner = (inner_t*)node;
+	int i;
+
+	if (node->leaf)
+		return;
+
+	/* keys[0] is not used, but is copied around when rebalancing */
+	if (inner->keys[0] == val)
+		inner->keys[0] = NULL;
+	for (i = 1; i < node->size; i++) {
+		if (inner->keys[i] == val)
+			inner->keys[i] = _node_first_val (inner->children[i]);
+	}
+
+	if (!inner->children[0]->leaf) {
+		for (i = 0; i < node->size; i++)
+			_inner_drop_key (inner->children[i], val);
+	}
+}
+
+/**
+ * Removes a piece of data from a token, and frees the value of
+ * the token if nothing has it any longer. The inner nodes of the
+ * token index may still use the value as a key, so they are
+ * changed first.
+ *
+ * @param index The index with the token index
+ * @param token The casefolded token
+ * @param data The data to remove
+ */
+static void _token_delete (s4_index_t *index, const char *token, void *data)
+{
+	const s4_val_t *val = g_hash_table_lookup (index->token_vals, token);
+
+	if (val == NULL)
+		return;
+
+	_index_delete (index->tokens, val, data);
+
+	if (_index_lookup (index->tokens, val) == NULL) {
+		g_rw_lock_writer_lock (&index->tokens->latch);
+		_inner_drop_key (index->tokens->root, val);
+		g_rw_lock_writer_unlock (&index->tokens->latch);
+
+		g_hash_table_remove (index->token_vals, token);
+	}
+}
+
+/**
+ * Adds or removes the tokens of a value to the token index.
+ * Called with the index locked exclusively.
+ *
+ * @param index The index with the token index
+ * @param val The value to tokenize
+ * @param data The data the value belongs to
+ * @param insert Non-zero to add the tokens, 0 to remove them
+ */
+static void _tokens_update (s4_index_t *index, const s4_val_t *val, void *data, int insert)
+{
+	const char *s, *end;
+	char buf[12], *token;
+	int32_t i;
+
+	if (s4_val_get_int (val, &i)) {
+		sprintf (buf, "%i", i);
+		s = buf;
+	} else if (!s4_val_get_casefolded_str (val, &s)) {
+		return;
+	}
+
+	while (*s) {
+		for (; isspace ((unsigned char)*s); s++);
+		for (end = s; *end && !isspace ((unsigned char)*end); end++);
+
+		if (end > s) {
+			token = g_strndup (s, end - s);
+			if (insert) {
+				_index_insert (index->tokens, _token_val (index, token), data);
+			} else {
+				_token_delete (index, token, data);
+			}
+			g_free (token);
+		}
+
+		s = end;
+	}
 }
 
 /**
@@ -253,42 +743,328 @@ static int _val_cmp (const s4_val_t *v1, const s4_val_t *v2)
  */
 int _index_insert (s4_index_t *index, const s4_val_t *val, void *new_data)
 {
-	int i,j;
+	const s4_val_t *sep;
+	node_t *sibling;
+
+	if (index->tokens != NULL)
+		_tokens_update (index, val, new_data, 1);
+
+	g_rw_lock_writer_lock (&index->latch);
+	sibling = _node_insert (index, index->root, val, new_data, &sep);
+
+	/* The root was split, so the tree grows one level */
+	if (sibling != NULL) {
+		inner_t *root = calloc (1, sizeof (inner_t));
+
+		root->node.size = 2;
+		root->children[0] = index->root;
+		root->children[1] = sibling;
+		root->keys[1] = sep;
+		index->root = &root->node;
+	}
+	g_rw_lock_writer_unlock (&index->latch);
+
+	return 1;
+}
+
+/**
+ * Sorts value-data pairs the way they are kept in an index.
+ */
+static int _pair_cmp (const void *a, const void *b)
+{
+	const index_pair_t *pa = a, *pb = b;
+	int ret = _val_cmp (pa->val, pb->val);
 
-	i = _bsearch (index, (index_function_t)_val_cmp, (void*)val);
+	if (ret == 0) {
+		ret = ((char*)pa->data > (char*)pb->data) - ((char*)pa->data < (char*)pb->data);
+	}
 
-	if (i >= index->size || _val_cmp (val, index->data[i].val)) {
-		if (index->size >= index->alloc) {
-			index->alloc *= 2;
-			index->data = realloc (index->data, sizeof (index_t) * index->alloc);
+	return ret;
+}
+
+/**
+ * Fills an empty index with many value-data pairs at once.
+ * The pairs are sorted and the tree is built one level at a time from
+ * the leaves up, with the nodes of every level about equally full.
+ * If the index is not empty the pairs are inserted one by one.
+ *
+ * @param index The index to fill
+ * @param pairs The pairs to add, they are sorted in place
+ * @param count The number of pairs
+ */
+void _index_build (s4_index_t *index, index_pair_t *pairs, int count)
+{
+	GPtrArray *level, *parents;
+	leaf_t *leaf = NULL;
+	index_t *item = NULL;
+	int i, n, values, nodes;
+
+	if (!index->root->leaf || index->root->size > 0) {
+		for (i = 0; i < count; i++) {
+			_index_insert (index, pairs[i].val, pairs[i].data);
 		}
-		memmove (index->data + i + 1, index->data + i, (index->size - i) * sizeof (index_t));
-		index->data[i].val = val;
-		index->data[i].size = 0;
-		index->data[i].alloc = 1;
-		index->data[i].data = malloc (sizeof (index_data_t) * index->data[i].alloc);
+		return;
+	}
 
-		index->size++;
+	if (count == 0)
+		return;
+
+	if (index->tokens != NULL) {
+		for (i = 0; i < count; i++) {
+			_tokens_update (index, pairs[i].val, pairs[i].data, 1);
+		}
+	}
+
+	qsort (pairs, count, sizeof (index_pair_t), _pair_cmp);
+
+	for (i = 1, values = 1; i < count; i++) {
+		if (_val_cmp (pairs[i - 1].val, pairs[i].val))
+			values++;
 	}
 
-	j = _data_search (index->data + i, new_data);
+	g_rw_lock_writer_lock (&index->latch);
+
+	free (index->first);
+	level = g_ptr_array_new ();
+	nodes = (values + NODE_ORDER - 1) / NODE_ORDER;
+
+	for (i = 0, n = -1; i < count; i++) {
+		if (item == NULL || _val_cmp (item->val, pairs[i].val)) {
+			if (item != NULL)
+				_stats_update (index, 0, item->size);
+
+			/* Value n goes to leaf n * nodes / values */
+			n++;
+			if (level->len < (gint64)n * nodes / values + 1) {
+				leaf_t *new_leaf = calloc (1, sizeof (leaf_t));
+
+				new_leaf->node.leaf = 1;
+				new_leaf->prev = leaf;
+				if (leaf != NULL)
+					leaf->next = new_leaf;
+				leaf = new_leaf;
+				g_ptr_array_add (level, leaf);
+			}
+
+			item = leaf->items + leaf->node.size++;
+			item->val = pairs[i].val;
+			item->size = 0;
+			item->alloc = 1;
+			item->data = malloc (sizeof (index_data_t) * item->alloc);
+		}
+
+		/* The same entry can have a value from several sources */
+		if (item->size > 0 && item->data[item->size - 1].data == pairs[i].data) {
+			item->data[item->size - 1].count++;
+			continue;
+		}
+
+		if (item->size >= item->alloc) {
+			item->alloc *= 2;
+			item->data = realloc (item->data, sizeof (index_data_t) * item->alloc);
+		}
+		item->data[item->size].data = pairs[i].data;
+		item->data[item->size].count = 1;
+		item->size++;
+	}
+	_stats_update (index, 0, item->size);
+
+	index->first = g_ptr_array_index (level, 0);
+
+	/* Every level gets a parent for about every NODE_ORDER nodes */
+	while (level->len > 1) {
+		inner_t *inner = NULL;
+
+		parents = g_ptr_array_new ();
+		nodes = (level->len + NODE_ORDER - 1) / NODE_ORDER;
+
+		for (i = 0; i < level->len; i++) {
+			node_t *child = g_ptr_array_index (level, i);
+
+			if (parents->len < (gint64)i * nodes / level->len + 1) {
+				inner = calloc (1, sizeof (inner_t));
+				g_ptr_array_add (parents, inner);
+			}
+
+			inner->keys[inner->node.size] = _node_first_val (child);
+			inner->children[inner->node.size] = child;
+			inner->node.size++;
+		}
+
+		g_ptr_array_free (level, TRUE);
+		level = parents;
+	}
+
+	index->root = g_ptr_array_index (level, 0);
+	g_ptr_array_free (level, TRUE);
+
+	g_rw_lock_writer_unlock (&index->latch);
+}
+
+/**
+ * Rebalances a child of an inner node that has less than half as
+ * many values or children as it can hold. It is merged with a
+ * sibling if they fit in one node, otherwise the sibling gives it
+ * enough to make them about the same size.
+ *
+ * @param inner The node the child belongs to, it has more than one child
+ * @param i The position of the child
+ */
+static void _node_rebalance (inner_t *inner, int i)
+{
+	int j = (i > 0)?i - 1:i;
+	node_t *left = inner->children[j], *right = inner->children[j + 1];
+	int n = left->size + right->size, m;
+
+	if (left->leaf) {
+		leaf_t *l = (leaf_t*)left, *r = (leaf_t*)right;
+
+		if (n <= NODE_ORDER) {
+			memcpy (l->items + left->size, r->items, right->size * sizeof (index_t));
+			left->size = n;
+
+			l->next = r->next;
+			if (r->next != NULL)
+				r->next->prev = l;
+			free (r);
+			goto remove_right;
+		}
 
-	if (j >= index->data[i].size || new_data != index->data[i].data[j].data) {
-		if (index->data[i].size >= index->data[i].alloc) {
-			index->data[i].alloc *= 2;
-			index->data[i].data = realloc (index->data[i].data, sizeof (index_data_t) * index->data[i].alloc);
+		if (left->size < right->size) {
+			m = right->size - n / 2;
+			memcpy (l->items + left->size, r->items, m * sizeof (index_t));
+			memmove (r->items, r->items + m, (right->size - m) * sizeof (index_t));
+			left->size += m;
+			right->size -= m;
+		} else {
+			m = left->size - n / 2;
+			memmove (r->items + m, r->items, right->size * sizeof (index_t));
+			memcpy (r->items, l->items + left->size - m, m * sizeof (index_t));
+			left->size -= m;
+			right->size += m;
 		}
-		memmove (index->data[i].data + j + 1, index->data[i].data + j,
-				(index->data[i].size - j) * sizeof (index_data_t));
-		index->data[i].data[j].data = new_data;
-		index->data[i].data[j].count = 1;
 
-		index->data[i].size++;
+		inner->keys[j + 1] = r->items[0].val;
 	} else {
-		index->data[i].data[j].count++;
+		inner_t *l = (inner_t*)left, *r = (inner_t*)right;
+
+		/* The first child of right gets the key that separates
+		 * it from left, as it may not be first any longer
+		 */
+		r->keys[0] = inner->keys[j + 1];
+
+		if (n <= NODE_ORDER) {
+			memcpy (l->keys + left->size, r->keys, right->size * sizeof (s4_val_t*));
+			memcpy (l->children + left->size, r->children, right->size * sizeof (node_t*));
+			left->size = n;
+
+			free (r);
+			goto remove_right;
+		}
+
+		if (left->size < right->size) {
+			m = right->size - n / 2;
+			memcpy (l->keys + left->size, r->keys, m * sizeof (s4_val_t*));
+			memcpy (l->children + left->size, r->children, m * sizeof (node_t*));
+			memmove (r->keys, r->keys + m, (right->size - m) * sizeof (s4_val_t*));
+			memmove (r->children, r->children + m, (right->size - m) * sizeof (node_t*));
+			left->size += m;
+			right->size -= m;
+		} else {
+			m = left->size - n / 2;
+			memmove (r->keys + m, r->keys, right->size * sizeof (s4_val_t*));
+			memmove (r->children + m, r->children, right->size * sizeof (node_t*));
+			memcpy (r->keys, l->keys + left->size - m, m * sizeof (s4_val_t*));
+			memcpy (r->children, l->children + left->size - m, m * sizeof (node_t*));
+			left->size -= m;
+			right->size += m;
+		}
+
+		inner->keys[j + 1] = r->keys[0];
 	}
 
-	return 1;
+	return;
+
+remove_right:
+	memmove (inner->keys + j + 1, inner->keys + j + 2,
+			(inner->node.size - j - 2) * sizeof (s4_val_t*));
+	memmove (inner->children + j + 1, inner->children + j + 2,
+			(inner->node.size - j - 2) * sizeof (node_t*));
+	inner->node.size--;
+}
+
+/**
+ * Removes a value-data pair below a node.
+ * Nodes that become less than half full are merged with or
+ * given values by a sibling, see _node_rebalance.
+ *
+ * @param index The index the node belongs to
+ * @param node The node to remove from
+ * @param val The value to remove
+ * @param data The data to remove
+ * @return 0 if the value-data pair is not found, 1 otherwise
+ */
+static int _node_delete (s4_index_t *index, node_t *node, const s4_val_t *val, void *data)
+{
+	inner_t *inner;
+	node_t *child;
+	int i, n = node->size, ret;
+
+	if (node->leaf) {
+		leaf_t *leaf = (leaf_t*)node;
+		int old_size;
+
+		i = _leaf_search (leaf, (index_function_t)_val_cmp, (void*)val);
+		if (i >= n || _val_cmp (leaf->items[i].val, val))
+			return 0;
+
+		old_size = leaf->items[i].size;
+		if (!_item_delete (leaf->items + i, data))
+			return 0;
+
+		_stats_update (index, old_size, leaf->items[i].size);
+
+		if (leaf->items[i].size <= 0) {
+			free (leaf->items[i].data);
+			memmove (leaf->items + i, leaf->items + i + 1, (n - i - 1) * sizeof (index_t));
+			leaf->node.size--;
+		}
+
+		return 1;
+	}
+
+	inner = (inner_t*)node;
+	i = _inner_search (inner, (index_function_t)_val_cmp, (void*)val, 1);
+	child = inner->children[i];
+	ret = _node_delete (index, child, val, data);
+
+	if (child->size == 0) {
+		if (child->leaf) {
+			leaf_t *leaf = (leaf_t*)child;
+
+			if (leaf->prev != NULL)
+				leaf->prev->next = leaf->next;
+			else
+				index->first = leaf->next;
+			if (leaf->next != NULL)
+				leaf->next->prev = leaf->prev;
+		}
+		free (child);
+
+		/* The first child has no key, so when it is removed the
+		 * key of the second child goes instead
+		 */
+		memmove (inner->children + i, inner->children + i + 1, (n - i - 1) * sizeof (node_t*));
+		i = MAX (i, 1);
+		if (i < n) {
+			memmove (inner->keys + i, inner->keys + i + 1, (n - i - 1) * sizeof (s4_val_t*));
+		}
+		inner->node.size--;
+	} else if (child->size < NODE_ORDER / 2 && n > 1) {
+		_node_rebalance (inner, i);
+	}
+
+	return ret;
 }
 
 /**
@@ -301,31 +1077,72 @@ int _index_insert (s4_index_t *index, const s4_val_t *val, void *new_data)
  */
 int _index_delete (s4_index_t *index, const s4_val_t *val, void *data)
 {
-	int i,j;
+	int ret;
 
-	i = _bsearch (index, (index_function_t)_val_cmp, (void*)val);
-	if (i >= index->size || _val_cmp (val, index->data[i].val)) {
-		return 0;
+	if (index->tokens != NULL)
+		_tokens_update (index, val, data, 0);
+
+	g_rw_lock_writer_lock (&index->latch);
+	ret = _node_delete (index, index->root, val, data);
+
+	/* Shrink the tree while the root only has one child */
+	while (!index->root->leaf && index->root->size == 1) {
+		inner_t *root = (inner_t*)index->root;
+		index->root = root->children[0];
+		free (root);
 	}
 
-	j = _data_search (index->data + i, data);
-	if (j >= index->size || data != index->data[i].data) {
-		return 0;
+	if (index->root->size == 0 && !index->root->leaf) {
+		free (index->root);
+		index->first = calloc (1, sizeof (leaf_t));
+		index->first->node.leaf = 1;
+		index->root = &index->first->node;
 	}
+	g_rw_lock_writer_unlock (&index->latch);
 
-	if (--index->data[i].data[j].count <= 0) {
-		memmove (index->data[i].data + j, index->data[i].data + j + 1,
-				(index->data[i].size - j - 1) * sizeof (index_data_t));
-		index->data[i].size--;
+	return ret;
+}
+
+/**
+ * Adds all the data associated with a value to a set.
+ *
+ * @param item The value to add the data of.
+ * @param set The set to add to.
+ */
+static void _add_to_set (index_t *item, s4_set_t *set)
+{
+	int j;
+
+	for (j = 0; j < item->size; j++) {
+		_set_add (set, item->data[j].data);
 	}
+}
 
-	if (index->data[i].size <= 0) {
-		free (index->data[i].data);
-		memmove (index->data + i, index->data + i + i, (index->size - i - 1) * sizeof (index_t));
-		index->size--;
+/**
+ * Looks up the data associated with a value.
+ * Used for a-indexes, where every value points at exactly one entry.
+ *
+ * @param index The index to look in
+ * @param val The value to look for
+ * @return The first data associated with val, or NULL if there is none
+ */
+void *_index_lookup (s4_index_t *index, const s4_val_t *val)
+{
+	leaf_t *leaf;
+	void *ret = NULL;
+	int i;
+
+	g_rw_lock_reader_lock (&index->latch);
+	leaf = _find_leaf (index, (index_function_t)_val_cmp, (void*)val, 1);
+	i = _leaf_search (leaf, (index_function_t)_val_cmp, (void*)val);
+
+	if (i < leaf->node.size && !_val_cmp (leaf->items[i].val, val)
+			&& leaf->items[i].size > 0) {
+		ret = leaf->items[i].data[0].data;
 	}
+	g_rw_lock_reader_unlock (&index->latch);
 
-	return 1;
+	return ret;
 }
 
 /**
@@ -336,40 +1153,111 @@ int _index_delete (s4_index_t *index, const s4_val_t *val, void *data)
  * It should return 0  if the value matches, -1 if the value is too small
  * and 1 if the value is too big,
  * @param func_data Data passed as the second argument to func
- * @return A GList where list->data is the data found matching
+ * @param set The set to add the data found matching to
  */
-GList *_index_search (s4_index_t *index, index_function_t func, void *func_data)
+void _index_search (s4_index_t *index, index_function_t func, void *func_data, s4_set_t *set)
 {
-	int i,j;
-	GHashTable *found;
-	GList *ret = NULL;
+	leaf_t *leaf;
+	int i;
 
 	if (func == NULL)
 		func = (index_function_t)_val_cmp;
 
-	i = _bsearch (index, func, func_data);
+	g_rw_lock_reader_lock (&index->latch);
+	leaf = _find_leaf (index, func, func_data, 0);
+	i = _leaf_search (leaf, func, func_data);
 
-	if (i >= index->size || func (index->data[i].val, func_data)) {
-		return NULL;
+	for (; leaf != NULL; leaf = leaf->next, i = 0) {
+		for (; i < leaf->node.size; i++) {
+			if (func (leaf->items[i].val, func_data))
+				goto done;
+
+			_add_to_set (leaf->items + i, set);
+		}
 	}
 
-	found = g_hash_table_new (NULL, NULL);
+done:
+	g_rw_lock_reader_unlock (&index->latch);
+}
+
+typedef struct {
+	const char *str;
+	size_t len;
+	int prefix;
+} str_search_t;
 
-	for (; i >= 0 && !func (index->data[i].val, func_data); i--)
-		;
-	i++;
-	for (; i < index->size && !func (index->data[i].val, func_data); i++) {
-		for (j = 0; j < index->data[i].size; j++) {
-			if (g_hash_table_lookup (found, index->data[i].data[j].data) == NULL) {
-				g_hash_table_insert (found, index->data[i].data[j].data, (void*)1);
-				ret = g_list_prepend (ret, index->data[i].data[j].data);
-			}
-		}
+/**
+ * A monotonic search function for casefolded strings or prefixes.
+ *
+ * @param val The value in the index
+ * @param data The str_search_t to look for
+ * @return 0 if the value matches, -1 if it is too small and 1 if it is too big
+ */
+static int _str_search_cmp (const s4_val_t *val, void *data)
+{
+	str_search_t *search = data;
+	const char *s;
+	int ret;
+
+	/* Integers are placed after strings, see _val_cmp */
+	if (!s4_val_get_casefolded_str (val, &s))
+		return 1;
+
+	if (search->prefix) {
+		ret = strncmp (s, search->str, search->len);
+	} else {
+		ret = strcmp (s, search->str);
 	}
 
-	g_hash_table_destroy (found);
+	return (ret > 0) - (ret < 0);
+}
+
+/**
+ * Searches the token index of an index.
+ *
+ * @param index The index to search, it must have a token index
+ * @param token The casefolded token to look for
+ * @param prefix Non-zero to find every token starting with token
+ * @param set The set to add the data of the values with the token to
+ */
+void _index_token_search (s4_index_t *index, const char *token, int prefix, s4_set_t *set)
+{
+	str_search_t search;
 
-	return ret;
+	search.str = token;
+	search.len = strlen (token);
+	search.prefix = prefix;
+
+	_index_search (index->tokens, _str_search_cmp, &search, set);
+}
+
+/**
+ * Finds the string values that start with a prefix when casefolded.
+ *
+ * @param index The index to search
+ * @param prefix The casefolded prefix
+ * @param set The set to add the data of the values found to
+ */
+void _index_prefix_search (s4_index_t *index, const char *prefix, s4_set_t *set)
+{
+	str_search_t search;
+
+	search.str = prefix;
+	search.len = strlen (prefix);
+	search.prefix = 1;
+
+	_index_search (index, _str_search_cmp, &search, set);
+}
+
+/**
+ * Gets the token index of an index.
+ *
+ * @param index The index
+ * @return The token index, or NULL if the values are not tokenized
+ */
+s4_index_t *_index_get_tokens (s4_index_t *index)
+{
+	return index->tokens;
 }
 
 /**
@@ -380,30 +1268,48 @@ GList *_index_search (s4_index_t *index, index_function_t func, void *func_data)
  * It should return 0  if the value matches, -1 if the value is too small
  * and 1 if the value is too big,
  * @param func_data Data passed as the second argument to func
- * @return A GList where list->data is the data found matching
+ * @param set The set to add the data found matching to
  */
-GList *_index_lsearch (s4_index_t *index, index_function_t func, void *func_data)
+void _index_lsearch (s4_index_t *index, index_function_t func, void *func_data, s4_set_t *set)
 {
-	int i, j;
-	GList *ret = NULL;
-	GHashTable *found;
-
-	found = g_hash_table_new (NULL, NULL);
+	leaf_t *leaf;
+	int i;
 
-	for (i = 0; i < index->size; i++) {
-		if (!func (index->data[i].val, func_data)) {
-			for (j = 0; j < index->data[i].size; j++) {
-				if (g_hash_table_lookup (found, index->data[i].data[j].data) == NULL) {
-					g_hash_table_insert (found, index->data[i].data[j].data, (void*)1);
-					ret = g_list_prepend (ret, index->data[i].data[j].data);
-				}
+	g_rw_lock_reader_lock (&index->latch);
+	for (leaf = index->first; leaf != NULL; leaf = leaf->next) {
+		for (i = 0; i < leaf->node.size; i++) {
+			if (!func (leaf->items[i].val, func_data)) {
+				_add_to_set (leaf->items + i, set);
 			}
 		}
 	}
+	g_rw_lock_reader_unlock (&index->latch);
+}
+
+/**
+ * Frees a node and everything below it.
+ *
+ * @param node The node to free
+ */
+static void _node_free (node_t *node)
+{
+	int i;
 
-	g_hash_table_unref (found);
+	if (node->leaf) {
+		leaf_t *leaf = (leaf_t*)node;
 
-	return ret;
+		for (i = 0; i < node->size; i++) {
+			free (leaf->items[i].data);
+		}
+	} else {
+		inner_t *inner = (inner_t*)node;
+
+		for (i = 0; i < node->size; i++) {
+			_node_free (inner->children[i]);
+		}
+	}
+
+	free (node);
 }
 
 /**
@@ -413,14 +1319,14 @@ GList *_index_lsearch (s4_index_t *index, index_function_t func, void *func_data
  */
 void _index_free (s4_index_t *index)
 {
-	int i;
-
-	for (i = 0; i < index->size; i++) {
-		free (index->data[i].data);
+	if (index->tokens != NULL) {
+		_index_free (index->tokens);
+		g_hash_table_destroy (index->token_vals);
 	}
 
+	_node_free (index->root);
 	_lock_free (index->lock);
-	free (index->data);
+	g_rw_lock_clear (&index->latch);
 	free (index);
 }
 
@@ -434,6 +1340,81 @@ int _index_lock_exclusive (s4_index_t *index, s4_transaction_t *trans)
 	return _lock_exclusive (index->lock, trans);
 }
 
+/**
+ * Gets the statistics of an index.
+ * The index should be locked.
+ *
+ * @param index The index
+ * @return The statistics
+ */
+const s4_index_stats_t *_index_get_stats (s4_index_t *index)
+{
+	return &index->stats;
+}
+
+/**
+ * Counts the levels and leaves of the tree of an index.
+ *
+ * @param index The index
+ * @param stats The depth and leaves of it are set
+ */
+static void _index_get_shape (s4_index_t *index, s4_index_stats_t *stats)
+{
+	node_t *node;
+	leaf_t *leaf;
+
+	g_rw_lock_reader_lock (&index->latch);
+	stats->depth = 1;
+	for (node = index->root; !node->leaf; node = ((inner_t*)node)->children[0]) {
+		stats->depth++;
+	}
+
+	stats->leaves = 0;
+	for (leaf = index->first; leaf != NULL; leaf = leaf->next) {
+		stats->leaves++;
+	}
+	g_rw_lock_reader_unlock (&index->latch);
+}
+
+/**
+ * Gets the statistics of an index.
+ * This is meant for debugging, to see how selective the filters
+ * on a key are and why the planner chose the plan it did.
+ *
+ * @param s4 The database
+ * @param key The key of the index
+ * @param parent Non-zero to get the index of the entries with the key,
+ * used by filters with S4_COND_PARENT. Otherwise the index of the
+ * values the entries have for the key, which only exists if the key
+ * was given to s4_open.
+ * @param stats Filled with the statistics
+ * @return 0 if there is no such index, non-zero otherwise
+ */
+int s4_index_get_stats (s4_t *s4, const char *key, int parent, s4_index_stats_t *stats)
+{
+	s4_transaction_t *trans;
+	s4_index_t *index;
+
+	if (parent) {
+		index = _index_get_a (s4, _string_lookup (s4, key), 0);
+	} else {
+		index = _index_get_b (s4, key);
+	}
+
+	if (index == NULL) {
+		s4_set_errno (S4E_NOENT);
+		return 0;
+	}
+
+	trans = _transaction_dummy_alloc (s4);
+	_index_lock_shared (index, trans);
+	*stats = index->stats;
+	_index_get_shape (index, stats);
+	_transaction_dummy_free (trans);
+
+	return 1;
+}
+
 /**
  * @}
  */
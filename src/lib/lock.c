@@ -14,6 +14,7 @@
 
 #include "s4_priv.h"
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * @defgroup Lock Lock
@@ -30,54 +31,146 @@
  * @{
  */
 
-struct s4_lock_St {
+/* Locks do not have their own mutex and conditions, that would make
+ * every entry several hundred bytes larger. Instead each lock uses
+ * one of a fixed number of stripes, picked by its address. Waiters
+ * on a stripe are woken with a broadcast and recheck their own lock.
+ */
+#define LOCK_STRIPES 64
+
+typedef struct {
 	GMutex lock;
-	GCond upgrade_signal, signal;
-	GHashTable *transactions;
-	int writers_waiting;
+	GCond signal;
+} lock_stripe_t;
+
+static lock_stripe_t stripes[LOCK_STRIPES];
+
+/* One of these exists for every lock a transaction holds. It is linked
+ * both into the list of locks held by the transaction, and into the
+ * list of transactions holding the lock.
+ */
+struct s4_lock_holder_St {
+	s4_lock_t *lock;
+	s4_transaction_t *trans;
+	s4_lock_holder_t *next_lock;
+	s4_lock_holder_t *next_holder;
+};
+
+struct s4_lock_St {
+	s4_lock_holder_t *holders;
 	int readers;
-	int exclusive;
-	int upgrade, want_upgrade;
+	short writers_waiting;
+	char exclusive;
+	char upgrade;
 };
 
+static lock_stripe_t *_lock_stripe (s4_lock_t *lock)
+{
+	return stripes + (((gsize)lock >> 4) % LOCK_STRIPES);
+}
+
 /* Creates a new lock structure */
 s4_lock_t *_lock_alloc ()
 {
-	s4_lock_t *lock = calloc (sizeof (s4_lock_t), 1);
-	g_mutex_init (&lock->lock);
-	g_cond_init (&lock->signal);
-	g_cond_init (&lock->upgrade_signal);
-	lock->transactions = g_hash_table_new (NULL, NULL);
-
-	return lock;
+	return calloc (sizeof (s4_lock_t), 1);
 }
 
 /* Frees a lock structure */
 void _lock_free (s4_lock_t *lock)
 {
-	g_mutex_clear (&lock->lock);
-	g_cond_clear (&lock->signal);
-	g_cond_clear (&lock->upgrade_signal);
-	g_hash_table_destroy (lock->transactions);
 	free (lock);
 }
 
 /* Checks if transactions holds this lock */
 static int _lock_has_trans (s4_lock_t *lock, s4_transaction_t *trans)
 {
-	return g_hash_table_lookup (lock->transactions, trans) != NULL;
+	s4_lock_holder_t *h;
+
+	for (h = lock->holders; h != NULL; h = h->next_holder) {
+		if (h->trans == trans)
+			return 1;
+	}
+
+	return 0;
 }
 
-/* Adds a transactions to the table of transactions holding this lock */
+/* Adds a transactions to the holders of this lock, and the
+ * lock to the locks held by the transaction
+ */
 static void _lock_add_trans (s4_lock_t *lock, s4_transaction_t *trans)
 {
-	g_hash_table_insert (lock->transactions, trans, GINT_TO_POINTER (1));
+	s4_lock_holder_t *h = malloc (sizeof (s4_lock_holder_t));
+
+	h->lock = lock;
+	h->trans = trans;
+	h->next_holder = lock->holders;
+	h->next_lock = _transaction_get_locks (trans);
+	lock->holders = h;
+	_transaction_set_locks (trans, h);
 }
 
-/* Removes a transactions from the table of transactions holding this lock */
+/* Removes a transactions from the holders of this lock */
 static void _lock_del_trans (s4_lock_t *lock, s4_transaction_t *trans)
 {
-	g_hash_table_remove (lock->transactions, trans);
+	s4_lock_holder_t **h;
+
+	for (h = &lock->holders; *h != NULL; h = &(*h)->next_holder) {
+		if ((*h)->trans == trans) {
+			*h = (*h)->next_holder;
+			break;
+		}
+	}
+}
+
+/* A list of locks. Deadlock detection walks only a handful of
+ * locks, so the first few are kept on the stack
+ */
+#define LOCK_LIST_SIZE 16
+
+typedef struct {
+	s4_lock_t **items;
+	int size, alloc;
+	s4_lock_t *fixed[LOCK_LIST_SIZE];
+} lock_list_t;
+
+static void _lock_list_init (lock_list_t *list)
+{
+	list->items = list->fixed;
+	list->size = 0;
+	list->alloc = LOCK_LIST_SIZE;
+}
+
+static void _lock_list_clear (lock_list_t *list)
+{
+	if (list->items != list->fixed)
+		free (list->items);
+}
+
+static void _lock_list_add (lock_list_t *list, s4_lock_t *lock)
+{
+	if (list->size >= list->alloc) {
+		list->alloc *= 2;
+		if (list->items == list->fixed) {
+			list->items = malloc (sizeof (s4_lock_t*) * list->alloc);
+			memcpy (list->items, list->fixed, sizeof (list->fixed));
+		} else {
+			list->items = realloc (list->items, sizeof (s4_lock_t*) * list->alloc);
+		}
+	}
+
+	list->items[list->size++] = lock;
+}
+
+static int _lock_list_has (lock_list_t *list, s4_lock_t *lock)
+{
+	int i;
+
+	for (i = 0; i < list->size; i++) {
+		if (list->items[i] == lock)
+			return 1;
+	}
+
+	return 0;
 }
 
 /* Checks if making trans wait for lock would deadlock.
@@ -87,163 +180,187 @@ static void _lock_del_trans (s4_lock_t *lock, s4_transaction_t *trans)
  * are locks and edges go from the lock to the locks the transactions holding
  * this lock are waiting for. If there is a cycle we have a deadlock.
  *
+ * Only called when trans actually has to wait. trans must be waiting
+ * for lock already, so if another transaction starts waiting on a lock
+ * trans holds at the same time, at least one of them sees the cycle.
+ *
  * Returns 1 if it will deadlock, 0 otherwise
  */
-static int _lock_will_deadlock_helper (s4_lock_t *lock, s4_transaction_t *trans, GHashTable *visited, int first)
+static int _lock_will_deadlock (s4_lock_t *lock, s4_transaction_t *trans)
 {
-	GHashTableIter iter;
-	GList *waiting_for = NULL;
-	s4_transaction_t *t;
-	int ret = 0;
+	lock_list_t visited, todo;
+	s4_lock_holder_t *h;
+	int ret = 0, first = 1;
 
-	/* Bail if the lock is NULL or has already been visited */
-	if (lock == NULL || g_hash_table_lookup (visited, lock) != NULL)
-		return 0;
-
-	/* Add this lock to the table of visited locks */
-	g_hash_table_insert (visited, lock, GINT_TO_POINTER (1));
+	_lock_list_init (&visited);
+	_lock_list_init (&todo);
+	_lock_list_add (&todo, lock);
 
-	g_mutex_lock (&lock->lock);
-	g_hash_table_iter_init (&iter, lock->transactions);
+	while (!ret && todo.size > 0) {
+		lock_stripe_t *stripe;
+		s4_lock_t *l = todo.items[--todo.size];
 
-	/* Get a list of all transactions holding this lock */
-	while (g_hash_table_iter_next (&iter, (void**)&t, NULL)) {
-		if (t != trans) {
-			waiting_for = g_list_prepend (waiting_for, _transaction_get_waiting_for (t));
-		} else {
-			/* If we found a lock that this transaction holds
-			 * and it's not the first lock, we have a deadlock.
-			 */
-			ret = !first;
-		}
-	}
+		if (_lock_list_has (&visited, l))
+			continue;
+		_lock_list_add (&visited, l);
 
-	g_mutex_unlock (&lock->lock);
+		stripe = _lock_stripe (l);
+		g_mutex_lock (&stripe->lock);
 
-	/* Check all the locks the transactions in the list are waiting for */
-	while (!ret && waiting_for != NULL) {
-		ret = _lock_will_deadlock_helper (waiting_for->data, trans, visited, 0);
-		waiting_for = g_list_delete_link (waiting_for, waiting_for);
-	}
+		/* Follow the transactions holding this lock */
+		for (h = l->holders; h != NULL; h = h->next_holder) {
+			if (h->trans != trans) {
+				s4_lock_t *waiting_for = _transaction_get_waiting_for (h->trans);
 
-	g_list_free (waiting_for);
-
-	return ret;
-}
+				if (waiting_for != NULL)
+					_lock_list_add (&todo, waiting_for);
+			} else {
+				/* If we found a lock that this transaction holds
+				 * and it's not the first lock, we have a deadlock.
+				 */
+				ret = !first;
+			}
+		}
 
-static int _lock_will_deadlock (s4_lock_t *lock, s4_transaction_t *trans)
-{
-	GHashTable *visited;
-	int ret;
+		g_mutex_unlock (&stripe->lock);
+		first = 0;
+	}
 
-	visited = g_hash_table_new (NULL, NULL);
-	ret = _lock_will_deadlock_helper (lock, trans, visited, 1);
+	_lock_list_clear (&visited);
+	_lock_list_clear (&todo);
 
-	g_hash_table_destroy (visited);
 	return ret;
 }
 
-/* Aquires an exclusive lock. */
-int _lock_exclusive (s4_lock_t *lock, s4_transaction_t *trans)
+/* Prepares trans for waiting on lock.
+ * Returns 0 and sets s4_errno if waiting would deadlock, 1 otherwise
+ */
+static int _lock_prepare_wait (s4_lock_t *lock, s4_transaction_t *trans)
 {
 	_transaction_set_waiting_for (trans, lock);
 
 	if (_lock_will_deadlock (lock, trans)) {
 		_transaction_set_waiting_for (trans, NULL);
+		_stats_count (_transaction_get_db (trans), S4_STAT_DEADLOCKS, 1);
 		s4_set_errno (S4E_DEADLOCK);
 		return 0;
 	}
 
-	g_mutex_lock (&lock->lock);
+	return 1;
+}
+
+/* Aquires an exclusive lock. */
+int _lock_exclusive (s4_lock_t *lock, s4_transaction_t *trans)
+{
+	lock_stripe_t *stripe = _lock_stripe (lock);
+	gint64 wait_start = 0;
+	int has;
+
+	g_mutex_lock (&stripe->lock);
+	has = _lock_has_trans (lock, trans);
+
+	/* Only look for deadlocks if we have to wait */
+	if (has?(!lock->exclusive && lock->readers > 1)
+			:(lock->readers || lock->exclusive || lock->upgrade)) {
+		g_mutex_unlock (&stripe->lock);
+		wait_start = g_get_monotonic_time ();
+		if (!_lock_prepare_wait (lock, trans))
+			return 0;
+		g_mutex_lock (&stripe->lock);
+	}
 
-	if (_lock_has_trans (lock, trans)) {
+	if (has) {
 		/* If we already hold this lock, but not exclusively,
 		 * we have to upgrade it
 		 */
 		if (!lock->exclusive) {
-			lock->want_upgrade = 1;
 			lock->readers--;
 			while (lock->readers) {
-				g_cond_wait (&lock->upgrade_signal, &lock->lock);
+				g_cond_wait (&stripe->signal, &stripe->lock);
 			}
-			lock->want_upgrade = 0;
 		}
 	} else {
 		lock->writers_waiting++;
 		while (lock->readers || lock->exclusive || lock->upgrade) {
-			g_cond_wait (&lock->signal, &lock->lock);
+			g_cond_wait (&stripe->signal, &stripe->lock);
 		}
 		lock->writers_waiting--;
 
 		_lock_add_trans (lock, trans);
-		_transaction_add_lock (trans, lock);
 	}
 
 	_transaction_set_waiting_for (trans, NULL);
 	lock->exclusive = 1;
 
-	g_mutex_unlock (&lock->lock);
+	g_mutex_unlock (&stripe->lock);
+
+	if (wait_start != 0)
+		_stats_time (_transaction_get_db (trans), S4_STAT_LOCK_WAIT, wait_start);
 	return 1;
 }
 
 /* Aquires a shared (upgradable if this is not a read-only transcation) lock */
 int _lock_shared (s4_lock_t *lock, s4_transaction_t *trans)
 {
+	lock_stripe_t *stripe = _lock_stripe (lock);
+	gint64 wait_start = 0;
+
 	/* If this is not a read-only transaction, we might want to
 	 * aquire this lock exclusively later on, therefore it must be
 	 * upgradable
 	 */
 	int upgrade = !(_transaction_get_flags (trans) & S4_TRANS_READONLY);
 
-	_transaction_set_waiting_for (trans, lock);
-
-	if (_lock_will_deadlock (lock, trans)) {
-		_transaction_set_waiting_for (trans, NULL);
-		s4_set_errno (S4E_DEADLOCK);
-		return 0;
-	}
+	/* Read-only transactions read from a snapshot instead */
+	if (!upgrade)
+		return 1;
 
-	g_mutex_lock (&lock->lock);
+	g_mutex_lock (&stripe->lock);
 
 	/* If we do not already hold this lock we have to aquire it */
 	if (!_lock_has_trans (lock, trans)) {
-		while (lock->exclusive || lock->writers_waiting || (lock->upgrade && upgrade)) {
-			g_cond_wait (&lock->signal, &lock->lock);
+		if (lock->exclusive || lock->writers_waiting || lock->upgrade) {
+			g_mutex_unlock (&stripe->lock);
+			wait_start = g_get_monotonic_time ();
+			if (!_lock_prepare_wait (lock, trans))
+				return 0;
+			g_mutex_lock (&stripe->lock);
 		}
 
-		lock->readers++;
-		if (upgrade) {
-			lock->upgrade = 1;
+		while (lock->exclusive || lock->writers_waiting || lock->upgrade) {
+			g_cond_wait (&stripe->signal, &stripe->lock);
 		}
+
+		lock->readers++;
+		lock->upgrade = 1;
 		_lock_add_trans (lock, trans);
-		_transaction_add_lock (trans, lock);
+		_transaction_set_waiting_for (trans, NULL);
 	}
 
-	_transaction_set_waiting_for (trans, NULL);
-	g_mutex_unlock (&lock->lock);
+	g_mutex_unlock (&stripe->lock);
+
+	if (wait_start != 0)
+		_stats_time (_transaction_get_db (trans), S4_STAT_LOCK_WAIT, wait_start);
 	return 1;
 }
 
 /* Unlocks a single lock held by trans */
 static void _lock_unlock (s4_lock_t *lock, s4_transaction_t *trans)
 {
+	lock_stripe_t *stripe = _lock_stripe (lock);
 	int upgrade = !(_transaction_get_flags (trans) & S4_TRANS_READONLY);
 
-	g_mutex_lock (&lock->lock);
+	g_mutex_lock (&stripe->lock);
 	if (lock->exclusive) {
 		lock->exclusive = 0;
-		g_cond_signal (&lock->signal);
+		g_cond_broadcast (&stripe->signal);
 	} else if (lock->readers) {
 		lock->readers--;
 
+		/* Wakes both waiting writers and the upgrader */
 		if (lock->readers == 0) {
-			if (lock->want_upgrade) {
-				g_cond_signal (&lock->upgrade_signal);
-			} else {
-				g_cond_signal (&lock->signal);
-			}
+			g_cond_broadcast (&stripe->signal);
 		}
-
 	}
 
 	_lock_del_trans (lock, trans);
@@ -251,18 +368,21 @@ static void _lock_unlock (s4_lock_t *lock, s4_transaction_t *trans)
 		lock->upgrade = 0;
 	}
 
-	g_mutex_unlock (&lock->lock);
+	g_mutex_unlock (&stripe->lock);
 }
 
 /* Unlocks all locks held by trans */
 void _lock_unlock_all (s4_transaction_t *trans)
 {
-	GList *locks = _transaction_get_locks (trans);
+	s4_lock_holder_t *h = _transaction_get_locks (trans), *next;
 
-	for (; locks != NULL; locks = g_list_next (locks)) {
-		s4_lock_t *lock = locks->data;
-		_lock_unlock (lock, trans);
+	for (; h != NULL; h = next) {
+		next = h->next_lock;
+		_lock_unlock (h->lock, trans);
+		free (h);
 	}
+
+	_transaction_set_locks (trans, NULL);
 }
 
 /**
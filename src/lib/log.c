@@ -16,6 +16,7 @@
 #include "logging.h"
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #ifdef _WIN32
 #include <io.h>      /* For _chsize */
@@ -23,6 +24,7 @@
 #else
 #include <unistd.h>  /* For ftruncate */
 #include <fcntl.h>
+#include <sys/stat.h>
 #endif
 
 /**
@@ -34,8 +36,16 @@
  */
 
 typedef enum {
-	LOG_ENTRY_ADD = 0xaddadd,
-	LOG_ENTRY_DEL = 0xde1e7e,
+	LOG_ENTRY_ADD = 0xadd5,
+	LOG_ENTRY_DEL = 0xde15,
+	/* Modifications that may refer to strings written earlier in
+	 * the same transaction, see s4_options_set_compact_strings
+	 */
+	LOG_ENTRY_ADD_REF = 0xadd7,
+	LOG_ENTRY_DEL_REF = 0xde17,
+	/* Modifications written before they had checksums */
+	LOG_ENTRY_ADD_V1 = 0xaddadd,
+	LOG_ENTRY_DEL_V1 = 0xde1e7e,
 	LOG_ENTRY_WRAP = 0x123123,
 	LOG_ENTRY_INIT = 0x87654321,
 	LOG_ENTRY_BEGIN = 0x1,
@@ -44,37 +54,131 @@ typedef enum {
 	LOG_ENTRY_CHECKPOINT = 0x4
 } log_type_t;
 
-#define LOG_SIZE (2*1024*1024)
-
 struct log_header {
 	log_type_t type;
 	log_number_t num;
 };
 
+/* crc is the CRC-32 of the lengths and the data following the
+ * header, so entries that were only partly written are found.
+ * Version 1 entries stop before crc.
+ *
+ * In LOG_ENTRY_ADD_REF and LOG_ENTRY_DEL_REF entries a length below -1
+ * stands for the (-len - 2)th string written out in full since the
+ * start of the transaction, and nothing follows for it. Every entry of
+ * a transaction is read when it is redone, so the strings are known.
+ */
 struct mod_header {
 	int32_t ka_len;
 	int32_t va_len;
 	int32_t kb_len;
 	int32_t vb_len;
 	int32_t s_len;
+	uint32_t crc;
 };
 
+#define MOD_HEADER_V1_SIZE ((size_t)&((struct mod_header*)0)->crc)
+
 struct s4_log_data_St {
 	FILE *logfile;
 	int log_users;
 	GMutex lock;
 
+	/* Entries are put together here and written in one go.
+	 * buf_start is the log number of the first byte.
+	 */
+	char *buf;
+	int buf_len, buf_alloc;
+	log_number_t buf_start;
+
+	/* The log mapped into memory for redo, or NULL */
+	GMappedFile *map;
+	/* Set until the log has been redone after opening it */
+	int recovering;
+
+	/* The current size of the logfile, and the size it should
+	 * grow to on the next checkpoint
+	 */
+	int32_t size;
+	int32_t want_size;
+
 	log_number_t last_checkpoint;
 	log_number_t last_synced;
 	log_number_t last_logpoint;
 	log_number_t next_logpoint;
+	/* The end of the last transaction that changed something */
+	log_number_t last_mod;
+
+	/* Group commit. Every write to the log gets a ticket, and
+	 * committers wait until the ticket is synced to disk.
+	 * Protected by flush_lock, not lock.
+	 */
+	GMutex flush_lock;
+	GCond flush_cond;
+	guint64 written;
+	guint64 flushed;
+	int flushing;
+
+	/* Syncs the log for transactions that did not wait for it,
+	 * started by the first of them
+	 */
+	GThread *flusher;
+	GCond flusher_cond;
+	int flusher_run;
 };
 
+static uint32_t crc_table[256];
+
+/**
+ * Fills in the CRC-32 lookup table.
+ */
+static void _crc_init (void)
+{
+	static gsize initialized = 0;
+	uint32_t c;
+	int i, j;
+
+	if (g_once_init_enter (&initialized)) {
+		for (i = 0; i < 256; i++) {
+			for (c = i, j = 0; j < 8; j++) {
+				c = (c & 1)?(0xedb88320 ^ (c >> 1)):(c >> 1);
+			}
+			crc_table[i] = c;
+		}
+		g_once_init_leave (&initialized, 1);
+	}
+}
+
+/**
+ * Updates a CRC-32 with more data.
+ *
+ * @param crc The CRC of the data so far, 0 to start.
+ * @param data The data to add.
+ * @param len The length of the data.
+ * @return The new CRC.
+ */
+static uint32_t _crc_update (uint32_t crc, const void *data, int len)
+{
+	const unsigned char *p = data;
+
+	crc = ~crc;
+	while (len-- > 0) {
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
 s4_log_data_t *_log_create_data ()
 {
 	s4_log_data_t *ret = calloc (1, sizeof (s4_log_data_t));
 
 	g_mutex_init (&ret->lock);
+	g_mutex_init (&ret->flush_lock);
+	g_cond_init (&ret->flush_cond);
+	g_cond_init (&ret->flusher_cond);
+
+	_crc_init ();
 
 	return ret;
 }
@@ -82,6 +186,10 @@ s4_log_data_t *_log_create_data ()
 void _log_free_data (s4_log_data_t *data)
 {
 	g_mutex_clear (&data->lock);
+	g_mutex_clear (&data->flush_lock);
+	g_cond_clear (&data->flush_cond);
+	g_cond_clear (&data->flusher_cond);
+	free (data->buf);
 	free (data);
 }
 
@@ -94,50 +202,130 @@ static int _get_size (struct mod_header *hdr)
 {
 	int ret = sizeof (struct mod_header);
 
-	ret += hdr->ka_len + hdr->kb_len + hdr->s_len;
+	ret += MAX (hdr->ka_len, 0) + MAX (hdr->kb_len, 0) + MAX (hdr->s_len, 0);
 
 	if (hdr->va_len == -1)
 		ret += sizeof (int32_t);
 	else
-		ret += hdr->va_len;
+		ret += MAX (hdr->va_len, 0);
 
 	if (hdr->vb_len == -1)
 		ret += sizeof (int32_t);
 	else
-		ret += hdr->vb_len;
+		ret += MAX (hdr->vb_len, 0);
 
 	return ret;
 }
 
 /**
- * Writes a string to a file.
- * @param str The string to write.
- * @param len The length of the string.
- * @param file The file to write to.
+ * Appends data to the write buffer.
+ *
+ * @param s4 The database handle.
+ * @param ptr The data to append.
+ * @param len The length of the data.
  */
-static void _write_str (const char *str, int len, FILE *file)
+static void _log_append (s4_t *s4, const void *ptr, int len)
 {
-	fwrite (str, 1, len, file);
+	s4_log_data_t *data = s4->log_data;
+
+	if (data->buf_len + len > data->buf_alloc) {
+		data->buf_alloc = MAX (data->buf_alloc * 2, data->buf_len + len);
+		data->buf_alloc = MAX (data->buf_alloc, 4096);
+		data->buf = realloc (data->buf, data->buf_alloc);
+	}
+
+	memcpy (data->buf + data->buf_len, ptr, len);
+	data->buf_len += len;
 }
 
 /**
- * Writes a value to a file.
- * @param val The value to write.
+ * Appends a value to the write buffer.
+ *
+ * @param s4 The database handle.
+ * @param val The value to append.
  * @param len The lenght of the value.
- * @param file The file to write to.
  */
-static void _write_val (const s4_val_t *val, int len, FILE *file)
+static void _log_append_val (s4_t *s4, const s4_val_t *val, int len)
 {
 	const char *s;
 	int32_t i;
 
 	if (len == -1) {
 		s4_val_get_int (val, &i);
-		fwrite (&i, sizeof (int32_t), 1, file);
-	} else {
+		_log_append (s4, &i, sizeof (int32_t));
+	} else if (len > 0) {
 		s4_val_get_str (val, &s);
-		_write_str (s, len, file);
+		_log_append (s4, s, len);
+	}
+}
+
+/**
+ * Appends a string to the write buffer, unless it is
+ * a reference to a string written before.
+ *
+ * @param s4 The database handle.
+ * @param str The string to append.
+ * @param len The length of the string.
+ */
+static void _log_append_str (s4_t *s4, const char *str, int len)
+{
+	if (len > 0) {
+		_log_append (s4, str, len);
+	}
+}
+
+/**
+ * Starts putting together entries to write.
+ * Must be called with the log lock held.
+ *
+ * @param s4 The database handle.
+ */
+static void _log_begin_entries (s4_t *s4)
+{
+	s4->log_data->buf_len = 0;
+	s4->log_data->buf_start = s4->log_data->next_logpoint;
+}
+
+/**
+ * Writes the entries in the write buffer to the log file.
+ * The buffer never crosses the end of the file, so this is
+ * a single write.
+ *
+ * @param s4 The database handle.
+ */
+static void _log_write_entries (s4_t *s4)
+{
+	s4_log_data_t *data = s4->log_data;
+	const char *buf = data->buf;
+	int len = data->buf_len;
+	long offset = data->buf_start % data->size;
+
+#ifdef _WIN32
+	if (fseek (data->logfile, offset, SEEK_SET) != 0
+			|| fwrite (buf, 1, len, data->logfile) != len) {
+		len = -1;
+	}
+#else
+	while (len > 0) {
+		ssize_t written = pwrite (fileno (data->logfile), buf, len, offset);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			break;
+
+		buf += written;
+		len -= written;
+		offset += written;
+	}
+#endif
+
+	if (len != 0) {
+		S4_ERROR ("could not write to the log: %s", g_strerror (errno));
 	}
+
+	data->buf_len = 0;
+	data->buf_start = data->next_logpoint;
 }
 
 /**
@@ -158,7 +346,83 @@ static int _get_val_len (const s4_val_t *val)
 }
 
 /**
- * Estimates the size needed to write the entire oplist to the log.
+ * Gets the length to log a string with.
+ * Strings found in the dictionary are referred to, the others are
+ * written in full and added to it.
+ *
+ * @param dict The strings written so far in the transaction,
+ * or NULL to write every string in full.
+ * @param str The string.
+ * @return The length of the string, or the reference to it.
+ */
+static int _get_str_len (GHashTable *dict, const char *str)
+{
+	int ref;
+
+	if (dict == NULL) {
+		return strlen (str);
+	}
+
+	ref = GPOINTER_TO_INT (g_hash_table_lookup (dict, str));
+	if (ref > 0) {
+		return -1 - ref;
+	}
+
+	g_hash_table_insert (dict, (void*)str, GINT_TO_POINTER (g_hash_table_size (dict) + 1));
+	return strlen (str);
+}
+
+/**
+ * Gets the length to log a value with.
+ *
+ * @param dict The strings written so far in the transaction, or NULL.
+ * @param val The value.
+ * @return -1 for integer values, otherwise like _get_str_len.
+ */
+static int _get_ref_val_len (GHashTable *dict, const s4_val_t *val)
+{
+	const char *s;
+
+	if (s4_val_get_str (val, &s)) {
+		return _get_str_len (dict, s);
+	}
+	return -1;
+}
+
+/**
+ * Calculates the size of an add or delete entry in the log.
+ * Entries that refer to earlier strings may be smaller.
+ *
+ * @return The size of the entry, including its log header.
+ */
+int _log_mod_size (const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b, const char *src)
+{
+	struct mod_header mhdr;
+
+	mhdr.ka_len = strlen (key_a);
+	mhdr.kb_len = strlen (key_b);
+	mhdr.s_len = strlen (src);
+	mhdr.va_len = _get_val_len (val_a);
+	mhdr.vb_len = _get_val_len (val_b);
+
+	return sizeof (struct log_header) + _get_size (&mhdr);
+}
+
+/**
+ * Calculates the size of an entry with no data in the log.
+ *
+ * @return The size of the entry.
+ */
+int _log_simple_size (void)
+{
+	return sizeof (struct log_header);
+}
+
+/**
+ * Calculates the size needed to write the entire oplist to the log.
+ * The oplist keeps track of the size of its ops, so this does not
+ * have to look at them.
  *
  * @param list The oplist to estimate the size of
  * @param writing A pointer to an int that will be set to 1
@@ -166,30 +430,8 @@ static int _get_val_len (const s4_val_t *val)
  * @return The estimated size.
  */
 static int _estimate_size (oplist_t *list, int *writing) {
-	int ret = 0, largest = 0;
-	_oplist_first (list);
-
-	while (_oplist_next (list)) {
-		const char *key_a, *key_b, *src;
-		const s4_val_t *val_a, *val_b;
-		int size = sizeof (struct log_header);
-
-		if (_oplist_get_add (list, &key_a, &val_a, &key_b, &val_b, &src)) {
-			size += sizeof (struct mod_header);
-			size += strlen (key_a) + strlen (key_a) + strlen (src);
-			size += _get_val_len (val_a) + _get_val_len (val_b);
-		} else if (_oplist_get_del (list, &key_a, &val_a, &key_b, &val_b, &src)) {
-			size += sizeof (struct mod_header);
-			size += strlen (key_a) + strlen (key_a) + strlen (src);
-			size += _get_val_len (val_a) + _get_val_len (val_b);
-		} else if (_oplist_get_writing (list)) {
-			/* A write is only the size of a log header */
-			*writing = 1;
-		}
-
-		largest = MAX (size, largest);
-		ret += size;
-	}
+	int largest;
+	int ret = _oplist_get_log_size (list, &largest, writing);
 
 	if (ret == 0) {
 		return 0;
@@ -223,7 +465,10 @@ static void _log_unlock (s4_t *s4)
 
 
 /**
- * Writes a log header to the log.
+ * Appends a log header to the write buffer.
+ * If the entry does not fit before the end of the file, a wrap-around
+ * entry is appended and the buffer written, and the entry is put
+ * at the start of the file.
  *
  * @param s4 The database handle.
  * @param hdr The header to write.
@@ -231,35 +476,36 @@ static void _log_unlock (s4_t *s4)
  */
 static void _log_write_header (s4_t *s4, struct log_header hdr, int size)
 {
-	log_number_t pos, round;
+	s4_log_data_t *data = s4->log_data;
+	log_number_t pos;
 
-	if (s4->log_data->logfile == NULL)
+	if (data->logfile == NULL)
 		return;
 
-	pos = s4->log_data->next_logpoint % LOG_SIZE;
-	round = s4->log_data->next_logpoint / LOG_SIZE;
+	pos = data->next_logpoint % data->size;
 
 	/* Wrap around if we're at the end */
-	if ((pos + size) > (LOG_SIZE - sizeof (struct log_header) * 2)) {
+	if ((pos + size) > (data->size - sizeof (struct log_header) * 2)) {
 		struct log_header hdr;
 
-		hdr.num = pos + round * LOG_SIZE;
+		hdr.num = data->next_logpoint;
 		hdr.type = LOG_ENTRY_WRAP;
-		fwrite (&hdr, sizeof (struct log_header), 1, s4->log_data->logfile);
-		pos = 0;
-		round++;
-		rewind (s4->log_data->logfile);
+		_log_append (s4, &hdr, sizeof (struct log_header));
+
+		data->next_logpoint += data->size - pos;
+		_log_write_entries (s4);
 	}
 
-	hdr.num = pos + round * LOG_SIZE;
-	fwrite (&hdr, sizeof (struct log_header), 1, s4->log_data->logfile);
+	hdr.num = data->next_logpoint;
+	_log_append (s4, &hdr, sizeof (struct log_header));
 
-	s4->log_data->last_logpoint = s4->log_data->next_logpoint;
-	s4->log_data->next_logpoint = ftell (s4->log_data->logfile) + round * LOG_SIZE + size;
+	data->last_logpoint = data->next_logpoint;
+	data->next_logpoint += sizeof (struct log_header) + size;
 }
 
 /**
- * Writes a log entry for a modification operation (add or del).
+ * Appends a log entry for a modification operation (add or del)
+ * to the write buffer.
  * @param s4 The database we are writing the log entry to.
  * @param type The log entry type.
  * @param key_a The key_a string.
@@ -267,39 +513,49 @@ static void _log_write_header (s4_t *s4, struct log_header hdr, int size)
  * @param key_b The key_b string.
  * @param val_b The val_b value.
  * @param src The source string.
+ * @param dict The strings written so far in the transaction, or NULL
+ * to write every string in full.
  */
 static void _log_mod (s4_t *s4, log_type_t type, const char *key_a, const s4_val_t *val_a,
-		const char *key_b, const s4_val_t *val_b, const char *src)
+		const char *key_b, const s4_val_t *val_b, const char *src, GHashTable *dict)
 {
 	struct log_header lhdr;
 	struct mod_header mhdr;
-	int size;
+	uint32_t crc;
+	int size, start;
 
 	if (s4->log_data->logfile == NULL)
 		return;
 
 	lhdr.type = type;
-	mhdr.ka_len = strlen (key_a);
-	mhdr.kb_len = strlen (key_b);
-	mhdr.s_len = strlen (src);
-	mhdr.va_len = _get_val_len (val_a);
-	mhdr.vb_len = _get_val_len (val_b);
+	/* In the order they are read back, so the references match */
+	mhdr.ka_len = _get_str_len (dict, key_a);
+	mhdr.va_len = _get_ref_val_len (dict, val_a);
+	mhdr.kb_len = _get_str_len (dict, key_b);
+	mhdr.vb_len = _get_ref_val_len (dict, val_b);
+	mhdr.s_len = _get_str_len (dict, src);
 
 	size = _get_size (&mhdr);
 
 	_log_write_header (s4, lhdr, size);
 
-	fwrite (&mhdr, sizeof (struct mod_header), 1, s4->log_data->logfile);
-
-	_write_str (key_a, mhdr.ka_len, s4->log_data->logfile);
-	_write_val (val_a, mhdr.va_len, s4->log_data->logfile);
-	_write_str (key_b, mhdr.kb_len, s4->log_data->logfile);
-	_write_val (val_b, mhdr.vb_len, s4->log_data->logfile);
-	_write_str (src, mhdr.s_len, s4->log_data->logfile);
+	start = s4->log_data->buf_len;
+	_log_append (s4, &mhdr, sizeof (struct mod_header));
+	_log_append_str (s4, key_a, mhdr.ka_len);
+	_log_append_val (s4, val_a, mhdr.va_len);
+	_log_append_str (s4, key_b, mhdr.kb_len);
+	_log_append_val (s4, val_b, mhdr.vb_len);
+	_log_append_str (s4, src, mhdr.s_len);
+
+	/* The checksum covers everything but itself */
+	crc = _crc_update (0, s4->log_data->buf + start, MOD_HEADER_V1_SIZE);
+	crc = _crc_update (crc, s4->log_data->buf + start + sizeof (struct mod_header),
+			size - sizeof (struct mod_header));
+	memcpy (s4->log_data->buf + start + MOD_HEADER_V1_SIZE, &crc, sizeof (uint32_t));
 }
 
 /**
- * Writes a single header with no data.
+ * Appends a single header with no data to the write buffer.
  * @param s4 The database handle.
  * @param type The type of the log header.
  */
@@ -312,6 +568,182 @@ static void _log_simple (s4_t *s4, log_type_t type)
 	_log_write_header (s4, hdr, 0);
 }
 
+/**
+ * Drops the mapping of the log file.
+ * Must be called before the file changes size.
+ *
+ * @param s4 The database.
+ */
+static void _log_unmap (s4_t *s4)
+{
+	if (s4->log_data->map != NULL) {
+		g_mapped_file_unref (s4->log_data->map);
+		s4->log_data->map = NULL;
+	}
+}
+
+/**
+ * Maps the log file into memory, so redo does not have to read it.
+ * A read-only mapping is private, and it is not certain to see what
+ * is written to the file after it is made, so the file is mapped
+ * again every time.
+ *
+ * @param s4 The database.
+ * @return The contents of the log, or NULL on error.
+ */
+static const char *_log_map (s4_t *s4)
+{
+	s4_log_data_t *data = s4->log_data;
+
+	_log_unmap (s4);
+
+	data->map = g_mapped_file_new_from_fd (fileno (data->logfile), FALSE, NULL);
+	if (data->map == NULL)
+		return NULL;
+	if (g_mapped_file_get_length (data->map) < data->size) {
+		_log_unmap (s4);
+		return NULL;
+	}
+
+	return g_mapped_file_get_contents (data->map);
+}
+
+/**
+ * Sets the logfile size.
+ * @param s4 The database to resize the logfile of.
+ * @param size The new size.
+ * @return 0 on success, -1 on error.
+ */
+static int _log_truncate (s4_t *s4, int32_t size)
+{
+#ifdef _WIN32
+	return _chsize (fileno (s4->log_data->logfile), size);
+#else
+	return ftruncate (fileno (s4->log_data->logfile), size);
+#endif
+}
+
+/**
+ * Gets the size of the logfile on disk.
+ * @param s4 The database.
+ * @return The size, or -1 on error.
+ */
+static long _log_file_size (s4_t *s4)
+{
+#ifdef _WIN32
+	if (fseek (s4->log_data->logfile, 0, SEEK_END) != 0)
+		return -1;
+
+	return ftell (s4->log_data->logfile);
+#else
+	struct stat st;
+
+	if (fstat (fileno (s4->log_data->logfile), &st) != 0)
+		return -1;
+
+	return st.st_size;
+#endif
+}
+
+/**
+ * Reads the header of a log entry straight from the file.
+ * Used to see if there is anything new in the log before mapping it.
+ *
+ * @param s4 The database.
+ * @param num The log number of the entry.
+ * @param hdr Filled with the header.
+ * @return 0 if the header does not fit before the end of the log
+ * or could not be read, non-zero otherwise.
+ */
+static int _log_read_header (s4_t *s4, log_number_t num, struct log_header *hdr)
+{
+	s4_log_data_t *data = s4->log_data;
+	long offset = num % data->size;
+	char *buf = (char*)hdr;
+	int len = sizeof (struct log_header);
+
+	if (offset + len > data->size)
+		return 0;
+
+#ifdef _WIN32
+	if (fseek (data->logfile, offset, SEEK_SET) != 0
+			|| fread (buf, 1, len, data->logfile) != len) {
+		return 0;
+	}
+	len = 0;
+#else
+	while (len > 0) {
+		ssize_t got = pread (fileno (data->logfile), buf, len, offset);
+
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			break;
+
+		buf += got;
+		len -= got;
+		offset += got;
+	}
+#endif
+
+	return len == 0;
+}
+
+/**
+ * Asks for the log to grow to at least the given size.
+ * The size is rounded up to a power of two multiple of the current
+ * size. This makes sure the entry at the last checkpoint still has
+ * room for a wrap-around entry after it once it is moved.
+ *
+ * @param s4 The database.
+ * @param size The minimum size wanted.
+ */
+static void _log_want_size (s4_t *s4, int64_t size)
+{
+	int64_t new_size = s4->log_data->size;
+
+	while (new_size < size && new_size * 2 <= S4_LOG_MAX_SIZE) {
+		new_size *= 2;
+	}
+
+	s4->log_data->want_size = MAX (s4->log_data->want_size, new_size);
+}
+
+/**
+ * Grows the logfile if a larger log is wanted.
+ * Growing changes where every log number is placed in the file, so
+ * it is only done when the database file holds everything that
+ * changed. Nothing but the entry at the last checkpoint is needed then,
+ * and it is written at its new place as an init-entry.
+ * Must be called with the log lock held, right after a checkpoint has
+ * been written to disk.
+ *
+ * @param s4 The database.
+ */
+static void _log_grow (s4_t *s4)
+{
+	s4_log_data_t *data = s4->log_data;
+
+	if (data->want_size <= data->size || data->last_mod > data->last_synced)
+		return;
+
+	fflush (data->logfile);
+	_log_unmap (s4);
+	if (_log_truncate (s4, data->want_size) != 0) {
+		S4_ERROR ("could not grow the log to %i bytes", data->want_size);
+		data->want_size = data->size;
+		return;
+	}
+
+	S4_DBG ("growing the log from %i to %i bytes", data->size, data->want_size);
+	data->size = data->want_size;
+
+	data->next_logpoint = data->last_synced;
+	_log_begin_entries (s4);
+	_log_simple (s4, LOG_ENTRY_INIT);
+	_log_write_entries (s4);
+}
+
 /**
  * Writes a checkpoint entry to the log, marking that the
  * database has finished being written to disk.
@@ -323,22 +755,166 @@ void _log_checkpoint (s4_t *s4)
 	hdr.type = LOG_ENTRY_CHECKPOINT;
 
 	_log_lock (s4);
+	_log_grow (s4);
+	_log_begin_entries (s4);
 	_log_simple (s4, LOG_ENTRY_BEGIN);
-	_log_write_header (s4, hdr, sizeof (int32_t));
-	fwrite (&s4->log_data->last_synced, sizeof (log_number_t), 1, s4->log_data->logfile);
+	_log_write_header (s4, hdr, sizeof (log_number_t));
+	_log_append (s4, &s4->log_data->last_synced, sizeof (log_number_t));
 	s4->log_data->last_checkpoint = s4->log_data->last_synced;
 	_log_simple (s4, LOG_ENTRY_END);
+	_log_write_entries (s4);
 	_log_unlock (s4);
 }
 
 /**
- * Flushes file buffers and syncs the log to disk.
+ * Flushes the file buffers to the operating system.
+ * Must be called with the log lock held.
+ *
  * @param s4 The database to flush the log of.
+ * @return The ticket to pass to _log_sync to wait for
+ * the flushed data to reach the disk.
  */
-static void _log_flush (s4_t *s4)
+static guint64 _log_flush (s4_t *s4)
 {
+	guint64 ticket;
+
 	fflush (s4->log_data->logfile);
-	fsync (fileno (s4->log_data->logfile));
+
+	g_mutex_lock (&s4->log_data->flush_lock);
+	ticket = ++s4->log_data->written;
+	g_mutex_unlock (&s4->log_data->flush_lock);
+
+	return ticket;
+}
+
+/**
+ * Waits until the log is synced to disk up to a ticket.
+ * The first thread to get here syncs everything flushed so far while
+ * the others wait for it, so concurrent commits share one fsync.
+ * Must be called without the log lock held.
+ *
+ * @param s4 The database to sync the log of.
+ * @param ticket The ticket returned by _log_flush.
+ */
+static void _log_sync (s4_t *s4, guint64 ticket)
+{
+	s4_log_data_t *data = s4->log_data;
+
+	g_mutex_lock (&data->flush_lock);
+	while (data->flushed < ticket) {
+		if (data->flushing) {
+			g_cond_wait (&data->flush_cond, &data->flush_lock);
+		} else {
+			guint64 goal = data->written;
+			gint64 start;
+
+			data->flushing = 1;
+			g_mutex_unlock (&data->flush_lock);
+
+			start = g_get_monotonic_time ();
+			fsync (fileno (data->logfile));
+			_stats_time (s4, S4_STAT_LOG_FSYNC, start);
+
+			g_mutex_lock (&data->flush_lock);
+			data->flushing = 0;
+			data->flushed = MAX (data->flushed, goal);
+			g_cond_broadcast (&data->flush_cond);
+		}
+	}
+	g_mutex_unlock (&data->flush_lock);
+}
+
+/**
+ * Waits until everything written to the log so far is on disk.
+ *
+ * @param s4 The database to sync the log of.
+ */
+void _log_sync_all (s4_t *s4)
+{
+	guint64 ticket;
+
+	if (s4->log_data->logfile == NULL)
+		return;
+
+	g_mutex_lock (&s4->log_data->flush_lock);
+	ticket = s4->log_data->written;
+	g_mutex_unlock (&s4->log_data->flush_lock);
+
+	_log_sync (s4, ticket);
+}
+
+/**
+ * Finds how much of the log is in use.
+ *
+ * @param s4 The database.
+ * @param used Set to the bytes written since the last checkpoint.
+ * @param size Set to the size of the log, 0 if there is no log.
+ */
+void _log_get_fill (s4_t *s4, int32_t *used, int32_t *size)
+{
+	_log_lock (s4);
+	if (s4->log_data->logfile == NULL) {
+		*used = *size = 0;
+	} else {
+		*used = s4->log_data->next_logpoint - s4->log_data->last_checkpoint;
+		*size = s4->log_data->size;
+	}
+	_log_unlock (s4);
+}
+
+/**
+ * Syncs the log flush_interval milliseconds after something was
+ * written without being synced. It sleeps until that happens.
+ *
+ * @param s4 The database to sync the log of.
+ */
+static void *_log_flusher_thread (s4_t *s4)
+{
+	s4_log_data_t *data = s4->log_data;
+	gint64 interval = s4->options.flush_interval * G_TIME_SPAN_MILLISECOND;
+	gint64 deadline;
+
+	g_mutex_lock (&data->flush_lock);
+	while (data->flusher_run) {
+		if (data->flushed >= data->written) {
+			g_cond_wait (&data->flusher_cond, &data->flush_lock);
+			continue;
+		}
+
+		/* Later commits share the sync, so wake-ups from them
+		 * do not cut the interval short
+		 */
+		deadline = g_get_monotonic_time () + interval;
+		while (data->flusher_run
+				&& g_cond_wait_until (&data->flusher_cond, &data->flush_lock, deadline));
+
+		g_mutex_unlock (&data->flush_lock);
+		_log_sync_all (s4);
+		g_mutex_lock (&data->flush_lock);
+	}
+	g_mutex_unlock (&data->flush_lock);
+
+	return NULL;
+}
+
+/**
+ * Tells the flusher thread that something was written without
+ * being synced, starting it if this is the first time.
+ *
+ * @param s4 The database to sync the log of.
+ */
+static void _log_wake_flusher (s4_t *s4)
+{
+	s4_log_data_t *data = s4->log_data;
+
+	g_mutex_lock (&data->flush_lock);
+	if (data->flusher == NULL) {
+		data->flusher = g_thread_new ("s4 log flusher",
+				(GThreadFunc)_log_flusher_thread, s4);
+	} else {
+		g_cond_signal (&data->flusher_cond);
+	}
+	g_mutex_unlock (&data->flush_lock);
 }
 
 /**
@@ -350,8 +926,11 @@ static void _log_flush (s4_t *s4)
 int _log_write (oplist_t *list)
 {
 	s4_t *s4 = _oplist_get_db (list);
+	int flags = _transaction_get_flags (_oplist_get_trans (list));
 	int writing = 0;
 	int size = _estimate_size (list, &writing);
+	GHashTable *dict = NULL;
+	guint64 ticket;
 
 	if (s4->log_data->logfile == NULL || size == 0)
 		return 1;
@@ -359,128 +938,236 @@ int _log_write (oplist_t *list)
 	_log_lock (s4);
 	if (writing) {
 		s4->log_data->last_synced = s4->log_data->last_logpoint;
+	} else if (size > s4->log_data->size / 4) {
+		/* Transactions this big would fill the log after a few
+		 * commits, or not fit at all
+		 */
+		_log_want_size (s4, (int64_t)size * 4);
 	}
 
-	if ((s4->log_data->next_logpoint + size) > (s4->log_data->last_checkpoint + LOG_SIZE)) {
+	if ((s4->log_data->next_logpoint + size) > (s4->log_data->last_checkpoint + s4->log_data->size)) {
 		_log_unlock (s4);
+		if (!writing)
+			_stats_count (s4, S4_STAT_LOG_FULL, 1);
 		return writing;
 	}
 
+	_log_begin_entries (s4);
 	_log_simple (s4, LOG_ENTRY_BEGIN);
 
+	if (s4->options.compact_strings) {
+		dict = g_hash_table_new (NULL, NULL);
+	}
+
 	_oplist_first (list);
 	while (_oplist_next (list)) {
 		const char *key_a, *key_b, *src;
 		const s4_val_t *val_a, *val_b;
 
 		if (_oplist_get_add (list, &key_a, &val_a, &key_b, &val_b, &src)) {
-			_log_mod (s4, LOG_ENTRY_ADD, key_a, val_a, key_b, val_b, src);
+			_log_mod (s4, dict?LOG_ENTRY_ADD_REF:LOG_ENTRY_ADD,
+					key_a, val_a, key_b, val_b, src, dict);
 		} else if (_oplist_get_del (list, &key_a, &val_a, &key_b, &val_b, &src)) {
-			_log_mod (s4, LOG_ENTRY_DEL, key_a, val_a, key_b, val_b, src);
+			_log_mod (s4, dict?LOG_ENTRY_DEL_REF:LOG_ENTRY_DEL,
+					key_a, val_a, key_b, val_b, src, dict);
 		} else if (_oplist_get_writing (list)) {
 			_log_simple (s4, LOG_ENTRY_WRITING);
 		}
 	}
 
 	_log_simple (s4, LOG_ENTRY_END);
+	_log_write_entries (s4);
+
+	if (dict != NULL) {
+		g_hash_table_destroy (dict);
+	}
+
+	if (!writing) {
+		s4->log_data->last_mod = s4->log_data->last_logpoint;
+	}
 
-	if (s4->log_data->last_synced > (s4->log_data->last_checkpoint + LOG_SIZE / 2))
+	if (s4->log_data->last_synced > (s4->log_data->last_checkpoint + s4->log_data->size / 2))
 		_start_sync (s4);
 
-	_log_flush (s4);
+	ticket = _log_flush (s4);
 	_log_unlock (s4);
+
+	/* Writing-entries are not synced, the checkpoint syncs the
+	 * database file instead. The flusher thread will get to
+	 * the commits of NOSYNC transactions.
+	 */
+	if (writing) {
+		return 1;
+	} else if (flags & S4_TRANS_NOSYNC) {
+		_log_wake_flusher (s4);
+	} else {
+		_log_sync (s4, ticket);
+	}
 	return 1;
 }
 
 /**
- * Reads a string from the log file.
+ * Reads a string from a log entry.
  * @param s4 The database
- * @param len The string length.
- * @return A pointer to a constant string, or NULL on error.
+ * @param data A pointer to the data to read from, moved past the string.
+ * @param len The string length, or a reference to an earlier string.
+ * @param buf A buffer to put the string together in.
+ * @param dict The strings read in full since the start of the
+ * transaction, or NULL if the entry can not refer to them.
+ * @return A pointer to a constant string, or NULL if it refers
+ * to a string that is not there.
  */
-static const char *_read_str (s4_t *s4, int len)
+static const char *_read_str (s4_t *s4, const char **data, int len, GString *buf,
+		GPtrArray *dict)
 {
-	const char *ret = NULL;
-	char *str = NULL;
+	const char *ret;
 
-	if (len < 0 || len > LOG_SIZE)
-		goto cleanup;
-
-	str = malloc (len + 1);
+	if (len < -1) {
+		if (dict == NULL || -2 - len >= dict->len)
+			return NULL;
+		return g_ptr_array_index (dict, -2 - len);
+	}
 
-	if (fread (str, 1, len, s4->log_data->logfile) != len)
-		goto cleanup;
+	g_string_truncate (buf, 0);
+	g_string_append_len (buf, *data, len);
+	*data += len;
 
-	str[len] = '\0';
-	ret = _string_lookup (s4, str);
+	ret = _string_lookup (s4, buf->str);
+	if (dict != NULL) {
+		g_ptr_array_add (dict, (void*)ret);
+	}
 
-cleanup:
-	free (str);
 	return ret;
 }
 
 /**
- * Reads an S4 value from the log file.
+ * Reads an S4 value from a log entry.
  * @param s4 the database.
+ * @param data A pointer to the data to read from, moved past the value.
  * @param len The value length.
+ * @param buf A buffer to put strings together in.
+ * @param dict The strings read in full since the start of the
+ * transaction, or NULL if the entry can not refer to them.
  * @return A pointer to a constant value, or NULL on error.
  */
-static const s4_val_t *_read_val (s4_t *s4, int len)
+static const s4_val_t *_read_val (s4_t *s4, const char **data, int len, GString *buf,
+		GPtrArray *dict)
 {
-	const s4_val_t *ret = NULL;
+	const char *str;
 
 	if (len == -1) {
 		int32_t i;
-		fread (&i, sizeof (int32_t), 1, s4->log_data->logfile);
-		ret = _int_lookup_val (s4, i);
-	} else {
-		const char *str = _read_str (s4, len);
 
-		if (str != NULL)
-			ret = _string_lookup_val (s4, str);
+		memcpy (&i, *data, sizeof (int32_t));
+		*data += sizeof (int32_t);
+		return _int_lookup_val (s4, i);
 	}
 
-	return ret;
+	str = _read_str (s4, data, len, buf, dict);
+	if (str == NULL)
+		return NULL;
+
+	return _string_lookup_val (s4, str);
+}
+
+/**
+ * Checks that a length in a modification header makes sense.
+ *
+ * @param len The length.
+ * @param max The largest length there can be.
+ * @param val Non-zero if it is the length of a value.
+ * @param refs Non-zero if it may refer to an earlier string.
+ * @return non-zero if the length is valid, 0 otherwise.
+ */
+static int _valid_len (int32_t len, int32_t max, int val, int refs)
+{
+	if (len >= 0)
+		return len <= max;
+	if (len == -1)
+		return val;
+
+	return refs && len >= -max;
+}
+
+/**
+ * Checks that the lengths in a modification header make sense.
+ *
+ * @param s4 The database.
+ * @param mhdr The header to check.
+ * @param refs Non-zero if the entry may refer to earlier strings.
+ * @return non-zero if the lengths are valid, 0 otherwise.
+ */
+static int _valid_mod_header (s4_t *s4, const struct mod_header *mhdr, int refs)
+{
+	int32_t max = s4->log_data->size;
+
+	return _valid_len (mhdr->ka_len, max, 0, refs)
+		&& _valid_len (mhdr->kb_len, max, 0, refs)
+		&& _valid_len (mhdr->s_len, max, 0, refs)
+		&& _valid_len (mhdr->va_len, max, 1, refs)
+		&& _valid_len (mhdr->vb_len, max, 1, refs);
 }
 
 /**
  * Reads a modification entry (add or del).
+ * Entries with checksums are only used if the checksum matches.
  *
  * @param s4 The database.
  * @param list The oplist to insert the operation in.
  * @param type The type of the log entry.
- * @return 0 on error, non-zero on success.
+ * @param data The entry, following the log header.
+ * @param avail The number of bytes available at data.
+ * @param buf A buffer to put strings together in.
+ * @param dict The strings read in full since the start of the transaction.
+ * @return The size of the entry, or 0 on error.
  */
-static int _read_mod (s4_t *s4, oplist_t *list, log_type_t type)
+static int _read_mod (s4_t *s4, oplist_t *list, log_type_t type,
+		const char *data, int avail, GString *buf, GPtrArray *dict)
 {
 	const char *key_a, *key_b, *src;
 	const s4_val_t *val_a, *val_b;
 	struct mod_header mhdr;
+	int v1 = (type == LOG_ENTRY_ADD_V1 || type == LOG_ENTRY_DEL_V1);
+	int refs = (type == LOG_ENTRY_ADD_REF || type == LOG_ENTRY_DEL_REF);
+	int hdr_size = v1?MOD_HEADER_V1_SIZE:sizeof (struct mod_header);
+	int len;
 
-	if (list == NULL)
+	if (list == NULL || avail < hdr_size)
 		return 0;
 
-	fread (&mhdr, sizeof (struct mod_header), 1, s4->log_data->logfile);
+	memcpy (&mhdr, data, hdr_size);
+	if (!_valid_mod_header (s4, &mhdr, refs))
+		return 0;
 
-	key_a = _read_str (s4, mhdr.ka_len);
-	val_a = _read_val (s4, mhdr.va_len);
-	key_b = _read_str (s4, mhdr.kb_len);
-	val_b = _read_val (s4, mhdr.vb_len);
-	src = _read_str (s4, mhdr.s_len);
+	len = _get_size (&mhdr) - sizeof (struct mod_header);
+	if (hdr_size + len > avail)
+		return 0;
+	data += hdr_size;
 
-	if (key_a == NULL || key_b == NULL
-			|| val_a == NULL || val_b == NULL
-			|| src == NULL) {
+	if (!v1 && mhdr.crc != _crc_update (_crc_update (0, &mhdr, MOD_HEADER_V1_SIZE),
+				data, len)) {
 		return 0;
 	}
 
-	if (type == LOG_ENTRY_ADD) {
+	if (!refs)
+		dict = NULL;
+
+	key_a = _read_str (s4, &data, mhdr.ka_len, buf, dict);
+	val_a = _read_val (s4, &data, mhdr.va_len, buf, dict);
+	key_b = _read_str (s4, &data, mhdr.kb_len, buf, dict);
+	val_b = _read_val (s4, &data, mhdr.vb_len, buf, dict);
+	src = _read_str (s4, &data, mhdr.s_len, buf, dict);
+
+	if (key_a == NULL || val_a == NULL || key_b == NULL || val_b == NULL || src == NULL)
+		return 0;
+
+	if (type == LOG_ENTRY_ADD || type == LOG_ENTRY_ADD_V1 || type == LOG_ENTRY_ADD_REF) {
 		_oplist_insert_add (list, key_a, val_a, key_b, val_b, src);
-	} else if (type == LOG_ENTRY_DEL) {
+	} else {
 		_oplist_insert_del (list, key_a, val_a, key_b, val_b, src);
 	}
 
-	return 1;
+	return hdr_size + len;
 }
 
 /**
@@ -491,69 +1178,128 @@ static int _read_mod (s4_t *s4, oplist_t *list, log_type_t type)
  */
 static int _log_redo (s4_t *s4)
 {
+	s4_log_data_t *data = s4->log_data;
 	struct log_header hdr;
 	log_number_t pos, round, new_checkpoint = -1, new_synced = -1;
 	log_number_t last_valid_logpoint;
 	oplist_t *oplist = NULL;
-	int invalid_entry = 0;
+	int invalid_entry = 0, has_mods = 0, redone = 0, len;
+	gint64 start = g_get_monotonic_time ();
+	const char *log;
+	GString *buf;
+	GPtrArray *dict;
+	long size;
+	int grown = 0;
+
+	fflush (data->logfile);
+
+	/* Another handle grew the log. Every log number is at a new place
+	 * now, and the database file holds everything written before it
+	 * grew, so we start over from its last checkpoint.
+	 */
+	size = _log_file_size (s4);
+	if (size > data->size && size <= S4_LOG_MAX_SIZE) {
+		S4_DBG ("the log grew from %i to %li bytes", data->size, size);
+		_log_unmap (s4);
+		data->size = size;
+		data->want_size = MAX (data->want_size, data->size);
+		_reread_file (s4);
+		grown = 1;
+	}
 
-	fflush (s4->log_data->logfile);
+	/* Usually nobody else wrote anything since we last looked. Our
+	 * last entry is still in place then, and the one after it is
+	 * not, which two headers read from the file tell us without
+	 * mapping the whole log.
+	 */
+	if (!grown && _log_read_header (s4, data->last_logpoint, &hdr)
+			&& hdr.num == data->last_logpoint) {
+		log_number_t next = data->last_logpoint + sizeof (struct log_header);
+
+		if (!_log_read_header (s4, next, &hdr) || hdr.num != next) {
+			data->next_logpoint = next;
+			if (data->recovering)
+				_stats_time (s4, S4_STAT_RECOVERY, start);
+			data->recovering = 0;
+			return 1;
+		}
+	}
+
+	log = _log_map (s4);
+	if (log == NULL) {
+		return 0;
+	}
 
 	/* Check if the log wrapped around since our last write */
-	pos = s4->log_data->last_logpoint % LOG_SIZE;
-	if (fseek (s4->log_data->logfile, pos, SEEK_SET) != 0 ||
-			fread (&hdr, sizeof (struct log_header), 1, s4->log_data->logfile) != 1) {
+	pos = data->last_logpoint % data->size;
+	if (pos + sizeof (struct log_header) > data->size) {
 		return 0;
 	}
+	memcpy (&hdr, log + pos, sizeof (struct log_header));
 
 	/* If it did, we have to read in everything */
-	if (hdr.num != s4->log_data->last_logpoint) {
+	if (hdr.num != data->last_logpoint) {
 		_reread_file (s4);
 	}
 
-	last_valid_logpoint = s4->log_data->last_logpoint;
-	s4->log_data->next_logpoint = s4->log_data->last_logpoint + sizeof (struct log_header);
+	last_valid_logpoint = data->last_logpoint;
+	data->next_logpoint = data->last_logpoint + sizeof (struct log_header);
 
-	pos = s4->log_data->next_logpoint % LOG_SIZE;
-	round = s4->log_data->next_logpoint / LOG_SIZE;
-	if (fseek (s4->log_data->logfile, pos, SEEK_SET) != 0) {
-		return 0;
-	}
+	pos = data->next_logpoint % data->size;
+	round = data->next_logpoint / data->size;
+	buf = g_string_sized_new (64);
+	dict = g_ptr_array_new ();
 
-	/* Read log entries until fread fails, or the header num is different
-	 * from the expected number.
+	/* Read log entries until we get to the end of the file, or the header
+	 * num is different from the expected number.
 	 */
 	while (!invalid_entry
-			&& fread (&hdr, sizeof (struct log_header), 1, s4->log_data->logfile) == 1
-			&& hdr.num == (pos + round * LOG_SIZE)) {
+			&& pos + sizeof (struct log_header) <= data->size
+			&& (memcpy (&hdr, log + pos, sizeof (struct log_header)),
+				hdr.num == (pos + round * data->size))) {
 
-		s4->log_data->last_logpoint = s4->log_data->next_logpoint;
+		data->last_logpoint = data->next_logpoint;
+		pos += sizeof (struct log_header);
 
 		switch (hdr.type) {
 		case LOG_ENTRY_WRAP:
 			round++;
-			rewind (s4->log_data->logfile);
+			pos = 0;
 			break;
 
 		case LOG_ENTRY_DEL:
 		case LOG_ENTRY_ADD:
-			if (!_read_mod (s4, oplist, hdr.type))
+		case LOG_ENTRY_DEL_V1:
+		case LOG_ENTRY_ADD_V1:
+		case LOG_ENTRY_DEL_REF:
+		case LOG_ENTRY_ADD_REF:
+			len = _read_mod (s4, oplist, hdr.type, log + pos, data->size - pos, buf, dict);
+			if (len == 0)
 				invalid_entry = 1;
 
+			pos += len;
+			has_mods = 1;
 			break;
 
 		case LOG_ENTRY_CHECKPOINT:
-			fread (&new_checkpoint, sizeof (log_number_t), 1, s4->log_data->logfile);
+			if (pos + sizeof (log_number_t) > data->size) {
+				invalid_entry = 1;
+				break;
+			}
+			memcpy (&new_checkpoint, log + pos, sizeof (log_number_t));
+			pos += sizeof (log_number_t);
 			break;
 
 		case LOG_ENTRY_WRITING:
-			new_synced = s4->log_data->last_logpoint;
+			new_synced = data->last_logpoint;
 			break;
 
 		case LOG_ENTRY_BEGIN:
 			oplist = _oplist_new (_transaction_dummy_alloc (s4));
+			g_ptr_array_set_size (dict, 0);
 			new_checkpoint = -1;
 			new_synced = -1;
+			has_mods = 0;
 			break;
 
 		case LOG_ENTRY_END:
@@ -567,11 +1313,15 @@ static int _log_redo (s4_t *s4)
 			oplist = NULL;
 
 			if (new_checkpoint != -1) {
-				s4->log_data->last_synced = s4->log_data->last_checkpoint = new_checkpoint;
+				data->last_synced = data->last_checkpoint = new_checkpoint;
 			} else if (new_synced != -1) {
-				s4->log_data->last_synced = new_synced;
+				data->last_synced = new_synced;
+			}
+			if (has_mods) {
+				data->last_mod = data->last_logpoint;
+				redone++;
 			}
-			last_valid_logpoint = s4->log_data->last_logpoint;
+			last_valid_logpoint = data->last_logpoint;
 			break;
 
 		case LOG_ENTRY_INIT:
@@ -584,34 +1334,37 @@ static int _log_redo (s4_t *s4)
 			break;
 		}
 
-		pos = ftell (s4->log_data->logfile);
-		s4->log_data->next_logpoint = pos + round * LOG_SIZE;
+		data->next_logpoint = pos + round * data->size;
 	}
 
+	g_string_free (buf, TRUE);
+	g_ptr_array_free (dict, TRUE);
+
 	if (oplist != NULL) {
 		_transaction_dummy_free (_oplist_get_trans (oplist));
 		_oplist_free (oplist);
 	}
 
-	s4->log_data->last_logpoint = last_valid_logpoint;
-	s4->log_data->next_logpoint = last_valid_logpoint + sizeof (struct log_header);
-	pos = s4->log_data->next_logpoint % LOG_SIZE;
-	fseek (s4->log_data->logfile, pos, SEEK_SET);
+	data->last_logpoint = last_valid_logpoint;
+	data->next_logpoint = last_valid_logpoint + sizeof (struct log_header);
 
-	return 1;
-}
+	/* Redoing after opening is crash recovery, the time it takes
+	 * is worth knowing. Later on it just picks up what other
+	 * processes did.
+	 */
+	if (data->recovering) {
+		_stats_count (s4, S4_STAT_RECOVERED, redone);
+		_stats_time (s4, S4_STAT_RECOVERY, start);
+	}
+	if (data->recovering && redone > 0) {
+		S4_INFO ("recovered %i transactions from the log in %.3f seconds", redone,
+				(g_get_monotonic_time () - start) / (double)G_TIME_SPAN_SECOND);
+	} else if (redone > 0) {
+		S4_DBG ("redid %i transactions from the log", redone);
+	}
+	data->recovering = 0;
 
-/**
- * Truncates the logfile to LOG_SIZE length.
- * @param s4 The database to truncate the logfile of.
- */
-static void _log_truncate (s4_t *s4)
-{
-#ifdef _WIN32
-	_chsize (fileno (s4->log_data->logfile, LOG_SIZE));
-#else
-	ftruncate (fileno (s4->log_data->logfile), LOG_SIZE);
-#endif
+	return 1;
 }
 
 /**
@@ -663,20 +1416,40 @@ static void _log_unlockf (s4_t *s4, int offset)
 int _log_open (s4_t *s4)
 {
 	char *log_name = g_strconcat (s4->filename, ".log", NULL);
+	long size = 0;
 
 	s4->log_data->logfile = fopen (log_name, "r+");
 
-	if (s4->log_data->logfile == NULL) {
+	/* An existing log keeps its size, it may only grow */
+	if (s4->log_data->logfile != NULL) {
+		size = _log_file_size (s4);
+	}
+
+	if (s4->log_data->logfile == NULL || size <= 0) {
+		if (s4->log_data->logfile != NULL) {
+			fclose (s4->log_data->logfile);
+		}
 		s4->log_data->logfile = fopen (log_name, "w+");
 		if (s4->log_data->logfile == NULL) {
+			g_free (log_name);
 			s4_set_errno (S4E_LOGOPEN);
 			return 0;
 		}
-		_log_truncate (s4);
+		s4->log_data->size = s4->options.log_size;
+		_log_truncate (s4, s4->log_data->size);
+		_log_begin_entries (s4);
 		_log_simple (s4, LOG_ENTRY_INIT);
+		_log_write_entries (s4);
+	} else {
+		s4->log_data->size = size;
+		_log_want_size (s4, s4->options.log_size);
 	}
 	g_free (log_name);
 
+	s4->log_data->recovering = 1;
+	s4->log_data->flusher_run = 1;
+	s4->log_data->flusher = NULL;
+
 	return 1;
 }
 
@@ -687,6 +1460,16 @@ int _log_open (s4_t *s4)
  */
 int _log_close (s4_t *s4)
 {
+	g_mutex_lock (&s4->log_data->flush_lock);
+	s4->log_data->flusher_run = 0;
+	g_cond_signal (&s4->log_data->flusher_cond);
+	g_mutex_unlock (&s4->log_data->flush_lock);
+	if (s4->log_data->flusher != NULL)
+		g_thread_join (s4->log_data->flusher);
+
+	_log_sync_all (s4);
+	_log_unmap (s4);
+
 	if (fclose (s4->log_data->logfile) != 0) {
 		return 0;
 	}
@@ -761,6 +1544,22 @@ log_number_t _log_last_synced (s4_t *s4)
 	return s4->log_data->last_synced;
 }
 
+/**
+ * Finds where the last checkpoint is, and where the next entry goes.
+ * Everything logged before checkpoint is in the database file.
+ *
+ * @param s4 The database.
+ * @param checkpoint Set to the log number of the last checkpoint.
+ * @param next Set to the log number of the next entry.
+ */
+void _log_get_checkpoint (s4_t *s4, log_number_t *checkpoint, log_number_t *next)
+{
+	_log_lock (s4);
+	*checkpoint = s4->log_data->last_checkpoint;
+	*next = s4->log_data->next_logpoint;
+	_log_unlock (s4);
+}
+
 void _log_init (s4_t *s4, log_number_t last_checkpoint)
 {
 	s4->log_data->last_synced = last_checkpoint;
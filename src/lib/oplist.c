@@ -14,16 +14,28 @@ typedef struct {
 	const s4_val_t *val_a, *val_b;
 } op_t;
 
+/* The ops are kept in the order they were inserted. cur is the
+ * index of the current op, or -1 before the first one.
+ * log_size and log_largest are the size of the ops in the log
+ * and of the largest of them, updated as ops are inserted.
+ */
 struct oplist_St {
 	s4_transaction_t *trans;
-	GList *ops, *cur;
+	op_t *ops;
+	int count, alloc, cur;
+	int log_size, log_largest, writing;
 };
 
 oplist_t *_oplist_new (s4_transaction_t *trans)
 {
 	oplist_t *ret = malloc (sizeof (oplist_t));
-	ret->ops = NULL;
-	ret->cur = NULL;
+	ret->alloc = 16;
+	ret->ops = malloc (sizeof (op_t) * ret->alloc);
+	ret->count = 0;
+	ret->cur = -1;
+	ret->log_size = 0;
+	ret->log_largest = 0;
+	ret->writing = 0;
 	ret->trans = trans;
 
 	return ret;
@@ -41,25 +53,57 @@ s4_transaction_t *_oplist_get_trans (oplist_t *list)
 
 void _oplist_free (oplist_t *list)
 {
-	g_list_foreach (list->ops, (GFunc)free, NULL);
-	g_list_free (list->ops);
+	free (list->ops);
 	free (list);
 }
 
+/* Appends a new op and accounts for the log space it needs */
+static op_t *_oplist_append (oplist_t *list, op_type_t type, int log_size)
+{
+	op_t *op;
+
+	if (list->count >= list->alloc) {
+		list->alloc *= 2;
+		list->ops = realloc (list->ops, sizeof (op_t) * list->alloc);
+	}
+
+	op = &list->ops[list->count++];
+	op->type = type;
+
+	list->log_size += log_size;
+	list->log_largest = MAX (list->log_largest, log_size);
+
+	return op;
+}
+
+/**
+ * Gets the room the ops in an oplist take up in the log.
+ *
+ * @param list The oplist
+ * @param largest Where to store the size of the largest op
+ * @param writing Where to store if the oplist contains a write
+ * @return The size of all the ops
+ */
+int _oplist_get_log_size (oplist_t *list, int *largest, int *writing)
+{
+	*largest = list->log_largest;
+	*writing = list->writing;
+
+	return list->log_size;
+}
+
 void _oplist_insert_add (oplist_t *list,
 		const char *key_a, const s4_val_t *val_a,
 		const char *key_b, const s4_val_t *val_b,
 		const char *src)
 {
-	op_t *op = malloc (sizeof (op_t));
-	op->type = OP_ADD;
+	op_t *op = _oplist_append (list, OP_ADD,
+			_log_mod_size (key_a, val_a, key_b, val_b, src));
 	op->key_a = key_a;
 	op->key_b = key_b;
 	op->src = src;
 	op->val_a = val_a;
 	op->val_b = val_b;
-
-	list->ops = g_list_prepend (list->ops, op);
 }
 
 void _oplist_insert_del (oplist_t *list,
@@ -67,48 +111,39 @@ void _oplist_insert_del (oplist_t *list,
 		const char *key_b, const s4_val_t *val_b,
 		const char *src)
 {
-	op_t *op = malloc (sizeof (op_t));
-	op->type = OP_DEL;
+	op_t *op = _oplist_append (list, OP_DEL,
+			_log_mod_size (key_a, val_a, key_b, val_b, src));
 	op->key_a = key_a;
 	op->key_b = key_b;
 	op->src = src;
 	op->val_a = val_a;
 	op->val_b = val_b;
-
-	list->ops = g_list_prepend (list->ops, op);
 }
 
 void _oplist_insert_writing (oplist_t *list)
 {
-	op_t *op = malloc (sizeof (op_t));
-	op->type = OP_WRITING;
-
-	list->ops = g_list_prepend (list->ops, op);
+	_oplist_append (list, OP_WRITING, _log_simple_size ());
+	list->writing = 1;
 }
 
 int _oplist_next (oplist_t *list)
 {
-	if (list->ops == NULL) {
-		return 0;
-	} else if (list->cur == NULL) {
-		list->cur = g_list_last (list->ops);
-	} else if (list->cur != list->ops) {
-		list->cur = g_list_previous (list->cur);
-	} else {
+	if (list->cur >= list->count - 1) {
 		return 0;
 	}
 
+	list->cur++;
 	return 1;
 }
 
 void _oplist_first (oplist_t *list)
 {
-	list->cur = NULL;
+	list->cur = -1;
 }
 
 void _oplist_last (oplist_t *list)
 {
-	list->cur = list->ops;
+	list->cur = list->count - 1;
 }
 
 int _oplist_get_add (oplist_t *list,
@@ -118,10 +153,10 @@ int _oplist_get_add (oplist_t *list,
 {
 	op_t *op;
 
-	if (list->cur == NULL)
+	if (list->cur < 0)
 		return 0;
 
-	op = list->cur->data;
+	op = &list->ops[list->cur];
 
 	if (op->type != OP_ADD)
 		return 0;
@@ -142,10 +177,10 @@ int _oplist_get_del (oplist_t *list,
 {
 	op_t *op;
 
-	if (list->cur == NULL)
+	if (list->cur < 0)
 		return 0;
 
-	op = list->cur->data;
+	op = &list->ops[list->cur];
 
 	if (op->type != OP_DEL)
 		return 0;
@@ -163,10 +198,10 @@ int _oplist_get_writing (oplist_t *list)
 {
 	op_t *op;
 
-	if (list->cur == NULL)
+	if (list->cur < 0)
 		return 0;
 
-	op = list->cur->data;
+	op = &list->ops[list->cur];
 
 	if (op->type != OP_WRITING)
 		return 0;
@@ -176,7 +211,7 @@ int _oplist_get_writing (oplist_t *list)
 
 int _oplist_rollback (oplist_t *list)
 {
-	for (; list->cur != NULL; list->cur = g_list_next (list->cur)) {
+	for (; list->cur >= 0; list->cur--) {
 		const char *key_a, *key_b, *src;
 		const s4_val_t *val_a, *val_b;
 
@@ -0,0 +1,191 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+
+/**
+ * @defgroup Options Options
+ * @ingroup S4
+ * @brief Per-database settings passed to s4_open_with_options.
+ *
+ * @{
+ */
+
+/**
+ * Fills in the default options.
+ *
+ * @param opts The options to initialize.
+ */
+void _options_init (s4_options_t *opts)
+{
+	opts->log_size = S4_LOG_DEFAULT_SIZE;
+	opts->flush_interval = S4_LOG_DEFAULT_FLUSH_INTERVAL;
+	opts->query_threads = 0;
+	opts->sort_keys = 0;
+	opts->token_index = 0;
+	opts->query_cache = 0;
+	opts->compact_strings = 0;
+}
+
+/**
+ * Creates a new options object with the default settings.
+ *
+ * @return A new options object.
+ */
+s4_options_t *s4_options_create (void)
+{
+	s4_options_t *opts = malloc (sizeof (s4_options_t));
+
+	_options_init (opts);
+
+	return opts;
+}
+
+/**
+ * Frees an options object.
+ * The options are copied by s4_open_with_options, so they can be
+ * freed as soon as the database is opened.
+ *
+ * @param opts The options to free.
+ */
+void s4_options_free (s4_options_t *opts)
+{
+	free (opts);
+}
+
+/**
+ * Sets the size of the log file.
+ * This is the size a new log is created with. An existing log that is
+ * smaller will grow to at least this size on the next checkpoint, but
+ * logs are never shrunk. The log also grows by itself when a single
+ * transaction takes up more than a quarter of it.
+ *
+ * @param opts The options to change.
+ * @param size The size in bytes. It is clamped to
+ * [S4_LOG_MIN_SIZE, S4_LOG_MAX_SIZE].
+ */
+void s4_options_set_log_size (s4_options_t *opts, int32_t size)
+{
+	opts->log_size = CLAMP (size, S4_LOG_MIN_SIZE, S4_LOG_MAX_SIZE);
+}
+
+/**
+ * Sets how often the log is synced to disk in the background.
+ * Transactions started with S4_TRANS_NOSYNC do not wait for their
+ * changes to reach the disk, so this is about how much of them
+ * can be lost in a crash.
+ *
+ * @param opts The options to change.
+ * @param msec The interval in milliseconds.
+ */
+void s4_options_set_flush_interval (s4_options_t *opts, int msec)
+{
+	opts->flush_interval = MAX (msec, 1);
+}
+
+/**
+ * Sets how many threads check the entries of a query.
+ * Queries with many candidates are split up and checked in parallel,
+ * the thread calling s4_query does its share of the work.
+ * Queries with custom filters or combiners are always checked in
+ * the calling thread, so the callbacks need not be thread safe.
+ *
+ * @param opts The options to change.
+ * @param threads The number of threads, including the calling thread.
+ * 0 or 1 checks every query in the calling thread, which is the default.
+ */
+void s4_options_set_query_threads (s4_options_t *opts, int threads)
+{
+	opts->query_threads = MAX (threads, 0);
+}
+
+/**
+ * Sets if the sort keys of string values are computed up front.
+ * The collated and casefolded versions of a string are normally
+ * computed the first time a value is compared that way. With this set
+ * they are computed when the value is added, and saved with the
+ * database, so sorting the results of a query never has to compute or
+ * look up anything. Collated keys depend on LC_COLLATE, and are
+ * computed again when the database is opened with a different locale.
+ *
+ * @param opts The options to change.
+ * @param enable Non-zero to compute the keys up front, 0 to compute
+ * them when needed, which is the default.
+ */
+void s4_options_set_sort_keys (s4_options_t *opts, int enable)
+{
+	opts->sort_keys = enable;
+}
+
+/**
+ * Sets if the values of the keys given to s4_open are tokenized.
+ * Every such key then also has an index from the tokens in its values
+ * to the entries, and filters of type S4_FILTER_TOKEN on the key look
+ * their tokens up in it instead of checking every value. This only
+ * works for tokens that are a single word, or a word followed by a *.
+ * The index takes about as much memory as the index of the values.
+ *
+ * @param opts The options to change.
+ * @param enable Non-zero to tokenize the values, 0 to not tokenize them,
+ * which is the default.
+ */
+void s4_options_set_token_index (s4_options_t *opts, int enable)
+{
+	opts->token_index = enable;
+}
+
+/**
+ * Sets how many query results are cached.
+ * Read-only transactions then look the results of s4_query up by
+ * what their condition and fetchspec contain, and get the rows a
+ * query made the same way got before, if no commit since then changed
+ * a key the query filters on or fetches.
+ *
+ * Every query still gets a resultset of its own that can be sorted
+ * and freed like any other, only the rows are shared. Queries with
+ * custom filters or combiners are not cached.
+ *
+ * @param opts The options to change.
+ * @param size The largest number of results to keep. 0 turns the cache
+ * off, which is the default.
+ */
+void s4_options_set_query_cache (s4_options_t *opts, int size)
+{
+	opts->query_cache = MAX (size, 0);
+}
+
+/**
+ * Sets if strings are stored compacted on disk.
+ * The strings of the database file are then sorted and stored with
+ * only the part that differs from the string before them, so the
+ * long common prefixes of URLs cost next to nothing. Log entries
+ * refer back to strings already written earlier in the same
+ * transaction instead of writing them again, so adding an entry
+ * with many properties writes its key, value and source once.
+ * Files written this way can not be read by versions of S4 that
+ * do not know about it, but are read no matter what this is set to.
+ *
+ * @param opts The options to change.
+ * @param enable Non-zero to compact the strings, 0 to store them as
+ * they are, which is the default.
+ */
+void s4_options_set_compact_strings (s4_options_t *opts, int enable)
+{
+	opts->compact_strings = enable;
+}
+
+/**
+ * @}
+ */
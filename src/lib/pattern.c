@@ -38,11 +38,15 @@
 typedef struct pattern_St {
 	char *str; /* The string to match, for string patterns '?' is replaced by '\0' */
 	int len;   /* The lenght of the string */
+	int literal; /* Set if a string pattern has no '?' */
+	int skip;  /* The index of the first character that is not '?', -1 if there is none */
 	struct pattern_St *next; /* The next sub-pattern */
 } pattern_t;
 
 struct s4_pattern_St {
 	int casefolded;
+	/* The casefolded literal prefix, see s4_pattern_get_prefix */
+	char *prefix;
 	pattern_t *str_pattern;
 	pattern_t *pos_pattern;
 	pattern_t *neg_pattern;
@@ -234,6 +238,11 @@ _copy_str (const char *str, int len, pattern_t *p, int casefold)
 	}
 
 	g_string_free (g_str, TRUE);
+
+	p->literal = memchr (p->str, '\0', p->len) == NULL;
+	for (p->skip = 0; p->skip < p->len && p->str[p->skip] == '\0'; p->skip++);
+	if (p->skip == p->len)
+		p->skip = -1;
 }
 
 /* Creates a string pattern.
@@ -286,6 +295,9 @@ _match_pattern (const char *str, pattern_t *p)
 {
 	int i;
 
+	if (p->literal)
+		return !memcmp (str, p->str, p->len);
+
 	for (i = 0; i < p->len; i++) {
 		if (p->str[i] != 0 && p->str[i] != str[i])
 			return 0;
@@ -296,18 +308,34 @@ _match_pattern (const char *str, pattern_t *p)
 
 /* Searches the string for the pattern p
  * Returns the index of the first place matching, or -1 if it's not found
+ * Only the places where the first character that is not '?' is found
+ * are tried, and memchr finds them.
  */
 static int
 _find_pattern (const char *str, int len, pattern_t *p)
 {
 	int i = 0;
 	int stop = len - p->len;
+	const char *c;
 
-	for (i = 0; i <= stop && !_match_pattern (str + i, p); i++);
-
-	if (i > stop)
+	if (stop < 0)
 		return -1;
-	return i;
+	/* Nothing but '?', so it matches at the start */
+	if (p->skip < 0)
+		return 0;
+
+	while (i <= stop) {
+		c = memchr (str + i + p->skip, p->str[p->skip], stop - i + 1);
+		if (c == NULL)
+			return -1;
+
+		i = c - str - p->skip;
+		if (_match_pattern (str + i, p))
+			return i;
+		i++;
+	}
+
+	return -1;
 }
 
 /* Tries to match the pattern against the given string
@@ -397,6 +425,7 @@ s4_pattern_create (const char *pattern, int casefold)
 	s4_pattern_t *ret = malloc (sizeof (s4_pattern_t));
 
 	ret->casefolded = casefold;
+	ret->prefix = NULL;
 	ret->str_pattern = _str_pattern_create (pattern, casefold);
 	ret->pos_pattern = NULL;
 	ret->neg_pattern = NULL;
@@ -415,11 +444,37 @@ s4_pattern_create (const char *pattern, int casefold)
 		} else if (*pattern == '*') {
 			ret->neg_pattern = _num_pattern_create (pattern);
 		}
+	} else {
+		/* Only strings can match, so every match starts with
+		 * the characters before the first wildcard
+		 */
+		size_t len = strcspn (pattern, "*?");
+
+		if (len > 0) {
+			ret->prefix = g_utf8_casefold (pattern, len);
+		}
 	}
 
 	return ret;
 }
 
+/**
+ * Gets the literal prefix of a pattern.
+ * Every value the pattern matches is a string, and casefolded it
+ * starts with the prefix. This holds whether the pattern was created
+ * to match casefolded strings or not, so the prefix can be used to
+ * search sorted casefolded values.
+ *
+ * @param p The pattern
+ * @return The casefolded prefix, or NULL if the pattern starts with a
+ * wildcard or can match integers
+ */
+const char *
+s4_pattern_get_prefix (const s4_pattern_t *p)
+{
+	return p->prefix;
+}
+
 /**
  * Matches a pattern against a value
  * @param p The pattern to use
@@ -460,6 +515,7 @@ s4_pattern_free (s4_pattern_t *pattern)
 	_free_pattern (pattern->str_pattern);
 	_free_pattern (pattern->pos_pattern);
 	_free_pattern (pattern->neg_pattern);
+	g_free (pattern->prefix);
 	free (pattern);
 }
 
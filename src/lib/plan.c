@@ -0,0 +1,425 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include "logging.h"
+#include <stdlib.h>
+#include <limits.h>
+
+/**
+ *
+ * @internal
+ * @defgroup Plan Plan
+ * @ingroup S4
+ * @brief Finds the entries a query has to check.
+ *
+ * The planner walks the condition and uses indexes to find a set of
+ * entries that contains every entry that can match. The candidates
+ * are still checked against the whole condition afterwards, so the
+ * set only has to be a superset of the result.
+ *
+ * - A filter with a key can use the a-index of the key if it checks
+ *   the parent, or the b-index of the key if there is one.
+ * - An AND starts with the candidates of its most selective indexable
+ *   operand, and intersects them with the others until there are
+ *   so few candidates that checking them is cheaper than searching.
+ * - An OR unites the candidates of its operands, if all of them
+ *   are indexable.
+ * - Anything else (NOT, custom combiners, filters on every key)
+ *   is not indexable, and a query with no indexable parts looks
+ *   at every entry in the database.
+ *
+ * How selective an operand is, is guessed from the statistics the
+ * indexes keep.
+ *
+ * Token filters on a key with a token index look their token up in
+ * it, if the token is something the token index can find. Match
+ * filters with a literal prefix search the range of values starting
+ * with it.
+ *
+ * @{
+ */
+
+typedef struct {
+	s4_condition_t *cond;
+	int estimate;
+} plan_operand_t;
+
+/**
+ * An index function that matches everything
+ *
+ * @return 0
+ */
+static int _everything (void)
+{
+	return 0;
+}
+
+/**
+ * Checks if the candidates for a condition can be found with indexes.
+ *
+ * @param s4 The database
+ * @param cond The condition
+ * @return non-zero if the condition is indexable, 0 otherwise
+ */
+static int _plan_indexable (s4_t *s4, s4_condition_t *cond)
+{
+	s4_condition_t *op;
+	int i;
+
+	if (s4_cond_is_filter (cond)) {
+		const char *key = s4_cond_get_key (cond);
+
+		return key != NULL && ((s4_cond_get_flags (cond) & S4_COND_PARENT)
+				|| _index_get_b (s4, key) != NULL);
+	}
+
+	switch (s4_cond_get_combiner_type (cond)) {
+	case S4_COMBINE_AND:
+		for (i = 0; (op = s4_cond_get_operand (cond, i)) != NULL; i++) {
+			if (_plan_indexable (s4, op))
+				return 1;
+		}
+		return 0;
+
+	case S4_COMBINE_OR:
+		for (i = 0; (op = s4_cond_get_operand (cond, i)) != NULL; i++) {
+			if (!_plan_indexable (s4, op))
+				return 0;
+		}
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Gets the index an indexable filter uses.
+ *
+ * @param s4 The database
+ * @param cond An indexable filter
+ * @return The index, or NULL if no entry has the key
+ */
+static s4_index_t *_plan_get_index (s4_t *s4, s4_condition_t *cond)
+{
+	const char *key = s4_cond_get_key (cond);
+
+	if (s4_cond_get_flags (cond) & S4_COND_PARENT) {
+		return _index_get_a (s4, key, 0);
+	}
+
+	return _index_get_b (s4, key);
+}
+
+/**
+ * Gets the literal prefix of a match filter.
+ *
+ * @param cond The filter
+ * @return The casefolded prefix, or NULL if cond is not a match filter
+ * or its pattern can match values without a common prefix
+ */
+static const char *_plan_get_prefix (s4_condition_t *cond)
+{
+	if (s4_cond_get_filter_type (cond) != S4_FILTER_MATCH)
+		return NULL;
+
+	return s4_pattern_get_prefix (s4_cond_get_funcdata (cond));
+}
+
+/**
+ * Gets the token index a filter can use, and the token to look up.
+ *
+ * @param index The index the filter uses
+ * @param cond The filter
+ * @param token Set to the token to look up, to be freed with g_free
+ * @param prefix Set to non-zero if every token starting with token matches
+ * @return The token index, or NULL if the filter can not use one
+ */
+static s4_index_t *_plan_get_tokens (s4_index_t *index, s4_condition_t *cond,
+		char **token, int *prefix)
+{
+	s4_index_t *tokens = _index_get_tokens (index);
+
+	if (tokens == NULL || (*token = s4_cond_get_token (cond, prefix)) == NULL)
+		return NULL;
+
+	return tokens;
+}
+
+/**
+ * Guesses how many candidates an indexable condition has.
+ * The statistics are only used as a guess, so they are read
+ * without locking the indexes.
+ *
+ * @param s4 The database
+ * @param cond An indexable condition
+ * @return The estimated number of candidates
+ */
+static int _plan_estimate (s4_t *s4, s4_condition_t *cond)
+{
+	const s4_index_stats_t *stats;
+	s4_index_t *index, *tokens;
+	s4_condition_t *op;
+	char *token;
+	int i, est, ret, prefix;
+
+	if (s4_cond_is_filter (cond)) {
+		index = _plan_get_index (s4, cond);
+		if (index == NULL)
+			return 0;
+
+		tokens = _plan_get_tokens (index, cond, &token, &prefix);
+		if (tokens != NULL) {
+			g_free (token);
+			stats = _index_get_stats (tokens);
+			if (stats->values == 0)
+				return 0;
+			if (!prefix)
+				return (stats->entries + stats->values - 1) / stats->values;
+			return stats->entries / 3 + 1;
+		}
+
+		stats = _index_get_stats (index);
+		if (stats->values == 0)
+			return 0;
+		/* The average number of entries per value */
+		if (s4_cond_get_filter_type (cond) == S4_FILTER_EQUAL)
+			return (stats->entries + stats->values - 1) / stats->values;
+		/* A range, assume it covers a third of the index */
+		if (s4_cond_is_monotonic (cond) || _plan_get_prefix (cond) != NULL)
+			return stats->entries / 3 + 1;
+		return stats->entries;
+	}
+
+	if (s4_cond_get_combiner_type (cond) == S4_COMBINE_AND) {
+		ret = INT_MAX;
+		for (i = 0; (op = s4_cond_get_operand (cond, i)) != NULL; i++) {
+			if (_plan_indexable (s4, op))
+				ret = MIN (ret, _plan_estimate (s4, op));
+		}
+	} else {
+		ret = 0;
+		for (i = 0; (op = s4_cond_get_operand (cond, i)) != NULL; i++) {
+			est = _plan_estimate (s4, op);
+			ret = (est > INT_MAX - ret)?INT_MAX:ret + est;
+		}
+	}
+
+	return ret;
+}
+
+static int _operand_cmp (const void *a, const void *b)
+{
+	const plan_operand_t *oa = a, *ob = b;
+
+	return (oa->estimate > ob->estimate) - (oa->estimate < ob->estimate);
+}
+
+/**
+ * Finds the candidates for a filter using an index.
+ *
+ * @param trans The transaction the query runs in
+ * @param cond An indexable filter
+ * @return The candidates, or NULL if the transaction deadlocked
+ */
+static s4_set_t *_plan_filter (s4_transaction_t *trans, s4_condition_t *cond)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	index_function_t func = (index_function_t)s4_cond_get_filter_function (cond);
+	s4_index_t *index = _plan_get_index (s4, cond), *tokens;
+	s4_set_t *ret;
+	const char *str;
+	char *token;
+	int prefix;
+
+	/* No entry has this key */
+	if (index == NULL) {
+		return _set_new (0);
+	}
+
+	if (!_index_lock_shared (index, trans)) {
+		return NULL;
+	}
+
+	ret = _set_new (0);
+	if ((tokens = _plan_get_tokens (index, cond, &token, &prefix)) != NULL) {
+		_index_token_search (index, token, prefix, ret);
+		S4_DBG ("plan: token index of %s, token %s%s", s4_cond_get_key (cond),
+				token, prefix?"*":"");
+		g_free (token);
+		return ret;
+	} else if ((str = _plan_get_prefix (cond)) != NULL) {
+		_index_prefix_search (index, str, ret);
+	} else if (s4_cond_is_monotonic (cond)) {
+		_index_search (index, func, cond, ret);
+	} else {
+		_index_lsearch (index, func, cond, ret);
+	}
+
+	S4_DBG ("plan: %s-index of %s, found %i",
+			(s4_cond_get_flags (cond) & S4_COND_PARENT)?"a":"b",
+			s4_cond_get_key (cond), _set_size (ret));
+
+	return ret;
+}
+
+static s4_set_t *_plan_cond (s4_transaction_t *trans, s4_condition_t *cond);
+
+/**
+ * Finds the candidates for an AND.
+ * The operands are searched from the most to the least selective,
+ * and the search stops when it is cheaper to let the caller check
+ * the remaining operands on the candidates found so far.
+ *
+ * @param trans The transaction the query runs in
+ * @param cond The AND condition
+ * @return The candidates, or NULL if the transaction deadlocked
+ */
+static s4_set_t *_plan_and (s4_transaction_t *trans, s4_condition_t *cond)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	plan_operand_t *ops;
+	s4_condition_t *op;
+	s4_set_t *ret = NULL, *sub;
+	int i, n;
+
+	for (n = 0; s4_cond_get_operand (cond, n) != NULL; n++);
+	ops = malloc (sizeof (plan_operand_t) * MAX (n, 1));
+
+	/* The operands that are not indexable only remove entries,
+	 * the others will do as candidates
+	 */
+	for (i = n = 0; (op = s4_cond_get_operand (cond, i)) != NULL; i++) {
+		if (_plan_indexable (s4, op)) {
+			ops[n].cond = op;
+			ops[n].estimate = _plan_estimate (s4, op);
+			n++;
+		}
+	}
+	qsort (ops, n, sizeof (plan_operand_t), _operand_cmp);
+
+	for (i = 0; i < n; i++) {
+		if (ret != NULL && _set_size (ret) <= ops[i].estimate) {
+			S4_DBG ("plan: checking %i operands on %i candidates",
+					n - i, _set_size (ret));
+			break;
+		}
+
+		S4_DBG ("plan: operand %i of %i, estimated %i", i + 1, n, ops[i].estimate);
+		sub = _plan_cond (trans, ops[i].cond);
+		if (sub == NULL) {
+			if (ret != NULL)
+				_set_free (ret);
+			ret = NULL;
+			break;
+		}
+
+		if (ret == NULL) {
+			ret = sub;
+		} else {
+			_set_intersect (ret, sub);
+			_set_free (sub);
+		}
+
+		/* Nothing can match, no need to look at the rest */
+		if (_set_size (ret) == 0)
+			break;
+	}
+
+	free (ops);
+	return ret;
+}
+
+/**
+ * Finds the candidates for an indexable condition.
+ *
+ * @param trans The transaction the query runs in
+ * @param cond The condition
+ * @return The candidates, or NULL if the transaction deadlocked
+ */
+static s4_set_t *_plan_cond (s4_transaction_t *trans, s4_condition_t *cond)
+{
+	s4_condition_t *op;
+	s4_set_t *ret = NULL, *sub;
+	int i;
+
+	if (s4_cond_is_filter (cond)) {
+		return _plan_filter (trans, cond);
+	}
+	if (s4_cond_get_combiner_type (cond) == S4_COMBINE_AND) {
+		return _plan_and (trans, cond);
+	}
+
+	for (i = 0; (op = s4_cond_get_operand (cond, i)) != NULL; i++) {
+		sub = _plan_cond (trans, op);
+		if (sub == NULL) {
+			if (ret != NULL)
+				_set_free (ret);
+			return NULL;
+		}
+
+		if (ret == NULL) {
+			ret = sub;
+		} else {
+			_set_union (ret, sub);
+			_set_free (sub);
+		}
+	}
+
+	if (ret == NULL) {
+		ret = _set_new (0);
+	}
+
+	return ret;
+}
+
+/**
+ * Finds all the entries that may match a condition.
+ * The indexes used are locked in the transaction.
+ *
+ * @param trans The transaction the query runs in
+ * @param cond The condition
+ * @return The candidates, or NULL if the transaction deadlocked
+ */
+s4_set_t *_plan_query (s4_transaction_t *trans, s4_condition_t *cond)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	GList *indices;
+	s4_set_t *ret;
+
+	if (_plan_indexable (s4, cond)) {
+		_stats_count (s4, S4_STAT_PLAN_INDEXED, 1);
+		return _plan_cond (trans, cond);
+	}
+
+	_stats_count (s4, S4_STAT_PLAN_SCANNED, 1);
+	ret = _set_new (0);
+	indices = _index_get_all_a (s4);
+
+	for (; indices != NULL; indices = g_list_delete_link (indices, indices)) {
+		if (!_index_lock_shared (indices->data, trans)) {
+			g_list_free (indices);
+			_set_free (ret);
+			return NULL;
+		}
+		_index_lsearch (indices->data, (index_function_t)_everything, NULL, ret);
+	}
+
+	return ret;
+}
+
+/**
+ * @}
+ */
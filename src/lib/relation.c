@@ -16,10 +16,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* A key, value, source tuple. They are the ids of the constants,
+ * see _const_get, so an item takes 12 bytes instead of 24.
+ */
 typedef struct {
-	const char *key;
-	const s4_val_t *val;
-	const char *src;
+	int32_t key, val, src;
 } entry_data_t;
 
 typedef struct {
@@ -27,14 +28,61 @@ typedef struct {
 	const char *key;
 	const s4_val_t *val;
 	int size, alloc;
+	/* Entries are numbered in the order they were created */
+	int serial;
 
 	entry_data_t *data;
+	entry_version_t *versions;
 } entry_t;
 
+/* The stamp of a version saved by a transaction that is still running */
+#define VERSION_PENDING G_MAXUINT64
+
+/* An old version of an entry, kept for read-only transactions that
+ * started before it was changed. The version is the data the entry
+ * had before the commit with the given stamp.
+ */
+struct entry_version_St {
+	entry_t *entry;
+	entry_data_t *data;
+	int size;
+	guint64 stamp;
+
+	/* The version before this one */
+	entry_version_t *older;
+	/* The next version saved by the same transaction */
+	entry_version_t *next;
+	/* The version stamped after this one, by any transaction */
+	entry_version_t *later;
+};
+
+/* Protects the versions of the entries, and their data when read
+ * by read-only transactions. Striped like the locks to keep entries small.
+ */
+#define VERSION_STRIPES 64
+static GRWLock version_stripes[VERSION_STRIPES];
+
 struct s4_entry_data_St {
 	entry_t *entry;
 	const char *prev_key;
 	const s4_val_t *prev_val;
+
+	int entry_count;
+
+	/* Entries changed since the last full write, used by S4_INCREMENTAL */
+	GHashTable *dirty;
+	GMutex dirty_lock;
+
+	/* Snapshots for read-only transactions */
+	GMutex version_lock;
+	/* The stamp of the last commit */
+	guint64 version;
+	/* The snapshots in use */
+	GArray *snapshots;
+	/* The entries that have old versions */
+	GHashTable *versioned;
+	/* The stamped versions, from the oldest stamp to the newest */
+	entry_version_t *first_stamped, *last_stamped;
 };
 
 #define LINEAR_SEARCH_SIZE 0
@@ -56,14 +104,100 @@ s4_entry_data_t *_entry_create_data ()
 {
 	s4_entry_data_t *ret = calloc (1, sizeof (s4_entry_data_t));
 
+	ret->dirty = g_hash_table_new (NULL, NULL);
+	g_mutex_init (&ret->dirty_lock);
+
+	g_mutex_init (&ret->version_lock);
+	ret->snapshots = g_array_new (FALSE, FALSE, sizeof (guint64));
+	ret->versioned = g_hash_table_new (NULL, NULL);
+
 	return ret;
 }
 
 void _entry_free_data (s4_entry_data_t *data)
 {
+	g_hash_table_destroy (data->dirty);
+	g_mutex_clear (&data->dirty_lock);
+	g_mutex_clear (&data->version_lock);
+	g_array_free (data->snapshots, TRUE);
+	g_hash_table_destroy (data->versioned);
 	free (data);
 }
 
+/**
+ * Remembers that an entry has changed since the last full write.
+ * Only done if the database was opened with S4_INCREMENTAL.
+ *
+ * @param s4 The database the entry belongs to
+ * @param entry The entry that changed
+ */
+static void _entry_set_dirty (s4_t *s4, entry_t *entry)
+{
+	if (!(s4->open_flags & S4_INCREMENTAL))
+		return;
+
+	g_mutex_lock (&s4->entry_data->dirty_lock);
+	g_hash_table_insert (s4->entry_data->dirty, entry, entry);
+	g_mutex_unlock (&s4->entry_data->dirty_lock);
+}
+
+/**
+ * Forgets the dirty entries. Called when a full write takes its
+ * snapshot. Entries changed by transactions that have not committed
+ * yet are kept, the snapshot does not have their changes.
+ *
+ * @param s4 The database
+ */
+void _entry_clear_dirty (s4_t *s4)
+{
+	s4_entry_data_t *data = s4->entry_data;
+	GHashTableIter iter;
+	entry_t *entry;
+
+	g_mutex_lock (&data->version_lock);
+	g_mutex_lock (&data->dirty_lock);
+	g_hash_table_remove_all (data->dirty);
+
+	if (s4->open_flags & S4_INCREMENTAL) {
+		g_hash_table_iter_init (&iter, data->versioned);
+		while (g_hash_table_iter_next (&iter, (void**)&entry, NULL)) {
+			if (entry->versions != NULL && entry->versions->stamp == VERSION_PENDING)
+				g_hash_table_insert (data->dirty, entry, entry);
+		}
+	}
+
+	g_mutex_unlock (&data->dirty_lock);
+	g_mutex_unlock (&data->version_lock);
+}
+
+/**
+ * Gets the number of entries changed since the last full write.
+ *
+ * @param s4 The database
+ * @return The number of dirty entries
+ */
+int _entry_get_dirty_count (s4_t *s4)
+{
+	int ret;
+
+	g_mutex_lock (&s4->entry_data->dirty_lock);
+	ret = g_hash_table_size (s4->entry_data->dirty);
+	g_mutex_unlock (&s4->entry_data->dirty_lock);
+
+	return ret;
+}
+
+/**
+ * Gets the number of entries in the database
+ *
+ * @param s4 The database
+ * @return The number of entries
+ */
+int _entry_get_count (s4_t *s4)
+{
+	return g_atomic_int_get (&s4->entry_data->entry_count);
+}
+
 /**
  * Searches an entry for key
  *
@@ -72,7 +206,7 @@ void _entry_free_data (s4_entry_data_t *data)
  * @return The index of the item before the first item with key=key,
  * or the index of the first item with key=key.
  */
-static int _entry_search (entry_t *entry, const char *key)
+static int _entry_search (entry_t *entry, int32_t key)
 {
 	int lo = 0;
 	int hi = entry->size;
@@ -92,20 +226,28 @@ static int _entry_search (entry_t *entry, const char *key)
 }
 
 /**
- * Inserts a key,value,source tuple into an entry
+ * Inserts a key,value,source tuple into an entry.
+ * Values are constants, so equal ids are equal values.
  *
  * @param entry The entry to insert into
- * @param key The key to insert
- * @param val The value to insert
- * @param src The source to insert
+ * @param key The id of the key to insert
+ * @param val The id of the value to insert
+ * @param src The id of the source to insert
  * @return 0 if the tuple already exists, non-zero otherwise
  */
-static int _entry_insert (entry_t *entry, const char *key, const s4_val_t *val, const char *src)
+static int _entry_insert (entry_t *entry, int32_t key, int32_t val, int32_t src)
 {
-	int i = _entry_search (entry, key);
+	int i;
+
+	/* Data read from file is mostly inserted in key order */
+	if (entry->size == 0 || entry->data[entry->size - 1].key < key) {
+		i = entry->size;
+	} else {
+		i = _entry_search (entry, key);
+	}
 
 	for (; i < entry->size && entry->data[i].key == key; i++) {
-		if (entry->data[i].src == src && !s4_val_cmp (entry->data[i].val, val, S4_CMP_BINARY))
+		if (entry->data[i].src == src && entry->data[i].val == val)
 			return 0;
 	}
 
@@ -128,18 +270,18 @@ static int _entry_insert (entry_t *entry, const char *key, const s4_val_t *val,
  * Deletes a key,value,source tuple from an entry
  *
  * @param entry The entry to delete from
- * @param key The key to delete
- * @param val The value to delete
- * @param src The source to delete
+ * @param key The id of the key to delete
+ * @param val The id of the value to delete
+ * @param src The id of the source to delete
  * @return 0 if the tuple was not found, 1 otherwise
  */
-static int _entry_delete (entry_t *entry, const char *key, const s4_val_t *val, const char *src)
+static int _entry_delete (entry_t *entry, int32_t key, int32_t val, int32_t src)
 {
 	int i = _entry_search (entry, key);
 	int found = 0;
 
 	for (; i < entry->size && entry->data[i].key == key; i++) {
-		if (entry->data[i].src == src && !s4_val_cmp (entry->data[i].val, val, S4_CMP_BINARY)) {
+		if (entry->data[i].src == src && entry->data[i].val == val) {
 			found = 1;
 			break;
 		}
@@ -154,17 +296,39 @@ static int _entry_delete (entry_t *entry, const char *key, const s4_val_t *val,
 	return 1;
 }
 
+/**
+ * Computes the sort keys of a value added to an entry,
+ * if the database wants them computed up front.
+ *
+ * @param s4 The database
+ * @param val The value
+ */
+static void _prepare_sort_keys (s4_t *s4, const s4_val_t *val)
+{
+	const char *str;
+
+	if (s4->options.sort_keys) {
+		s4_val_get_collated_str (val, &str);
+		s4_val_get_casefolded_str (val, &str);
+	}
+}
+
 /**
  * Creates a new entry
  *
+ * @param s4 The database the entry belongs to
  * @param key The key of the entry
  * @param val The value of the entry
  * @return A new empty entry
  */
-static entry_t *_entry_create (const char *key, const s4_val_t *val)
+static entry_t *_entry_create (s4_t *s4, const char *key, const s4_val_t *val)
 {
 	entry_t *entry = malloc (sizeof (entry_t));
 
+	entry->serial = g_atomic_int_add (&s4->entry_data->entry_count, 1);
+
+	_prepare_sort_keys (s4, val);
+
 	entry->lock = _lock_alloc ();
 	entry->key = key;
 	entry->val = val;
@@ -172,10 +336,260 @@ static entry_t *_entry_create (const char *key, const s4_val_t *val)
 	entry->alloc = 1;
 
 	entry->data = malloc (sizeof (entry_data_t) * entry->alloc);
+	entry->versions = NULL;
 
 	return entry;
 }
 
+static GRWLock *_entry_stripe (entry_t *entry)
+{
+	return version_stripes + (((gsize)entry >> 4) % VERSION_STRIPES);
+}
+
+/**
+ * Frees versions of an entry.
+ *
+ * @param v The newest version to free, it and all older are freed
+ */
+static void _version_free (entry_version_t *v)
+{
+	entry_version_t *older;
+
+	for (; v != NULL; v = older) {
+		older = v->older;
+		free (v->data);
+		free (v);
+	}
+}
+
+/**
+ * Saves the data of an entry before a transaction changes it, so
+ * read-only transactions can still read it. A transaction only saves
+ * an entry once, the first time it changes it. The entry must be
+ * locked exclusively.
+ *
+ * @param trans The transaction about to change the entry
+ * @param entry The entry
+ */
+static void _entry_save_version (s4_transaction_t *trans, entry_t *entry)
+{
+	s4_entry_data_t *data = _transaction_get_db (trans)->entry_data;
+	GRWLock *stripe = _entry_stripe (entry);
+	entry_version_t *v;
+
+	g_mutex_lock (&data->version_lock);
+	g_rw_lock_writer_lock (stripe);
+
+	if (entry->versions == NULL || entry->versions->stamp != VERSION_PENDING) {
+		v = malloc (sizeof (entry_version_t));
+		v->entry = entry;
+		v->size = entry->size;
+		v->data = malloc (sizeof (entry_data_t) * MAX (entry->size, 1));
+		memcpy (v->data, entry->data, sizeof (entry_data_t) * entry->size);
+		v->stamp = VERSION_PENDING;
+		v->older = entry->versions;
+		v->next = _transaction_get_versions (trans);
+
+		entry->versions = v;
+		_transaction_set_versions (trans, v);
+		g_hash_table_insert (data->versioned, entry, entry);
+	}
+
+	g_rw_lock_writer_unlock (stripe);
+	g_mutex_unlock (&data->version_lock);
+}
+
+/**
+ * Frees the versions no snapshot can see anymore.
+ * Must be called with version_lock held.
+ *
+ * @param data The entry data
+ */
+static void _entry_collect_versions (s4_entry_data_t *data)
+{
+	entry_t *entry;
+	entry_version_t *v, **p;
+	guint64 oldest = data->version;
+	guint i;
+
+	if (data->first_stamped == NULL)
+		return;
+
+	for (i = 0; i < data->snapshots->len; i++) {
+		oldest = MIN (oldest, g_array_index (data->snapshots, guint64, i));
+	}
+
+	/* Snapshots only see versions stamped after they started. The
+	 * versions are freed in the order they were stamped, so the one
+	 * freed is always the oldest version of its entry.
+	 */
+	while ((v = data->first_stamped) != NULL && v->stamp <= oldest) {
+		GRWLock *stripe;
+
+		data->first_stamped = v->later;
+		entry = v->entry;
+		stripe = _entry_stripe (entry);
+
+		g_rw_lock_writer_lock (stripe);
+		for (p = &entry->versions; *p != v; p = &(*p)->older);
+		*p = NULL;
+
+		if (entry->versions == NULL) {
+			g_hash_table_remove (data->versioned, entry);
+		}
+		g_rw_lock_writer_unlock (stripe);
+
+		_version_free (v);
+	}
+
+	if (data->first_stamped == NULL)
+		data->last_stamped = NULL;
+}
+
+/**
+ * Stamps the versions saved by a transaction when it ends.
+ * This is done whether it committed or not, a rolled back
+ * transaction just leaves the entries as they were. Must be
+ * called before the transaction releases its locks.
+ *
+ * @param trans The transaction
+ */
+void _entry_stamp_versions (s4_transaction_t *trans)
+{
+	s4_entry_data_t *data = _transaction_get_db (trans)->entry_data;
+	entry_version_t *v = _transaction_get_versions (trans);
+
+	if (v == NULL)
+		return;
+
+	g_mutex_lock (&data->version_lock);
+	data->version++;
+
+	if (_transaction_get_db (trans)->query_cache != NULL) {
+		_query_cache_invalidate (_transaction_get_db (trans)->query_cache,
+				_transaction_get_ops (trans));
+	}
+
+	for (; v != NULL; v = v->next) {
+		GRWLock *stripe = _entry_stripe (v->entry);
+
+		g_rw_lock_writer_lock (stripe);
+		v->stamp = data->version;
+		g_rw_lock_writer_unlock (stripe);
+
+		v->later = NULL;
+		if (data->last_stamped == NULL)
+			data->first_stamped = v;
+		else
+			data->last_stamped->later = v;
+		data->last_stamped = v;
+	}
+	_transaction_set_versions (trans, NULL);
+
+	if (data->snapshots->len == 0) {
+		_entry_collect_versions (data);
+	}
+	g_mutex_unlock (&data->version_lock);
+}
+
+/**
+ * Starts a snapshot of the database.
+ *
+ * @param s4 The database
+ * @return The snapshot, it sees every commit stamped up to now
+ */
+guint64 _entry_begin_snapshot (s4_t *s4)
+{
+	s4_entry_data_t *data = s4->entry_data;
+	guint64 ret;
+
+	g_mutex_lock (&data->version_lock);
+	ret = data->version;
+	g_array_append_val (data->snapshots, ret);
+	g_mutex_unlock (&data->version_lock);
+
+	return ret;
+}
+
+/**
+ * Ends a snapshot started with _entry_begin_snapshot.
+ *
+ * @param s4 The database
+ * @param snapshot The snapshot
+ */
+void _entry_end_snapshot (s4_t *s4, guint64 snapshot)
+{
+	s4_entry_data_t *data = s4->entry_data;
+	guint i;
+
+	g_mutex_lock (&data->version_lock);
+	for (i = 0; i < data->snapshots->len; i++) {
+		if (g_array_index (data->snapshots, guint64, i) == snapshot) {
+			g_array_remove_index (data->snapshots, i);
+			break;
+		}
+	}
+	_entry_collect_versions (data);
+	g_mutex_unlock (&data->version_lock);
+}
+
+/**
+ * Adds every entry with old versions to a set. Their index entries
+ * may have changed after a snapshot started, so a query in the
+ * snapshot has to check them too.
+ *
+ * @param s4 The database
+ * @param set The set to add to
+ */
+static void _entry_add_versioned (s4_t *s4, s4_set_t *set)
+{
+	s4_entry_data_t *data = s4->entry_data;
+	GHashTableIter iter;
+	entry_t *entry;
+
+	g_mutex_lock (&data->version_lock);
+	g_hash_table_iter_init (&iter, data->versioned);
+	while (g_hash_table_iter_next (&iter, (void**)&entry, NULL)) {
+		_set_add (set, entry);
+	}
+	g_mutex_unlock (&data->version_lock);
+}
+
+/**
+ * Gets an entry as it was when a snapshot started.
+ * The stripe of the entry must be locked for reading
+ * for as long as the view is used.
+ *
+ * @param entry The entry
+ * @param snapshot The snapshot
+ * @param view Filled with the entry as the snapshot sees it
+ * @return view
+ */
+static entry_t *_entry_get_view (entry_t *entry, guint64 snapshot, entry_t *view)
+{
+	entry_version_t *v = entry->versions, *visible = NULL;
+
+	for (; v != NULL && v->stamp > snapshot; v = v->older) {
+		visible = v;
+	}
+
+	view->lock = entry->lock;
+	view->key = entry->key;
+	view->val = entry->val;
+	view->versions = NULL;
+
+	if (visible == NULL) {
+		view->size = entry->size;
+		view->alloc = entry->alloc;
+		view->data = entry->data;
+	} else {
+		view->size = view->alloc = visible->size;
+		view->data = visible->data;
+	}
+
+	return view;
+}
+
 static int _entry_lock_shared (entry_t *entry, s4_transaction_t *trans)
 {
 	return _lock_shared (entry->lock, trans);
@@ -206,27 +620,26 @@ int _s4_add (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
 {
 	s4_index_t *index;
 	entry_t *entry;
-	GList *entries;
 	int ret;
 	s4_t *s4 = _transaction_get_db (trans);
 
 	index = _index_get_a (s4, key_a, 1);
 	if (!_index_lock_shared (index, trans)) goto deadlocked;
-	entries = _index_search (index, NULL, (void*)val_a);
+	entry = _index_lookup (index, val_a);
 
-	if (entries == NULL) {
-		entry = _entry_create (key_a, val_a);
+	if (entry == NULL) {
+		entry = _entry_create (s4, key_a, val_a);
 		if (!_index_lock_exclusive (index, trans)) goto deadlocked;
 		_index_insert (index, val_a, entry);
-	} else {
-		entry = entries->data;
-		g_list_free (entries);
 	}
 
 	if (!_entry_lock_exclusive (entry, trans)) goto deadlocked;
-	ret = _entry_insert (entry, key_b, val_b, src);
+	_entry_save_version (trans, entry);
+	ret = _entry_insert (entry, _string_id (s4, key_b), _val_get_id (val_b), _string_id (s4, src));
 
 	if (ret) {
+		_entry_set_dirty (s4, entry);
+		_prepare_sort_keys (s4, val_b);
 		index = _index_get_b (s4, key_b);
 
 		if (index != NULL) {
@@ -248,10 +661,8 @@ deadlocked:
  * written next to each other on file, and it can therefore save
  * many index searches.
  */
-int _s4_add_internal (s4_t *s4, const char *key_a, const s4_val_t *value_a,
-		const char *key_b, const s4_val_t *value_b, const char *src)
+static entry_t *_entry_get_internal (s4_t *s4, const char *key_a, const s4_val_t *value_a)
 {
-	int ret;
 	s4_index_t *index;
 
 	/* If key_a and value_a are equal to the key and value of entry
@@ -259,26 +670,32 @@ int _s4_add_internal (s4_t *s4, const char *key_a, const s4_val_t *value_a,
 	 */
 	if (s4->entry_data->prev_key != key_a
 	    || s4->entry_data->prev_val != value_a) {
-		GList *entries;
-
 		index = _index_get_a (s4, key_a, 1);
-		entries = _index_search (index, NULL, (void*)value_a);
+		s4->entry_data->entry = _index_lookup (index, value_a);
 
-		if (entries == NULL) {
-			s4->entry_data->entry = _entry_create (key_a, value_a);
+		if (s4->entry_data->entry == NULL) {
+			s4->entry_data->entry = _entry_create (s4, key_a, value_a);
 			_index_insert (index, value_a, s4->entry_data->entry);
-		} else {
-			s4->entry_data->entry = entries->data;
-			g_list_free (entries);
 		}
 
 		s4->entry_data->prev_key = key_a;
 		s4->entry_data->prev_val = value_a;
 	}
 
-	ret = _entry_insert (s4->entry_data->entry, key_b, value_b, src);
+	return s4->entry_data->entry;
+}
+
+int _s4_add_internal (s4_t *s4, const char *key_a, const s4_val_t *value_a,
+		const char *key_b, const s4_val_t *value_b, const char *src)
+{
+	int ret;
+	s4_index_t *index;
+
+	ret = _entry_insert (_entry_get_internal (s4, key_a, value_a),
+			_string_id (s4, key_b), _val_get_id (value_b), _string_id (s4, src));
 
 	if (ret) {
+		_prepare_sort_keys (s4, value_b);
 		index = _index_get_b (s4, key_b);
 
 		if (index != NULL) {
@@ -289,6 +706,121 @@ int _s4_add_internal (s4_t *s4, const char *key_a, const s4_val_t *value_a,
 	return ret;
 }
 
+/* Relations read from a file. Entries are filled in as the relations
+ * are added, but the b-indexes are built in one go by _s4_load_finish,
+ * see _index_build.
+ */
+struct s4_load_St {
+	s4_t *s4;
+	/* Maps b-indexes to GArrays of the index_pair_t to add to them */
+	GHashTable *pairs;
+};
+
+static void _load_free_pairs (GArray *pairs)
+{
+	g_array_free (pairs, TRUE);
+}
+
+/**
+ * Starts loading relations into a database.
+ * Like _s4_add_internal it does not take any locks.
+ *
+ * @param s4 The database to load into
+ * @return A new load
+ */
+s4_load_t *_s4_load_begin (s4_t *s4)
+{
+	s4_load_t *load = malloc (sizeof (s4_load_t));
+
+	load->s4 = s4;
+	load->pairs = g_hash_table_new_full (NULL, NULL,
+			NULL, (GDestroyNotify)_load_free_pairs);
+
+	return load;
+}
+
+/**
+ * Adds a relation to a load. It is in its entry right away, but is
+ * not in the b-index of key_b until the load is finished.
+ * It expects internal keys and values, like _s4_add_internal.
+ *
+ * @return 0 if the relation already exists, non-zero otherwise
+ */
+int _s4_load_add (s4_load_t *load, const char *key_a, const s4_val_t *value_a,
+		const char *key_b, const s4_val_t *value_b, const char *src)
+{
+	s4_t *s4 = load->s4;
+	s4_index_t *index;
+	index_pair_t pair;
+	GArray *pairs;
+	int ret;
+
+	ret = _entry_insert (_entry_get_internal (s4, key_a, value_a),
+			_string_id (s4, key_b), _val_get_id (value_b), _string_id (s4, src));
+
+	if (ret) {
+		_prepare_sort_keys (s4, value_b);
+		index = _index_get_b (s4, key_b);
+
+		if (index != NULL) {
+			pairs = g_hash_table_lookup (load->pairs, index);
+			if (pairs == NULL) {
+				pairs = g_array_new (FALSE, FALSE, sizeof (index_pair_t));
+				g_hash_table_insert (load->pairs, index, pairs);
+			}
+
+			pair.val = value_b;
+			pair.data = s4->entry_data->entry;
+			g_array_append_val (pairs, pair);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Builds the b-indexes of the relations in a load, and frees it.
+ *
+ * @param load The load to finish
+ */
+void _s4_load_finish (s4_load_t *load)
+{
+	GHashTableIter iter;
+	s4_index_t *index;
+	GArray *pairs;
+
+	g_hash_table_iter_init (&iter, load->pairs);
+	while (g_hash_table_iter_next (&iter, (void**)&index, (void**)&pairs)) {
+		_index_build (index, (index_pair_t*)pairs->data, pairs->len);
+	}
+
+	g_hash_table_destroy (load->pairs);
+	free (load);
+}
+
+/* Removes everything from an entry, creating it if it does not exist.
+ * Like _s4_add_internal it expects internal keys and values and does
+ * not take any locks. Used when reading incremental checkpoints, where
+ * an entry replaces the one found in the full file.
+ */
+void _s4_clear_internal (s4_t *s4, const char *key_a, const s4_val_t *value_a)
+{
+	entry_t *entry = _entry_get_internal (s4, key_a, value_a);
+	s4_index_t *index;
+	int i;
+
+	for (i = 0; i < entry->size; i++) {
+		index = _index_get_b (s4, _const_get_str (s4, entry->data[i].key));
+
+		if (index != NULL) {
+			_index_delete (index, _const_get (s4, entry->data[i].val), entry);
+		}
+	}
+
+	entry->size = 0;
+	_entry_set_dirty (s4, entry);
+}
+
 /**
  * Deletes a relation from a database
  *
@@ -305,7 +837,6 @@ int _s4_del (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
 {
 	s4_index_t *index;
 	entry_t *entry;
-	GList *entries;
 	int ret;
 	s4_t *s4 = _transaction_get_db (trans);
 
@@ -315,19 +846,18 @@ int _s4_del (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
 	}
 
 	if (!_index_lock_shared (index, trans)) goto deadlocked;
-	entries = _index_search (index, NULL, (void*)val_a);
+	entry = _index_lookup (index, val_a);
 
-	if (entries == NULL) {
+	if (entry == NULL) {
 		return 0;
-	} else {
-		entry = entries->data;
-		g_list_free (entries);
 	}
 
 	if (!_entry_lock_exclusive (entry, trans)) goto deadlocked;
-	ret = _entry_delete (entry, key_b, val_b, src);
+	_entry_save_version (trans, entry);
+	ret = _entry_delete (entry, _string_id (s4, key_b), _val_get_id (val_b), _string_id (s4, src));
 
 	if (ret) {
+		_entry_set_dirty (s4, entry);
 		index = _index_get_b (s4, key_b);
 
 		if (index != NULL) {
@@ -365,137 +895,331 @@ static int _everything (void)
  */
 void _free_relations (s4_t *s4)
 {
-	s4_index_t *index;
-	GList *indexes, *entries;
+	GList *indexes;
+	s4_set_t *entries = _set_new (0);
+	int i;
 
 	indexes = _index_get_all_a (s4);
 
 	for (; indexes != NULL; indexes = g_list_delete_link (indexes, indexes)) {
-		index = indexes->data;
-		entries = _index_search (index, (index_function_t)_everything, NULL);
+		_set_clear (entries);
+		_index_lsearch (indexes->data, (index_function_t)_everything, NULL, entries);
 
-		for (; entries != NULL; entries = g_list_delete_link (entries, entries)) {
-			entry_t *entry = entries->data;
+		for (i = 0; i < _set_size (entries); i++) {
+			entry_t *entry = _set_get (entries, i);
 
 			_lock_free (entry->lock);
+			_version_free (entry->versions);
 			free (entry->data);
 			free (entry);
 		}
 	}
+
+	_set_free (entries);
 }
 
+/* The items of an entry with one key, data[start] to data[end - 1] */
+typedef struct {
+	int32_t key;
+	int start, end;
+} key_range_t;
+
+/* Entries with at most this many items do not allocate when checked */
+#define CHECK_BUF_SIZE 64
+
+/* An entry that is checked and fetched. The data of the entry is walked
+ * once, the first time it is needed, to find the range of every key.
+ * Filters and fetchspec columns then go straight to their key.
+ */
 typedef struct {
 	s4_t *s4;
 	entry_t *l;
+
+	/* The ranges of the keys, range_count is -1 until they are found */
+	int range_count;
+	key_range_t *ranges;
+	/* The priorities of the items of the last range passed to _range_best_src */
+	int *prios;
+
+	key_range_t range_buf[CHECK_BUF_SIZE];
+	int prio_buf[CHECK_BUF_SIZE];
 } check_data_t;
 
 /**
- * Checks an entry against a condition
+ * Starts checking an entry.
  *
- * @param cond The condition to check
- * @param d The database and entry to check
- * @return 0 if the entry matched, non-zero otherwise
+ * @param data The check data to initialize
+ * @param s4 The database the entry lives in
+ * @param l The entry
  */
-static int _check_cond (s4_condition_t *cond, void *d)
+static void _check_data_init (check_data_t *data, s4_t *s4, entry_t *l)
 {
-	check_data_t *data = d;
-	entry_t *l = data->l;
+	data->s4 = s4;
+	data->l = l;
+	data->range_count = -1;
+	data->ranges = NULL;
+}
+
+/**
+ * Frees what checking an entry allocated.
+ *
+ * @param data The check data to clear
+ */
+static void _check_data_clear (check_data_t *data)
+{
+	if (data->ranges != data->range_buf)
+		free (data->ranges);
+	data->ranges = NULL;
+}
+
+/**
+ * Finds the ranges of the keys of an entry in one walk over its data.
+ *
+ * @param data The check data of the entry
+ */
+static void _find_ranges (check_data_t *data)
+{
+	entry_t *l = data->l;
+	key_range_t *ranges;
+	int i, n = 0;
+
+	if (l->size <= CHECK_BUF_SIZE) {
+		data->ranges = data->range_buf;
+		data->prios = data->prio_buf;
+	} else {
+		data->ranges = malloc (l->size * (sizeof (key_range_t) + sizeof (int)));
+		data->prios = (int*)(data->ranges + l->size);
+	}
+	ranges = data->ranges;
+
+	for (i = 0; i < l->size; i++) {
+		if (n == 0 || ranges[n - 1].key != l->data[i].key) {
+			ranges[n].key = l->data[i].key;
+			ranges[n].start = i;
+			n++;
+		}
+		ranges[n - 1].end = i + 1;
+	}
+
+	data->range_count = n;
+}
+
+/**
+ * Gets the range of a key in an entry.
+ *
+ * @param data The check data of the entry
+ * @param key The id of the key
+ * @return The range, or NULL if the entry does not have the key
+ */
+static key_range_t *_get_range (check_data_t *data, int32_t key)
+{
+	int lo = 0, hi;
+
+	if (data->range_count < 0)
+		_find_ranges (data);
+
+	hi = data->range_count;
+	while (lo < hi) {
+		int m = (hi + lo) / 2;
+
+		if (data->ranges[m].key < key)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+
+	if (lo < data->range_count && data->ranges[lo].key == key)
+		return data->ranges + lo;
+
+	return NULL;
+}
+
+/**
+ * Finds the priority of the best source of a range. The priority of
+ * every item is looked up once and kept in data->prios, so the items
+ * with the best source are those with
+ * data->prios[i - range->start] equal to the returned priority.
+ * They stay there until the next call.
+ *
+ * @param data The check data of the entry
+ * @param range The range
+ * @param sp The sourcepref to use
+ * @return The priority of the best source, INT_MAX if there is none
+ */
+static int _range_best_src (check_data_t *data, key_range_t *range, s4_sourcepref_t *sp)
+{
+	entry_t *l = data->l;
+	int i, src, best_src = INT_MAX;
+
+	for (i = range->start; i < range->end; i++) {
+		src = _sourcepref_get_priority (sp, data->s4, l->data[i].src);
+		data->prios[i - range->start] = src;
+		if (src < best_src)
+			best_src = src;
+	}
+
+	return best_src;
+}
+
+/**
+ * Checks if an item of a range is the first item with the best source
+ * and its value. Sources with the same priority can hold the same
+ * value, it should still only be counted once.
+ *
+ * @param data The check data of the entry, after _range_best_src
+ * @param range The range
+ * @param best_src The priority returned by _range_best_src
+ * @param i The index of the item
+ * @return non-zero if the item is the first, 0 otherwise
+ */
+static int _range_first_val (check_data_t *data, key_range_t *range, int best_src, int i)
+{
+	entry_t *l = data->l;
+	int j;
+
+	if (data->prios[i - range->start] != best_src)
+		return 0;
+
+	for (j = range->start; j < i; j++) {
+		if (data->prios[j - range->start] == best_src &&
+				l->data[j].val == l->data[i].val)
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Checks the values of a key against a filter
+ *
+ * @param cond The filter
+ * @param data The database and entry to check
+ * @param range The range of the key
+ * @return 0 if a value with the best source matched, non-zero otherwise
+ */
+static int _check_range (s4_condition_t *cond, check_data_t *data, key_range_t *range)
+{
+	entry_t *l = data->l;
+	int i, best_src = _range_best_src (data, range, s4_cond_get_sourcepref (cond));
+	int ret = 1;
+
+	for (i = range->start; ret && best_src < INT_MAX && i < range->end; i++) {
+		if (data->prios[i - range->start] == best_src) {
+			ret = s4_cond_get_filter_function (cond)(_const_get (data->s4, l->data[i].val), cond);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Checks an entry against a condition
+ *
+ * @param cond The condition to check
+ * @param d The database and entry to check
+ * @return 0 if the entry matched, non-zero otherwise
+ */
+static int _check_cond (s4_condition_t *cond, void *d)
+{
+	check_data_t *data = d;
+	entry_t *l = data->l;
 	int ret = 1;
 	int i;
 
 	if (s4_cond_is_combiner (cond)) {
 		ret = s4_cond_get_combine_function (cond)(cond, _check_cond, d);
 	} else if (s4_cond_is_filter (cond)) {
-		const char *key = s4_cond_get_key (cond);
-		int null = key == NULL;
+		int32_t key = s4_cond_get_ikey (cond);
 
 		if ((s4_cond_get_flags (cond) & S4_COND_PARENT)) {
-			if (key == l->key || null) {
+			if (s4_cond_get_key (cond) == l->key || key == 0) {
 				ret = s4_cond_get_filter_function (cond)(l->val, cond);
 			}
+		} else if (key == 0) {
+			_get_range (data, 0);
+			for (i = 0; ret && i < data->range_count; i++) {
+				ret = _check_range (cond, data, data->ranges + i);
+			}
 		} else {
-			i = 0;
-			do {
-				s4_sourcepref_t *sp = s4_cond_get_sourcepref (cond);
-				int start, src, best_src = INT_MAX;
-
-				if (null) {
-					key = l->data[i].key;
-				}
-
-				start = _entry_search (l, key);
-
-				for (i = start; i < l->size && l->data[i].key == key; i++) {
-					if ((src = s4_sourcepref_get_priority (sp, l->data[i].src)) < best_src) {
-						best_src = src;
-					}
-				}
-				for (i = start; i < l->size && ret && l->data[i].key == key; i++) {
-					if (best_src < INT_MAX &&
-							s4_sourcepref_get_priority (sp, l->data[i].src) == best_src) {
-						ret = s4_cond_get_filter_function (cond)(l->data[i].val, cond);
-					}
-				}
-			} while (i < l->size && ret && null);
+			key_range_t *range = _get_range (data, key);
+
+			if (range != NULL) {
+				ret = _check_range (cond, data, range);
+			}
 		}
 	}
 
 	return ret;
 }
 
+/**
+ * Adds the values of a key to a result
+ *
+ * @param data The database and entry to fetch from
+ * @param range The range of the key
+ * @param sp The sourcepref to use
+ * @param result The result to add to
+ * @param arena The arena to allocate in, or NULL
+ * @return The new result
+ */
+static s4_result_t *_fetch_range (check_data_t *data, key_range_t *range,
+		s4_sourcepref_t *sp, s4_result_t *result, s4_arena_t *arena)
+{
+	s4_t *s4 = data->s4;
+	entry_t *l = data->l;
+	int i, best_src = _range_best_src (data, range, sp);
+
+	for (i = range->start; best_src < INT_MAX && i < range->end; i++) {
+		if (data->prios[i - range->start] == best_src) {
+			result = s4_result_create (result, _const_get_str (s4, l->data[i].key),
+					_const_get (s4, l->data[i].val), _const_get_str (s4, l->data[i].src),
+					arena);
+		}
+	}
+
+	return result;
+}
+
 /**
  * Fetches values from an entry
  *
- * @param s4 The database the entry lives in
- * @param l The entry to fetch from
+ * @param data The database and entry to fetch from
  * @param fs The fetchspec that tells us what to fetch
+ * @param arena The arena to allocate the row in, or NULL
  * @return An array of results
  */
-static s4_resultrow_t *_fetch (s4_t *s4, entry_t *l, s4_fetchspec_t *fs)
+static s4_resultrow_t *_fetch (check_data_t *data, s4_fetchspec_t *fs, s4_arena_t *arena)
 {
+	entry_t *l = data->l;
 	s4_resultrow_t *row;
-	int k,f;
+	int k, i;
 	int fetch_size = s4_fetchspec_size (fs);
 
-	row = s4_resultrow_create (fetch_size);
+	row = s4_resultrow_create (fetch_size, arena);
 
 	for (k = 0; k < fetch_size; k++) {
-		const char *fkey = s4_fetchspec_get_key (fs, k);
+		int32_t fkey = s4_fetchspec_get_ikey (fs, k);
 		int flags = s4_fetchspec_get_flags (fs, k);
-		int null = fkey == NULL;
 		s4_result_t *result;
 		s4_sourcepref_t *sp = s4_fetchspec_get_sourcepref (fs, k);
 
 		result = NULL;
-		f = 0;
 
-		if ((flags & S4_FETCH_PARENT) && (fkey == l->key || null)) {
-			result = s4_result_create (result, l->key, l->val, NULL);
+		if ((flags & S4_FETCH_PARENT) && (s4_fetchspec_get_key (fs, k) == l->key || fkey == 0)) {
+			result = s4_result_create (result, l->key, l->val, NULL, arena);
 		}
 
-		if (flags & S4_FETCH_DATA) {
-			do {
-				int src, start, best_src = INT_MAX;
-
-				if (null && l->size > 0) {
-					fkey = l->data[f].key;
-				}
-
-				start = _entry_search (l, fkey);
-
-				for (f = start; f < l->size && l->data[f].key == fkey; f++) {
-					if ((src = s4_sourcepref_get_priority (sp, l->data[f].src)) < best_src) {
-						best_src = src;
-					}
-				}
-				for (f = start; f < l->size && l->data[f].key == fkey; f++) {
-					if (best_src < INT_MAX &&
-							s4_sourcepref_get_priority (sp, l->data[f].src) == best_src) {
-						result = s4_result_create (result, l->data[f].key,
-								l->data[f].val, l->data[f].src);
-					}
-				}
-			} while (f < l->size && null);
+		if ((flags & S4_FETCH_DATA) && fkey == 0) {
+			_get_range (data, 0);
+			for (i = 0; i < data->range_count; i++) {
+				result = _fetch_range (data, data->ranges + i, sp, result, arena);
+			}
+		} else if (flags & S4_FETCH_DATA) {
+			key_range_t *range = _get_range (data, fkey);
+
+			if (range != NULL) {
+				result = _fetch_range (data, range, sp, result, arena);
+			}
 		}
 
 		s4_resultrow_set_col (row, k, result);
@@ -504,10 +1228,538 @@ static s4_resultrow_t *_fetch (s4_t *s4, entry_t *l, s4_fetchspec_t *fs)
 	return row;
 }
 
+/* Queries with fewer candidates than this per job are not split up */
+#define QUERY_JOB_MIN 256
+
+typedef struct {
+	GMutex lock;
+	GCond cond;
+	int left;
+} query_wait_t;
+
+/* A part of the candidates of a query */
+typedef struct {
+	s4_t *s4;
+	s4_condition_t *cond;
+	s4_fetchspec_t *fs;
+	s4_set_t *entries;
+	int start, end;
+
+	/* Read the entries as this snapshot sees them */
+	int readonly;
+	guint64 snapshot;
+
+	/* The rows and where they are allocated */
+	s4_resultrow_t **rows;
+	int row_count;
+	s4_arena_t *arena;
+	query_wait_t *wait;
+} query_job_t;
+
+/**
+ * Checks and fetches the candidates of a job. The entries must
+ * already be locked, as this does not touch the transaction.
+ *
+ * @param job The job to run
+ */
+static void _query_run (query_job_t *job)
+{
+	check_data_t data;
+	int i;
+
+	job->rows = malloc (sizeof (s4_resultrow_t*) * MAX (job->end - job->start, 1));
+	job->row_count = 0;
+	job->arena = _arena_new ();
+
+	for (i = job->start; i < job->end; i++) {
+		entry_t *entry = _set_get (job->entries, i), view;
+		GRWLock *stripe = NULL;
+
+		if (job->readonly) {
+			stripe = _entry_stripe (entry);
+			g_rw_lock_reader_lock (stripe);
+			entry = _entry_get_view (entry, job->snapshot, &view);
+		}
+
+		_check_data_init (&data, job->s4, entry);
+		if (entry->size != 0 && !_check_cond (job->cond, &data))
+			job->rows[job->row_count++] = _fetch (&data, job->fs, job->arena);
+		_check_data_clear (&data);
+
+		if (stripe != NULL)
+			g_rw_lock_reader_unlock (stripe);
+	}
+}
+
+/**
+ * Runs a query job in the query thread pool.
+ *
+ * @param job The job to run
+ * @param unused Not used
+ */
+void _s4_query_job (void *job, void *unused)
+{
+	query_job_t *j = job;
+
+	_query_run (j);
+
+	g_mutex_lock (&j->wait->lock);
+	if (--j->wait->left == 0)
+		g_cond_signal (&j->wait->cond);
+	g_mutex_unlock (&j->wait->lock);
+}
+
+/**
+ * Checks the candidates of a query and adds the matching rows
+ * to the resultset. Large queries are split into jobs that run
+ * in the query thread pool. The rows are added in the same order
+ * either way.
+ *
+ * @param trans The transaction the query runs in
+ * @param entries The candidates, already locked
+ * @param cond The condition to check
+ * @param fs The fetchspec to fetch with
+ * @param ret The resultset to add the rows to
+ */
+static void _query_check (s4_transaction_t *trans, s4_set_t *entries,
+		s4_condition_t *cond, s4_fetchspec_t *fs, s4_resultset_t *ret)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	query_wait_t wait;
+	query_job_t *jobs;
+	int i, j, count = _set_size (entries), job_count = 1;
+
+	/* Custom filters and combiners were never required to be
+	 * thread safe, so their queries stay in this thread
+	 */
+	if (s4->query_pool != NULL && !s4_cond_is_custom (cond)) {
+		job_count = CLAMP (count / QUERY_JOB_MIN, 1, s4->options.query_threads * 4);
+	}
+
+	jobs = malloc (sizeof (query_job_t) * job_count);
+	for (i = 0; i < job_count; i++) {
+		jobs[i].s4 = s4;
+		jobs[i].cond = cond;
+		jobs[i].fs = fs;
+		jobs[i].entries = entries;
+		jobs[i].readonly = _transaction_get_flags (trans) & S4_TRANS_READONLY;
+		jobs[i].snapshot = _transaction_get_snapshot (trans);
+		jobs[i].start = (int)((gint64)count * i / job_count);
+		jobs[i].end = (int)((gint64)count * (i + 1) / job_count);
+		jobs[i].wait = &wait;
+	}
+
+	if (job_count > 1) {
+		g_mutex_init (&wait.lock);
+		g_cond_init (&wait.cond);
+		wait.left = job_count - 1;
+
+		for (i = 1; i < job_count; i++)
+			g_thread_pool_push (s4->query_pool, jobs + i, NULL);
+	}
+
+	_query_run (jobs);
+
+	if (job_count > 1) {
+		g_mutex_lock (&wait.lock);
+		while (wait.left > 0)
+			g_cond_wait (&wait.cond, &wait.lock);
+		g_mutex_unlock (&wait.lock);
+
+		g_mutex_clear (&wait.lock);
+		g_cond_clear (&wait.cond);
+	}
+
+	for (i = 0; i < job_count; i++) {
+		for (j = 0; j < jobs[i].row_count; j++)
+			s4_resultset_add_row (ret, jobs[i].rows[j]);
+		free (jobs[i].rows);
+		_arena_unref (jobs[i].arena);
+	}
+	free (jobs);
+}
+
+/**
+ * Orders entries by when they were created, so the rows of a query do
+ * not come out in the order of the addresses of their entries.
+ */
+static int _entry_serial_cmp (const void *a, const void *b)
+{
+	const entry_t *ea = *(entry_t* const*)a;
+	const entry_t *eb = *(entry_t* const*)b;
+
+	return (ea->serial > eb->serial) - (ea->serial < eb->serial);
+}
+
+/**
+ * Finds the candidates of a query and locks them.
+ * Read-only transactions do not lock, their candidates are
+ * read as the snapshot sees them instead.
+ *
+ * @param trans The transaction the query runs in
+ * @param cond The condition to find the candidates of
+ * @return The candidates, in the order they were created, or NULL
+ * if the transaction deadlocked
+ */
+static s4_set_t *_query_candidates (s4_transaction_t *trans, s4_condition_t *cond)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	s4_set_t *entries;
+	int i;
+
+	entries = _plan_query (trans, cond);
+	if (entries == NULL)
+		goto deadlocked;
+
+	if (_transaction_get_flags (trans) & S4_TRANS_READONLY) {
+		/* Read-only transactions do not lock, so entries changed
+		 * after the snapshot may have left the indexes
+		 */
+		_entry_add_versioned (s4, entries);
+	} else {
+		/* Lock everything first, the locks belong to the
+		 * transaction and can only be taken by this thread
+		 */
+		for (i = 0; i < _set_size (entries); i++) {
+			if (!_entry_lock_shared (_set_get (entries, i), trans)) {
+				_set_free (entries);
+				goto deadlocked;
+			}
+		}
+	}
+
+	_set_order (entries, _entry_serial_cmp);
+	return entries;
+
+deadlocked:
+	_transaction_set_deadlocked (trans);
+	return NULL;
+}
+
+/* The aggregate of the entries with one value of the grouping key */
+typedef struct {
+	int32_t id;
+	int32_t count;
+	gint64 sum;
+	int32_t min, max;
+	/* Set if min and max have been set */
+	int ints;
+} group_t;
+
+/**
+ * Adds an integer to the sum, minimum and maximum of a group.
+ *
+ * @param group The group
+ * @param ival The integer
+ */
+static void _group_add_int (group_t *group, int32_t ival)
+{
+	group->sum += ival;
+	if (!group->ints || ival < group->min)
+		group->min = ival;
+	if (!group->ints || ival > group->max)
+		group->max = ival;
+	group->ints = 1;
+}
+
+/**
+ * Adds an entry to a group. Values of the key that are not
+ * integers are only counted.
+ *
+ * @param data The database and entry to add
+ * @param key The interned key, NULL to only count the entry
+ * @param ikey The id of the key
+ * @param sp The sourcepref to use
+ * @param group The group to add to
+ */
+static void _group_add (check_data_t *data, const char *key, int32_t ikey,
+		s4_sourcepref_t *sp, group_t *group)
+{
+	entry_t *l = data->l;
+	key_range_t *range;
+	int32_t ival;
+	int i, best_src;
+
+	group->count++;
+
+	if (key == NULL)
+		return;
+
+	if (key == l->key) {
+		if (s4_val_get_int (l->val, &ival))
+			_group_add_int (group, ival);
+		return;
+	}
+
+	range = _get_range (data, ikey);
+	if (range == NULL)
+		return;
+
+	best_src = _range_best_src (data, range, sp);
+	for (i = range->start; best_src < INT_MAX && i < range->end; i++) {
+		if (_range_first_val (data, range, best_src, i) &&
+				s4_val_get_int (_const_get (data->s4, l->data[i].val), &ival))
+			_group_add_int (group, ival);
+	}
+}
+
+/**
+ * Adds the aggregate of one group to another.
+ *
+ * @param group The group to add to
+ * @param other The group to add
+ */
+static void _group_merge (group_t *group, const group_t *other)
+{
+	group->count += other->count;
+	if (other->ints) {
+		group->sum += other->sum;
+		if (!group->ints || other->min < group->min)
+			group->min = other->min;
+		if (!group->ints || other->max > group->max)
+			group->max = other->max;
+		group->ints = 1;
+	}
+}
+
+/**
+ * Finds the group of a value, creating it if there is none.
+ *
+ * @param groups The groups, in the order they were created
+ * @param index Maps value ids to positions in groups
+ * @param id The id of the value
+ * @return The group, valid until the next group is created
+ */
+static group_t *_group_get (GArray *groups, GHashTable *index, int32_t id)
+{
+	gpointer pos;
+	group_t *group;
+
+	if (g_hash_table_lookup_extended (index, GINT_TO_POINTER (id), NULL, &pos))
+		return &g_array_index (groups, group_t, GPOINTER_TO_INT (pos));
+
+	g_hash_table_insert (index, GINT_TO_POINTER (id), GINT_TO_POINTER (groups->len));
+	g_array_set_size (groups, groups->len + 1);
+	group = &g_array_index (groups, group_t, groups->len - 1);
+	group->id = id;
+
+	return group;
+}
+
+/**
+ * Adds an entry to the groups of its values of the grouping key.
+ * Entries without the grouping key are left out.
+ *
+ * @param data The database and entry to add
+ * @param gkey The interned grouping key
+ * @param igkey The id of the grouping key
+ * @param gsp The sourcepref of the grouping key
+ * @param groups The groups, in the order they were found
+ * @param index Maps value ids to groups
+ * @param key The interned key to aggregate, NULL to only count
+ * @param ikey The id of the key to aggregate
+ * @param sp The sourcepref of the key to aggregate
+ */
+static void _group_entry (check_data_t *data,
+		const char *gkey, int32_t igkey, s4_sourcepref_t *gsp,
+		GArray *groups, GHashTable *index,
+		const char *key, int32_t ikey, s4_sourcepref_t *sp)
+{
+	entry_t *l = data->l;
+	key_range_t *range;
+	group_t entry = {0};
+	int i, best_src;
+
+	/* The entry adds the same to every group it is in */
+	_group_add (data, key, ikey, sp, &entry);
+
+	if (gkey == l->key) {
+		_group_merge (_group_get (groups, index, _val_get_id (l->val)), &entry);
+		return;
+	}
+
+	range = _get_range (data, igkey);
+	if (range == NULL)
+		return;
+
+	best_src = _range_best_src (data, range, gsp);
+	for (i = range->start; best_src < INT_MAX && i < range->end; i++) {
+		if (_range_first_val (data, range, best_src, i))
+			_group_merge (_group_get (groups, index, l->data[i].val), &entry);
+	}
+}
+
 /**
  * @}
  */
 
+/**
+ * Groups the entries matching a condition by the values of a key, and
+ * aggregates every group. Nothing is fetched, the groups are computed
+ * from the entries as they are checked.
+ *
+ * @param trans The transaction this query belongs to.
+ * @param cond The condition to check entries against
+ * @param group_key The key to group by, NULL to put every entry in one group
+ * @param group_sp The sourcepref to pick the values of group_key with
+ * @param type What to compute for every group
+ * @param key The key to aggregate, not used by S4_AGGREGATE_COUNT
+ * @param sp The sourcepref to pick the values of key with
+ * @return A resultset with a row per group, in the order the groups were found
+ */
+s4_resultset_t *_s4_query_group (s4_transaction_t *trans, s4_condition_t *cond,
+		const char *group_key, s4_sourcepref_t *group_sp,
+		s4_aggregate_t type, const char *key, s4_sourcepref_t *sp)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	int readonly = _transaction_get_flags (trans) & S4_TRANS_READONLY;
+	guint64 snapshot = _transaction_get_snapshot (trans);
+	s4_resultset_t *ret = s4_resultset_create (2);
+	GArray *groups = g_array_new (FALSE, TRUE, sizeof (group_t));
+	GHashTable *index = g_hash_table_new (NULL, NULL);
+	s4_arena_t *arena;
+	s4_set_t *entries;
+	int32_t igkey, ikey;
+	int i;
+
+	group_key = _string_lookup (s4, group_key);
+	igkey = _string_id (s4, group_key);
+	key = (type == S4_AGGREGATE_COUNT)?NULL:_string_lookup (s4, key);
+	ikey = _string_id (s4, key);
+
+	/* Without a key to group by there is one group, even if it is empty */
+	if (group_key == NULL)
+		g_array_set_size (groups, 1);
+
+	s4_cond_update_key (cond, s4);
+
+	entries = _query_candidates (trans, cond);
+	if (entries == NULL) {
+		g_array_set_size (groups, 0);
+		entries = _set_new (0);
+	}
+
+	for (i = 0; i < _set_size (entries); i++) {
+		entry_t *entry = _set_get (entries, i), view;
+		GRWLock *stripe = NULL;
+		check_data_t data;
+
+		if (readonly) {
+			stripe = _entry_stripe (entry);
+			g_rw_lock_reader_lock (stripe);
+			entry = _entry_get_view (entry, snapshot, &view);
+		}
+
+		_check_data_init (&data, s4, entry);
+		if (entry->size != 0 && !_check_cond (cond, &data)) {
+			if (group_key == NULL) {
+				_group_add (&data, key, ikey, sp, &g_array_index (groups, group_t, 0));
+			} else {
+				_group_entry (&data, group_key, igkey, group_sp,
+						groups, index, key, ikey, sp);
+			}
+		}
+		_check_data_clear (&data);
+
+		if (stripe != NULL)
+			g_rw_lock_reader_unlock (stripe);
+	}
+	_set_free (entries);
+
+	arena = _arena_new ();
+	for (i = 0; i < groups->len; i++) {
+		group_t *group = &g_array_index (groups, group_t, i);
+		s4_resultrow_t *row = s4_resultrow_create (2, arena);
+		int has_val = 1;
+		int32_t val;
+
+		if (group_key != NULL) {
+			s4_resultrow_set_col (row, 0, s4_result_create (NULL, group_key,
+						_const_get (s4, group->id), NULL, arena));
+		}
+
+		switch (type) {
+		case S4_AGGREGATE_COUNT:
+			val = group->count;
+			break;
+		case S4_AGGREGATE_SUM:
+			val = CLAMP (group->sum, G_MININT32, G_MAXINT32);
+			break;
+		case S4_AGGREGATE_MIN:
+			val = group->min;
+			has_val = group->ints;
+			break;
+		case S4_AGGREGATE_MAX:
+		default:
+			val = group->max;
+			has_val = group->ints;
+			break;
+		}
+
+		if (has_val) {
+			s4_resultrow_set_col (row, 1, s4_result_create (NULL, key,
+						_val_new_int_in (val, arena), NULL, arena));
+		}
+
+		s4_resultset_add_row (ret, row);
+	}
+	_arena_unref (arena);
+
+	g_hash_table_destroy (index);
+	g_array_free (groups, TRUE);
+
+	return ret;
+}
+
+/**
+ * Finds and fetches the entries matching a condition.
+ *
+ * @param trans The transaction the query runs in
+ * @param fs The fetchspec to use when fetching data, with interned keys
+ * @param cond The condition to check entries against, with interned keys
+ * @param examined Set to the number of candidates checked,
+ * or -1 if the transaction deadlocked
+ * @return A resultset with a row for every entry that matched
+ */
+static s4_resultset_t *_query_uncached (s4_transaction_t *trans,
+		s4_fetchspec_t *fs, s4_condition_t *cond, int *examined)
+{
+	s4_resultset_t *ret = s4_resultset_create (s4_fetchspec_size (fs));
+	s4_set_t *entries;
+
+	*examined = -1;
+	entries = _query_candidates (trans, cond);
+	if (entries == NULL)
+		return ret;
+
+	_query_check (trans, entries, cond, fs, ret);
+	*examined = _set_size (entries);
+	_set_free (entries);
+
+	return ret;
+}
+
+/**
+ * Queries the database without the query cache and without
+ * counting the query in the statistics, for checkpoints.
+ *
+ * @param trans The transaction this query belongs to.
+ * @param fs The fetchspec to use when fetching data
+ * @param cond The condition to check entries against
+ * @return A resultset with a row for every entry that matched
+ */
+s4_resultset_t *_s4_query_uncached (s4_transaction_t *trans,
+		s4_fetchspec_t *fs, s4_condition_t *cond)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	int examined;
+
+	s4_cond_update_key (cond, s4);
+	s4_fetchspec_update_key (s4, fs);
+
+	return _query_uncached (trans, fs, cond, &examined);
+}
+
 /**
  * Queries a database for all entries matching a condition,
  * then fetches data from them.
@@ -522,64 +1774,233 @@ s4_resultset_t *_s4_query (
 		s4_fetchspec_t *fs,
 		s4_condition_t *cond)
 {
-	check_data_t data;
+	s4_resultset_t *ret;
+	s4_t *s4 = _transaction_get_db (trans);
+	guint64 snapshot = _transaction_get_snapshot (trans);
+	gint64 start = g_get_monotonic_time ();
+	int examined;
+	int cache = s4->query_cache != NULL &&
+		(_transaction_get_flags (trans) & S4_TRANS_READONLY) &&
+		!s4_cond_is_custom (cond);
+
+	s4_cond_update_key (cond, s4);
+	s4_fetchspec_update_key (s4, fs);
+
+	if (cache && (ret = _query_cache_lookup (s4->query_cache, snapshot, cond, fs)) != NULL) {
+		_stats_count (s4, S4_STAT_QUERY_CACHE_HITS, 1);
+		_stats_time (s4, S4_STAT_QUERY, start);
+		return ret;
+	}
+
+	ret = _query_uncached (trans, fs, cond, &examined);
+	if (examined < 0)
+		return ret;
+
+	_stats_count (s4, S4_STAT_ROWS_EXAMINED, examined);
+	_stats_count (s4, S4_STAT_ROWS_RETURNED, s4_resultset_get_rowcount (ret));
+
+	/* Only results of the newest snapshot are cached, a commit
+	 * stamped since then may already have dropped what it changes
+	 */
+	if (cache) {
+		g_mutex_lock (&s4->entry_data->version_lock);
+		if (s4->entry_data->version == snapshot)
+			_query_cache_insert (s4->query_cache, snapshot, cond, fs, ret);
+		g_mutex_unlock (&s4->entry_data->version_lock);
+	}
+
+	_stats_time (s4, S4_STAT_QUERY, start);
+	return ret;
+}
+
+/**
+ * Fetches data from every entry changed since the last full write,
+ * including entries that are now empty. Read-only transactions
+ * fetch the entries as their snapshot sees them.
+ *
+ * @param trans The transaction this query belongs to.
+ * @param fs The fetchspec to use when fetching data
+ * @return A resultset with a row for every dirty entry
+ */
+s4_resultset_t *_s4_query_dirty (s4_transaction_t *trans, s4_fetchspec_t *fs)
+{
 	GList *entries;
-	s4_index_t *index;
 	s4_resultset_t *ret = s4_resultset_create (s4_fetchspec_size (fs));
 	s4_t *s4 = _transaction_get_db (trans);
+	s4_arena_t *arena = _arena_new ();
+	int readonly = _transaction_get_flags (trans) & S4_TRANS_READONLY;
+	guint64 snapshot = _transaction_get_snapshot (trans);
+	check_data_t data;
 
-	s4_cond_update_key (cond, s4);
 	s4_fetchspec_update_key (s4, fs);
 
-	if (s4_cond_is_filter (cond)
-			&& (s4_cond_get_flags (cond) & S4_COND_PARENT)
-			&& s4_cond_get_key (cond) != NULL) {
-		index = _index_get_a (s4, s4_cond_get_key (cond), 0);
+	g_mutex_lock (&s4->entry_data->dirty_lock);
+	entries = g_hash_table_get_keys (s4->entry_data->dirty);
+	g_mutex_unlock (&s4->entry_data->dirty_lock);
 
-		if (index == NULL) {
-			entries = NULL;
-		} else {
-			if (!_index_lock_shared (index, trans)) goto deadlocked;
-			if (s4_cond_is_monotonic (cond)) {
-				entries = _index_search (index, (index_function_t)s4_cond_get_filter_function (cond), cond);
-			} else {
-				entries = _index_lsearch (index, (index_function_t)s4_cond_get_filter_function (cond), cond);
-			}
-		}
-	} else if (s4_cond_is_filter (cond)
-			&& s4_cond_get_key (cond) != NULL
-			&& (index = _index_get_b (s4, s4_cond_get_key (cond))) != NULL) {
-		if (!_index_lock_shared (index, trans)) goto deadlocked;
-		if (s4_cond_is_monotonic (cond)) {
-			entries = _index_search (index, (index_function_t)s4_cond_get_filter_function (cond), cond);
-		} else {
-			entries = _index_lsearch (index, (index_function_t)s4_cond_get_filter_function (cond), cond);
+	for (; entries != NULL; entries = g_list_delete_link (entries, entries)) {
+		entry_t *entry = entries->data, view;
+		GRWLock *stripe = NULL;
+
+		if (readonly) {
+			stripe = _entry_stripe (entry);
+			g_rw_lock_reader_lock (stripe);
+			entry = _entry_get_view (entry, snapshot, &view);
+		} else if (!_entry_lock_shared (entry, trans)) {
+			_transaction_set_deadlocked (trans);
+			g_list_free (entries);
+			break;
 		}
+		_check_data_init (&data, s4, entry);
+		s4_resultset_add_row (ret, _fetch (&data, fs, arena));
+		_check_data_clear (&data);
+
+		if (stripe != NULL)
+			g_rw_lock_reader_unlock (stripe);
+	}
+
+	_arena_unref (arena);
+	return ret;
+}
+
+struct s4_cursor_St {
+	s4_transaction_t *trans;
+	s4_fetchspec_t *fs;
+	s4_condition_t *cond;
+
+	/* The candidates, NULL if there is nothing to return */
+	s4_set_t *entries;
+	int pos, offset, limit;
+
+	/* The row returned last */
+	s4_resultrow_t *row;
+};
+
+/**
+ * Plans a query, but leaves checking and fetching
+ * the candidates to _cursor_next.
+ *
+ * @param trans The transaction this query belongs to.
+ * @param fs The fetchspec to use when fetching data
+ * @param cond The condition to check entries against
+ * @param offset The number of matching rows to skip
+ * @param limit The largest number of rows to return, negative for no limit
+ * @return A new cursor
+ */
+s4_cursor_t *_s4_query_cursor (s4_transaction_t *trans, s4_fetchspec_t *fs,
+		s4_condition_t *cond, int offset, int limit)
+{
+	s4_cursor_t *cursor = malloc (sizeof (s4_cursor_t));
+	s4_t *s4 = _transaction_get_db (trans);
+
+	cursor->trans = trans;
+	cursor->fs = s4_fetchspec_ref (fs);
+	cursor->cond = s4_cond_ref (cond);
+	cursor->entries = NULL;
+	cursor->pos = 0;
+	cursor->offset = MAX (offset, 0);
+	cursor->limit = limit;
+	cursor->row = NULL;
+
+	if (limit == 0)
+		return cursor;
+
+	s4_cond_update_key (cond, s4);
+	s4_fetchspec_update_key (s4, fs);
+
+	cursor->entries = _plan_query (trans, cond);
+	if (cursor->entries == NULL) {
+		_transaction_set_deadlocked (trans);
 	} else {
-		GList *indices;
-		indices = _index_get_all_a (s4);
+		if (_transaction_get_flags (trans) & S4_TRANS_READONLY)
+			_entry_add_versioned (s4, cursor->entries);
+		_set_order (cursor->entries, _entry_serial_cmp);
+	}
 
-		for (entries = NULL; indices != NULL; indices = g_list_delete_link (indices, indices)) {
-			if (!_index_lock_shared (indices->data, trans)) goto deadlocked;
-			entries = g_list_concat (entries, _index_lsearch (indices->data, (index_function_t)_everything, NULL));
-		}
+	return cursor;
+}
+
+/**
+ * Gets the next row of a cursor.
+ * The candidates are checked until one matches. They are locked as
+ * they are checked, not up front like s4_query does.
+ *
+ * @param cursor The cursor to get the row from
+ * @param row Where to store the row. It is valid until the next call
+ * or until the cursor is freed.
+ * @return non-zero if there was a row, 0 if there are no more rows or
+ * the transaction deadlocked
+ */
+int s4_cursor_next (s4_cursor_t *cursor, const s4_resultrow_t **row)
+{
+	s4_t *s4 = _transaction_get_db (cursor->trans);
+	int readonly = _transaction_get_flags (cursor->trans) & S4_TRANS_READONLY;
+	guint64 snapshot = _transaction_get_snapshot (cursor->trans);
+	check_data_t data;
+
+	if (cursor->row != NULL) {
+		s4_resultrow_unref (cursor->row);
+		cursor->row = NULL;
 	}
 
-	data.s4 = s4;
-	for (; entries != NULL; entries = g_list_delete_link (entries, entries)) {
-		entry_t *entry = entries->data;
-		data.l = entry;
+	if (cursor->entries == NULL)
+		return 0;
+
+	while (cursor->limit != 0 && cursor->pos < _set_size (cursor->entries)) {
+		entry_t *entry = _set_get (cursor->entries, cursor->pos++), view;
+		GRWLock *stripe = NULL;
+		int match;
+
+		if (readonly) {
+			stripe = _entry_stripe (entry);
+			g_rw_lock_reader_lock (stripe);
+			entry = _entry_get_view (entry, snapshot, &view);
+		} else if (!_entry_lock_shared (entry, cursor->trans)) {
+			_transaction_set_deadlocked (cursor->trans);
+			_set_free (cursor->entries);
+			cursor->entries = NULL;
+			return 0;
+		}
+
+		_check_data_init (&data, s4, entry);
+		match = entry->size != 0 && !_check_cond (cursor->cond, &data);
+
+		if (match && cursor->offset > 0) {
+			cursor->offset--;
+		} else if (match) {
+			cursor->row = s4_resultrow_ref (_fetch (&data, cursor->fs, NULL));
+			if (cursor->limit > 0)
+				cursor->limit--;
+		}
+		_check_data_clear (&data);
 
-		if (!_entry_lock_shared (entry, trans)) goto deadlocked;
-		if (entry->size != 0 && !_check_cond (cond, &data))
-			s4_resultset_add_row (ret, _fetch (s4, entry, fs));
+		if (stripe != NULL)
+			g_rw_lock_reader_unlock (stripe);
+
+		if (cursor->row != NULL) {
+			*row = cursor->row;
+			return 1;
+		}
 	}
 
-	return ret;
+	return 0;
+}
 
-deadlocked:
-	_transaction_set_deadlocked (trans);
-	return ret;
+/**
+ * Frees a cursor and the last row it returned.
+ *
+ * @param cursor The cursor to free
+ */
+void s4_cursor_free (s4_cursor_t *cursor)
+{
+	if (cursor->row != NULL)
+		s4_resultrow_unref (cursor->row);
+	if (cursor->entries != NULL)
+		_set_free (cursor->entries);
+
+	s4_fetchspec_unref (cursor->fs);
+	s4_cond_unref (cursor->cond);
+	free (cursor);
 }
 
 /**
@@ -98,12 +98,20 @@ void s4_result_free (s4_result_t *res)
  * @param key The key
  * @param val The value
  * @param src The source
+ * @param arena The arena to allocate the result in, or NULL
+ * to allocate it on its own and free it with s4_result_free
  * @return A new result
  */
 s4_result_t *s4_result_create (s4_result_t *next, const char *key,
-		const s4_val_t *val, const char *src)
+		const s4_val_t *val, const char *src, s4_arena_t *arena)
 {
-	s4_result_t *ret = malloc (sizeof (s4_result_t));
+	s4_result_t *ret;
+
+	if (arena != NULL) {
+		ret = _arena_alloc (arena, sizeof (s4_result_t));
+	} else {
+		ret = malloc (sizeof (s4_result_t));
+	}
 
 	ret->next = next;
 	ret->key = key;
@@ -21,14 +21,20 @@
 struct s4_resultset_St {
 	int col_count;
 	int row_count;
-	int ref_count;
+	gint ref_count;
 
 	GPtrArray *results;
+	/* The arenas the rows are allocated in */
+	GPtrArray *arenas;
 };
 
+/* A row allocated in an arena lives as long as the arena does,
+ * and every resultset holding it has a reference to the arena.
+ */
 struct s4_resultrow_St {
-	int refs;
+	gint refs;
 	int col_count;
+	s4_arena_t *arena;
 	s4_result_t *cols[0];
 };
 
@@ -53,9 +59,6 @@ struct s4_order_St {
 	int size;
 };
 
-#define ORDER_RAND_MIN -1 /* closed bound */
-#define ORDER_RAND_MAX 2 /* open bound */
-
 /**
  * @defgroup ResultSet Result Set
  * @ingroup S4
@@ -84,10 +87,49 @@ s4_resultset_t *s4_resultset_create (int col_count)
 	ret->row_count = 0;
 
 	ret->results = g_ptr_array_new_with_free_func ((GDestroyNotify)s4_resultrow_unref);
+	ret->arenas = g_ptr_array_new_with_free_func ((GDestroyNotify)_arena_unref);
+
+	return ret;
+}
+
+/**
+ * Copies a resultset. The copy shares the rows with the set, but
+ * has its own order, so either can be sorted without changing the
+ * other.
+ *
+ * @param set The set to copy
+ * @return A new resultset with the same rows as set
+ */
+s4_resultset_t *_resultset_copy (const s4_resultset_t *set)
+{
+	s4_resultset_t *ret = s4_resultset_create (set->col_count);
+	int i;
+
+	g_ptr_array_set_size (ret->results, set->results->len);
+	for (i = 0; i < set->results->len; i++) {
+		g_ptr_array_index (ret->results, i) =
+			s4_resultrow_ref (g_ptr_array_index (set->results, i));
+	}
+	for (i = 0; i < set->arenas->len; i++) {
+		g_ptr_array_add (ret->arenas, _arena_ref (g_ptr_array_index (set->arenas, i)));
+	}
+	ret->row_count = set->row_count;
 
 	return ret;
 }
 
+/**
+ * Frees a resultset once the last reference to it is gone.
+ *
+ * @param set The set to free
+ */
+static void _resultset_destroy (s4_resultset_t *set)
+{
+	g_ptr_array_free (set->results, TRUE);
+	g_ptr_array_free (set->arenas, TRUE);
+	free (set);
+}
+
 /**
  * @}
  */
@@ -99,6 +141,18 @@ s4_resultset_t *s4_resultset_create (int col_count)
  */
 void s4_resultset_add_row (s4_resultset_t *set, const s4_resultrow_t *row)
 {
+	int i;
+
+	if (row->arena != NULL) {
+		/* Rows mostly come from the arena added last */
+		for (i = set->arenas->len - 1; i >= 0; i--) {
+			if (g_ptr_array_index (set->arenas, i) == row->arena)
+				break;
+		}
+		if (i < 0)
+			g_ptr_array_add (set->arenas, _arena_ref (row->arena));
+	}
+
 	s4_resultrow_ref ((s4_resultrow_t*)row);
 	g_ptr_array_add (set->results, (void*)row);
 	set->row_count++;
@@ -158,30 +212,66 @@ int s4_resultset_get_rowcount (const s4_resultset_t *set)
 	return set->row_count;
 }
 
-static int _compare_rows (const s4_resultrow_t **row1, const s4_resultrow_t **row2, s4_order_t *order)
+/* What a row is ordered by, one for every entry in the order */
+typedef union {
+	const s4_val_t *val;
+	guint32 rand;
+} sort_col_t;
+
+/* A row and its sort columns. The index is the position the row
+ * was added in, so rows that compare equal keep their order.
+ */
+typedef struct {
+	s4_resultrow_t *row;
+	int index;
+	sort_col_t *cols;
+} sort_key_t;
+
+/**
+ * Finds the values a row is ordered by, so comparing two rows
+ * does not have to look through the columns every time.
+ *
+ * @param key The key to fill in, key->cols must have room for order->size columns
+ * @param row The row
+ * @param index The position of the row
+ * @param order The order
+ */
+static void _sort_key_init (sort_key_t *key, s4_resultrow_t *row, int index, s4_order_t *order)
 {
-	int i, j, ret = 0;
-	for (i = 0; !ret && i < order->size; i++) {
+	int i, j;
+
+	key->row = row;
+	key->index = index;
+
+	for (i = 0; i < order->size; i++) {
 		s4_order_entry_t *entry = &order->columns[i];
-		if (entry->type == ORDER_TYPE_COLUMN) {
-			const s4_val_t *val1 = NULL;
-			const s4_val_t *val2 = NULL;
-
-			for (j = 0; j < entry->size; j++) {
-				int col = entry->columns[j];
-				if ((*row1)->cols[col] != NULL) {
-					val1 = s4_result_get_val ((*row1)->cols[col]);
-					break;
-				}
-			}
 
-			for (j = 0; j < entry->size; j++) {
-				int col = entry->columns[j];
-				if ((*row2)->cols[col] != NULL) {
-					val2 = s4_result_get_val ((*row2)->cols[col]);
-					break;
-				}
+		if (entry->type == ORDER_TYPE_RANDOM) {
+			key->cols[i].rand = g_rand_int (entry->random);
+			continue;
+		}
+
+		key->cols[i].val = NULL;
+		for (j = 0; j < entry->size; j++) {
+			int col = entry->columns[j];
+			if (col >= 0 && col < row->col_count && row->cols[col] != NULL) {
+				key->cols[i].val = s4_result_get_val (row->cols[col]);
+				break;
 			}
+		}
+	}
+}
+
+static int _compare_keys (const sort_key_t *key1, const sort_key_t *key2, s4_order_t *order)
+{
+	int i, ret = 0;
+
+	for (i = 0; !ret && i < order->size; i++) {
+		s4_order_entry_t *entry = &order->columns[i];
+
+		if (entry->type == ORDER_TYPE_COLUMN) {
+			const s4_val_t *val1 = key1->cols[i].val;
+			const s4_val_t *val2 = key2->cols[i].val;
 
 			if (val1 == NULL || val2 == NULL) {
 				if (val1 == NULL)
@@ -195,11 +285,11 @@ static int _compare_rows (const s4_resultrow_t **row1, const s4_resultrow_t **ro
 			if (entry->direction == S4_ORDER_DESCENDING)
 				ret = -ret;
 		} else {
-			ret = g_rand_int_range (entry->random, ORDER_RAND_MIN, ORDER_RAND_MAX);
+			ret = (key1->cols[i].rand > key2->cols[i].rand) - (key1->cols[i].rand < key2->cols[i].rand);
 		}
 	}
 
-	return (ret == 0) ? (row1 - row2) : ret;
+	return (ret == 0) ? (key1->index - key2->index) : ret;
 }
 
 /**
@@ -209,11 +299,214 @@ static int _compare_rows (const s4_resultrow_t **row1, const s4_resultrow_t **ro
  */
 void s4_resultset_sort (s4_resultset_t *set, s4_order_t *order)
 {
-	if (order->size > 0) {
-		g_ptr_array_sort_with_data (set->results, (GCompareDataFunc)_compare_rows, (void*)order);
+	sort_key_t *keys;
+	sort_col_t *cols;
+	int i;
+
+	if (order->size == 0 || set->row_count == 0)
+		return;
+
+	keys = malloc (sizeof (sort_key_t) * set->row_count);
+	cols = malloc (sizeof (sort_col_t) * set->row_count * order->size);
+
+	for (i = 0; i < set->row_count; i++) {
+		keys[i].cols = cols + i * order->size;
+		_sort_key_init (keys + i, g_ptr_array_index (set->results, i), i, order);
+	}
+
+	g_qsort_with_data (keys, set->row_count, sizeof (sort_key_t),
+			(GCompareDataFunc)_compare_keys, order);
+
+	for (i = 0; i < set->row_count; i++) {
+		g_ptr_array_index (set->results, i) = keys[i].row;
+	}
+
+	free (keys);
+	free (cols);
+}
+
+/**
+ * @{
+ * @internal
+ */
+
+/* The first rows in an order. The rows are kept in a heap with the
+ * last of them on top, so a new row only has to be compared with it
+ * to see if it should be kept. The heap grows as rows are added, up
+ * to limit rows.
+ */
+struct s4_topk_St {
+	s4_order_t *order;
+	int limit, count, added;
+
+	/* alloc keys, the last is used for the row being added */
+	sort_key_t *heap;
+	int alloc;
+};
+
+/* The number of rows a top-k has room for at first */
+#define TOPK_INITIAL 64
+
+/**
+ * Makes room for more keys in a top-k heap.
+ *
+ * @param topk The top-k
+ * @param alloc The new number of keys
+ */
+static void _topk_resize (s4_topk_t *topk, int alloc)
+{
+	int i;
+
+	topk->heap = realloc (topk->heap, sizeof (sort_key_t) * alloc);
+	for (i = topk->alloc; i < alloc; i++) {
+		topk->heap[i].cols = malloc (sizeof (sort_col_t) * MAX (topk->order->size, 1));
+	}
+	topk->alloc = alloc;
+}
+
+/**
+ * Creates a new top-k.
+ *
+ * @param order The order of the rows
+ * @param limit The number of rows to keep, negative to keep every row
+ * @return A new top-k
+ */
+s4_topk_t *_topk_new (s4_order_t *order, int limit)
+{
+	s4_topk_t *topk = malloc (sizeof (s4_topk_t));
+
+	topk->order = order;
+	topk->limit = (limit < 0)?G_MAXINT - 1:limit;
+	topk->count = 0;
+	topk->added = 0;
+	topk->heap = NULL;
+	topk->alloc = 0;
+	_topk_resize (topk, MIN (topk->limit, TOPK_INITIAL) + 1);
+
+	return topk;
+}
+
+static void _topk_swap (s4_topk_t *topk, int a, int b)
+{
+	sort_key_t tmp = topk->heap[a];
+	topk->heap[a] = topk->heap[b];
+	topk->heap[b] = tmp;
+}
+
+static void _topk_sift_up (s4_topk_t *topk, int i)
+{
+	while (i > 0 && _compare_keys (topk->heap + (i - 1) / 2, topk->heap + i, topk->order) < 0) {
+		_topk_swap (topk, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void _topk_sift_down (s4_topk_t *topk, int i)
+{
+	int child;
+
+	while ((child = 2 * i + 1) < topk->count) {
+		if (child + 1 < topk->count
+				&& _compare_keys (topk->heap + child, topk->heap + child + 1, topk->order) < 0)
+			child++;
+		if (_compare_keys (topk->heap + i, topk->heap + child, topk->order) >= 0)
+			break;
+
+		_topk_swap (topk, i, child);
+		i = child;
+	}
+}
+
+/**
+ * Offers a row to a top-k. The row is referenced if it is kept,
+ * and rows pushed out by it are unreferenced.
+ *
+ * @param topk The top-k
+ * @param row The row
+ */
+void _topk_add (s4_topk_t *topk, const s4_resultrow_t *row)
+{
+	sort_key_t *key;
+	int spare;
+
+	if (topk->limit == 0)
+		return;
+
+	if (topk->count == topk->alloc - 1 && topk->count < topk->limit) {
+		_topk_resize (topk, MIN ((gint64)topk->count * 2, topk->limit) + 1);
+	}
+
+	/* Build the key in the spare slot at the end */
+	spare = topk->alloc - 1;
+	_topk_swap (topk, topk->count, spare);
+	key = topk->heap + topk->count;
+	_sort_key_init (key, (s4_resultrow_t*)row, topk->added++, topk->order);
+
+	if (topk->count < topk->limit) {
+		s4_resultrow_ref (key->row);
+		_topk_sift_up (topk, topk->count++);
+	} else if (_compare_keys (key, topk->heap, topk->order) < 0) {
+		s4_resultrow_ref (key->row);
+		s4_resultrow_unref (topk->heap[0].row);
+		_topk_swap (topk, 0, spare);
+		_topk_sift_down (topk, 0);
 	}
 }
 
+/**
+ * Adds the rows of a top-k to a resultset in order, and frees the top-k.
+ *
+ * @param topk The top-k
+ * @param set The resultset to add to
+ * @param offset The number of rows to skip
+ */
+void _topk_finish (s4_topk_t *topk, s4_resultset_t *set, int offset)
+{
+	int i;
+
+	g_qsort_with_data (topk->heap, topk->count, sizeof (sort_key_t),
+			(GCompareDataFunc)_compare_keys, topk->order);
+
+	for (i = 0; i < topk->count; i++) {
+		if (i >= offset)
+			s4_resultset_add_row (set, topk->heap[i].row);
+		s4_resultrow_unref (topk->heap[i].row);
+	}
+
+	for (i = 0; i < topk->alloc; i++) {
+		free (topk->heap[i].cols);
+	}
+	free (topk->heap);
+	free (topk);
+}
+
+/**
+ * @}
+ */
+
+/**
+ * Sorts a resultset and throws away everything but the first rows.
+ * Only the rows that are kept are sorted, so this takes
+ * O(n log limit) instead of the O(n log n) of s4_resultset_sort.
+ *
+ * @param set The set to sort
+ * @param order The columns to order the result by
+ * @param limit The number of rows to keep, negative to keep every row
+ */
+void s4_resultset_sort_limit (s4_resultset_t *set, s4_order_t *order, int limit)
+{
+	s4_topk_t *topk = _topk_new (order, limit);
+	int i;
+
+	for (i = 0; i < set->row_count; i++) {
+		_topk_add (topk, g_ptr_array_index (set->results, i));
+	}
+
+	g_ptr_array_set_size (set->results, 0);
+	set->row_count = 0;
+	_topk_finish (topk, set, 0);
+}
+
 /**
  * Shuffles the resultset into a pseudo-random order
  * @param set The resultset to shuffle
@@ -224,49 +517,72 @@ void s4_resultset_shuffle (s4_resultset_t *set)
 }
 
 /**
- * Frees a resultset and all the results in it
+ * Drops a reference to a resultset, freeing it and all the results
+ * in it if it was the last one. This is the same as s4_resultset_unref,
+ * so a set that was given to s4_resultset_ref is not freed until that
+ * reference is dropped too.
  * @param set The set to free
  */
 void s4_resultset_free (s4_resultset_t *set)
 {
-	g_ptr_array_free (set->results, TRUE);
-	free (set);
+	s4_resultset_unref (set);
 }
 
+/**
+ * References a resultset. Resultsets can be referenced and
+ * unreferenced from any thread.
+ *
+ * @param set The set to reference
+ * @return The set given
+ */
 s4_resultset_t *s4_resultset_ref (s4_resultset_t *set)
 {
 	if (set != NULL)
-		set->ref_count++;
+		g_atomic_int_inc (&set->ref_count);
 	return set;
-
 }
+
+/**
+ * Unreferences a resultset. If the refcount hits 0 the set is freed.
+ *
+ * @param set The set to unreference
+ */
 void s4_resultset_unref (s4_resultset_t *set)
 {
-	if (set->ref_count <= 0) {
+	if (g_atomic_int_get (&set->ref_count) <= 0) {
 		S4_ERROR ("s4_resultset_unref: ref_count <= 0");
 		return;
 	}
-	set->ref_count--;
-	if (set->ref_count == 0)
-		s4_resultset_free (set);
+	if (g_atomic_int_dec_and_test (&set->ref_count))
+		_resultset_destroy (set);
 }
 
 /**
  * Creates a new row
  * @param col_count The number of columns in the row
+ * @param arena The arena to allocate the row in. The results of the row
+ * must be allocated in it too. If NULL the row and its results are
+ * freed when the last reference to the row is dropped.
  * @return A new resultrow
  */
-s4_resultrow_t *s4_resultrow_create (int col_count)
+s4_resultrow_t *s4_resultrow_create (int col_count, s4_arena_t *arena)
 {
 	int i;
-	s4_resultrow_t *row = malloc (sizeof (s4_resultrow_t)
-			+ sizeof (s4_result_t*) * col_count);
+	size_t size = sizeof (s4_resultrow_t) + sizeof (s4_result_t*) * col_count;
+	s4_resultrow_t *row;
+
+	if (arena != NULL) {
+		row = _arena_alloc (arena, size);
+	} else {
+		row = malloc (size);
+	}
 
 	for (i = 0; i < col_count; i++) {
 		row->cols[i] = NULL;
 	}
 	row->refs = 0;
 	row->col_count = col_count;
+	row->arena = arena;
 
 	return row;
 }
@@ -302,13 +618,14 @@ int s4_resultrow_get_col (const s4_resultrow_t *row, int col_no, const s4_result
 }
 
 /**
- * References a resultrow
+ * References a resultrow. Rows can be shared by resultsets in
+ * different threads, so this is atomic.
  * @param row The row to reference
  */
 s4_resultrow_t *s4_resultrow_ref (s4_resultrow_t *row)
 {
 	if (row != NULL)
-		row->refs++;
+		g_atomic_int_inc (&row->refs);
 	return row;
 }
 
@@ -318,13 +635,12 @@ s4_resultrow_t *s4_resultrow_ref (s4_resultrow_t *row)
  */
 void s4_resultrow_unref (s4_resultrow_t *row)
 {
-	if (row->refs <= 0) {
+	if (g_atomic_int_get (&row->refs) <= 0) {
 		S4_ERROR ("s4_resultrow_unref: ref_count <= 0");
 		return;
 	}
-	row->refs--;
 
-	if (row->refs <= 0) {
+	if (g_atomic_int_dec_and_test (&row->refs) && row->arena == NULL) {
 		int i;
 		for (i = 0; i < row->col_count; i++) {
 			if (row->cols[i] != NULL) {
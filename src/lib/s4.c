@@ -19,6 +19,14 @@
 #include <stdlib.h>
 #include <glib/gstdio.h>
 #include <errno.h>
+#include <locale.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 static GPrivate _errno = G_PRIVATE_INIT (g_free);
 
@@ -31,16 +39,89 @@ static GPrivate _errno = G_PRIVATE_INIT (g_free);
  */
 
 #define S4_MAGIC ("s4db")
+#define S4_DELTA_MAGIC ("s4dl")
+#define S4_KEYS_MAGIC ("s4sk")
 #define S4_MAGIC_LEN (4)
-#define S4_VERSION 1
+#define S4_VERSION 2
+/* Version 2 with the strings front-coded, see s4_options_set_compact_strings */
+#define S4_VERSION_FRONT_CODED 3
 
 typedef struct {
 	char magic[S4_MAGIC_LEN];
 	int32_t version;
 	unsigned char uuid[16];
 	log_number_t last_checkpoint;
+	int32_t string_count;
+	int32_t entry_count;
+	/* The last_checkpoint of the full file an incremental file
+	 * applies to. Unused in full files.
+	 */
+	log_number_t base_checkpoint;
 } s4_header_t;
 
+/* Files written by version 1 only have the first four fields
+ * of the header.
+ */
+#define S4_V1_HEADER_SIZE ((size_t)&((s4_header_t*)0)->string_count)
+
+/* In a version 2 file the header is followed by string_count strings.
+ * Every string is stored as an int32_t length followed by the string
+ * and a terminating '\0', padded to a multiple of four bytes. The
+ * strings are given ids starting at 1 in the order they appear.
+ *
+ * Version 3 files are laid out the same way, but the strings are
+ * sorted and front-coded. Every string is stored as the number of
+ * leading bytes it shares with the string before it, the number of
+ * bytes that follow, and those bytes, with the numbers stored 7 bits
+ * to a byte with the high bit set on every byte but the last. The
+ * strings are padded to a multiple of four bytes as a whole.
+ *
+ * After the strings comes entry_count entries. Every entry is an
+ * s4_file_entry_t followed by count s4_file_pair_t. A negative key
+ * means the value is an integer, otherwise the value is a string id.
+ * Entries with the same key are stored next to each other sorted
+ * the same way the index sorts them, and the pairs in an entry are
+ * sorted by key id. Opening a file still interns every string and
+ * adds every pair, but when the strings are new to the database
+ * their ids follow the file order, so the pairs are appended to
+ * their entries without moving anything around.
+ * The b-indexes of a full file are built in one go after the
+ * entries are read.
+ *
+ * If the database computes sort keys up front (s4_options_set_sort_keys)
+ * the entries are followed by an s4_file_keys_t and count s4_file_key_t,
+ * giving the collated and casefolded strings of the string values.
+ * Readers that don't know about them stop after the entries.
+ *
+ * Incremental checkpoints (S4_INCREMENTAL) are written to a separate
+ * delta file using the same layout, but with S4_DELTA_MAGIC. It holds
+ * every entry changed since the last full write, and an entry in it
+ * replaces the entire entry found in the full file.
+ */
+typedef struct {
+	int32_t key, val;
+	int32_t count;
+} s4_file_entry_t;
+
+typedef struct {
+	int32_t key, val;
+	int32_t src;
+} s4_file_pair_t;
+
+typedef struct {
+	char magic[S4_MAGIC_LEN];
+	int32_t count;
+	/* The string id of the LC_COLLATE locale the keys were collated in */
+	int32_t locale;
+} s4_file_keys_t;
+
+typedef struct {
+	int32_t str;
+	int32_t collated, casefolded;
+} s4_file_key_t;
+
+#define STRING_SIZE(len) ((sizeof (int32_t) + (len) + 1 + 3) & ~3)
+
 /**
  * @{
  * @internal
@@ -95,6 +176,7 @@ static GHashTable *_read_string (s4_t *s4, FILE *file)
  */
 static int _read_relations (s4_t *s4, FILE *file, GHashTable *strings)
 {
+	s4_load_t *load = _s4_load_begin (s4);
 	s4_intpair_t rec;
 
 	while (fread (&rec, sizeof (s4_intpair_t), 1, file) == 1) {
@@ -118,27 +200,488 @@ static int _read_relations (s4_t *s4, FILE *file, GHashTable *strings)
 			val_b = _int_lookup_val (s4, rec.val_b);
 		}
 
-		_s4_add_internal (s4, key_a, val_a, key_b, val_b, src);
+		_s4_load_add (load, key_a, val_a, key_b, val_b, src);
+	}
+
+	_s4_load_finish (load);
+	return 0;
+}
+
+/**
+ * Reads the body of a version 1 file.
+ *
+ * @param s4 The database to read into
+ * @param filename The file to read
+ * @return 0 on success, non-zero on error
+ */
+static int _read_v1 (s4_t *s4, const char *filename)
+{
+	FILE *file = fopen (filename, "r");
+	GHashTable *strings;
+	int ret = 0;
+
+	if (file == NULL || fseek (file, S4_V1_HEADER_SIZE, SEEK_SET)) {
+		if (file != NULL)
+			fclose (file);
+		return -1;
+	}
+
+	strings = _read_string (s4, file);
+	if (strings == NULL || _read_relations (s4, file, strings) == -1) {
+		ret = -1;
+	}
+	if (strings != NULL)
+		g_hash_table_destroy (strings);
+
+	fclose (file);
+	return ret;
+}
+
+/**
+ * Looks up the value a file id refers to
+ *
+ * @param s4 The database
+ * @param vals The values of the strings in the file
+ * @param count The number of strings in the file
+ * @param key The key id, negative if the value is an int
+ * @param val The value, an int or a string id
+ * @return The value, or NULL if the id is out of range
+ */
+static const s4_val_t *_get_file_val (s4_t *s4, const s4_val_t **vals,
+		int32_t count, int32_t key, int32_t val)
+{
+	if (key < 0) {
+		return _int_lookup_val (s4, val);
+	} else if (val <= 0 || val > count) {
+		return NULL;
+	}
+
+	return vals[val];
+}
+
+/**
+ * Looks up the string a file id refers to
+ *
+ * @param strs The strings in the file
+ * @param count The number of strings in the file
+ * @param id The id of the string, the sign is ignored
+ * @return The string, or NULL if the id is out of range
+ */
+static const char *_get_file_str (const char **strs, int32_t count, int32_t id)
+{
+	id = ABS (id);
+	if (id <= 0 || id > count) {
+		return NULL;
+	}
+
+	return strs[id];
+}
+
+/**
+ * Gets the name of the locale strings are collated in.
+ *
+ * @return The name of the locale
+ */
+static const char *_collate_locale (void)
+{
+	const char *ret = setlocale (LC_COLLATE, NULL);
+
+	return (ret == NULL)?"C":ret;
+}
+
+/**
+ * Reads the sort keys stored after the entries.
+ * Collated keys are thrown away if they were collated
+ * in a different locale than the current one.
+ *
+ * @param data The sort keys
+ * @param size The size of data
+ * @param vals The values of the strings in the file
+ * @param strs The strings in the file
+ * @param count The number of strings in the file
+ * @return 0 on success, non-zero on error
+ */
+static int _read_sort_keys (const char *data, size_t size,
+		const s4_val_t **vals, const char **strs, int32_t count)
+{
+	const s4_file_keys_t *hdr = (const s4_file_keys_t*)data;
+	const s4_file_key_t *keys = (const s4_file_key_t*)(data + sizeof (s4_file_keys_t));
+	const char *locale, *collated, *casefolded;
+	int32_t i;
+	int same_locale;
+
+	size -= sizeof (s4_file_keys_t);
+	if (hdr->count < 0 || size / sizeof (s4_file_key_t) < hdr->count)
+		return -1;
+
+	locale = _get_file_str (strs, count, hdr->locale);
+	if (locale == NULL)
+		return -1;
+	same_locale = !strcmp (locale, _collate_locale ());
+
+	for (i = 0; i < hdr->count; i++) {
+		collated = _get_file_str (strs, count, keys[i].collated);
+		casefolded = _get_file_str (strs, count, keys[i].casefolded);
+		if (keys[i].str <= 0 || keys[i].str > count || collated == NULL || casefolded == NULL)
+			return -1;
+
+		_val_set_sort_keys (vals[keys[i].str], same_locale?collated:NULL, casefolded);
+	}
+
+	return 0;
+}
+
+/**
+ * Reads the strings of a version 2 file.
+ * The strings are used straight from the mapped file without copying,
+ * unless copy is set.
+ *
+ * @param s4 The database to add the strings to
+ * @param data The contents of the file
+ * @param size The size of the file
+ * @param pos The position of the strings, moved past them
+ * @param count The number of strings
+ * @param vals Filled with the values of the strings, starting at 1
+ * @param copy Non-zero to copy the strings, so the file is not kept mapped
+ * @return 0 on success, non-zero on error
+ */
+static int _read_plain_strings (s4_t *s4, const char *data, size_t size,
+		size_t *pos, int32_t count, const s4_val_t **vals, int copy)
+{
+	int32_t i, len;
+
+	for (i = 1; i <= count; i++) {
+		if (size - *pos < sizeof (int32_t))
+			return -1;
+
+		len = *(const int32_t*)(data + *pos);
+		if (len < 0 || size - *pos < STRING_SIZE (len)
+				|| data[*pos + sizeof (int32_t) + len] != '\0')
+			return -1;
+
+		if (copy)
+			vals[i] = _string_lookup_val (s4, data + *pos + sizeof (int32_t));
+		else
+			vals[i] = _string_lookup_static_val (s4, data + *pos + sizeof (int32_t));
+		*pos += STRING_SIZE (len);
 	}
 
 	return 0;
 }
 
+/**
+ * Reads a number stored 7 bits to a byte.
+ *
+ * @param data The contents of the file
+ * @param size The size of the file
+ * @param pos The position of the number, moved past it
+ * @param ret Set to the number
+ * @return 0 on success, non-zero on error
+ */
+static int _read_varint (const char *data, size_t size, size_t *pos, uint32_t *ret)
+{
+	int shift;
+
+	*ret = 0;
+	for (shift = 0; shift < 32 && *pos < size; shift += 7) {
+		unsigned char c = data[(*pos)++];
+
+		*ret |= (uint32_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Reads the front-coded strings of a version 3 file.
+ * Every string has to be put together, so they are copied.
+ *
+ * @param s4 The database to add the strings to
+ * @param data The contents of the file
+ * @param size The size of the file
+ * @param pos The position of the strings, moved past them
+ * @param count The number of strings
+ * @param vals Filled with the values of the strings, starting at 1
+ * @return 0 on success, non-zero on error
+ */
+static int _read_front_coded_strings (s4_t *s4, const char *data, size_t size,
+		size_t *pos, int32_t count, const s4_val_t **vals)
+{
+	GString *buf = g_string_sized_new (64);
+	uint32_t prefix, len;
+	int32_t i;
+	int ret = -1;
+
+	for (i = 1; i <= count; i++) {
+		if (_read_varint (data, size, pos, &prefix)
+				|| _read_varint (data, size, pos, &len)
+				|| prefix > buf->len || len > size - *pos
+				|| memchr (data + *pos, '\0', len) != NULL)
+			goto cleanup;
+
+		g_string_truncate (buf, prefix);
+		g_string_append_len (buf, data + *pos, len);
+		*pos += len;
+
+		vals[i] = _string_lookup_val (s4, buf->str);
+	}
+
+	*pos = (*pos + 3) & ~3;
+	ret = (*pos > size);
+
+cleanup:
+	g_string_free (buf, TRUE);
+	return ret;
+}
+
+/* A pair of an entry read from file, and the in-memory id of its key */
+typedef struct {
+	int32_t key;
+	int32_t pair;
+} pair_order_t;
+
+static gint _compare_pair_order (gconstpointer a, gconstpointer b)
+{
+	const pair_order_t *order_a = a, *order_b = b;
+
+	if (order_a->key != order_b->key)
+		return (order_a->key < order_b->key)?-1:1;
+	return order_a->pair - order_b->pair;
+}
+
+/**
+ * Reads the body of a version 2 or 3 file.
+ * Unless copy is set, the strings of a version 2 file are used
+ * straight from the mapped file without copying, so the mapping
+ * has to be kept around until the database is closed.
+ *
+ * @param s4 The database to read into
+ * @param data The contents of the file
+ * @param size The size of the file
+ * @param delta Non-zero if this is an incremental file
+ * @param copy Non-zero to copy the strings, see _read_file
+ * @return 0 on success, non-zero on error
+ */
+static int _read_v2 (s4_t *s4, const char *data, size_t size, int delta, int copy)
+{
+	const s4_header_t *hdr = (const s4_header_t*)data;
+	const s4_val_t **vals;
+	const char **strs;
+	s4_load_t *load = NULL;
+	GArray *order = NULL;
+	size_t pos = sizeof (s4_header_t), keys_pos;
+	int front_coded = (hdr->version == S4_VERSION_FRONT_CODED);
+	/* The smallest a string can take up */
+	size_t min_string = front_coded?2:STRING_SIZE (0);
+	int32_t i, j;
+	int ret = -1, sorted;
+
+	if (size < sizeof (s4_header_t) || hdr->string_count < 0 || hdr->entry_count < 0
+			|| hdr->string_count > (size - pos) / min_string) {
+		return -1;
+	}
+
+	vals = malloc (sizeof (s4_val_t*) * (hdr->string_count + 1));
+	strs = malloc (sizeof (char*) * (hdr->string_count + 1));
+
+	if (front_coded) {
+		if (_read_front_coded_strings (s4, data, size, &pos, hdr->string_count, vals))
+			goto cleanup;
+	} else if (_read_plain_strings (s4, data, size, &pos, hdr->string_count, vals, copy)) {
+		goto cleanup;
+	}
+
+	for (i = 1; i <= hdr->string_count; i++) {
+		s4_val_get_str (vals[i], strs + i);
+	}
+
+	/* The sort keys are stored after the entries, but have to be
+	 * known before the entries are added so they are not computed
+	 */
+	for (i = 0, keys_pos = pos; i < hdr->entry_count; i++) {
+		const s4_file_entry_t *entry = (const s4_file_entry_t*)(data + keys_pos);
+
+		if (size - keys_pos < sizeof (s4_file_entry_t))
+			goto cleanup;
+		keys_pos += sizeof (s4_file_entry_t);
+
+		if (entry->count < 0 || (size - keys_pos) / sizeof (s4_file_pair_t) < entry->count)
+			goto cleanup;
+		keys_pos += sizeof (s4_file_pair_t) * entry->count;
+	}
+
+	if (size - keys_pos >= sizeof (s4_file_keys_t)
+			&& !strncmp (S4_KEYS_MAGIC, data + keys_pos, S4_MAGIC_LEN)
+			&& _read_sort_keys (data + keys_pos, size - keys_pos, vals, strs, hdr->string_count))
+		goto cleanup;
+
+	/* A full file is read into an empty database, so its b-indexes
+	 * can be built at once. Incremental files change entries that
+	 * are already indexed.
+	 */
+	if (!delta)
+		load = _s4_load_begin (s4);
+
+	order = g_array_new (FALSE, FALSE, sizeof (pair_order_t));
+
+	for (i = 0; i < hdr->entry_count; i++) {
+		const s4_file_entry_t *entry = (const s4_file_entry_t*)(data + pos);
+		const s4_file_pair_t *pairs;
+		const s4_val_t *val_a;
+		const char *key_a;
+
+		if (size - pos < sizeof (s4_file_entry_t))
+			goto cleanup;
+		pos += sizeof (s4_file_entry_t);
+
+		if (entry->count < 0 || (size - pos) / sizeof (s4_file_pair_t) < entry->count)
+			goto cleanup;
+		pairs = (const s4_file_pair_t*)(data + pos);
+		pos += sizeof (s4_file_pair_t) * entry->count;
+
+		key_a = _get_file_str (strs, hdr->string_count, entry->key);
+		val_a = _get_file_val (s4, vals, hdr->string_count, entry->key, entry->val);
+		if (key_a == NULL || val_a == NULL)
+			goto cleanup;
+
+		if (delta) {
+			_s4_clear_internal (s4, key_a, val_a);
+		}
+
+		/* The pairs are sorted by their key ids in the file, but the
+		 * entries are sorted by in-memory ids. They are the same unless
+		 * some strings were already known, so only sort when needed.
+		 */
+		g_array_set_size (order, 0);
+		for (j = 0, sorted = 1; j < entry->count; j++) {
+			pair_order_t o;
+
+			if (_get_file_str (strs, hdr->string_count, pairs[j].key) == NULL)
+				goto cleanup;
+
+			o.key = _val_get_id (vals[ABS (pairs[j].key)]);
+			o.pair = j;
+			if (j > 0 && o.key < g_array_index (order, pair_order_t, j - 1).key)
+				sorted = 0;
+			g_array_append_val (order, o);
+		}
+
+		if (!sorted)
+			g_array_sort (order, _compare_pair_order);
+
+		for (j = 0; j < entry->count; j++) {
+			const s4_file_pair_t *pair = pairs + g_array_index (order, pair_order_t, j).pair;
+			const char *key_b, *src;
+			const s4_val_t *val_b;
+
+			key_b = _get_file_str (strs, hdr->string_count, pair->key);
+			src = _get_file_str (strs, hdr->string_count, pair->src);
+			val_b = _get_file_val (s4, vals, hdr->string_count, pair->key, pair->val);
+			if (key_b == NULL || src == NULL || val_b == NULL)
+				goto cleanup;
+
+			if (load != NULL) {
+				_s4_load_add (load, key_a, val_a, key_b, val_b, src);
+			} else {
+				_s4_add_internal (s4, key_a, val_a, key_b, val_b, src);
+			}
+		}
+	}
+
+	ret = 0;
+
+cleanup:
+	if (load != NULL)
+		_s4_load_finish (load);
+	if (order != NULL)
+		g_array_free (order, TRUE);
+	free (vals);
+	free (strs);
+	return ret;
+}
+
+/**
+ * Reads the incremental checkpoint written on top of a full file, if any.
+ *
+ * @param s4 The database to read into
+ * @param base The header of the full file
+ * @param copy Non-zero to copy the strings, see _read_file
+ * @return 0 on success or if there is no incremental file, non-zero on error
+ */
+static int _read_delta (s4_t *s4, const s4_header_t *base, int copy)
+{
+	GMappedFile *file;
+	const s4_header_t *hdr;
+	const char *data;
+	size_t size;
+	int ret;
+
+	file = g_mapped_file_new (s4->delta_filename, FALSE, NULL);
+	if (file == NULL) {
+		return 0;
+	}
+
+	data = g_mapped_file_get_contents (file);
+	size = g_mapped_file_get_length (file);
+	hdr = (const s4_header_t*)data;
+
+	/* A delta file that was not written on top of this exact file
+	 * is left over from before the last full write
+	 */
+	if (size < sizeof (s4_header_t)
+			|| strncmp (S4_DELTA_MAGIC, hdr->magic, S4_MAGIC_LEN)
+			|| (hdr->version != S4_VERSION && hdr->version != S4_VERSION_FRONT_CODED)
+			|| memcmp (hdr->uuid, base->uuid, sizeof (hdr->uuid))
+			|| hdr->base_checkpoint != base->last_checkpoint) {
+		g_mapped_file_unref (file);
+		return 0;
+	}
+
+	ret = _read_v2 (s4, data, size, 1, copy);
+	if (!ret) {
+		_log_init (s4, hdr->last_checkpoint);
+	}
+
+	if (copy)
+		g_mapped_file_unref (file);
+	else
+		_const_add_mapping (s4, file);
+
+	return ret;
+}
+
 /**
  * Reads an S4 database from filename.
+ * On the first read the strings are used from the mapped file, which
+ * stays mapped until the database is closed. Later reads copy them
+ * instead, or every reread would keep another mapping of a file that
+ * may already have been replaced. Windows can not replace a mapped
+ * file, so strings are always copied there.
  *
  * @param s4 The s4 database to read the data into
  * @param filename The name of the file to read from
  * @param flags Flags passed to s4_open
+ * @param reread Non-zero if the database was read before
  * @return 0 on success, non-zero on error
  */
-static int _read_file (s4_t *s4, const char *filename, int flags)
+static int _read_file (s4_t *s4, const char *filename, int flags, int reread)
 {
-	FILE *file = fopen (filename, "r");
-	s4_header_t hdr;
-	int i;
-
-	if (file == NULL) {
+	GMappedFile *file;
+	const s4_header_t *hdr;
+	const char *data;
+	size_t size;
+	int i, fd, ret;
+#ifdef _WIN32
+	int copy = 1;
+#else
+	int copy = reread;
+#endif
+
+	fd = g_open (filename, O_RDONLY, 0);
+
+	if (fd == -1) {
 		int ret = 0;
 		switch (errno) {
 			case ENOENT:
@@ -156,44 +699,72 @@ static int _read_file (s4_t *s4, const char *filename, int flags)
 		}
 		return ret;
 	} else if (flags & S4_NEW) {
-		fclose (file);
+		close (fd);
 		s4_set_errno (S4E_EXISTS);
 		return -1;
 	}
 
-	fread (&hdr, sizeof (s4_header_t), 1, file);
-	if (strncmp (S4_MAGIC, hdr.magic, S4_MAGIC_LEN)) {
-		fclose (file);
+	file = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+	close (fd);
+
+	if (file == NULL) {
+		s4_set_errno (S4E_OPEN);
+		return -1;
+	}
+
+	data = g_mapped_file_get_contents (file);
+	size = g_mapped_file_get_length (file);
+	hdr = (const s4_header_t*)data;
+
+	if (size < S4_V1_HEADER_SIZE || strncmp (S4_MAGIC, hdr->magic, S4_MAGIC_LEN)) {
+		g_mapped_file_unref (file);
 		s4_set_errno (S4E_MAGIC);
 		return -1;
 	}
 
-	if (hdr.version != S4_VERSION) {
-		fclose (file);
+	if (hdr->version != S4_VERSION && hdr->version != S4_VERSION_FRONT_CODED
+			&& hdr->version != 1) {
+		g_mapped_file_unref (file);
 		s4_set_errno (S4E_VERSION);
 		return -1;
 	}
 
-	_log_init (s4, hdr.last_checkpoint);
+	_log_init (s4, hdr->last_checkpoint);
 
 	for (i = 0; i < 16; i++) {
-		s4->uuid[i] = hdr.uuid[i];
+		s4->uuid[i] = hdr->uuid[i];
 	}
 
-	GHashTable *strings = _read_string (s4, file);
-	if (strings == NULL || _read_relations (s4, file, strings) == -1) {
-		fclose (file);
+	if (hdr->version == 1) {
+		ret = _read_v1 (s4, filename);
+	} else {
+		ret = _read_v2 (s4, data, size, 0, copy);
+
+		if (!ret) {
+			s4->has_base = 1;
+			s4->base_checkpoint = hdr->last_checkpoint;
+			ret = _read_delta (s4, hdr, copy);
+		}
+	}
+
+	if (copy)
+		g_mapped_file_unref (file);
+	else
+		_const_add_mapping (s4, file);
+
+	if (ret) {
 		s4_set_errno (S4E_INCONS);
 		return -1;
 	}
-	g_hash_table_destroy (strings);
 
-	fclose (file);
 	return 0;
 }
 
 int _reread_file (s4_t *s4)
 {
+	if (s4->query_cache != NULL)
+		_query_cache_clear (s4->query_cache);
+
 	_free_relations (s4);
 
 	_index_free_data (s4->index_data);
@@ -201,153 +772,348 @@ int _reread_file (s4_t *s4)
 	s4->index_data = _index_create_data ();
 	s4->entry_data = _entry_create_data ();
 
-	return _read_file (s4, s4->filename, S4_EXISTS);
+	return _read_file (s4, s4->filename, S4_EXISTS, 1);
 }
 
+typedef struct {
+	GHashTable *strings;
+	GPtrArray *string_list;
+	GArray *entries;
+	GArray *pairs;
+	int entry_count;
+
+	/* The string values sort keys are saved for, NULL if they are not saved */
+	GHashTable *keyed;
+	GArray *keys;
+} save_data_t;
+
 /**
- * Writes all the id->string relations in the hash table to file
+ * Gets the id of a string, or gives it an unique id if it doesn't have one
  *
- * @param strings The hashtable holding the key-value pairs
- * @param file The file to write to
+ * @param sd A structure holding the strings found so far.
+ * @param str The string to lookup
+ * @return The id associated with the string
  */
-static void _write_strings (GHashTable *strings, FILE *file)
+static int32_t _get_string_number (save_data_t *sd, const char *str)
 {
-	GHashTableIter iter;
-	void *i;
-	const char *str;
+	int32_t i = GPOINTER_TO_INT (g_hash_table_lookup (sd->strings, str));
 
-	g_hash_table_iter_init (&iter, strings);
-	while (g_hash_table_iter_next (&iter, (void**)&str, &i)) {
-		int32_t len = strlen (str);
-		int32_t str_id = GPOINTER_TO_INT (i);
-		fwrite (&str_id, sizeof (int32_t), 1, file);
-		fwrite (&len, sizeof (int32_t), 1, file);
-		fwrite (str, 1, len, file);
+	if (i == 0) {
+		g_ptr_array_add (sd->string_list, (void*)str);
+		i = sd->string_list->len;
+		g_hash_table_insert (sd->strings, (void*)str, GINT_TO_POINTER (i));
 	}
+
+	return i;
 }
 
 /**
- * Writes a list of int-pairs to file
+ * Gets the file representation of a key-value pair
  *
- * @param pairs A GList with pairs to write
- * @param file The file to write to
+ * @param sd The save data
+ * @param key The key
+ * @param val The value
+ * @param key_id Where to store the key
+ * @param val_id Where to store the value
  */
-static void _write_pairs (GList *pairs, FILE *file)
+static void _get_pair_ids (save_data_t *sd, const char *key, const s4_val_t *val,
+		int32_t *key_id, int32_t *val_id)
 {
-	for (; pairs != NULL; pairs = g_list_next (pairs)) {
-		s4_intpair_t *pair = pairs->data;
-		fwrite (pair, sizeof (s4_intpair_t), 1, file);
-		free (pair);
+	const char *str;
+	int32_t i;
+
+	*key_id = _get_string_number (sd, key);
+
+	if (s4_val_get_int (val, &i)) {
+		*val_id = i;
+		*key_id = -*key_id;
+	} else if (s4_val_get_str (val, &str)) {
+		*val_id = _get_string_number (sd, str);
+
+		if (sd->keyed != NULL && g_hash_table_lookup (sd->keyed, val) == NULL) {
+			s4_file_key_t key;
+
+			key.str = *val_id;
+			s4_val_get_collated_str (val, &str);
+			key.collated = _get_string_number (sd, str);
+			s4_val_get_casefolded_str (val, &str);
+			key.casefolded = _get_string_number (sd, str);
+
+			g_array_append_val (sd->keys, key);
+			g_hash_table_insert (sd->keyed, (void*)val, (void*)val);
+		}
 	}
 }
 
-typedef struct {
-	GHashTable *strings;
-	GList *pairs;
-	int new_id;
-} save_data_t;
-
-/**
- * Gets the id of a string, or gives it an unique id if it doesn't have one
- *
- * @param sd A structure holding the strings found so far and the next free id.
- * @param str The string to lookup
- * @return The id associated with the string
+/*
+ * Sorts the rows of the resultset the way they will be read back
  */
-static int _get_string_number (save_data_t *sd, const char *str)
+static int _compare_entry_rows (const void *a, const void *b)
 {
-	int i = GPOINTER_TO_INT (g_hash_table_lookup (sd->strings, str));
+	const s4_resultrow_t *row_a = *(const s4_resultrow_t**)a;
+	const s4_resultrow_t *row_b = *(const s4_resultrow_t**)b;
+	const s4_result_t *res_a, *res_b;
+	const char *key_a, *key_b;
 
-	if (i == 0) {
-		i = sd->new_id++;
-		g_hash_table_insert (sd->strings, (void*)str, GINT_TO_POINTER (i));
+	s4_resultrow_get_col (row_a, 0, &res_a);
+	s4_resultrow_get_col (row_b, 0, &res_b);
+
+	key_a = s4_result_get_key (res_a);
+	key_b = s4_result_get_key (res_b);
+
+	if (key_a != key_b) {
+		return strcmp (key_a, key_b);
 	}
 
-	return i;
+	return s4_val_cmp (s4_result_get_val (res_a), s4_result_get_val (res_b), S4_CMP_CASELESS);
+}
+
+static int _compare_pairs (const void *a, const void *b)
+{
+	const s4_file_pair_t *pair_a = a, *pair_b = b;
+
+	return ABS (pair_a->key) - ABS (pair_b->key);
 }
 
 /*
- * A helper function converting a resultset into a list of int-pairs.
+ * A helper function converting a resultset into entries and pairs.
  */
-static void _result_to_pairs (s4_resultset_t *res, save_data_t *sd)
+static void _result_to_entries (s4_resultset_t *res, save_data_t *sd)
 {
 	const s4_resultrow_t *row;
-	int row_no;
+	GPtrArray *rows = g_ptr_array_new ();
+	int row_no, i;
 
 	for (row_no = 0; s4_resultset_get_row (res, row_no, &row); row_no++) {
-		int32_t va, ka, i;
-		const s4_val_t *val_a, *val_b;
-		const char *key_a, *key_b, *src, *str;
+		g_ptr_array_add (rows, (void*)row);
+	}
+	g_ptr_array_sort (rows, _compare_entry_rows);
+
+	for (i = 0; i < rows->len; i++) {
 		const s4_result_t *id_res, *val_res;
+		s4_file_entry_t entry;
+		s4_file_pair_t pair;
 
+		row = g_ptr_array_index (rows, i);
 		s4_resultrow_get_col (row, 0, &id_res);
 		s4_resultrow_get_col (row, 1, &val_res);
 
-		val_a = s4_result_get_val (id_res);
-		key_a = s4_result_get_key (id_res);
+		g_array_set_size (sd->pairs, 0);
+		for (; val_res != NULL; val_res = s4_result_next (val_res)) {
+			_get_pair_ids (sd, s4_result_get_key (val_res), s4_result_get_val (val_res),
+					&pair.key, &pair.val);
+			pair.src = _get_string_number (sd, s4_result_get_src (val_res));
+			g_array_append_val (sd->pairs, pair);
+		}
+		g_array_sort (sd->pairs, _compare_pairs);
 
-		ka = _get_string_number (sd, key_a);
+		_get_pair_ids (sd, s4_result_get_key (id_res), s4_result_get_val (id_res),
+				&entry.key, &entry.val);
+		entry.count = sd->pairs->len;
 
-		if (s4_val_get_int (val_a, &i)) {
-			va = i;
-			ka = -ka;
-		} else if (s4_val_get_str (val_a, &str)) {
-			va = _get_string_number (sd, str);
-		}
+		g_array_append_vals (sd->entries, &entry, sizeof (s4_file_entry_t));
+		g_array_append_vals (sd->entries, sd->pairs->data,
+				sizeof (s4_file_pair_t) * sd->pairs->len);
+		sd->entry_count++;
+	}
 
-		for (; val_res != NULL; val_res = s4_result_next (val_res)) {
-			s4_intpair_t *pair = malloc (sizeof (s4_intpair_t));
-
-			val_b = s4_result_get_val (val_res);
-			key_b = s4_result_get_key (val_res);
-			src = s4_result_get_src (val_res);
-
-			pair->val_a = va;
-			pair->key_a = ka;
-			pair->key_b = _get_string_number (sd, key_b);
-			pair->src = _get_string_number (sd, src);
-
-			if (s4_val_get_int (val_b, &i)) {
-				pair->val_b = i;
-				pair->key_b = -pair->key_b;
-			} else if (s4_val_get_str (val_b, &str)) {
-				pair->val_b = _get_string_number (sd, str);
-			}
+	g_ptr_array_free (rows, TRUE);
+}
+
+/**
+ * Writes all the strings in the save data to file
+ *
+ * @param sd The save data
+ * @param file The file to write to
+ */
+static void _write_strings (save_data_t *sd, FILE *file)
+{
+	static const char padding[4] = {0};
+	int i;
+
+	for (i = 0; i < sd->string_list->len; i++) {
+		const char *str = g_ptr_array_index (sd->string_list, i);
+		int32_t len = strlen (str);
+
+		fwrite (&len, sizeof (int32_t), 1, file);
+		fwrite (str, 1, len, file);
+		fwrite (padding, 1, STRING_SIZE (len) - sizeof (int32_t) - len, file);
+	}
+}
+
+static int _compare_strings (const void *a, const void *b)
+{
+	return strcmp (*(const char**)a, *(const char**)b);
+}
+
+/**
+ * Sorts the strings in the save data so they can be front-coded,
+ * and changes the ids in entries and sort keys to match. The pairs
+ * of every entry are sorted by key again afterwards.
+ *
+ * @param sd The save data
+ * @return An array with the new id of every old id, free with free
+ */
+static int32_t *_sort_strings (save_data_t *sd)
+{
+	int32_t *ids = malloc (sizeof (int32_t) * (sd->string_list->len + 1));
+	char *data = sd->entries->data;
+	int i, j, pos;
+
+	g_ptr_array_sort (sd->string_list, _compare_strings);
+
+	ids[0] = 0;
+	for (i = 0; i < sd->string_list->len; i++) {
+		const char *str = g_ptr_array_index (sd->string_list, i);
 
-			sd->pairs = g_list_prepend (sd->pairs, pair);
+		ids[GPOINTER_TO_INT (g_hash_table_lookup (sd->strings, str))] = i + 1;
+		g_hash_table_insert (sd->strings, (void*)str, GINT_TO_POINTER (i + 1));
+	}
+
+	for (pos = 0; pos < sd->entries->len;) {
+		s4_file_entry_t *entry = (s4_file_entry_t*)(data + pos);
+		s4_file_pair_t *pairs = (s4_file_pair_t*)(data + pos + sizeof (s4_file_entry_t));
+
+		if (entry->key > 0)
+			entry->val = ids[entry->val];
+		entry->key = (entry->key < 0)?-ids[-entry->key]:ids[entry->key];
+
+		for (j = 0; j < entry->count; j++) {
+			if (pairs[j].key > 0)
+				pairs[j].val = ids[pairs[j].val];
+			pairs[j].key = (pairs[j].key < 0)?-ids[-pairs[j].key]:ids[pairs[j].key];
+			pairs[j].src = ids[pairs[j].src];
 		}
+
+		/* Keep the pairs sorted by key id under the new ids */
+		qsort (pairs, entry->count, sizeof (s4_file_pair_t), _compare_pairs);
+
+		pos += sizeof (s4_file_entry_t) + sizeof (s4_file_pair_t) * entry->count;
+	}
+
+	for (i = 0; i < sd->keys->len; i++) {
+		s4_file_key_t *key = &g_array_index (sd->keys, s4_file_key_t, i);
+
+		key->str = ids[key->str];
+		key->collated = ids[key->collated];
+		key->casefolded = ids[key->casefolded];
+	}
+
+	return ids;
+}
+
+/**
+ * Writes a number 7 bits to a byte.
+ *
+ * @param i The number to write
+ * @param file The file to write to
+ * @return The number of bytes written
+ */
+static int _write_varint (uint32_t i, FILE *file)
+{
+	int ret = 1;
+
+	for (; i >= 0x80; i >>= 7, ret++) {
+		fputc ((i & 0x7f) | 0x80, file);
 	}
+	fputc (i, file);
+
+	return ret;
 }
 
 /**
- * Writes the database to disk
+ * Writes all the strings in the save data to file front-coded.
+ * The strings must have been sorted by _sort_strings.
+ *
+ * @param sd The save data
+ * @param file The file to write to
+ */
+static void _write_front_coded_strings (save_data_t *sd, FILE *file)
+{
+	static const char padding[4] = {0};
+	const char *prev = "";
+	int i, size = 0;
+
+	for (i = 0; i < sd->string_list->len; i++) {
+		const char *str = g_ptr_array_index (sd->string_list, i);
+		int32_t prefix, len;
+
+		for (prefix = 0; str[prefix] != '\0' && str[prefix] == prev[prefix]; prefix++);
+		len = strlen (str + prefix);
+
+		size += _write_varint (prefix, file);
+		size += _write_varint (len, file);
+		fwrite (str + prefix, 1, len, file);
+		size += len;
+
+		prev = str;
+	}
+
+	fwrite (padding, 1, ((size + 3) & ~3) - size, file);
+}
+
+/**
+ * Checks if the next checkpoint should be incremental.
+ * Once the changed entries get above a quarter of the database
+ * it is cheaper to compact everything into a new full file.
+ *
+ * @param s4 The database
+ * @return non-zero if only the changed entries should be written
+ */
+static int _write_delta (s4_t *s4)
+{
+	return (s4->open_flags & S4_INCREMENTAL) && s4->has_base
+		&& _entry_get_dirty_count (s4) * 4 <= _entry_get_count (s4);
+}
+
+/**
+ * Writes the database to disk.
+ * The database is read from a snapshot, so commits only wait
+ * for the moment it takes to pick the snapshot.
  *
  * @param s4 The database to write
  * @return non-zero on success, 0 on error
  */
 static int _write_file (s4_t *s4)
 {
-	int32_t i = -1;
-	int j;
+	int j, delta, failed;
 	FILE *file;
 	s4_header_t hdr;
+	s4_file_keys_t keys_hdr;
 	save_data_t sd;
 	s4_condition_t *cond;
 	s4_fetchspec_t *fs;
 	s4_resultset_t *res;
 	s4_transaction_t *trans;
+	const char *filename, *tmp_filename;
+	gint64 start = g_get_monotonic_time ();
 
+	g_mutex_lock (&s4->write_lock);
 	_log_lock_db (s4);
 
-	file = fopen (s4->tmp_filename, "w");
+	delta = _write_delta (s4);
+	if (delta) {
+		filename = s4->delta_filename;
+		tmp_filename = s4->tmp_delta_filename;
+	} else {
+		filename = s4->filename;
+		tmp_filename = s4->tmp_filename;
+	}
+
+	file = fopen (tmp_filename, "w");
 	if (file == NULL) {
 		_log_unlock_db (s4);
+		g_mutex_unlock (&s4->write_lock);
 		return 0;
 	}
 
 	sd.strings = g_hash_table_new (NULL, NULL);
-	sd.pairs = NULL;
-	sd.new_id = 1;
+	sd.string_list = g_ptr_array_new ();
+	sd.entries = g_array_new (FALSE, FALSE, 1);
+	sd.pairs = g_array_new (FALSE, FALSE, sizeof (s4_file_pair_t));
+	sd.entry_count = 0;
+	sd.keyed = s4->options.sort_keys?g_hash_table_new (NULL, NULL):NULL;
+	sd.keys = g_array_new (FALSE, FALSE, sizeof (s4_file_key_t));
 
 	cond = s4_cond_new_filter (S4_FILTER_EXISTS, NULL, NULL, NULL, S4_CMP_BINARY, 0);
 
@@ -355,53 +1121,133 @@ static int _write_file (s4_t *s4)
 	s4_fetchspec_add (fs, NULL, NULL, S4_FETCH_PARENT);
 	s4_fetchspec_add (fs, NULL, NULL, S4_FETCH_DATA);
 
-	do {
-		trans = s4_begin (s4, 0);
-		res = s4_query (trans, fs, cond);
-		_transaction_writing (trans);
-	} while (!s4_commit (trans));
+	/* Everything committed after the snapshot will be in the next delta */
+	trans = _transaction_begin_checkpoint (s4, !delta);
+	if (delta) {
+		res = _s4_query_dirty (trans, fs);
+	} else {
+		res = _s4_query_uncached (trans, fs, cond);
+	}
+	s4_commit (trans);
+
+	_result_to_entries (res, &sd);
+
+	if (sd.keyed != NULL) {
+		strncpy (keys_hdr.magic, S4_KEYS_MAGIC, S4_MAGIC_LEN);
+		keys_hdr.count = sd.keys->len;
+		keys_hdr.locale = _get_string_number (&sd, _string_lookup (s4, _collate_locale ()));
+	}
+
+	if (s4->options.compact_strings) {
+		int32_t *ids = _sort_strings (&sd);
 
-	_result_to_pairs (res, &sd);
+		if (sd.keyed != NULL)
+			keys_hdr.locale = ids[keys_hdr.locale];
+		free (ids);
+	}
 
 	s4_cond_free (cond);
 	s4_fetchspec_free (fs);
 	s4_resultset_free (res);
 
-	strncpy (hdr.magic, S4_MAGIC, S4_MAGIC_LEN);
-	hdr.version = S4_VERSION;
+	memset (&hdr, 0, sizeof (s4_header_t));
+	strncpy (hdr.magic, delta?S4_DELTA_MAGIC:S4_MAGIC, S4_MAGIC_LEN);
+	hdr.version = s4->options.compact_strings?S4_VERSION_FRONT_CODED:S4_VERSION;
 	for (j = 0; j < 16; j++) {
 		hdr.uuid[j] = s4->uuid[j];
 	}
 	hdr.last_checkpoint = _log_last_synced (s4);
+	hdr.string_count = sd.string_list->len;
+	hdr.entry_count = sd.entry_count;
+	hdr.base_checkpoint = delta?s4->base_checkpoint:0;
 
 	fwrite (&hdr, sizeof (s4_header_t), 1, file);
-	_write_strings (sd.strings, file);
-	fwrite (&i, sizeof (int32_t), 1, file);
-	_write_pairs (sd.pairs, file);
+	if (s4->options.compact_strings) {
+		_write_front_coded_strings (&sd, file);
+	} else {
+		_write_strings (&sd, file);
+	}
+	if (sd.entries->len > 0)
+		fwrite (sd.entries->data, 1, sd.entries->len, file);
+	if (sd.keyed != NULL) {
+		fwrite (&keys_hdr, sizeof (s4_file_keys_t), 1, file);
+		if (sd.keys->len > 0)
+			fwrite (sd.keys->data, sizeof (s4_file_key_t), sd.keys->len, file);
+		g_hash_table_destroy (sd.keyed);
+	}
 
 	g_hash_table_destroy (sd.strings);
-	g_list_free (sd.pairs);
+	g_ptr_array_free (sd.string_list, TRUE);
+	g_array_free (sd.entries, TRUE);
+	g_array_free (sd.pairs, TRUE);
+	g_array_free (sd.keys, TRUE);
 
-	fclose (file);
+	/* A file that could not be written in full must not replace
+	 * the old one, the log is dropped up to it after the rename
+	 */
+	failed = ferror (file);
+	if (fclose (file) != 0)
+		failed = 1;
+	if (failed)
+		g_unlink (tmp_filename);
+
+	if (failed || g_rename (tmp_filename, filename)) {
+		/* The dirty entries are gone, so the next
+		 * checkpoint has to be a full one
+		 */
+		s4->has_base = 0;
+		_log_unlock_db (s4);
+		g_mutex_unlock (&s4->write_lock);
+		return 0;
+	}
 
-	g_rename (s4->tmp_filename, s4->filename);
+	if (!delta) {
+		g_unlink (s4->delta_filename);
+		s4->has_base = 1;
+		s4->base_checkpoint = hdr.last_checkpoint;
+	}
 
 	_log_checkpoint (s4);
 	_log_unlock_db (s4);
+	g_mutex_unlock (&s4->write_lock);
+
+	_stats_time (s4, S4_STAT_SYNC, start);
 	return 1;
 }
 
+/**
+ * Writes a full checkpoint, even if incremental checkpoints are used.
+ * Needed after changes that did not go through transactions, as
+ * they are neither in the log nor marked as changed.
+ *
+ * @param s4 The database to write
+ * @return non-zero on success, 0 on error
+ */
+int _write_full_file (s4_t *s4)
+{
+	s4->has_base = 0;
+	return _write_file (s4);
+}
+
 static void *_sync_thread (s4_t *s4)
 {
+	int ok;
+
 	g_mutex_lock (&s4->sync_lock);
 	while (s4->sync_thread_run) {
-		if (s4->sync_thread_run)
+		if (!s4->sync_pending)
 			g_cond_wait (&s4->sync_cond, &s4->sync_lock);
+		s4->sync_pending = 0;
 		g_mutex_unlock (&s4->sync_lock);
 
-		s4_sync (s4);
+		ok = _write_file (s4);
+		if (!ok) {
+			S4_ERROR ("s4_sync: could not write file");
+		}
 
 		g_mutex_lock (&s4->sync_lock);
+		s4->sync_ok = ok;
+		s4->sync_rounds++;
 		g_cond_broadcast (&s4->sync_finished_cond);
 	}
 	g_mutex_unlock (&s4->sync_lock);
@@ -413,31 +1259,65 @@ static void *_sync_thread (s4_t *s4)
 void _start_sync (s4_t *s4)
 {
 	g_mutex_lock (&s4->sync_lock);
+	s4->sync_pending = 1;
 	g_cond_signal (&s4->sync_cond);
 	g_mutex_unlock (&s4->sync_lock);
 }
 
-/* Start and wait for sync to finish */
-void _sync (s4_t *s4)
+/**
+ * Waits until everything logged so far is checkpointed, so the log
+ * it takes up can be used again. The sync thread writes the
+ * checkpoint, this only waits for it; a checkpoint the sync thread
+ * is already writing is used if it frees enough of the log.
+ * Gives up if a sync fails or does not move the checkpoint.
+ *
+ * @param s4 The database to sync
+ */
+void _sync_log (s4_t *s4)
 {
-	g_mutex_lock (&s4->sync_lock);
-	g_cond_signal (&s4->sync_cond);
-	g_cond_wait (&s4->sync_finished_cond, &s4->sync_lock);
-	g_mutex_unlock (&s4->sync_lock);
+	log_number_t checkpoint, prev, next, goal;
+	guint rounds;
+	int ok;
+
+	_log_get_checkpoint (s4, &checkpoint, &goal);
+
+	while (checkpoint < goal) {
+		g_mutex_lock (&s4->sync_lock);
+		rounds = s4->sync_rounds;
+		s4->sync_pending = 1;
+		g_cond_signal (&s4->sync_cond);
+		while (s4->sync_rounds == rounds && s4->sync_thread_run)
+			g_cond_wait (&s4->sync_finished_cond, &s4->sync_lock);
+		ok = s4->sync_ok && s4->sync_rounds != rounds;
+		g_mutex_unlock (&s4->sync_lock);
+
+		prev = checkpoint;
+		_log_get_checkpoint (s4, &checkpoint, &next);
+		if (!ok || checkpoint == prev)
+			break;
+	}
 }
 
 static s4_t *_alloc (void)
 {
+	static gint serial = 0;
 	s4_t* s4 = calloc (1, sizeof(s4_t));
 
+	do {
+		s4->serial = g_atomic_int_add (&serial, 1) + 1;
+	} while (s4->serial == 0);
+
 	g_mutex_init (&s4->sync_lock);
 	g_cond_init (&s4->sync_cond);
 	g_cond_init (&s4->sync_finished_cond);
+	g_rw_lock_init (&s4->checkpoint_lock);
+	g_mutex_init (&s4->write_lock);
 
 	s4->const_data = _const_create_data ();
 	s4->index_data = _index_create_data ();
 	s4->entry_data = _entry_create_data ();
 	s4->log_data = _log_create_data ();
+	s4->stats_data = _stats_create_data ();
 
 	return s4;
 }
@@ -449,19 +1329,31 @@ static s4_t *_alloc (void)
  */
 static void _free (s4_t *s4)
 {
+	if (s4->query_pool != NULL) {
+		g_thread_pool_free (s4->query_pool, FALSE, TRUE);
+	}
+	if (s4->query_cache != NULL) {
+		_query_cache_free (s4->query_cache);
+	}
+
 	_free_relations (s4);
 
 	g_mutex_clear (&s4->sync_lock);
 	g_cond_clear (&s4->sync_cond);
 	g_cond_clear (&s4->sync_finished_cond);
+	g_rw_lock_clear (&s4->checkpoint_lock);
+	g_mutex_clear (&s4->write_lock);
 
 	_const_free_data (s4->const_data);
 	_index_free_data (s4->index_data);
 	_entry_free_data (s4->entry_data);
 	_log_free_data (s4->log_data);
+	_stats_free_data (s4->stats_data);
 
 	free (s4->filename);
 	g_free (s4->tmp_filename);
+	g_free (s4->delta_filename);
+	g_free (s4->tmp_delta_filename);
 	free (s4);
 }
 
@@ -489,6 +1381,12 @@ static void _free (s4_t *s4)
  * 		Creates a memory-only database. It will not read any files
  * 		on startup or write files on shutdown. Use this if you want
  * 		a temporary database.
+ * </P><P>
+ * @b S4_INCREMENTAL
+ * <BR>
+ * 		Checkpoints only write the entries changed since the last
+ * 		full write to filename.delta. A new full file is written
+ * 		once the changes grow too big.
  * <BR>
  *
  * @param filename The name of the file containing the database
@@ -497,14 +1395,53 @@ static void _free (s4_t *s4)
  * @return A pointer to an s4_t, or NULL if something went wrong.
  */
 s4_t *s4_open (const char *filename, const char **indices, int open_flags)
+{
+	return s4_open_with_options (filename, indices, open_flags, NULL);
+}
+
+/**
+ * Opens an S4 database with non-default options.
+ * See s4_open for a description of the other arguments.
+ *
+ * @param filename The name of the file containing the database
+ * @param indices An array of keys to have indices on
+ * @param open_flags Zero or more of the flags bitwise-or'd.
+ * @param opts The options to use, or NULL to use the defaults.
+ * @return A pointer to an s4_t, or NULL if something went wrong.
+ */
+s4_t *s4_open_with_options (const char *filename, const char **indices,
+		int open_flags, const s4_options_t *opts)
 {
 	int i;
 	s4_t *s4;
 
 	s4 = _alloc ();
 
+	if (opts != NULL) {
+		s4->options = *opts;
+	} else {
+		_options_init (&s4->options);
+	}
+
+	if (s4->options.query_threads > 1) {
+		s4->query_pool = g_thread_pool_new (_s4_query_job, NULL,
+				s4->options.query_threads - 1, FALSE, NULL);
+	}
+	if (s4->options.query_cache > 0) {
+		s4->query_cache = _query_cache_new (s4->options.query_cache);
+	}
+
 	for (i = 0; indices != NULL && indices[i] != NULL; i++) {
-		_index_add (s4, indices[i], _index_create ());
+		s4_index_t *index = _index_create ();
+
+		if (s4->options.token_index)
+			_index_create_tokens (index);
+		_index_add (s4, indices[i], index);
+	}
+
+	/* Memory-only databases are never written */
+	if (open_flags & S4_MEMORY) {
+		open_flags &= ~S4_INCREMENTAL;
 	}
 
 	s4->open_flags = open_flags;
@@ -515,7 +1452,9 @@ s4_t *s4_open (const char *filename, const char **indices, int open_flags)
 
 	s4->filename = strdup (filename);
 	s4->tmp_filename = g_strconcat (filename, ".chkpnt", NULL);
-	if (_read_file (s4, s4->filename, open_flags)) {
+	s4->delta_filename = g_strconcat (filename, ".delta", NULL);
+	s4->tmp_delta_filename = g_strconcat (filename, ".delta.chkpnt", NULL);
+	if (_read_file (s4, s4->filename, open_flags, 0)) {
 		_free (s4);
 		return NULL;
 	}
@@ -573,6 +1512,18 @@ void s4_sync (s4_t *s4)
 	}
 }
 
+/**
+ * Waits until everything committed is synced to the log on disk.
+ * Use this as a barrier after transactions started with S4_TRANS_NOSYNC.
+ *
+ * @param s4 The database to flush
+ *
+ */
+void s4_flush_log (s4_t *s4)
+{
+	_log_sync_all (s4);
+}
+
 /**
  * Returns the last error number set.
  * This function is thread safe, error numbers set in one thread
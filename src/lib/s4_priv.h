@@ -25,45 +25,121 @@ typedef struct s4_index_data_St s4_index_data_t;
 typedef struct s4_const_data_St s4_const_data_t;
 typedef struct s4_entry_data_St s4_entry_data_t;
 typedef struct s4_log_data_St s4_log_data_t;
+typedef struct s4_query_cache_St s4_query_cache_t;
+typedef struct s4_stats_data_St s4_stats_data_t;
+
+struct s4_options_St {
+	int32_t log_size;
+	int flush_interval;
+	int query_threads;
+	int sort_keys;
+	int token_index;
+	int query_cache;
+	int compact_strings;
+};
 
 struct s4_St {
 	int open_flags;
+	s4_options_t options;
+	/* Tells databases apart even if one is allocated where
+	 * a closed one was, never 0
+	 */
+	guint serial;
 
 	s4_index_data_t *index_data;
 	s4_const_data_t *const_data;
 	s4_entry_data_t *entry_data;
 	s4_log_data_t *log_data;
+	s4_stats_data_t *stats_data;
 
 	GCond sync_cond, sync_finished_cond;
 	int sync_thread_run;
 	GThread *sync_thread;
 	GMutex sync_lock;
+	/* Set when a sync is asked for, so it is not missed while the
+	 * sync thread is busy. sync_rounds counts the syncs done and
+	 * sync_ok tells if the last one wrote the file.
+	 */
+	int sync_pending;
+	guint sync_rounds;
+	int sync_ok;
+
+	/* Held for reading by commits while they log and stamp their
+	 * changes, and for writing by checkpoints picking their snapshot
+	 */
+	GRWLock checkpoint_lock;
+	/* Only one checkpoint is written at a time */
+	GMutex write_lock;
+	/* The number of bulk loads begun and not finished or aborted,
+	 * no transaction can begin while it is not 0
+	 */
+	gint bulk_loads;
+
+	/* Checks the candidates of large queries, NULL if
+	 * queries run in the calling thread only
+	 */
+	GThreadPool *query_pool;
+	/* Results of recent read-only queries, NULL if they are not cached */
+	s4_query_cache_t *query_cache;
 
 	char *filename;
 	char *tmp_filename;
+	char *delta_filename;
+	char *tmp_delta_filename;
 	unsigned char uuid[16];
+
+	/* Set when filename holds a full checkpoint that an
+	 * incremental checkpoint can be written on top of
+	 */
+	int has_base;
+	log_number_t base_checkpoint;
 };
 
 typedef struct str_St str_t;
+typedef struct s4_arena_St s4_arena_t;
+typedef struct entry_version_St entry_version_t;
 
 void s4_set_errno (s4_errno_t err);
+void _options_init (s4_options_t *opts);
 void _start_sync (s4_t *s4);
-void _sync (s4_t *s4);
+void _sync_log (s4_t *s4);
 int _reread_file (s4_t *s4);
+int _write_full_file (s4_t *s4);
 
 int _s4_add_internal (s4_t *s4, const char *key_a, const s4_val_t *value_a,
 		const char *key_b, const s4_val_t *value_b, const char *src);
+void _s4_clear_internal (s4_t *s4, const char *key_a, const s4_val_t *value_a);
+typedef struct s4_load_St s4_load_t;
+s4_load_t *_s4_load_begin (s4_t *s4);
+int _s4_load_add (s4_load_t *load, const char *key_a, const s4_val_t *value_a,
+		const char *key_b, const s4_val_t *value_b, const char *src);
+void _s4_load_finish (s4_load_t *load);
 s4_entry_data_t *_entry_create_data (void);
 void _entry_free_data (s4_entry_data_t *data);
+void _entry_clear_dirty (s4_t *s4);
+int _entry_get_dirty_count (s4_t *s4);
+int _entry_get_count (s4_t *s4);
+void _entry_stamp_versions (s4_transaction_t *trans);
+guint64 _entry_begin_snapshot (s4_t *s4);
+void _entry_end_snapshot (s4_t *s4, guint64 snapshot);
 
 s4_val_t *s4_val_new_internal_string (const char *str, s4_t *s4);
+int32_t _val_get_id (const s4_val_t *val);
+void _val_set_id (s4_val_t *val, int32_t id);
+void _val_set_sort_keys (const s4_val_t *val, const char *collated, const char *casefolded);
+s4_val_t *_val_new_int_in (int32_t i, s4_arena_t *arena);
 
 const char *_string_lookup (s4_t *s4, const char *str);
 const char *_string_lookup_casefolded (s4_t *s4, const char *str);
 const char *_string_lookup_collated (s4_t *s4, const char *str);
 const s4_val_t *_string_lookup_val (s4_t *s4, const char *str);
+const s4_val_t *_string_lookup_static_val (s4_t *s4, const char *str);
+void _const_add_mapping (s4_t *s4, GMappedFile *file);
 const s4_val_t *_int_lookup_val (s4_t *s4, int32_t i);
 const s4_val_t *_const_lookup (s4_t *s4, const s4_val_t *val);
+const s4_val_t *_const_get (s4_t *s4, int32_t id);
+const char *_const_get_str (s4_t *s4, int32_t id);
+int32_t _string_id (s4_t *s4, const char *str);
 s4_const_data_t *_const_create_data (void);
 void _const_free_data (s4_const_data_t *data);
 
@@ -73,9 +149,29 @@ typedef struct {
 	int32_t src;
 } s4_intpair_t;
 
+typedef struct s4_set_St s4_set_t;
+
+s4_set_t *_set_new (int size_hint);
+void _set_free (s4_set_t *set);
+void _set_clear (s4_set_t *set);
+void _set_add (s4_set_t *set, void *p);
+int _set_size (s4_set_t *set);
+void *_set_get (s4_set_t *set, int i);
+void _set_order (s4_set_t *set, GCompareFunc cmp);
+void _set_intersect (s4_set_t *set, s4_set_t *other);
+void _set_union (s4_set_t *set, s4_set_t *other);
+
+s4_set_t *_plan_query (s4_transaction_t *trans, s4_condition_t *cond);
+
 typedef struct s4_index_St s4_index_t;
 typedef int (*index_function_t)(const s4_val_t *val, void *data);
 
+/* A value and the data it points at, see _index_build */
+typedef struct {
+	const s4_val_t *val;
+	void *data;
+} index_pair_t;
+
 s4_index_data_t *_index_create_data (void);
 void _index_free_data (s4_index_data_t *data);
 s4_index_t *_index_get_a (s4_t *s4, const char *key, int create);
@@ -83,23 +179,52 @@ s4_index_t *_index_get_b (s4_t *s4, const char *key);
 GList *_index_get_all_a (s4_t *s4);
 GList *_index_get_all_b (s4_t *s4);
 s4_index_t *_index_create (void);
+void _index_create_tokens (s4_index_t *index);
+s4_index_t *_index_get_tokens (s4_index_t *index);
+void _index_token_search (s4_index_t *index, const char *token, int prefix, s4_set_t *set);
+void _index_prefix_search (s4_index_t *index, const char *prefix, s4_set_t *set);
 int _index_add (s4_t *s4, const char *key, s4_index_t *index);
 int _index_insert (s4_index_t *index, const s4_val_t *val, void *data);
+void _index_build (s4_index_t *index, index_pair_t *pairs, int count);
 int _index_delete (s4_index_t *index, const s4_val_t *val, void *data);
-GList *_index_search (s4_index_t *index, index_function_t func, void *data);
-GList *_index_lsearch (s4_index_t *index, index_function_t func, void *data);
+void *_index_lookup (s4_index_t *index, const s4_val_t *val);
+void _index_search (s4_index_t *index, index_function_t func, void *data, s4_set_t *set);
+void _index_lsearch (s4_index_t *index, index_function_t func, void *data, s4_set_t *set);
 void _index_free (s4_index_t *index);
 int _index_lock_shared (s4_index_t *index, s4_transaction_t *trans);
 int _index_lock_exclusive (s4_index_t *index, s4_transaction_t *trans);
+const s4_index_stats_t *_index_get_stats (s4_index_t *index);
+
 
+int _sourcepref_get_priority (s4_sourcepref_t *sp, s4_t *s4, int32_t src);
 
 int32_t s4_cond_get_ikey (s4_condition_t *cond);
 void s4_cond_set_ikey (s4_condition_t *cond, int32_t ikey);
+char *s4_cond_get_token (s4_condition_t *cond, int *prefix);
+int32_t s4_fetchspec_get_ikey (s4_fetchspec_t *spec, int index);
+int s4_cond_is_custom (s4_condition_t *cond);
+s4_condition_t *s4_cond_copy (s4_condition_t *cond);
+guint s4_cond_hash (s4_condition_t *cond);
+int s4_cond_equal (s4_condition_t *a, s4_condition_t *b);
+s4_fetchspec_t *s4_fetchspec_copy (s4_fetchspec_t *spec);
+guint s4_fetchspec_hash (s4_fetchspec_t *spec);
+int s4_fetchspec_equal (s4_fetchspec_t *a, s4_fetchspec_t *b);
 
-s4_result_t *s4_result_create (s4_result_t *next, const char *key, const s4_val_t *val, const char *src);
+s4_arena_t *_arena_new (void);
+void *_arena_alloc (s4_arena_t *arena, size_t size);
+s4_arena_t *_arena_ref (s4_arena_t *arena);
+void _arena_unref (s4_arena_t *arena);
+
+s4_result_t *s4_result_create (s4_result_t *next, const char *key, const s4_val_t *val,
+		const char *src, s4_arena_t *arena);
 void s4_result_free (s4_result_t *res);
 
-s4_resultrow_t *s4_resultrow_create (int colcount);
+s4_resultrow_t *s4_resultrow_create (int colcount, s4_arena_t *arena);
+typedef struct s4_topk_St s4_topk_t;
+s4_topk_t *_topk_new (s4_order_t *order, int limit);
+void _topk_add (s4_topk_t *topk, const s4_resultrow_t *row);
+void _topk_finish (s4_topk_t *topk, s4_resultset_t *set, int offset);
+s4_resultset_t *_resultset_copy (const s4_resultset_t *set);
 s4_resultrow_t *s4_resultrow_ref (s4_resultrow_t *row);
 void s4_resultrow_unref (s4_resultrow_t *row);
 
@@ -108,9 +233,18 @@ int _s4_add (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
 int _s4_del (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
 		const char *key_b, const s4_val_t *val_b, const char *src);
 s4_resultset_t *_s4_query (s4_transaction_t *trans, s4_fetchspec_t *fs, s4_condition_t *cond);
+s4_resultset_t *_s4_query_uncached (s4_transaction_t *trans, s4_fetchspec_t *fs, s4_condition_t *cond);
+s4_resultset_t *_s4_query_dirty (s4_transaction_t *trans, s4_fetchspec_t *fs);
+s4_resultset_t *_s4_query_group (s4_transaction_t *trans, s4_condition_t *cond,
+		const char *group_key, s4_sourcepref_t *group_sp,
+		s4_aggregate_t type, const char *key, s4_sourcepref_t *sp);
+s4_cursor_t *_s4_query_cursor (s4_transaction_t *trans, s4_fetchspec_t *fs,
+		s4_condition_t *cond, int offset, int limit);
+void _s4_query_job (void *job, void *unused);
 void _free_relations (s4_t *s4);
 
 typedef struct s4_lock_St s4_lock_t;
+typedef struct s4_lock_holder_St s4_lock_holder_t;
 s4_lock_t *_lock_alloc (void);
 void _lock_free (s4_lock_t *lock);
 int _lock_exclusive (s4_lock_t *lock, s4_transaction_t *trans);
@@ -119,14 +253,18 @@ void _lock_unlock_all (s4_transaction_t *trans);
 
 s4_t *_transaction_get_db (s4_transaction_t *trans);
 void  _transaction_writing (s4_transaction_t *trans);
+s4_transaction_t *_transaction_begin_checkpoint (s4_t *s4, int full);
 s4_lock_t *_transaction_get_waiting_for (s4_transaction_t *trans);
 void _transaction_set_waiting_for (s4_transaction_t *trans, s4_lock_t *waiting_for);
-GList *_transaction_get_locks (s4_transaction_t *trans);
-void  _transaction_add_lock (s4_transaction_t *trans, s4_lock_t *lock);
+s4_lock_holder_t *_transaction_get_locks (s4_transaction_t *trans);
+void _transaction_set_locks (s4_transaction_t *trans, s4_lock_holder_t *locks);
 void _transaction_set_deadlocked (s4_transaction_t *trans);
 s4_transaction_t *_transaction_dummy_alloc (s4_t *s4);
 void _transaction_dummy_free (s4_transaction_t *trans);
 int _transaction_get_flags (s4_transaction_t *trans);
+entry_version_t *_transaction_get_versions (s4_transaction_t *trans);
+void _transaction_set_versions (s4_transaction_t *trans, entry_version_t *versions);
+guint64 _transaction_get_snapshot (s4_transaction_t *trans);
 
 typedef struct oplist_St oplist_t;
 oplist_t *_oplist_new (s4_transaction_t *trans);
@@ -151,11 +289,48 @@ int _oplist_get_del (oplist_t *list,
 		const char **key_b, const s4_val_t **val_b,
 		const char **src);
 int _oplist_get_writing (oplist_t *list);
+int _oplist_get_log_size (oplist_t *list, int *largest, int *writing);
 int _oplist_next (oplist_t *list);
 void _oplist_first (oplist_t *list);
 void _oplist_last (oplist_t *list);
 int _oplist_rollback (oplist_t *list);
 int _oplist_execute (oplist_t *list, int rollback_on_failure);
+oplist_t *_transaction_get_ops (s4_transaction_t *trans);
+
+s4_query_cache_t *_query_cache_new (int size);
+void _query_cache_free (s4_query_cache_t *cache);
+void _query_cache_clear (s4_query_cache_t *cache);
+s4_resultset_t *_query_cache_lookup (s4_query_cache_t *cache, guint64 snapshot,
+		s4_condition_t *cond, s4_fetchspec_t *fs);
+void _query_cache_insert (s4_query_cache_t *cache, guint64 snapshot,
+		s4_condition_t *cond, s4_fetchspec_t *fs, s4_resultset_t *set);
+void _query_cache_invalidate (s4_query_cache_t *cache, oplist_t *ops);
+
+typedef enum {
+	S4_STAT_DEADLOCKS,
+	S4_STAT_LOG_FULL,
+	S4_STAT_QUERY_CACHE_HITS,
+	S4_STAT_PLAN_INDEXED,
+	S4_STAT_PLAN_SCANNED,
+	S4_STAT_ROWS_EXAMINED,
+	S4_STAT_ROWS_RETURNED,
+	S4_STAT_RECOVERED,
+	S4_STAT_COUNTERS
+} s4_stat_counter_t;
+
+typedef enum {
+	S4_STAT_LOCK_WAIT,
+	S4_STAT_LOG_FSYNC,
+	S4_STAT_SYNC,
+	S4_STAT_QUERY,
+	S4_STAT_RECOVERY,
+	S4_STAT_TIMERS
+} s4_stat_timer_t;
+
+s4_stats_data_t *_stats_create_data (void);
+void _stats_free_data (s4_stats_data_t *data);
+void _stats_count (s4_t *s4, s4_stat_counter_t counter, int n);
+void _stats_time (s4_t *s4, s4_stat_timer_t timer, gint64 start);
 
 s4_log_data_t *_log_create_data (void);
 void _log_free_data (s4_log_data_t *data);
@@ -164,10 +339,16 @@ void _log_unlock_file (s4_t *s4);
 void _log_lock_db (s4_t *s4);
 void _log_unlock_db (s4_t *s4);
 int _log_write (oplist_t *list);
+int _log_mod_size (const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b, const char *src);
+int _log_simple_size (void);
 void _log_checkpoint (s4_t *s4);
 int _log_open (s4_t *s4);
 int _log_close (s4_t *s4);
+void _log_sync_all (s4_t *s4);
 log_number_t _log_last_synced (s4_t *s4);
+void _log_get_checkpoint (s4_t *s4, log_number_t *checkpoint, log_number_t *next);
 void _log_init (s4_t *s4, log_number_t last_checkpoint);
+void _log_get_fill (s4_t *s4, int32_t *used, int32_t *size);
 
 #endif
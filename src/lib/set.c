@@ -0,0 +1,250 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *
+ * @internal
+ * @defgroup Set Set
+ * @ingroup S4
+ * @brief Sets of pointers, used for the entries a query looks at.
+ *
+ * A set is an array of pointers kept sorted by address with no
+ * duplicates. Pointers are appended, and the array is only sorted
+ * when something was appended out of order and the set is read.
+ * Addresses differ from run to run, so a set that is read out in
+ * an order someone can see is put in order with _set_order first.
+ *
+ * @{
+ */
+
+struct s4_set_St {
+	void **data;
+	int size, alloc;
+	int sorted;
+};
+
+/**
+ * Creates a new set.
+ *
+ * @param size_hint The number of pointers to allocate room for.
+ * @return A new empty set.
+ */
+s4_set_t *_set_new (int size_hint)
+{
+	s4_set_t *set = malloc (sizeof (s4_set_t));
+
+	set->alloc = MAX (size_hint, 8);
+	set->data = malloc (sizeof (void*) * set->alloc);
+	set->size = 0;
+	set->sorted = 1;
+
+	return set;
+}
+
+/**
+ * Frees a set. The pointers in it are not freed.
+ *
+ * @param set The set to free.
+ */
+void _set_free (s4_set_t *set)
+{
+	free (set->data);
+	free (set);
+}
+
+/**
+ * Removes everything from a set, keeping the memory
+ * so it can be refilled without allocating.
+ *
+ * @param set The set to clear.
+ */
+void _set_clear (s4_set_t *set)
+{
+	set->size = 0;
+	set->sorted = 1;
+}
+
+/**
+ * Adds a pointer to a set.
+ *
+ * @param set The set to add to.
+ * @param p The pointer to add.
+ */
+void _set_add (s4_set_t *set, void *p)
+{
+	if (set->sorted && set->size > 0) {
+		void *last = set->data[set->size - 1];
+
+		if (last == p)
+			return;
+		if (last > p)
+			set->sorted = 0;
+	}
+
+	if (set->size >= set->alloc) {
+		set->alloc *= 2;
+		set->data = realloc (set->data, sizeof (void*) * set->alloc);
+	}
+
+	set->data[set->size++] = p;
+}
+
+static int _ptr_cmp (const void *a, const void *b)
+{
+	const char *pa = *(void* const*)a;
+	const char *pb = *(void* const*)b;
+
+	return (pa > pb) - (pa < pb);
+}
+
+/**
+ * Sorts the set and removes duplicates, if needed.
+ *
+ * @param set The set to sort.
+ */
+static void _set_sort (s4_set_t *set)
+{
+	int i, j;
+
+	if (set->sorted)
+		return;
+
+	qsort (set->data, set->size, sizeof (void*), _ptr_cmp);
+
+	for (i = j = 1; i < set->size; i++) {
+		if (set->data[i] != set->data[j - 1]) {
+			set->data[j++] = set->data[i];
+		}
+	}
+
+	set->size = MIN (j, set->size);
+	set->sorted = 1;
+}
+
+/**
+ * Gets the number of pointers in a set.
+ *
+ * @param set The set to get the size of.
+ * @return The number of pointers in the set.
+ */
+int _set_size (s4_set_t *set)
+{
+	_set_sort (set);
+	return set->size;
+}
+
+/**
+ * Puts the pointers of a set in another order than by address.
+ * Afterwards the set can only be read with _set_size and _set_get,
+ * it can no longer be added to or combined with other sets.
+ *
+ * @param set The set to order.
+ * @param cmp Compares two pointers, like qsort does with the
+ * addresses of the pointers.
+ */
+void _set_order (s4_set_t *set, GCompareFunc cmp)
+{
+	_set_sort (set);
+	qsort (set->data, set->size, sizeof (void*), cmp);
+}
+
+/**
+ * Gets a pointer in a set.
+ * Pointers are ordered by address, or as _set_order put them.
+ *
+ * @param set The set to get the pointer from.
+ * @param i The index of the pointer, 0 <= i < _set_size (set).
+ * @return The pointer.
+ */
+void *_set_get (s4_set_t *set, int i)
+{
+	_set_sort (set);
+	return set->data[i];
+}
+
+/**
+ * Removes everything from a set that is not in another set.
+ *
+ * @param set The set to change.
+ * @param other The set to intersect with.
+ */
+void _set_intersect (s4_set_t *set, s4_set_t *other)
+{
+	int i = 0, j = 0, k = 0;
+
+	_set_sort (set);
+	_set_sort (other);
+
+	while (i < set->size && j < other->size) {
+		if (set->data[i] == other->data[j]) {
+			set->data[k++] = set->data[i];
+			i++;
+			j++;
+		} else if ((char*)set->data[i] < (char*)other->data[j]) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+
+	set->size = k;
+}
+
+/**
+ * Adds everything in another set to a set.
+ *
+ * @param set The set to change.
+ * @param other The set to add.
+ */
+void _set_union (s4_set_t *set, s4_set_t *other)
+{
+	void **data;
+	int i = 0, j = 0, k = 0;
+
+	_set_sort (set);
+	_set_sort (other);
+
+	if (other->size == 0)
+		return;
+
+	set->alloc = MAX (set->size + other->size, 8);
+	data = malloc (sizeof (void*) * set->alloc);
+
+	while (i < set->size && j < other->size) {
+		if (set->data[i] == other->data[j]) {
+			data[k++] = set->data[i++];
+			j++;
+		} else if ((char*)set->data[i] < (char*)other->data[j]) {
+			data[k++] = set->data[i++];
+		} else {
+			data[k++] = other->data[j++];
+		}
+	}
+	for (; i < set->size; i++)
+		data[k++] = set->data[i];
+	for (; j < other->size; j++)
+		data[k++] = other->data[j];
+
+	free (set->data);
+	set->data = data;
+	set->size = k;
+}
+
+/**
+ * @}
+ */
@@ -16,12 +16,31 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* The priorities of source ids, an open addressing hash table that
+ * is only ever added to. Readers do not lock, so an id is set after
+ * its priority, and once set it never changes.
+ */
+typedef struct {
+	/* The serial of the database the ids belong to */
+	guint serial;
+	int size, used;
+	gint *ids, *prios;
+} prio_cache_t;
+
 struct s4_sourcepref_St {
 	GHashTable *table;
 	GMutex lock;
 	GPatternSpec **specs;
 	int spec_count;
 	int ref_count;
+
+	/* The cache of the database used last. Caches are replaced by
+	 * bigger ones when they fill up, or by the cache of another
+	 * database when it is used. The old ones are kept until the
+	 * sourcepref is freed, as readers may still use them.
+	 */
+	prio_cache_t *cache;
+	GSList *old_caches;
 };
 
 /**
@@ -32,6 +51,39 @@ struct s4_sourcepref_St {
  * @{
  */
 
+/* Creates an empty priority cache with room for size ids */
+static prio_cache_t *_cache_new (guint serial, int size)
+{
+	prio_cache_t *cache = malloc (sizeof (prio_cache_t) + sizeof (gint) * size * 2);
+
+	cache->serial = serial;
+	cache->size = size;
+	cache->used = 0;
+	cache->ids = (gint*)(cache + 1);
+	cache->prios = cache->ids + size;
+	memset (cache->ids, 0, sizeof (gint) * size);
+
+	return cache;
+}
+
+/* The first slot to look for id in */
+static int _cache_slot (prio_cache_t *cache, int32_t id)
+{
+	return ((guint32)id * 2654435769u) & (cache->size - 1);
+}
+
+/* Adds a priority to a cache that has room for it */
+static void _cache_insert (prio_cache_t *cache, int32_t id, int pri)
+{
+	int i;
+
+	for (i = _cache_slot (cache, id); cache->ids[i] != 0; i = (i + 1) & (cache->size - 1));
+
+	g_atomic_int_set (&cache->prios[i], pri);
+	g_atomic_int_set (&cache->ids[i], id);
+	cache->used++;
+}
+
 /* Helper function to s4_sourcepref_get_priority */
 static int _get_priority (s4_sourcepref_t *sp, const char *src)
 {
@@ -69,6 +121,9 @@ s4_sourcepref_t *s4_sourcepref_create (const char **srcprefs)
 	for (i = 0; i < sp->spec_count; i++)
 		sp->specs[i] = g_pattern_spec_new (srcprefs[i]);
 
+	sp->cache = _cache_new (0, 16);
+	sp->old_caches = NULL;
+
 	return sp;
 }
 
@@ -90,6 +145,8 @@ void s4_sourcepref_unref (s4_sourcepref_t *sp)
 			g_pattern_spec_free (sp->specs[i]);
 
 		free (sp->specs);
+		g_slist_free_full (sp->old_caches, free);
+		free (sp->cache);
 		free (sp);
 	}
 }
@@ -135,6 +192,119 @@ int s4_sourcepref_get_priority (s4_sourcepref_t *sp, const char *src)
 	return *i;
 }
 
+/**
+ * @{
+ * @internal
+ */
+
+/**
+ * Finds the priority of a source id and adds it to the cache.
+ *
+ * @param sp The sourcepref
+ * @param s4 The database the id belongs to
+ * @param src The id of the source
+ * @return The priority of the source
+ */
+static int _cache_priority (s4_sourcepref_t *sp, s4_t *s4, int32_t src)
+{
+	prio_cache_t *cache, *bigger;
+	int i, pri;
+
+	if (src == 0) {
+		/* 0 marks the free slots of the cache */
+		return s4_sourcepref_get_priority (sp, _const_get_str (s4, src));
+	}
+
+	g_mutex_lock (&sp->lock);
+
+	cache = sp->cache;
+	if (cache->serial != s4->serial) {
+		GSList *old;
+
+		/* Pick up where we left the database, the newest
+		 * of its caches is the biggest one
+		 */
+		for (old = sp->old_caches; old != NULL; old = old->next) {
+			if (((prio_cache_t*)old->data)->serial == s4->serial)
+				break;
+		}
+
+		if (old != NULL) {
+			bigger = old->data;
+			sp->old_caches = g_slist_delete_link (sp->old_caches, old);
+		} else {
+			bigger = _cache_new (s4->serial, 16);
+		}
+		sp->old_caches = g_slist_prepend (sp->old_caches, cache);
+		g_atomic_pointer_set (&sp->cache, bigger);
+		cache = bigger;
+	}
+
+	for (i = _cache_slot (cache, src); cache->ids[i] != 0; i = (i + 1) & (cache->size - 1)) {
+		/* Another thread added it */
+		if (cache->ids[i] == src) {
+			pri = cache->prios[i];
+			g_mutex_unlock (&sp->lock);
+			return pri;
+		}
+	}
+
+	/* Keep it at most half full */
+	if ((cache->used + 1) * 2 > cache->size) {
+		bigger = _cache_new (s4->serial, cache->size * 2);
+		for (i = 0; i < cache->size; i++) {
+			if (cache->ids[i] != 0)
+				_cache_insert (bigger, cache->ids[i], cache->prios[i]);
+		}
+		sp->old_caches = g_slist_prepend (sp->old_caches, cache);
+		g_atomic_pointer_set (&sp->cache, bigger);
+		cache = bigger;
+	}
+
+	pri = _get_priority (sp, _const_get_str (s4, src));
+	_cache_insert (cache, src, pri);
+
+	g_mutex_unlock (&sp->lock);
+
+	return pri;
+}
+
+/**
+ * Gets the priority of a source by its id.
+ * This is what queries use, the priority is usually found
+ * without locking or looking up the string.
+ *
+ * @param sp The sourcepref to check against, may be NULL
+ * @param s4 The database the id belongs to
+ * @param src The id of the source, see _const_get
+ * @return The priority of the source
+ */
+int _sourcepref_get_priority (s4_sourcepref_t *sp, s4_t *s4, int32_t src)
+{
+	prio_cache_t *cache;
+	int32_t id;
+	int i;
+
+	if (sp == NULL)
+		return 0;
+
+	cache = g_atomic_pointer_get (&sp->cache);
+	if (cache->serial == s4->serial) {
+		for (i = _cache_slot (cache, src);
+				(id = g_atomic_int_get (&cache->ids[i])) != 0;
+				i = (i + 1) & (cache->size - 1)) {
+			if (id == src)
+				return g_atomic_int_get (&cache->prios[i]);
+		}
+	}
+
+	return _cache_priority (sp, s4, src);
+}
+
+/**
+ * @}
+ */
+
 /**
  * @}
  */
@@ -0,0 +1,241 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *
+ * @defgroup Stats Statistics
+ * @ingroup S4
+ * @brief Counts what the database spends its time on.
+ *
+ * Counters are kept in a handful of slots, and every thread adds to
+ * the slot it was given the first time it counted something. Threads
+ * rarely share a slot, so adding is an uncontended atomic add on a
+ * cache line the thread has to itself. Reading sums up every slot.
+ * The counters are 64 bits. Where the compiler has no lock-free
+ * atomic add that wide, each slot has a lock instead.
+ *
+ * @{
+ */
+
+#define STATS_SLOTS 16
+
+#if !defined (__ATOMIC_RELAXED) || !defined (__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+#define STATS_LOCKED
+#endif
+
+typedef struct {
+	gint64 count, usec;
+	gint64 histogram[S4_STATS_HISTOGRAM_SIZE];
+} stats_timer_t;
+
+typedef struct {
+	gint64 counters[S4_STAT_COUNTERS];
+	stats_timer_t timers[S4_STAT_TIMERS];
+#ifdef STATS_LOCKED
+	GMutex lock;
+#endif
+	/* Keeps the next slot off our cache lines */
+	char pad[64];
+} stats_slot_t;
+
+struct s4_stats_data_St {
+	stats_slot_t slots[STATS_SLOTS];
+};
+
+/* The slot of this thread plus one, 0 until it has been given one */
+static GPrivate _slot = G_PRIVATE_INIT (NULL);
+static gint _next_slot = 0;
+
+static stats_slot_t *_stats_slot (s4_t *s4)
+{
+	int slot = GPOINTER_TO_INT (g_private_get (&_slot));
+
+	if (slot == 0) {
+		slot = g_atomic_int_add (&_next_slot, 1) % STATS_SLOTS + 1;
+		g_private_set (&_slot, GINT_TO_POINTER (slot));
+	}
+
+	return s4->stats_data->slots + slot - 1;
+}
+
+/**
+ * Creates the statistics of a database, with every counter at 0.
+ *
+ * @return The new statistics
+ */
+s4_stats_data_t *_stats_create_data (void)
+{
+	s4_stats_data_t *data = calloc (1, sizeof (s4_stats_data_t));
+#ifdef STATS_LOCKED
+	int i;
+
+	for (i = 0; i < STATS_SLOTS; i++)
+		g_mutex_init (&data->slots[i].lock);
+#endif
+
+	return data;
+}
+
+/**
+ * Frees the statistics of a database.
+ *
+ * @param data The statistics to free
+ */
+void _stats_free_data (s4_stats_data_t *data)
+{
+#ifdef STATS_LOCKED
+	int i;
+
+	for (i = 0; i < STATS_SLOTS; i++)
+		g_mutex_clear (&data->slots[i].lock);
+#endif
+	free (data);
+}
+
+/**
+ * Adds to a counter in a slot.
+ *
+ * @param slot The slot the counter is in
+ * @param counter The counter
+ * @param n What to add
+ */
+static void _stats_add (stats_slot_t *slot, gint64 *counter, gint64 n)
+{
+#ifdef STATS_LOCKED
+	g_mutex_lock (&slot->lock);
+	*counter += n;
+	g_mutex_unlock (&slot->lock);
+#else
+	__atomic_fetch_add (counter, n, __ATOMIC_RELAXED);
+#endif
+}
+
+/**
+ * Adds to a counter.
+ *
+ * @param s4 The database
+ * @param counter The counter to add to
+ * @param n What to add
+ */
+void _stats_count (s4_t *s4, s4_stat_counter_t counter, int n)
+{
+	stats_slot_t *slot = _stats_slot (s4);
+
+	_stats_add (slot, &slot->counters[counter], n);
+}
+
+/**
+ * Counts something that is done, and how long it took.
+ *
+ * @param s4 The database
+ * @param timer The timer to count it in
+ * @param start When it started, from g_get_monotonic_time
+ */
+void _stats_time (s4_t *s4, s4_stat_timer_t timer, gint64 start)
+{
+	stats_slot_t *slot = _stats_slot (s4);
+	stats_timer_t *t = &slot->timers[timer];
+	gint64 usec = g_get_monotonic_time () - start;
+	int bucket = 0;
+
+	while (bucket < S4_STATS_HISTOGRAM_SIZE - 1 && (usec >> (bucket + 1)) > 0) {
+		bucket++;
+	}
+
+	_stats_add (slot, &t->count, 1);
+	_stats_add (slot, &t->usec, usec);
+	_stats_add (slot, &t->histogram[bucket], 1);
+}
+
+static int64_t _stats_get (stats_slot_t *slot, const gint64 *counter)
+{
+	int64_t ret;
+
+#ifdef STATS_LOCKED
+	g_mutex_lock (&slot->lock);
+	ret = *counter;
+	g_mutex_unlock (&slot->lock);
+#else
+	ret = __atomic_load_n (counter, __ATOMIC_RELAXED);
+#endif
+
+	return ret;
+}
+
+static void _stats_get_timer (s4_t *s4, s4_stat_timer_t timer, s4_stats_timer_t *ret)
+{
+	int i, j;
+
+	for (i = 0; i < STATS_SLOTS; i++) {
+		stats_slot_t *slot = &s4->stats_data->slots[i];
+		stats_timer_t *t = &slot->timers[timer];
+
+		ret->count += _stats_get (slot, &t->count);
+		ret->usec += _stats_get (slot, &t->usec);
+		for (j = 0; j < S4_STATS_HISTOGRAM_SIZE; j++)
+			ret->histogram[j] += _stats_get (slot, &t->histogram[j]);
+	}
+}
+
+static int64_t _stats_get_counter (s4_t *s4, s4_stat_counter_t counter)
+{
+	int64_t ret = 0;
+	int i;
+
+	for (i = 0; i < STATS_SLOTS; i++) {
+		stats_slot_t *slot = &s4->stats_data->slots[i];
+
+		ret += _stats_get (slot, &slot->counters[counter]);
+	}
+
+	return ret;
+}
+
+/**
+ * Gets statistics about what a database has been doing since it was
+ * opened. The counters are read one by one while the database is in
+ * use, so they may be a few operations apart.
+ *
+ * @param s4 The database
+ * @param stats Filled with the statistics
+ */
+void s4_get_stats (s4_t *s4, s4_stats_t *stats)
+{
+	memset (stats, 0, sizeof (s4_stats_t));
+
+	_stats_get_timer (s4, S4_STAT_LOCK_WAIT, &stats->lock_wait);
+	_stats_get_timer (s4, S4_STAT_LOG_FSYNC, &stats->log_fsync);
+	_stats_get_timer (s4, S4_STAT_SYNC, &stats->sync);
+	_stats_get_timer (s4, S4_STAT_QUERY, &stats->query);
+	_stats_get_timer (s4, S4_STAT_RECOVERY, &stats->recovery);
+
+	stats->deadlocks = _stats_get_counter (s4, S4_STAT_DEADLOCKS);
+	stats->log_full = _stats_get_counter (s4, S4_STAT_LOG_FULL);
+	stats->query_cache_hits = _stats_get_counter (s4, S4_STAT_QUERY_CACHE_HITS);
+	stats->plan_indexed = _stats_get_counter (s4, S4_STAT_PLAN_INDEXED);
+	stats->plan_scanned = _stats_get_counter (s4, S4_STAT_PLAN_SCANNED);
+	stats->rows_examined = _stats_get_counter (s4, S4_STAT_ROWS_EXAMINED);
+	stats->rows_returned = _stats_get_counter (s4, S4_STAT_ROWS_RETURNED);
+	stats->recovered = _stats_get_counter (s4, S4_STAT_RECOVERED);
+
+	_log_get_fill (s4, &stats->log_used, &stats->log_size);
+}
+
+/**
+ * @}
+ */
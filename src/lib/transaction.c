@@ -28,17 +28,27 @@ struct s4_transaction_St {
 	int flags;
 	s4_t *s4;
 	oplist_t *ops;
-	GList *locks;
+	s4_lock_holder_t *locks;
 	s4_lock_t *waiting_for;
 	int error_code;
 	int restartable, failed;
+
+	/* The snapshot read-only transactions read from */
+	guint64 snapshot;
+	/* The versions of the entries this transaction changed */
+	entry_version_t *versions;
 };
 
 
 static void _transaction_free (s4_transaction_t *trans)
 {
+	if (trans->flags & S4_TRANS_READONLY) {
+		_entry_end_snapshot (trans->s4, trans->snapshot);
+	} else {
+		_entry_stamp_versions (trans);
+	}
+
 	_lock_unlock_all (trans);
-	g_list_free (trans->locks);
 	_oplist_free (trans->ops);
 	free (trans);
 }
@@ -58,14 +68,34 @@ void _transaction_set_waiting_for (s4_transaction_t *trans, s4_lock_t *waiting_f
 	g_atomic_pointer_set (&trans->waiting_for, waiting_for);
 }
 
-GList *_transaction_get_locks (s4_transaction_t *trans)
+s4_lock_holder_t *_transaction_get_locks (s4_transaction_t *trans)
 {
 	return trans->locks;
 }
 
-void _transaction_add_lock (s4_transaction_t *trans, s4_lock_t *lock)
+void _transaction_set_locks (s4_transaction_t *trans, s4_lock_holder_t *locks)
 {
-	trans->locks = g_list_prepend (trans->locks, lock);
+	trans->locks = locks;
+}
+
+entry_version_t *_transaction_get_versions (s4_transaction_t *trans)
+{
+	return trans->versions;
+}
+
+void _transaction_set_versions (s4_transaction_t *trans, entry_version_t *versions)
+{
+	trans->versions = versions;
+}
+
+oplist_t *_transaction_get_ops (s4_transaction_t *trans)
+{
+	return trans->ops;
+}
+
+guint64 _transaction_get_snapshot (s4_transaction_t *trans)
+{
+	return trans->snapshot;
 }
 
 void _transaction_set_deadlocked (s4_transaction_t *trans)
@@ -84,8 +114,8 @@ s4_transaction_t *_transaction_dummy_alloc (s4_t *s4)
 
 void _transaction_dummy_free (s4_transaction_t *trans)
 {
+	_entry_stamp_versions (trans);
 	_lock_unlock_all (trans);
-	g_list_free (trans->locks);
 	free (trans);
 }
 
@@ -94,31 +124,158 @@ int _transaction_get_flags (s4_transaction_t *trans)
 	return trans->flags;
 }
 
+static s4_transaction_t *_transaction_new (s4_t *s4, int flags)
+{
+	s4_transaction_t *trans = calloc (sizeof (s4_transaction_t), 1);
+	trans->s4 = s4;
+	trans->flags = flags;
+	trans->ops = _oplist_new (trans);
+	trans->restartable = 1;
+
+	if (flags & S4_TRANS_READONLY) {
+		trans->snapshot = _entry_begin_snapshot (s4);
+	}
+
+	_log_lock_file (s4);
+
+	return trans;
+}
+
 /**
  * Starts a new transaction.
  *
  * @param s4 The database to run the transaction on.
  * @param flags Flags specifying what kind of transaction this should be.
+ * S4_TRANS_READONLY transactions can not change anything. They read
+ * the database as it was when they started, without taking any locks,
+ * so they never deadlock and writers do not wait for them.
+ * S4_TRANS_NOSYNC transactions do not wait for the log to be synced
+ * to disk when committing, so a crash may lose them. See s4_flush_log.
  * @return A new transaction that can be used when calling s4_add, s4_del
- * and s4_query.
+ * and s4_query, or NULL if a bulk load is open on the database
+ * (s4_errno is set to S4E_BULK).
  */
 s4_transaction_t *s4_begin (s4_t *s4, int flags)
 {
-	s4_transaction_t *trans = calloc (sizeof (s4_transaction_t), 1);
-	trans->s4 = s4;
-	trans->flags = flags;
-	trans->ops = _oplist_new (trans);
-	trans->restartable = 1;
+	if (g_atomic_int_get (&s4->bulk_loads) > 0) {
+		s4_set_errno (S4E_BULK);
+		return NULL;
+	}
 
-	_log_lock_file (s4);
+	return _transaction_new (s4, flags);
+}
+
+/**
+ * Logs the changes of a transaction and stamps them, so a checkpoint
+ * snapshot either sees the transaction and has it before its log
+ * number, or does not see it and has it after.
+ *
+ * @param trans The transaction to log.
+ * @return 0 if it did not fit in the log, non-zero otherwise.
+ */
+static int _transaction_log (s4_transaction_t *trans)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	int ret;
+
+	g_rw_lock_reader_lock (&s4->checkpoint_lock);
+	ret = _log_write (trans->ops);
+	if (ret) {
+		_entry_stamp_versions (trans);
+	}
+	g_rw_lock_reader_unlock (&s4->checkpoint_lock);
+
+	return ret;
+}
+
+/**
+ * Starts the read-only transaction a checkpoint reads the database
+ * from. Commits wait while the snapshot is taken and the writing-entry
+ * is logged, so everything logged before the entry is in the snapshot
+ * and nothing logged after it.
+ *
+ * @param s4 The database to checkpoint.
+ * @param full non-zero if every entry is written, so the entries
+ * changed up to now are no longer dirty.
+ * @return The transaction to read the database with.
+ */
+s4_transaction_t *_transaction_begin_checkpoint (s4_t *s4, int full)
+{
+	s4_transaction_t *trans, *mark;
+
+	g_rw_lock_writer_lock (&s4->checkpoint_lock);
+
+	trans = _transaction_new (s4, S4_TRANS_READONLY);
+	if (full) {
+		_entry_clear_dirty (s4);
+	}
+
+	/* The database is synced when the file is written,
+	 * _log_write does not sync the mark
+	 */
+	mark = _transaction_new (s4, S4_TRANS_NOSYNC);
+	_transaction_writing (mark);
+	_log_write (mark->ops);
+	_log_unlock_file (s4);
+	_transaction_free (mark);
+
+	g_rw_lock_writer_unlock (&s4->checkpoint_lock);
 
 	return trans;
 }
 
+/**
+ * Restarts a transaction that did not fit in the log.
+ * The changes are undone and the locks released so the database can
+ * be checkpointed (growing the log if the transaction was too big for
+ * it), then the operations are applied and logged once more.
+ * Only transactions that have not queried anything can be restarted,
+ * as nothing they did can depend on what they read.
+ *
+ * @param trans The transaction to restart.
+ * @return 0 on error (and sets s4_errno), non-zero on success.
+ * On error nothing in the transaction is applied.
+ */
+static int _transaction_restart (s4_transaction_t *trans)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+
+	_oplist_last (trans->ops);
+	_oplist_rollback (trans->ops);
+	_entry_stamp_versions (trans);
+	_lock_unlock_all (trans);
+
+	/* Only wait for the log to be freed, the sync thread writes
+	 * the checkpoint while other transactions go on
+	 */
+	_log_unlock_file (s4);
+	_sync_log (s4);
+	_log_lock_file (s4);
+
+	/* _oplist_execute rolls back by itself */
+	if (!_oplist_execute (trans->ops, 1)) {
+		return 0;
+	}
+
+	if (!_transaction_log (trans)) {
+		_oplist_last (trans->ops);
+		_oplist_rollback (trans->ops);
+		s4_set_errno (S4E_LOGFULL);
+		return 0;
+	}
+
+	return 1;
+}
+
 /**
  * Commits a transaction. On success the operations in the transactions
  * will be applied in one atomic step, on error none of the operations
  * in the transaction will be applied.
+ * If the transaction does not fit in the log and has not queried the
+ * database it is restarted once a checkpoint has freed the log, so it
+ * fails with S4E_LOGFULL only when that did not make enough room.
+ * Other transactions fail with S4E_LOGFULL right away, and a checkpoint
+ * is started in the background.
  *
  * @param trans The transaction to commit.
  * @return 0 on error (and sets s4_errno), non-zero on success.
@@ -126,21 +283,25 @@ s4_transaction_t *s4_begin (s4_t *s4, int flags)
 int s4_commit (s4_transaction_t *trans)
 {
 	int ret = 0;
-	int need_sync = 0;
+	int need_sync = 0, restarted = 0;
 	s4_t *s4 = _transaction_get_db (trans);
 
 	if (trans->failed) {
 		s4_set_errno (trans->error_code);
 	} else {
-		ret = _log_write (trans->ops);
+		ret = _transaction_log (trans);
 
-		if (ret == 0) {
+		if (ret == 0 && trans->restartable) {
+			ret = _transaction_restart (trans);
+			restarted = 1;
+		} else if (ret == 0) {
 			need_sync = 1;
 			s4_set_errno (S4E_LOGFULL);
 		}
 	}
 
-	if (ret == 0) {
+	/* A failed restart has already undone everything */
+	if (ret == 0 && !restarted) {
 		_oplist_last (trans->ops);
 		_oplist_rollback (trans->ops);
 	}
@@ -149,7 +310,7 @@ int s4_commit (s4_transaction_t *trans)
 	_transaction_free (trans);
 
 	if (need_sync) {
-		_sync (s4);
+		_start_sync (s4);
 	}
 
 	return ret;
@@ -285,7 +446,10 @@ int s4_del (s4_transaction_t *trans,
  * @param trans The transaction to use. If trans is NULL s4 must be non-null.
  * @param spec The fetchspecification to use when querying.
  * @param cond The condition to use when querying.
- * @return A resultset containing the fetched data.
+ * @return A resultset containing the fetched data, with the rows in
+ * the order their entries were created. If the database
+ * caches queries (see s4_options_set_query_cache) the rows of
+ * read-only transactions may be shared with other resultsets.
  */
 s4_resultset_t *s4_query (s4_transaction_t *trans,
 		s4_fetchspec_t *spec, s4_condition_t *cond)
@@ -303,6 +467,151 @@ s4_resultset_t *s4_query (s4_transaction_t *trans,
 	return ret;
 }
 
+/**
+ * Queries an S4 database without fetching everything up front.
+ * Entries are checked and fetched one at a time by s4_cursor_next,
+ * in the same order s4_query returns them. Entries skipped by offset
+ * are checked but never fetched, and nothing is checked after limit
+ * rows are returned.
+ *
+ * The cursor reads the database through the transaction, so it must
+ * be freed before the transaction is committed or aborted.
+ *
+ * @param trans The transaction to use.
+ * @param spec The fetchspecification to use when querying.
+ * @param cond The condition to use when querying.
+ * @param offset The number of matching rows to skip.
+ * @param limit The largest number of rows to return, negative for no limit.
+ * @return A new cursor, free it with s4_cursor_free.
+ */
+s4_cursor_t *s4_query_cursor (s4_transaction_t *trans,
+		s4_fetchspec_t *spec, s4_condition_t *cond, int offset, int limit)
+{
+	trans->restartable = 0;
+
+	if (trans->failed)
+		limit = 0;
+
+	return _s4_query_cursor (trans, spec, cond, offset, limit);
+}
+
+/**
+ * Queries an S4 database for the first rows in an order.
+ * Only offset + limit rows are kept while the matching entries are
+ * fetched, so ordering many rows for a short page takes
+ * O(n log (offset + limit)) and the rows that don't make it are
+ * freed right away. A negative limit sorts every row.
+ *
+ * @param trans The transaction to use.
+ * @param spec The fetchspecification to use when querying.
+ * @param cond The condition to use when querying.
+ * @param order The order of the rows.
+ * @param offset The number of rows to skip.
+ * @param limit The largest number of rows to return, negative for no limit.
+ * @return A resultset with the rows in order.
+ */
+s4_resultset_t *s4_query_ordered (s4_transaction_t *trans,
+		s4_fetchspec_t *spec, s4_condition_t *cond,
+		s4_order_t *order, int offset, int limit)
+{
+	s4_resultset_t *ret;
+	s4_cursor_t *cursor;
+	s4_topk_t *topk;
+	const s4_resultrow_t *row;
+
+	offset = MAX (offset, 0);
+	if (limit >= 0)
+		limit = (limit > G_MAXINT - 1 - offset)?-1:offset + limit;
+
+	topk = _topk_new (order, limit);
+	cursor = s4_query_cursor (trans, spec, cond, 0, -1);
+	while (s4_cursor_next (cursor, &row))
+		_topk_add (topk, row);
+	s4_cursor_free (cursor);
+
+	ret = s4_resultset_create (s4_fetchspec_size (spec));
+	_topk_finish (topk, ret, offset);
+
+	return ret;
+}
+
+/**
+ * Groups the entries matching a condition by the values of a key,
+ * and computes an aggregate for every group. The groups are computed
+ * from the entries directly, no rows are fetched for them.
+ *
+ * The resultset has a row per group in the order they were found. The
+ * first column is the value of group_key, the second the aggregate
+ * with key as its key. An entry with several values of group_key is in
+ * all of their groups, and entries without it are left out. If
+ * group_key is NULL every entry is in one group, and the resultset has
+ * exactly one row with an empty first column.
+ *
+ * @param trans The transaction to use.
+ * @param cond The condition to use when querying.
+ * @param group_key The key to group by, or NULL for a single group.
+ * @param group_sp The sourcepref to pick the values of group_key with.
+ * @param type The aggregate. S4_AGGREGATE_COUNT counts the entries,
+ * the others take the sum, minimum or maximum of the integer values
+ * of key. Values that are not integers are ignored, and if a group
+ * has none its minimum and maximum are empty columns. Sums outside of
+ * the range of an int32_t are clamped.
+ * @param key The key to aggregate, not used by S4_AGGREGATE_COUNT.
+ * @param sp The sourcepref to pick the values of key with.
+ * @return A resultset with two columns and a row per group.
+ */
+s4_resultset_t *s4_query_group (s4_transaction_t *trans, s4_condition_t *cond,
+		const char *group_key, s4_sourcepref_t *group_sp,
+		s4_aggregate_t type, const char *key, s4_sourcepref_t *sp)
+{
+	trans->restartable = 0;
+
+	if (trans->failed)
+		return s4_resultset_create (2);
+
+	return _s4_query_group (trans, cond, group_key, group_sp, type, key, sp);
+}
+
+/**
+ * Finds the distinct values of a key in the entries matching a
+ * condition, and how many entries have each of them.
+ * This is s4_query_group counting the entries of every group.
+ *
+ * @param trans The transaction to use.
+ * @param cond The condition to use when querying.
+ * @param key The key to find the values of.
+ * @param sp The sourcepref to pick the values with.
+ * @return A resultset with a row per value. The first column is
+ * the value, the second the number of entries with it.
+ */
+s4_resultset_t *s4_query_distinct (s4_transaction_t *trans,
+		s4_condition_t *cond, const char *key, s4_sourcepref_t *sp)
+{
+	return s4_query_group (trans, cond, key, sp, S4_AGGREGATE_COUNT, NULL, NULL);
+}
+
+/**
+ * Counts the entries matching a condition.
+ *
+ * @param trans The transaction to use.
+ * @param cond The condition to use when querying.
+ * @return The number of entries, 0 if the transaction failed.
+ */
+int s4_query_count (s4_transaction_t *trans, s4_condition_t *cond)
+{
+	s4_resultset_t *set;
+	const s4_result_t *res;
+	int32_t ret = 0;
+
+	set = s4_query_group (trans, cond, NULL, NULL, S4_AGGREGATE_COUNT, NULL, NULL);
+	res = s4_resultset_get_result (set, 0, 1);
+	if (res != NULL)
+		s4_val_get_int (s4_result_get_val (res), &ret);
+	s4_resultset_free (set);
+
+	return ret;
+}
+
 /**
  * @}
  */
@@ -23,8 +23,10 @@ typedef enum {
 	S4_VAL_INT
 } s4_val_type_t;
 
+/* id is the id of a constant value, see _const_get, and 0 otherwise */
 struct s4_val_St {
 	s4_val_type_t type;
+	int32_t id;
 	union {
 		struct {
 			s4_t *s4;
@@ -57,6 +59,7 @@ s4_val_t *s4_val_new_string (const char *str)
 {
 	s4_val_t *val = malloc (sizeof (s4_val_t));
 	val->type = S4_VAL_STR;
+	val->id = 0;
 	val->v.str.s = strdup (str);
 	val->v.str.co = NULL;
 	val->v.str.ca = NULL;
@@ -82,6 +85,7 @@ s4_val_t *s4_val_new_internal_string (const char *str, s4_t *s4)
 {
 	s4_val_t *val = malloc (sizeof (s4_val_t));
 	val->type = S4_VAL_STR_INTERNAL;
+	val->id = 0;
 	val->v.str.s = str;
 	val->v.str.co = NULL;
 	val->v.str.ca = NULL;
@@ -90,6 +94,67 @@ s4_val_t *s4_val_new_internal_string (const char *str, s4_t *s4)
 	return val;
 }
 
+/**
+ * Creates an integer value in an arena.
+ * It is freed with the arena, and must not be freed with s4_val_free.
+ *
+ * @param i The integer to use as the value
+ * @param arena The arena to allocate the value in
+ * @return A new integer value
+ */
+s4_val_t *_val_new_int_in (int32_t i, s4_arena_t *arena)
+{
+	s4_val_t *val = _arena_alloc (arena, INT_SIZE);
+	val->type = S4_VAL_INT;
+	val->id = 0;
+	val->v.i = i;
+
+	return val;
+}
+
+/**
+ * Gets the id of a constant value.
+ *
+ * @param val The value
+ * @return The id, or 0 if the value is not a constant
+ */
+int32_t _val_get_id (const s4_val_t *val)
+{
+	return val->id;
+}
+
+/**
+ * Sets the collated and casefolded strings of a constant string value,
+ * if they are not known already.
+ *
+ * @param val The value
+ * @param collated The collated string, or NULL to leave it unknown
+ * @param casefolded The casefolded string, or NULL to leave it unknown
+ */
+void _val_set_sort_keys (const s4_val_t *val, const char *collated, const char *casefolded)
+{
+	s4_val_t *v = (s4_val_t*)val;
+
+	if (val->type != S4_VAL_STR_INTERNAL)
+		return;
+
+	if (v->v.str.co == NULL)
+		v->v.str.co = collated;
+	if (v->v.str.ca == NULL)
+		v->v.str.ca = casefolded;
+}
+
+/**
+ * Sets the id of a constant value.
+ *
+ * @param val The value
+ * @param id The id
+ */
+void _val_set_id (s4_val_t *val, int32_t id)
+{
+	val->id = id;
+}
+
 /**
  * @}
  */
@@ -104,6 +169,7 @@ s4_val_t *s4_val_new_int (int32_t i)
 {
 	s4_val_t *val = malloc (INT_SIZE);
 	val->type = S4_VAL_INT;
+	val->id = 0;
 	val->v.i = i;
 
 	return val;
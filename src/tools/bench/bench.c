@@ -0,0 +1,217 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+
+/* Times benchmark cases and prints what they took.
+ * A case is timed as a whole, and the operations in it one by one,
+ * so the output has both the throughput and the latency percentiles.
+ * Times are taken from the monotonic clock, in microseconds.
+ */
+
+struct bench_St {
+	bench_format_t format;
+	FILE *out;
+	const char **filters;
+	int cases;
+};
+
+struct bench_case_St {
+	bench_t *bench;
+	char *name;
+	gint64 start, op_start;
+	GArray *samples;
+};
+
+/**
+ * Creates a new benchmark run.
+ *
+ * @param format How to print the cases
+ * @param out Where to print them
+ * @param filters NULL terminated name prefixes of the cases to run,
+ * NULL or empty to run every case
+ * @return The new run
+ */
+bench_t *bench_new (bench_format_t format, FILE *out, const char **filters)
+{
+	bench_t *bench = malloc (sizeof (bench_t));
+
+	bench->format = format;
+	bench->out = out;
+	bench->filters = filters;
+	bench->cases = 0;
+
+	return bench;
+}
+
+/**
+ * Checks if a case should run.
+ *
+ * @param bench The run
+ * @param name The name of the case, or a prefix of the names of a group of cases
+ * @return non-zero if it should, 0 otherwise
+ */
+int bench_enabled (bench_t *bench, const char *name)
+{
+	int i;
+
+	if (bench->filters == NULL || bench->filters[0] == NULL)
+		return 1;
+
+	for (i = 0; bench->filters[i] != NULL; i++) {
+		if (g_str_has_prefix (name, bench->filters[i]) ||
+				g_str_has_prefix (bench->filters[i], name))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Ends a run and frees it.
+ *
+ * @param bench The run
+ */
+void bench_finish (bench_t *bench)
+{
+	if (bench->format == BENCH_JSON)
+		fprintf (bench->out, bench->cases ? "\n]\n" : "[]\n");
+
+	fflush (bench->out);
+	free (bench);
+}
+
+/**
+ * Starts timing a case.
+ *
+ * @param bench The run
+ * @param name The name of the case
+ * @return The case, ended with bench_case_end
+ */
+bench_case_t *bench_case_begin (bench_t *bench, const char *name)
+{
+	bench_case_t *c = malloc (sizeof (bench_case_t));
+
+	c->bench = bench;
+	c->name = g_strdup (name);
+	c->samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+	c->start = g_get_monotonic_time ();
+
+	return c;
+}
+
+/**
+ * Starts timing an operation. Operations of one case
+ * can not overlap, see bench_add_samples for threads.
+ *
+ * @param c The case
+ */
+void bench_op_begin (bench_case_t *c)
+{
+	c->op_start = g_get_monotonic_time ();
+}
+
+/**
+ * Stops timing an operation.
+ *
+ * @param c The case
+ */
+void bench_op_end (bench_case_t *c)
+{
+	gint64 usec = g_get_monotonic_time () - c->op_start;
+	g_array_append_val (c->samples, usec);
+}
+
+/**
+ * Adds operations timed somewhere else, like in other threads.
+ *
+ * @param c The case
+ * @param samples The times of the operations in microseconds
+ */
+void bench_add_samples (bench_case_t *c, GArray *samples)
+{
+	g_array_append_vals (c->samples, samples->data, samples->len);
+}
+
+static int _sample_cmp (const void *a, const void *b)
+{
+	gint64 x = *(const gint64*)a, y = *(const gint64*)b;
+	return (x > y) - (x < y);
+}
+
+/* The nearest-rank percentile of sorted samples */
+static gint64 _percentile (GArray *samples, int p)
+{
+	int i = (samples->len * p + 99) / 100;
+	return g_array_index (samples, gint64, CLAMP (i, 1, samples->len) - 1);
+}
+
+/**
+ * Stops timing a case, prints it and frees it.
+ * A case without operations counts as one operation.
+ *
+ * @param c The case
+ */
+void bench_case_end (bench_case_t *c)
+{
+	bench_t *bench = c->bench;
+	gint64 total = g_get_monotonic_time () - c->start;
+	gint64 p50, p90, p99, max;
+	double sec, rate;
+	int ops;
+
+	if (c->samples->len == 0)
+		g_array_append_val (c->samples, total);
+
+	qsort (c->samples->data, c->samples->len, sizeof (gint64), _sample_cmp);
+	ops = c->samples->len;
+	p50 = _percentile (c->samples, 50);
+	p90 = _percentile (c->samples, 90);
+	p99 = _percentile (c->samples, 99);
+	max = g_array_index (c->samples, gint64, ops - 1);
+	sec = total / (double)G_USEC_PER_SEC;
+	rate = (total > 0) ? ops / sec : 0;
+
+	switch (bench->format) {
+	case BENCH_TEXT:
+		fprintf (bench->out, "%-28s %8i ops %9.3f s %11.0f ops/s"
+				"  p50 %7" G_GINT64_FORMAT " p90 %7" G_GINT64_FORMAT
+				" p99 %7" G_GINT64_FORMAT " max %8" G_GINT64_FORMAT " us\n",
+				c->name, ops, sec, rate, p50, p90, p99, max);
+		break;
+	case BENCH_CSV:
+		if (bench->cases == 0)
+			fprintf (bench->out, "name,ops,seconds,ops_per_sec,p50_us,p90_us,p99_us,max_us\n");
+		fprintf (bench->out, "%s,%i,%.6f,%.1f,%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT
+				",%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT "\n",
+				c->name, ops, sec, rate, p50, p90, p99, max);
+		break;
+	case BENCH_JSON:
+		fprintf (bench->out, "%s  {\"name\": \"%s\", \"ops\": %i, \"seconds\": %.6f, "
+				"\"ops_per_sec\": %.1f, \"p50_us\": %" G_GINT64_FORMAT
+				", \"p90_us\": %" G_GINT64_FORMAT ", \"p99_us\": %" G_GINT64_FORMAT
+				", \"max_us\": %" G_GINT64_FORMAT "}",
+				bench->cases ? ",\n" : "[\n",
+				c->name, ops, sec, rate, p50, p90, p99, max);
+		break;
+	}
+	fflush (bench->out);
+
+	bench->cases++;
+	g_array_free (c->samples, TRUE);
+	g_free (c->name);
+	free (c);
+}
@@ -0,0 +1,40 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdio.h>
+#include <glib.h>
+
+typedef enum {
+	BENCH_TEXT,
+	BENCH_CSV,
+	BENCH_JSON
+} bench_format_t;
+
+typedef struct bench_St bench_t;
+typedef struct bench_case_St bench_case_t;
+
+bench_t *bench_new (bench_format_t format, FILE *out, const char **filters);
+int bench_enabled (bench_t *bench, const char *name);
+void bench_finish (bench_t *bench);
+
+bench_case_t *bench_case_begin (bench_t *bench, const char *name);
+void bench_case_end (bench_case_t *c);
+void bench_op_begin (bench_case_t *c);
+void bench_op_end (bench_case_t *c);
+void bench_add_samples (bench_case_t *c, GArray *samples);
+
+#endif /* _BENCH_H */
@@ -13,136 +13,956 @@
  */
 
 #include "s4.h"
+#include "bench.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 
-#define ENTRIES 10000
+/* Songs per album, and albums per artist */
+#define TRACKS 12
+#define ALBUMS 4
 
 void log_init (GLogLevelFlags log_lev);
 
-long timediff (GTimeVal *prev, GTimeVal *cur)
+static bench_t *bench;
+static int songs = 20000;
+static int reps = 200;
+static int threads = 4;
+static int query_cache = 0;
+static int compact_strings = 0;
+
+static const char *indices[] = {"artist", "album", "title", NULL};
+static const char *sources[] = {"server", "plugin/id3v2", "plugin/*", NULL};
+static s4_sourcepref_t *sp;
+
+static const char *genres[] = {"Rock", "Pop", "Jazz", "Classical", "Metal",
+	"Electronic", "Folk", "Blues", "Hip-Hop", "Ambient"};
+static const char *words[] = {"love", "night", "blue", "road", "fire", "heart",
+	"rain", "dream", "river", "light", "city", "time", "home", "gold", "star",
+	"wind"};
+
+#define LEN(a) ((int)(sizeof (a) / sizeof (a[0])))
+
+static char *temp_filename (void)
 {
-	long ret;
+	char *filename;
+	int fd;
 
-   	ret = (cur->tv_sec - prev->tv_sec) * G_USEC_PER_SEC;
-	ret += cur->tv_usec - prev->tv_usec;
+	fd = g_file_open_tmp ("s4bench-XXXXXX", &filename, NULL);
+	g_close (fd, NULL);
+	g_unlink (filename);
 
-	return ret;
+	return filename;
 }
 
-void take_time (const char *message, GTimeVal *prev, GTimeVal *cur)
+static void remove_db (char *filename)
 {
-	g_get_current_time (cur);
+	static const char *suffixes[] = {"", ".log", ".delta", ".chkpnt", ".delta.chkpnt", NULL};
+	char *name;
+	int i;
+
+	for (i = 0; suffixes[i] != NULL; i++) {
+		name = g_strconcat (filename, suffixes[i], NULL);
+		g_unlink (name);
+		g_free (name);
+	}
+	g_free (filename);
+}
+
+static s4_t *open_db (const char *filename, const char **idx, int flags)
+{
+	s4_options_t *opts = s4_options_create ();
+	s4_t *s4;
 
-	printf ("%s %li.%.6li sec\n", message,
-			timediff (prev, cur) / G_USEC_PER_SEC,
-			timediff (prev, cur) % G_USEC_PER_SEC);
+	s4_options_set_token_index (opts, 1);
+	s4_options_set_query_cache (opts, query_cache);
+	s4_options_set_compact_strings (opts, compact_strings);
+	s4 = s4_open_with_options (filename, idx, flags, opts);
+	s4_options_free (opts);
 
-	g_get_current_time (prev);
+	if (s4 == NULL) {
+		fprintf (stderr, "Could not open %s\n", filename ? filename : "memory database");
+		exit (1);
+	}
+
+	return s4;
 }
 
-int main (int argc, char *argv[])
-{
+/* The modify scenarios of the old benchmark: int relations
+ * added and removed one by one, in one big transaction,
+ * backwards and from several threads at once.
+ */
+
+typedef struct {
 	s4_t *s4;
+	const char *key;
+	int first, last, step;
+	int add;
+	GArray *samples;
+} bench_range_t;
+
+static void modify (s4_t *s4, s4_transaction_t *t, const char *key, int i, int add)
+{
+	s4_val_t *val = s4_val_new_int (i);
+
+	if (add)
+		s4_add (t, key, val, "b", val, "src");
+	else
+		s4_del (t, key, val, "b", val, "src");
+
+	s4_val_free (val);
+}
+
+static gpointer modify_range (bench_range_t *range)
+{
 	s4_transaction_t *t;
-	int i, fd;
-	char *filename;
-	GTimeVal cur, prev;
+	gint64 start, usec;
+	int i;
 
-	log_init(G_LOG_LEVEL_MASK & ~G_LOG_LEVEL_DEBUG);
-	g_get_current_time (&prev);
+	for (i = range->first; i != range->last; i += range->step) {
+		start = g_get_monotonic_time ();
+		t = s4_begin (range->s4, 0);
+		modify (range->s4, t, range->key, i, range->add);
+		s4_commit (t);
+		usec = g_get_monotonic_time () - start;
+		g_array_append_val (range->samples, usec);
+	}
 
-	fd = g_file_open_tmp ("s4bench-XXXXXX", &filename, NULL);
-	g_close (fd, NULL);
-	g_unlink (filename);
+	return NULL;
+}
 
-	s4 = s4_open (filename, NULL, S4_NEW);
+static void bench_modify_single (s4_t *s4, const char *name, int backwards, int add)
+{
+	bench_range_t range;
+	bench_case_t *c;
+
+	if (!bench_enabled (bench, name))
+		return;
+
+	range.s4 = s4;
+	range.key = "a";
+	range.first = backwards ? songs : 0;
+	range.last = backwards ? 0 : songs;
+	range.step = backwards ? -1 : 1;
+	range.add = add;
+	range.samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+	c = bench_case_begin (bench, name);
+	modify_range (&range);
+	bench_add_samples (c, range.samples);
+	bench_case_end (c);
+
+	g_array_free (range.samples, TRUE);
+}
 
-	if (s4 == NULL) {
-		fprintf (stderr, "Could not open %s\n", argv[1]);
-		exit (1);
+static void bench_modify_big (s4_t *s4, const char *name, int add)
+{
+	s4_transaction_t *t;
+	bench_case_t *c;
+	int i;
+
+	if (!bench_enabled (bench, name))
+		return;
+
+	c = bench_case_begin (bench, name);
+	t = s4_begin (s4, 0);
+	for (i = 0; i < songs; i++)
+		modify (s4, t, "a", i, add);
+	s4_commit (t);
+	bench_case_end (c);
+}
+
+/* Runs single-op transactions from several threads at once.
+ * Every thread uses its own key, so they do not wait for each
+ * others' locks and only compete for the log.
+ */
+static void bench_modify_threaded (s4_t *s4, const char *name, int add)
+{
+	bench_range_t *ranges = malloc (sizeof (bench_range_t) * threads);
+	GThread **thread = malloc (sizeof (GThread*) * threads);
+	bench_case_t *c;
+	int i;
+
+	if (!bench_enabled (bench, name))
+		goto out;
+
+	c = bench_case_begin (bench, name);
+	for (i = 0; i < threads; i++) {
+		ranges[i].s4 = s4;
+		ranges[i].key = g_strdup_printf ("t%i", i);
+		ranges[i].first = i * songs / threads;
+		ranges[i].last = (i + 1) * songs / threads;
+		ranges[i].step = 1;
+		ranges[i].add = add;
+		ranges[i].samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+		thread[i] = g_thread_new ("bench", (GThreadFunc)modify_range, &ranges[i]);
+	}
+
+	for (i = 0; i < threads; i++) {
+		g_thread_join (thread[i]);
+		bench_add_samples (c, ranges[i].samples);
+		g_array_free (ranges[i].samples, TRUE);
+		g_free ((char*)ranges[i].key);
 	}
+	bench_case_end (c);
+
+out:
+	free (ranges);
+	free (thread);
+}
+
+static void bench_modify (void)
+{
+	char *filename;
+	s4_t *s4;
+
+	if (!bench_enabled (bench, "modify/"))
+		return;
+
+	filename = temp_filename ();
+	s4 = open_db (filename, NULL, S4_NEW);
+
+	bench_modify_single (s4, "modify/add", 0, 1);
+	bench_modify_single (s4, "modify/del", 0, 0);
+	bench_modify_big (s4, "modify/big-add", 1);
+	bench_modify_big (s4, "modify/big-del", 0);
+	bench_modify_single (s4, "modify/backwards-add", 1, 1);
+	bench_modify_single (s4, "modify/backwards-del", 1, 0);
+	bench_modify_threaded (s4, "modify/threaded-add", 1);
+	bench_modify_threaded (s4, "modify/threaded-del", 0);
 
-	take_time ("s4_open took", &prev, &cur);
+	s4_close (s4);
+	remove_db (filename);
+}
+
+/* A medialib-shaped dataset: every song is an entry with a song_id,
+ * string and int properties from a few sources, and some songs have
+ * a property from more than one source.
+ */
 
-	for (i = 0; i < ENTRIES; i++) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
+typedef int (*add_func_t) (void *data,
+		const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b,
+		const char *src);
+
+static int trans_add (void *t, const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b, const char *src)
+{
+	return s4_add (t, key_a, val_a, key_b, val_b, src);
+}
+
+static int bulk_add (void *bulk, const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b, const char *src)
+{
+	return s4_bulk_add (bulk, key_a, val_a, key_b, val_b, src);
+}
+
+static char *artist_name (int artist)
+{
+	return g_strdup_printf ("Artist %i", artist);
+}
+
+static char *album_name (int album)
+{
+	return g_strdup_printf ("Album %i", album);
+}
+
+static char *song_title (int song)
+{
+	return g_strdup_printf ("%s %s song %i", words[song % LEN (words)],
+			words[(song / LEN (words)) % LEN (words)], song);
+}
+
+static void add_str (add_func_t add, void *data, const s4_val_t *id,
+		const char *key, char *str, const char *src)
+{
+	s4_val_t *val = s4_val_new_string (str);
+	add (data, "song_id", id, key, val, src);
+	s4_val_free (val);
+	g_free (str);
+}
+
+static void add_int (add_func_t add, void *data, const s4_val_t *id,
+		const char *key, int32_t i, const char *src)
+{
+	s4_val_t *val = s4_val_new_int (i);
+	add (data, "song_id", id, key, val, src);
+	s4_val_free (val);
+}
+
+static void add_song (add_func_t add, void *data, int song)
+{
+	s4_val_t *id = s4_val_new_int (song);
+	int album = song / TRACKS, artist = album / ALBUMS;
+
+	add_str (add, data, id, "artist", artist_name (artist), "plugin/id3v2");
+	add_str (add, data, id, "album", album_name (album), "plugin/id3v2");
+	add_str (add, data, id, "title", song_title (song), "plugin/id3v2");
+	if (song % 5 == 0)
+		add_str (add, data, id, "title", g_strdup_printf ("Song %i", song), "plugin/mad");
+	add_str (add, data, id, "genre", g_strdup (genres[artist % LEN (genres)]), "plugin/id3v2");
+	add_str (add, data, id, "url",
+			g_strdup_printf ("file:///music/%i/%i/%i.mp3", artist, album, song), "server");
+	add_int (add, data, id, "tracknr", song % TRACKS + 1, "plugin/id3v2");
+	add_int (add, data, id, "date", 1950 + artist % 70, "plugin/id3v2");
+	add_int (add, data, id, "duration", 120000 + (song * 7919) % 300000, "plugin/mad");
+	add_int (add, data, id, "playcount", 0, "server");
+
+	s4_val_free (id);
+}
+
+static void bench_load_add (void)
+{
+	s4_transaction_t *t;
+	bench_case_t *c;
+	char *filename;
+	s4_t *s4;
+	int i;
+
+	if (!bench_enabled (bench, "load/add"))
+		return;
+
+	filename = temp_filename ();
+	s4 = open_db (filename, indices, S4_NEW);
+
+	c = bench_case_begin (bench, "load/add");
+	for (i = 0; i < songs; i++) {
+		bench_op_begin (c);
 		t = s4_begin (s4, 0);
-		s4_add (t, "a", val, "b", val, "src");
+		add_song (trans_add, t, i);
 		s4_commit (t);
-		s4_val_free (val);
+		bench_op_end (c);
 	}
+	bench_case_end (c);
 
-	take_time ("s4be_ip_add took", &prev, &cur);
+	s4_close (s4);
+	remove_db (filename);
+}
 
-	for (i = 0; i < ENTRIES; i++) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		t = s4_begin (s4, 0);
-		s4_del (t, "a", val, "b", val, "src");
-		s4_commit (t);
-		s4_val_free (val);
+/* Loads the dataset the query and mixed scenarios run against */
+static s4_t *load_library (void)
+{
+	bench_case_t *c = NULL;
+	s4_bulk_t *bulk;
+	s4_t *s4;
+	int i;
+
+	s4 = open_db (NULL, indices, S4_MEMORY);
+
+	if (bench_enabled (bench, "load/bulk"))
+		c = bench_case_begin (bench, "load/bulk");
+
+	bulk = s4_bulk_begin (s4);
+	for (i = 0; i < songs; i++)
+		add_song (bulk_add, bulk, i);
+	s4_bulk_finish (bulk);
+
+	if (c != NULL)
+		bench_case_end (c);
+
+	return s4;
+}
+
+/* The queries. Each one is made with a number so that
+ * repeated runs of it look at different parts of the library.
+ */
+
+typedef enum {
+	QUERY_FETCH,
+	QUERY_ORDERED,
+	QUERY_COUNT,
+	QUERY_DISTINCT
+} query_kind_t;
+
+typedef struct {
+	const char *name;
+	query_kind_t kind;
+	s4_condition_t *(*make) (int i);
+} query_t;
+
+static s4_condition_t *filter_str (s4_filter_type_t type, const char *key, char *str)
+{
+	s4_val_t *val = s4_val_new_string (str);
+	s4_condition_t *cond;
+
+	cond = s4_cond_new_filter (type, key, val, sp, S4_CMP_CASELESS, 0);
+	s4_val_free (val);
+	g_free (str);
+
+	return cond;
+}
+
+static s4_condition_t *filter_int (s4_filter_type_t type, const char *key, int32_t i)
+{
+	s4_val_t *val = s4_val_new_int (i);
+	s4_condition_t *cond;
+
+	cond = s4_cond_new_filter (type, key, val, sp, S4_CMP_BINARY, 0);
+	s4_val_free (val);
+
+	return cond;
+}
+
+static s4_condition_t *combine (s4_combine_type_t type, s4_condition_t *a, s4_condition_t *b)
+{
+	s4_condition_t *cond = s4_cond_new_combiner (type);
+
+	s4_cond_add_operand (cond, a);
+	s4_cond_add_operand (cond, b);
+	s4_cond_unref (a);
+	s4_cond_unref (b);
+
+	return cond;
+}
+
+static int artists (void)
+{
+	return MAX (1, songs / TRACKS / ALBUMS);
+}
+
+static s4_condition_t *make_equal (int i)
+{
+	return filter_str (S4_FILTER_EQUAL, "artist", artist_name ((i * 31) % artists ()));
+}
+
+static s4_condition_t *make_and (int i)
+{
+	return combine (S4_COMBINE_AND,
+			filter_str (S4_FILTER_EQUAL, "artist", artist_name ((i * 31) % artists ())),
+			filter_int (S4_FILTER_GREATER, "tracknr", TRACKS / 2));
+}
+
+static s4_condition_t *make_or (int i)
+{
+	int albums = MAX (1, songs / TRACKS);
+
+	return combine (S4_COMBINE_OR,
+			filter_str (S4_FILTER_EQUAL, "album", album_name ((i * 17) % albums)),
+			filter_str (S4_FILTER_EQUAL, "title", song_title ((i * 7919) % songs)));
+}
+
+static s4_condition_t *make_range (int i)
+{
+	return combine (S4_COMBINE_AND,
+			filter_int (S4_FILTER_GREATEREQ, "date", 1950 + i % 70),
+			filter_int (S4_FILTER_SMALLER, "date", 1950 + i % 70 + 5));
+}
+
+static s4_condition_t *make_token (int i)
+{
+	return filter_str (S4_FILTER_TOKEN, "title", g_strdup (words[i % LEN (words)]));
+}
+
+static s4_condition_t *make_match (int i)
+{
+	return filter_str (S4_FILTER_MATCH, "title", g_strdup_printf ("*song %i*", i % 100));
+}
+
+static s4_condition_t *make_prefix (int i)
+{
+	return filter_str (S4_FILTER_MATCH, "artist", g_strdup_printf ("artist %i*", i % 100));
+}
+
+static s4_condition_t *make_genre (int i)
+{
+	return filter_str (S4_FILTER_EQUAL, "genre", g_strdup (genres[i % LEN (genres)]));
+}
+
+static const query_t queries[] = {
+	{"query/equal", QUERY_FETCH, make_equal},
+	{"query/and", QUERY_FETCH, make_and},
+	{"query/or", QUERY_FETCH, make_or},
+	{"query/range", QUERY_FETCH, make_range},
+	{"query/token", QUERY_FETCH, make_token},
+	{"query/match", QUERY_FETCH, make_match},
+	{"query/prefix", QUERY_FETCH, make_prefix},
+	{"query/sorted", QUERY_ORDERED, make_genre},
+	{"query/count", QUERY_COUNT, make_genre},
+	{"query/distinct", QUERY_DISTINCT, make_genre},
+	{NULL}
+};
+
+/* What the queries fetch, like a playlist view would */
+static s4_fetchspec_t *create_fetchspec (void)
+{
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+
+	s4_fetchspec_add (fs, "song_id", NULL, S4_FETCH_PARENT);
+	s4_fetchspec_add (fs, "artist", sp, S4_FETCH_DATA);
+	s4_fetchspec_add (fs, "album", sp, S4_FETCH_DATA);
+	s4_fetchspec_add (fs, "tracknr", sp, S4_FETCH_DATA);
+	s4_fetchspec_add (fs, "title", sp, S4_FETCH_DATA);
+	s4_fetchspec_add (fs, "duration", sp, S4_FETCH_DATA);
+
+	return fs;
+}
+
+/* Sorted on artist, album and tracknr, showing the first page */
+static s4_order_t *create_order (void)
+{
+	s4_order_t *order = s4_order_create ();
+	int i;
+
+	for (i = 1; i <= 3; i++) {
+		s4_order_entry_t *entry;
+		entry = s4_order_add_column (order, S4_CMP_COLLATE, S4_ORDER_ASCENDING);
+		s4_order_entry_add_choice (entry, i);
 	}
 
-	take_time ("s4be_ip_del took", &prev, &cur);
+	return order;
+}
 
-	t = s4_begin (s4, 0);
-	for (i = 0; i < ENTRIES; i++) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		s4_add (t, "a", val, "b", val, "src");
-		s4_val_free (val);
+/* Runs a query in its own read-only transaction.
+ * The fetchspec can not be shared between threads.
+ */
+static void run_query (s4_t *s4, const query_t *q, s4_fetchspec_t *fs,
+		s4_order_t *order, int i)
+{
+	s4_condition_t *cond = q->make (i);
+	s4_transaction_t *t = s4_begin (s4, S4_TRANS_READONLY);
+	s4_resultset_t *set = NULL;
+
+	switch (q->kind) {
+	case QUERY_FETCH:
+		set = s4_query (t, fs, cond);
+		break;
+	case QUERY_ORDERED:
+		set = s4_query_ordered (t, fs, cond, order, 0, 50);
+		break;
+	case QUERY_COUNT:
+		s4_query_count (t, cond);
+		break;
+	case QUERY_DISTINCT:
+		set = s4_query_distinct (t, cond, "artist", sp);
+		break;
 	}
+
+	if (set != NULL)
+		s4_resultset_unref (set);
 	s4_commit (t);
+	s4_cond_unref (cond);
+}
 
-	take_time ("s4be_ip_add took", &prev, &cur);
+static void bench_queries (s4_t *s4)
+{
+	s4_fetchspec_t *fs = create_fetchspec ();
+	s4_order_t *order = create_order ();
+	bench_case_t *c;
+	int i, j;
+
+	for (j = 0; queries[j].name != NULL; j++) {
+		if (!bench_enabled (bench, queries[j].name))
+			continue;
+
+		c = bench_case_begin (bench, queries[j].name);
+		for (i = 0; i < reps; i++) {
+			bench_op_begin (c);
+			run_query (s4, &queries[j], fs, order, i);
+			bench_op_end (c);
+		}
+		bench_case_end (c);
+	}
 
-	t = s4_begin (s4, 0);
-	for (i = 0; i < ENTRIES; i++) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		s4_del (t, "a", val, "b", val, "src");
-		s4_val_free (val);
+	s4_order_free (order);
+	s4_fetchspec_unref (fs);
+}
+
+/* Readers running the query mix while one writer
+ * bumps playcounts, like a player does after every song.
+ */
+
+typedef struct {
+	s4_t *s4;
+	int seed;
+	GArray *samples;
+} worker_t;
+
+static gpointer reader (worker_t *w)
+{
+	s4_fetchspec_t *fs = create_fetchspec ();
+	s4_order_t *order = create_order ();
+	const query_t *q;
+	gint64 start, usec;
+	int i;
+
+	for (i = 0; i < reps; i++) {
+		q = &queries[(i + w->seed) % (LEN (queries) - 1)];
+		start = g_get_monotonic_time ();
+		run_query (w->s4, q, fs, order, i * threads + w->seed);
+		usec = g_get_monotonic_time () - start;
+		g_array_append_val (w->samples, usec);
 	}
-	s4_commit (t);
 
-	take_time ("s4be_ip_del took", &prev, &cur);
+	s4_order_free (order);
+	s4_fetchspec_unref (fs);
 
-	for (i = ENTRIES; i > 0; i--) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		t = s4_begin (s4, 0);
-		s4_add (t, "a", val, "b", val, "src");
+	return NULL;
+}
+
+static gpointer writer (worker_t *w)
+{
+	s4_transaction_t *t;
+	s4_val_t *id, *old, *new;
+	gint64 start, usec;
+	int i, song;
+
+	for (i = 0; i < reps; i++) {
+		song = (i * 7919) % songs;
+		id = s4_val_new_int (song);
+		/* Every song starts with a playcount of 0 and is picked
+		 * at most once as long as reps is less than songs */
+		old = s4_val_new_int (0);
+		new = s4_val_new_int (1);
+
+		start = g_get_monotonic_time ();
+		t = s4_begin (w->s4, 0);
+		s4_del (t, "song_id", id, "playcount", old, "server");
+		s4_add (t, "song_id", id, "playcount", new, "server");
 		s4_commit (t);
-		s4_val_free (val);
+		usec = g_get_monotonic_time () - start;
+		g_array_append_val (w->samples, usec);
+
+		s4_val_free (id);
+		s4_val_free (old);
+		s4_val_free (new);
 	}
 
-	take_time ("s4be_ip_add (backwards) took", &prev, &cur);
+	return NULL;
+}
 
-	for (i = ENTRIES; i > 0; i--) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		t = s4_begin (s4, 0);
-		s4_del (t, "a", val, "b", val, "src");
-		s4_commit (t);
-		s4_val_free (val);
+static void bench_mixed (s4_t *s4)
+{
+	worker_t *w = malloc (sizeof (worker_t) * (threads + 1));
+	GThread **thread = malloc (sizeof (GThread*) * (threads + 1));
+	bench_case_t *read, *write;
+	int i;
+
+	if (!bench_enabled (bench, "mixed/read") && !bench_enabled (bench, "mixed/write"))
+		goto out;
+
+	read = bench_case_begin (bench, "mixed/read");
+	write = bench_case_begin (bench, "mixed/write");
+
+	for (i = 0; i <= threads; i++) {
+		w[i].s4 = s4;
+		w[i].seed = i;
+		w[i].samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+		thread[i] = g_thread_new ("bench", (GThreadFunc)(i < threads ? reader : writer), &w[i]);
+	}
+
+	for (i = 0; i <= threads; i++) {
+		g_thread_join (thread[i]);
+		bench_add_samples (i < threads ? read : write, w[i].samples);
+		g_array_free (w[i].samples, TRUE);
 	}
 
-	take_time ("s4be_ip_del (backwards) took", &prev, &cur);
+	bench_case_end (read);
+	bench_case_end (write);
+
+out:
+	free (w);
+	free (thread);
+}
+
+/* Opening, syncing and closing a database on disk, and opening
+ * one with transactions in the log that are not in the file yet.
+ */
+static void bench_file (void)
+{
+	s4_transaction_t *t;
+	bench_case_t *c;
+	char *filename;
+	s4_t *s4, *recovered;
+	s4_bulk_t *bulk;
+	int i;
+
+	if (!bench_enabled (bench, "file/"))
+		return;
+
+	filename = temp_filename ();
+	s4 = open_db (filename, indices, S4_NEW);
+	bulk = s4_bulk_begin (s4);
+	for (i = 0; i < songs; i++)
+		add_song (bulk_add, bulk, i);
+	s4_bulk_finish (bulk);
+
+	if (bench_enabled (bench, "file/sync")) {
+		c = bench_case_begin (bench, "file/sync");
+		s4_sync (s4);
+		bench_case_end (c);
+	}
+
+	c = bench_enabled (bench, "file/close") ? bench_case_begin (bench, "file/close") : NULL;
+	s4_close (s4);
+	if (c != NULL)
+		bench_case_end (c);
+
+	c = bench_enabled (bench, "file/open") ? bench_case_begin (bench, "file/open") : NULL;
+	s4 = open_db (filename, indices, S4_EXISTS);
+	if (c != NULL)
+		bench_case_end (c);
+
+	if (bench_enabled (bench, "file/recover")) {
+		/* Opening the file again redoes what is in the log */
+		for (i = 0; i < songs / 10; i++) {
+			t = s4_begin (s4, S4_TRANS_NOSYNC);
+			add_song (trans_add, t, songs + i);
+			s4_commit (t);
+		}
+		s4_flush_log (s4);
+
+		c = bench_case_begin (bench, "file/recover");
+		recovered = open_db (filename, indices, 0);
+		bench_case_end (c);
+		s4_close (recovered);
+	}
 
 	s4_close (s4);
+	remove_db (filename);
+}
 
-	take_time ("s4_close took", &prev, &cur);
+/* Looks up constant strings, like every call that passes keys
+ * and sources as strings does, on one and on several threads.
+ * The lookups go through s4_fetchspec_update_key, every key of
+ * the fetchspec being looked up once per operation. The strings
+ * are all interned before the timing starts, so only hits are timed.
+ */
+#define CONST_KEYS 256
 
-	g_unlink (filename);
-	g_unlink (g_strconcat (filename, ".log", NULL));
+typedef struct {
+	s4_t *s4;
+	s4_fetchspec_t *fs;
+	GArray *samples;
+} const_worker_t;
 
-	g_free (filename);
+static s4_fetchspec_t *create_key_fetchspec (void)
+{
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	char *key;
+	int i;
+
+	for (i = 0; i < CONST_KEYS; i++) {
+		key = g_strdup_printf ("property %i", i);
+		s4_fetchspec_add (fs, key, NULL, S4_FETCH_DATA);
+		g_free (key);
+	}
+
+	return fs;
+}
+
+static gpointer const_lookup (const_worker_t *w)
+{
+	gint64 start, usec;
+	int i;
+
+	for (i = 0; i < songs; i++) {
+		start = g_get_monotonic_time ();
+		s4_fetchspec_update_key (w->s4, w->fs);
+		usec = g_get_monotonic_time () - start;
+		g_array_append_val (w->samples, usec);
+	}
+
+	return NULL;
+}
+
+static void bench_const_lookup (s4_t *s4, const char *name, int count)
+{
+	const_worker_t *w = malloc (sizeof (const_worker_t) * count);
+	GThread **thread = malloc (sizeof (GThread*) * count);
+	bench_case_t *c;
+	int i;
+
+	if (!bench_enabled (bench, name))
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		w[i].s4 = s4;
+		w[i].fs = create_key_fetchspec ();
+		w[i].samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+	}
+
+	c = bench_case_begin (bench, name);
+	for (i = 0; i < count; i++)
+		thread[i] = g_thread_new ("bench", (GThreadFunc)const_lookup, &w[i]);
+
+	for (i = 0; i < count; i++) {
+		g_thread_join (thread[i]);
+		bench_add_samples (c, w[i].samples);
+		g_array_free (w[i].samples, TRUE);
+		s4_fetchspec_unref (w[i].fs);
+	}
+	bench_case_end (c);
+
+out:
+	free (w);
+	free (thread);
+}
+
+static void bench_const (void)
+{
+	s4_fetchspec_t *fs;
+	s4_t *s4;
+
+	if (!bench_enabled (bench, "const/"))
+		return;
+
+	s4 = open_db (NULL, NULL, S4_MEMORY);
+	fs = create_key_fetchspec ();
+	s4_fetchspec_update_key (s4, fs);
+	s4_fetchspec_unref (fs);
+
+	bench_const_lookup (s4, "const/lookup", 1);
+	bench_const_lookup (s4, "const/threaded-lookup", threads);
+
+	s4_close (s4);
+}
+
+/* Matches patterns against many strings, like a query that
+ * has to check every value does.
+ */
+static void bench_patterns (void)
+{
+	static const char *patterns[] = {"*song 1234*", "*album*title*",
+		"Artist 1*", "*s?ng 4*", NULL};
+	int count = songs * 5;
+	s4_val_t **vals;
+	bench_case_t *c;
+	s4_pattern_t *p;
+	const char *folded;
+	char *str;
+	int i, j;
+
+	if (!bench_enabled (bench, "pattern/"))
+		return;
+
+	vals = malloc (sizeof (s4_val_t*) * count);
+	for (i = 0; i < count; i++) {
+		str = g_strdup_printf ("Artist %i - Album %i - The title of song %i",
+				i % 977, i % 5003, i);
+		vals[i] = s4_val_new_string (str);
+		g_free (str);
+		/* Casefold now so only matching is timed */
+		s4_val_get_casefolded_str (vals[i], &folded);
+	}
+
+	for (j = 0; patterns[j] != NULL; j++) {
+		str = g_strdup_printf ("pattern/%s", patterns[j]);
+		if (bench_enabled (bench, str)) {
+			p = s4_pattern_create (patterns[j], 1);
+			c = bench_case_begin (bench, str);
+			for (i = 0; i < count; i++)
+				s4_pattern_match (p, vals[i]);
+			bench_case_end (c);
+			s4_pattern_free (p);
+		}
+		g_free (str);
+	}
+
+	for (i = 0; i < count; i++)
+		s4_val_free (vals[i]);
+	free (vals);
+}
+
+static void usage (const char *name)
+{
+	fprintf (stderr, "Usage: %s [options] [scenario prefix ...]\n"
+			"  -f text|csv|json  Output format (text)\n"
+			"  -o <file>         Write the results to file (stdout)\n"
+			"  -n <songs>        Songs in the library (%i)\n"
+			"  -r <reps>         Times every query runs (%i)\n"
+			"  -t <threads>      Threads in the threaded scenarios (%i)\n"
+			"  -c <size>         Use a query cache of size results (%i)\n"
+			"  -s 0|1            Store strings compacted (%i)\n"
+			"Scenarios: modify/ load/ query/ mixed/ file/ const/ pattern/\n",
+			name, songs, reps, threads, query_cache, compact_strings);
+	exit (1);
+}
+
+int main (int argc, char *argv[])
+{
+	const char **filters = malloc (sizeof (char*) * argc);
+	bench_format_t format = BENCH_TEXT;
+	FILE *out = stdout;
+	int i, filter_count = 0;
+	s4_t *s4;
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (arg[0] != '-') {
+			filters[filter_count++] = arg;
+			continue;
+		}
+		if (strlen (arg) != 2 || i + 1 == argc)
+			usage (argv[0]);
+
+		arg = argv[++i];
+		switch (argv[i - 1][1]) {
+		case 'f':
+			if (!strcmp (arg, "text"))
+				format = BENCH_TEXT;
+			else if (!strcmp (arg, "csv"))
+				format = BENCH_CSV;
+			else if (!strcmp (arg, "json"))
+				format = BENCH_JSON;
+			else
+				usage (argv[0]);
+			break;
+		case 'o':
+			out = fopen (arg, "w");
+			if (out == NULL) {
+				fprintf (stderr, "Could not open %s\n", arg);
+				exit (1);
+			}
+			break;
+		case 'n':
+			songs = MAX (1, atoi (arg));
+			break;
+		case 'r':
+			reps = MAX (1, atoi (arg));
+			break;
+		case 't':
+			threads = MAX (1, atoi (arg));
+			break;
+		case 'c':
+			query_cache = MAX (0, atoi (arg));
+			break;
+		case 's':
+			compact_strings = atoi (arg);
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+	filters[filter_count] = NULL;
+
+	log_init (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING);
+	bench = bench_new (format, out, filters);
+	sp = s4_sourcepref_create (sources);
+
+	bench_modify ();
+	bench_load_add ();
+
+	if (bench_enabled (bench, "load/bulk") || bench_enabled (bench, "query/") ||
+			bench_enabled (bench, "mixed/")) {
+		s4 = load_library ();
+		bench_queries (s4);
+		bench_mixed (s4);
+		s4_close (s4);
+	}
+
+	bench_file ();
+	bench_const ();
+	bench_patterns ();
+
+	bench_finish (bench);
+	s4_sourcepref_unref (sp);
+	free (filters);
 
-	take_time ("g_unlink took", &prev, &cur);
+	if (out != stdout)
+		fclose (out);
 
 	return 0;
 }
@@ -46,6 +46,7 @@ void print_result (const s4_resultset_t *res);
 void print_cond (s4_condition_t *cond);
 void print_fetch (s4_fetchspec_t *fetch);
 void print_vars (void);
+void print_stats (void);
 void print_help (void);
 
 void config_init (void);
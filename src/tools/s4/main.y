@@ -62,7 +62,7 @@ s4_t *s4;
 
 %token <string> STRING QUOTED_STRING COND_VAR LIST_VAR RESULT_VAR FETCH_VAR PREF_VAR
 %token <number> INT
-%token INFO QUERY ADD DEL VARS SET HELP EXIT GR_EQ LE_EQ NOT_EQ
+%token INFO QUERY ADD DEL VARS STATS SET HELP EXIT GR_EQ LE_EQ NOT_EQ
 
 %type <value> value
 %type <condition> cond
@@ -110,6 +110,7 @@ command: /* Empty */
 	   | set
 	   | HELP { print_help (); }
 	   | VARS { print_vars (); }
+	   | STATS { print_stats (); }
 	   | EXIT { cleanup (); exit (0); }
 	   | COND_VAR '=' cond { g_hash_table_insert (cond_table, $1, $3); }
 	   | LIST_VAR '=' list { g_hash_table_insert (list_table, $1, $3); }
@@ -572,7 +573,7 @@ int main(int argc, const char *argv[])
 	list_table = g_hash_table_new_full (g_str_hash, g_str_equal,
 		free, (GDestroyNotify)unref_list);
 	res_table = g_hash_table_new_full (g_str_hash, g_str_equal,
-		free, (GDestroyNotify)s4_resultset_free);
+		free, (GDestroyNotify)s4_resultset_unref);
 	fetch_table = g_hash_table_new_full (g_str_hash, g_str_equal,
 		free, (GDestroyNotify)s4_fetchspec_unref);
 	pref_table = g_hash_table_new_full (g_str_hash, g_str_equal,
@@ -344,6 +344,45 @@ void print_vars ()
 	}
 }
 
+static void print_timer (const char *name, const s4_stats_timer_t *timer)
+{
+	int i;
+
+	printf ("%-12s %lli times, %.3f ms", name, (long long)timer->count,
+			timer->usec / 1000.0);
+	if (timer->count > 0)
+		printf (", %lli us average", (long long)(timer->usec / timer->count));
+	printf ("\n");
+
+	for (i = 0; i < S4_STATS_HISTOGRAM_SIZE; i++) {
+		if (timer->histogram[i] > 0)
+			printf ("    %9lli us+: %lli\n", 1LL << i, (long long)timer->histogram[i]);
+	}
+}
+
+void print_stats (void)
+{
+	s4_stats_t stats;
+
+	s4_get_stats (s4, &stats);
+
+	print_timer ("Lock waits", &stats.lock_wait);
+	print_timer ("Log fsyncs", &stats.log_fsync);
+	print_timer ("Syncs", &stats.sync);
+	print_timer ("Queries", &stats.query);
+	print_timer ("Recovery", &stats.recovery);
+
+	printf ("Deadlocks    %lli\n", (long long)stats.deadlocks);
+	printf ("Log          %i of %i bytes used, %lli commits did not fit\n",
+			stats.log_used, stats.log_size, (long long)stats.log_full);
+	printf ("Plans        %lli indexed, %lli full scans\n",
+			(long long)stats.plan_indexed, (long long)stats.plan_scanned);
+	printf ("Rows         %lli examined, %lli returned\n",
+			(long long)stats.rows_examined, (long long)stats.rows_returned);
+	printf ("Cache hits   %lli\n", (long long)stats.query_cache_hits);
+	printf ("Recovered    %lli transactions\n", (long long)stats.recovered);
+}
+
 void print_help (void)
 {
 	printf("All statements must end with a semicolon\n\n"
@@ -357,6 +396,7 @@ void print_help (void)
 			".set key value        - Sets the option key to val\n"
 			".set key              - Shows the value of the key\n"
 			".set                  - Shows the value of all keys\n"
+			".stats                - Prints what the database has been doing\n"
 			".vars                 - Prints all bound variables\n\n"
 			"?var = <cond>         - Assigns cond to the condition variable var\n"
 			"%%var = <fetch>        - Assigns fetch to the fetch variable var\n"
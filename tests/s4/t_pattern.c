@@ -208,3 +208,64 @@ CASE (test_pattern) {
 	CU_ASSERT_FALSE (match_int (p, -321));
 	s4_pattern_free (p);
 }
+
+CASE (test_pattern_prefix) {
+	s4_pattern_t *p;
+
+	p = s4_pattern_create ("Beat*", 0);
+	CU_ASSERT_STRING_EQUAL (s4_pattern_get_prefix (p), "beat");
+	CU_ASSERT_TRUE (match_str (p, "Beatles"));
+	CU_ASSERT_FALSE (match_str (p, "beatles"));
+	s4_pattern_free (p);
+
+	p = s4_pattern_create ("STRAß?e*", 1);
+	CU_ASSERT_STRING_EQUAL (s4_pattern_get_prefix (p), "strass");
+	s4_pattern_free (p);
+
+	p = s4_pattern_create ("boring", 1);
+	CU_ASSERT_STRING_EQUAL (s4_pattern_get_prefix (p), "boring");
+	s4_pattern_free (p);
+
+	p = s4_pattern_create ("*beat", 0);
+	CU_ASSERT_PTR_NULL (s4_pattern_get_prefix (p));
+	s4_pattern_free (p);
+
+	/* Integers can match these */
+	p = s4_pattern_create ("12*", 0);
+	CU_ASSERT_PTR_NULL (s4_pattern_get_prefix (p));
+	s4_pattern_free (p);
+
+	p = s4_pattern_create ("-1", 0);
+	CU_ASSERT_PTR_NULL (s4_pattern_get_prefix (p));
+	s4_pattern_free (p);
+}
+
+CASE (test_pattern_find) {
+	s4_pattern_t *p;
+
+	/* Places where the first character matches but the rest does not */
+	p = s4_pattern_create ("*aab*", 0);
+	CU_ASSERT_TRUE (match_str (p, "aaab"));
+	CU_ASSERT_TRUE (match_str (p, "xaabx"));
+	CU_ASSERT_FALSE (match_str (p, "abab"));
+	CU_ASSERT_FALSE (match_str (p, "aa"));
+	s4_pattern_free (p);
+
+	p = s4_pattern_create ("*?b?d", 0);
+	CU_ASSERT_TRUE (match_str (p, "abcd"));
+	CU_ASSERT_TRUE (match_str (p, "xxabcd"));
+	CU_ASSERT_FALSE (match_str (p, "bcd"));
+	CU_ASSERT_FALSE (match_str (p, "abcde"));
+	s4_pattern_free (p);
+
+	p = s4_pattern_create ("a*??*c", 0);
+	CU_ASSERT_TRUE (match_str (p, "axyc"));
+	CU_ASSERT_FALSE (match_str (p, "axc"));
+	s4_pattern_free (p);
+
+	p = s4_pattern_create ("*b?b*", 1);
+	CU_ASSERT_TRUE (match_str (p, "ABAB"));
+	CU_ASSERT_TRUE (match_str (p, "abbb"));
+	CU_ASSERT_FALSE (match_str (p, "abba"));
+	s4_pattern_free (p);
+}
@@ -40,13 +40,18 @@ static void _mem_close (void)
 	s4_close (s4);
 }
 
-static void _open (int flags)
+static void _open_with_options (int flags, const s4_options_t *opts)
 {
 	int fd = g_file_open_tmp ("t_s4-XXXXXX", &name, NULL);
 	g_close (fd, NULL);
 	g_unlink (name);
 
-	s4 = s4_open (name, NULL, flags);
+	s4 = s4_open_with_options (name, NULL, flags, opts);
+}
+
+static void _open (int flags)
+{
+	_open_with_options (flags, NULL);
 }
 
 static void _close (void)
@@ -295,3 +300,2053 @@ CASE (test_query) {
 
 	_mem_close ();
 }
+
+static void check_int_filter (s4_filter_type_t type, const char *key,
+		int32_t ival, int flags, int rows)
+{
+	s4_val_t *val = s4_val_new_int (ival);
+	s4_condition_t *cond = s4_cond_new_filter (type, key, val,
+			NULL, S4_CMP_CASELESS, flags);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+
+	s4_fetchspec_add (fs, NULL, NULL, S4_FETCH_DATA);
+
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	s4_commit (trans);
+
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), rows);
+
+	s4_resultset_free (set);
+	s4_fetchspec_free (fs);
+	s4_cond_free (cond);
+	s4_val_free (val);
+}
+
+static void check_int_query (const char *key, int32_t ival, int flags, int rows)
+{
+	check_int_filter (S4_FILTER_EQUAL, key, ival, flags, rows);
+}
+
+CASE (test_reopen) {
+	const char *indices[] = {"tracknr", NULL};
+	struct db_struct db[] = {
+		{"b", {"x", "foobar", NULL}, "src_b"},
+		{"a", {"b", "c", NULL}, "src_a"},
+		{"B", {"y", NULL}, "src_a"},
+		{"c", {"basdf", "c", NULL}, "src_c"},
+		{NULL, {NULL}, NULL}};
+	s4_transaction_t *trans;
+	s4_val_t *ival, *sval;
+	int i;
+
+	_open (S4_NEW);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	create_db (db);
+
+	trans = s4_begin (s4, 0);
+	for (i = 100; i > 0; i--) {
+		ival = s4_val_new_int (i);
+		sval = s4_val_new_int (i % 10);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", sval, "src_a"));
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", ival, "src_b"));
+		s4_val_free (ival);
+		s4_val_free (sval);
+	}
+	s4_commit (trans);
+
+	s4_sync (s4);
+	s4_close (s4);
+
+	s4 = s4_open (name, indices, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	check_db (db);
+	check_int_query ("id", 42, S4_COND_PARENT, 1);
+	check_int_query ("tracknr", 2, 0, 10);
+	check_int_query ("tracknr", 100, 0, 1);
+	/* Entries with two matching values must only show up once */
+	check_int_filter (S4_FILTER_SMALLER, "tracknr", 12, 0, 100);
+	check_int_filter (S4_FILTER_GREATER, "tracknr", 8, 0, 92);
+
+	_close ();
+}
+
+CASE (test_open_v1) {
+	struct db_struct db[] = {
+		{"a", {"b", NULL}, "src"},
+		{NULL, {NULL}, NULL}};
+	const char *strings[] = {"entry", "a", "property", "b", "src", "id"};
+	int32_t hdr[7] = {0, 1, 0, 0, 0, 0, 0};
+	int32_t pairs[][5] = {{1, 2, 3, 4, 5}, {-6, 1, 3, 4, 5}};
+	int32_t i, len, end = -1;
+	FILE *file;
+	int fd;
+
+	fd = g_file_open_tmp ("t_s4-XXXXXX", &name, NULL);
+	g_close (fd, NULL);
+
+	file = fopen (name, "w");
+	CU_ASSERT_PTR_NOT_NULL_FATAL (file);
+
+	memcpy (hdr, "s4db", 4);
+	fwrite (hdr, sizeof (int32_t), 7, file);
+	for (i = 0; i < 6; i++) {
+		int32_t id = i + 1;
+		len = strlen (strings[i]);
+		fwrite (&id, sizeof (int32_t), 1, file);
+		fwrite (&len, sizeof (int32_t), 1, file);
+		fwrite (strings[i], 1, len, file);
+	}
+	fwrite (&end, sizeof (int32_t), 1, file);
+	fwrite (pairs, sizeof (pairs), 1, file);
+	fclose (file);
+
+	s4 = s4_open (name, NULL, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	check_db (db);
+	check_int_query ("id", 1, S4_COND_PARENT, 1);
+
+	/* The file has been written in the new format at this point */
+	s4_close (s4);
+	s4 = s4_open (name, NULL, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	check_db (db);
+	check_int_query ("id", 1, S4_COND_PARENT, 1);
+
+	_close ();
+}
+
+CASE (test_incremental) {
+	struct db_struct db[] = {
+		{"a", {"b", "c", NULL}, "src_a"},
+		{"b", {"x", "foobar", NULL}, "src_b"},
+		{"c", {"basdf", "c", NULL}, "src_c"},
+		{NULL, {NULL}, NULL}};
+	struct db_struct changed[] = {
+		{"a", {"b", NULL}, "src_a"},
+		{"b", {"x", "foobar", "y", NULL}, "src_b"},
+		{"c", {"basdf", "c", NULL}, "src_c"},
+		{NULL, {NULL}, NULL}};
+	s4_transaction_t *trans;
+	s4_val_t *ival, *sval;
+	char *delta_name;
+	int i;
+
+	_open (S4_NEW | S4_INCREMENTAL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	delta_name = g_strconcat (name, ".delta", NULL);
+
+	create_db (db);
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 40; i++) {
+		ival = s4_val_new_int (i);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", ival, "src_a"));
+		s4_val_free (ival);
+	}
+	s4_commit (trans);
+
+	/* Most of the database changed, so this is a full write */
+	s4_sync (s4);
+	CU_ASSERT (!g_file_test (delta_name, G_FILE_TEST_EXISTS));
+
+	trans = s4_begin (s4, 0);
+	ival = s4_val_new_string ("a");
+	sval = s4_val_new_string ("c");
+	CU_ASSERT (s4_del (trans, "entry", ival, "property", sval, "src_a"));
+	s4_val_free (ival);
+	s4_val_free (sval);
+	ival = s4_val_new_string ("b");
+	sval = s4_val_new_string ("y");
+	CU_ASSERT (s4_add (trans, "entry", ival, "property", sval, "src_b"));
+	s4_val_free (ival);
+	s4_val_free (sval);
+	ival = s4_val_new_int (7);
+	CU_ASSERT (s4_del (trans, "id", ival, "tracknr", ival, "src_a"));
+	s4_val_free (ival);
+	s4_commit (trans);
+
+	s4_sync (s4);
+	CU_ASSERT (g_file_test (delta_name, G_FILE_TEST_EXISTS));
+	s4_close (s4);
+
+	s4 = s4_open (name, NULL, S4_EXISTS | S4_INCREMENTAL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	check_db (changed);
+	check_int_query ("id", 7, S4_COND_PARENT, 0);
+	check_int_query ("id", 8, S4_COND_PARENT, 1);
+	s4_close (s4);
+
+	/* Without S4_INCREMENTAL everything is compacted into the full file */
+	s4 = s4_open (name, NULL, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	CU_ASSERT (!g_file_test (delta_name, G_FILE_TEST_EXISTS));
+
+	check_db (changed);
+	check_int_query ("id", 7, S4_COND_PARENT, 0);
+
+	g_unlink (delta_name);
+	g_free (delta_name);
+	_close ();
+}
+
+CASE (test_sync_open_transaction) {
+	s4_transaction_t *trans, *open;
+	s4_val_t *ival;
+	char *delta_name;
+	int i;
+
+	_open (S4_NEW | S4_INCREMENTAL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	delta_name = g_strconcat (name, ".delta", NULL);
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 40; i++) {
+		ival = s4_val_new_int (i);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", ival, "src_a"));
+		s4_val_free (ival);
+	}
+	s4_commit (trans);
+
+	/* The sync does not wait for the open transaction, and leaves its
+	 * change out of the full write
+	 */
+	open = s4_begin (s4, 0);
+	ival = s4_val_new_int (100);
+	CU_ASSERT (s4_add (open, "id", ival, "tracknr", ival, "src_a"));
+	s4_val_free (ival);
+
+	s4_sync (s4);
+	CU_ASSERT (!g_file_test (delta_name, G_FILE_TEST_EXISTS));
+	CU_ASSERT (s4_commit (open));
+
+	/* The change is still dirty, so it ends up in the delta */
+	s4_sync (s4);
+	CU_ASSERT (g_file_test (delta_name, G_FILE_TEST_EXISTS));
+	s4_close (s4);
+
+	s4 = s4_open (name, NULL, S4_EXISTS | S4_INCREMENTAL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	check_int_query ("id", 5, S4_COND_PARENT, 1);
+	check_int_query ("id", 100, S4_COND_PARENT, 1);
+	s4_close (s4);
+
+	s4 = s4_open (name, NULL, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	check_int_query ("id", 100, S4_COND_PARENT, 1);
+
+	g_unlink (delta_name);
+	g_free (delta_name);
+	_close ();
+}
+
+static goffset _log_file_size (void)
+{
+	char *logname = g_strconcat (name, ".log", NULL);
+	GStatBuf buf;
+	goffset ret = -1;
+
+	if (g_stat (logname, &buf) == 0)
+		ret = buf.st_size;
+
+	g_free (logname);
+	return ret;
+}
+
+CASE (test_log_size) {
+	s4_options_t *opts = s4_options_create ();
+	s4_transaction_t *trans;
+	s4_val_t *ival, *sval;
+	goffset grown_size;
+	char buf[32];
+	int i;
+
+	s4_options_set_log_size (opts, S4_LOG_MIN_SIZE);
+	_open_with_options (S4_NEW, opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	CU_ASSERT_EQUAL (_log_file_size (), S4_LOG_MIN_SIZE);
+
+	/* Far bigger than the log, it has to grow for this to commit */
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 4000; i++) {
+		ival = s4_val_new_int (i);
+		sprintf (buf, "property %i", i);
+		sval = s4_val_new_string (buf);
+		CU_ASSERT (s4_add (trans, "id", ival, "property", sval, "src_a"));
+		s4_val_free (ival);
+		s4_val_free (sval);
+	}
+	CU_ASSERT (s4_commit (trans));
+	grown_size = _log_file_size ();
+	CU_ASSERT (grown_size > S4_LOG_MIN_SIZE);
+
+	check_int_query ("id", 0, S4_COND_PARENT, 1);
+	check_int_query ("id", 3999, S4_COND_PARENT, 1);
+	s4_close (s4);
+
+	/* Logs are never shrunk */
+	s4 = s4_open_with_options (name, NULL, S4_EXISTS, opts);
+	s4_options_free (opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	CU_ASSERT_EQUAL (_log_file_size (), grown_size);
+
+	check_int_query ("id", 2000, S4_COND_PARENT, 1);
+
+	_close ();
+}
+
+CASE (test_log_grown_by_other) {
+	s4_options_t *opts = s4_options_create ();
+	s4_transaction_t *trans;
+	s4_val_t *ival, *sval;
+	s4_t *grower, *other;
+	goffset size;
+	char buf[32];
+	int i;
+
+	s4_options_set_log_size (opts, S4_LOG_MIN_SIZE);
+	_open_with_options (S4_NEW, opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	grower = s4;
+
+	other = s4_open_with_options (name, NULL, S4_EXISTS, opts);
+	s4_options_free (opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (other);
+
+	trans = s4_begin (grower, 0);
+	for (i = 0; i < 4000; i++) {
+		ival = s4_val_new_int (i);
+		sprintf (buf, "property %i", i);
+		sval = s4_val_new_string (buf);
+		CU_ASSERT (s4_add (trans, "id", ival, "property", sval, "src_a"));
+		s4_val_free (ival);
+		s4_val_free (sval);
+	}
+	CU_ASSERT (s4_commit (trans));
+	size = _log_file_size ();
+	CU_ASSERT (size > S4_LOG_MIN_SIZE);
+
+	/* The other handle has to find its way around the grown log */
+	s4 = other;
+	check_int_query ("id", 3999, S4_COND_PARENT, 1);
+
+	trans = s4_begin (other, 0);
+	ival = s4_val_new_int (5000);
+	CU_ASSERT (s4_add (trans, "id", ival, "tracknr", ival, "src_a"));
+	s4_val_free (ival);
+	CU_ASSERT (s4_commit (trans));
+	CU_ASSERT_EQUAL (_log_file_size (), size);
+
+	/* And commit where the first one redoes from */
+	s4 = grower;
+	check_int_query ("id", 5000, S4_COND_PARENT, 1);
+
+	s4_close (other);
+	_close ();
+}
+
+CASE (test_log_checksum) {
+	struct db_struct db[] = {
+		{"a", {"intact", NULL}, "src_a"},
+		{NULL, {NULL}, NULL}};
+	struct db_struct torn[] = {
+		{"b", {"torn value", NULL}, "src_a"},
+		{NULL, {NULL}, NULL}};
+	s4_fetchspec_t *fs;
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	s4_t *writer;
+	char *logname, *data, *p;
+	gsize len;
+
+	_open (S4_NEW);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	create_db (db);
+	create_db (torn);
+	writer = s4;
+
+	/* Damage the second transaction in the log, like a write
+	 * that did not make it to the disk
+	 */
+	logname = g_strconcat (name, ".log", NULL);
+	CU_ASSERT_FATAL (g_file_get_contents (logname, &data, &len, NULL));
+	for (p = data; p + 10 <= data + len && memcmp (p, "torn value", 10); p++);
+	CU_ASSERT_FATAL (p + 10 <= data + len);
+	p[3] = 'N';
+	CU_ASSERT (g_file_set_contents (logname, data, len, NULL));
+	g_free (data);
+	g_free (logname);
+
+	/* The changes are only in the log, another handle has to redo them */
+	s4 = s4_open (name, NULL, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	check_db (db);
+
+	/* Only the intact transaction was redone */
+	fs = s4_fetchspec_create ();
+	s4_fetchspec_add (fs, NULL, NULL, S4_FETCH_PARENT);
+	cond = s4_cond_new_filter (S4_FILTER_EXISTS, "property", NULL, NULL, S4_CMP_CASELESS, 0);
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+
+	s4_close (writer);
+	_close ();
+}
+
+static void _commit_thread (const char *key)
+{
+	s4_transaction_t *trans;
+	s4_val_t *ival;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		ival = s4_val_new_int (i);
+		trans = s4_begin (s4, 0);
+		CU_ASSERT (s4_add (trans, key, ival, "property", ival, "src_a"));
+		CU_ASSERT (s4_commit (trans));
+		s4_val_free (ival);
+	}
+}
+
+CASE (test_concurrent_commit) {
+	const char *keys[] = {"t0", "t1", "t2", "t3"};
+	GThread *threads[4];
+	int i;
+
+	_open (S4_NEW);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	for (i = 0; i < 4; i++) {
+		threads[i] = g_thread_new ("commit", (GThreadFunc)_commit_thread, (gpointer)keys[i]);
+	}
+	for (i = 0; i < 4; i++) {
+		g_thread_join (threads[i]);
+	}
+
+	s4_close (s4);
+
+	/* Every commit was logged, even the ones that shared an fsync */
+	s4 = s4_open (name, NULL, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	for (i = 0; i < 4; i++) {
+		check_int_query (keys[i], 0, S4_COND_PARENT, 1);
+		check_int_query (keys[i], 99, S4_COND_PARENT, 1);
+	}
+
+	_close ();
+}
+
+CASE (test_nosync) {
+	s4_options_t *opts = s4_options_create ();
+	s4_transaction_t *trans;
+	s4_stats_t stats;
+	s4_val_t *ival;
+	gint64 fsyncs;
+	int i;
+
+	s4_options_set_flush_interval (opts, 500);
+	_open_with_options (S4_NEW, opts);
+	s4_options_free (opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	s4_get_stats (s4, &stats);
+	fsyncs = stats.log_fsync.count;
+	for (i = 0; i < 10; i++) {
+		ival = s4_val_new_int (i);
+		trans = s4_begin (s4, S4_TRANS_NOSYNC);
+		CU_ASSERT (s4_add (trans, "id", ival, "playcount", ival, "src_a"));
+		CU_ASSERT (s4_commit (trans));
+		s4_val_free (ival);
+	}
+
+	/* Committing does not sync the log */
+	s4_get_stats (s4, &stats);
+	CU_ASSERT_EQUAL (stats.log_fsync.count, fsyncs);
+
+	/* The flusher thread syncs them in the background */
+	for (i = 0; i < 300 && stats.log_fsync.count == fsyncs; i++) {
+		g_usleep (10000);
+		s4_get_stats (s4, &stats);
+	}
+	CU_ASSERT (stats.log_fsync.count > fsyncs);
+
+	/* A synced commit syncs right away */
+	fsyncs = stats.log_fsync.count;
+	ival = s4_val_new_int (10);
+	trans = s4_begin (s4, S4_TRANS_NOSYNC);
+	CU_ASSERT (s4_add (trans, "id", ival, "playcount", ival, "src_a"));
+	CU_ASSERT (s4_commit (trans));
+	s4_get_stats (s4, &stats);
+	CU_ASSERT_EQUAL (stats.log_fsync.count, fsyncs);
+
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_add (trans, "id", ival, "playcount", ival, "src_b"));
+	CU_ASSERT (s4_commit (trans));
+	s4_get_stats (s4, &stats);
+	CU_ASSERT (stats.log_fsync.count > fsyncs);
+	s4_val_free (ival);
+
+	check_int_query ("id", 9, S4_COND_PARENT, 1);
+	s4_close (s4);
+
+	s4 = s4_open (name, NULL, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	check_int_query ("id", 0, S4_COND_PARENT, 1);
+	check_int_query ("id", 9, S4_COND_PARENT, 1);
+
+	_close ();
+}
+
+/* The number of threads of this process with a name, -1 if unknown */
+static int _count_threads (const char *thread_name)
+{
+	GDir *dir = g_dir_open ("/proc/self/task", 0, NULL);
+	const char *tid;
+	int ret = 0;
+
+	if (dir == NULL)
+		return -1;
+
+	while ((tid = g_dir_read_name (dir)) != NULL) {
+		char *path = g_build_filename ("/proc/self/task", tid, "comm", NULL);
+		char *comm;
+
+		if (g_file_get_contents (path, &comm, NULL, NULL)) {
+			if (!strcmp (g_strchomp (comm), thread_name))
+				ret++;
+			g_free (comm);
+		}
+		g_free (path);
+	}
+	g_dir_close (dir);
+
+	return ret;
+}
+
+CASE (test_nosync_flusher_lazy) {
+	s4_transaction_t *trans;
+	s4_val_t *ival = s4_val_new_int (1);
+	int before = _count_threads ("s4 log flusher");
+
+	/* Opening, committing and checkpointing do not start the flusher */
+	_open (S4_NEW);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_add (trans, "id", ival, "playcount", ival, "src_a"));
+	CU_ASSERT (s4_commit (trans));
+	s4_sync (s4);
+
+	if (before >= 0) {
+		CU_ASSERT_EQUAL (_count_threads ("s4 log flusher"), before);
+	}
+
+	/* The first NOSYNC commit starts it */
+	trans = s4_begin (s4, S4_TRANS_NOSYNC);
+	CU_ASSERT (s4_add (trans, "id", ival, "playcount", ival, "src_b"));
+	CU_ASSERT (s4_commit (trans));
+
+	if (before >= 0) {
+		CU_ASSERT_EQUAL (_count_threads ("s4 log flusher"), before + 1);
+	}
+
+	s4_val_free (ival);
+	_close ();
+}
+
+CASE (test_recovery_stats) {
+	s4_transaction_t *trans;
+	s4_stats_t stats;
+	s4_val_t *ival;
+	s4_t *other;
+	int i;
+
+	_open (S4_NEW);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	s4_get_stats (s4, &stats);
+	CU_ASSERT_EQUAL (stats.recovery.count, 1);
+	CU_ASSERT_EQUAL (stats.recovered, 0);
+
+	for (i = 0; i < 10; i++) {
+		ival = s4_val_new_int (i);
+		trans = s4_begin (s4, 0);
+		CU_ASSERT (s4_add (trans, "id", ival, "playcount", ival, "src_a"));
+		CU_ASSERT (s4_commit (trans));
+		s4_val_free (ival);
+	}
+
+	/* The commits are only in the log, so opening redoes them */
+	other = s4_open (name, NULL, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (other);
+
+	s4_get_stats (other, &stats);
+	CU_ASSERT_EQUAL (stats.recovery.count, 1);
+	CU_ASSERT_EQUAL (stats.recovered, 10);
+
+	s4_close (other);
+	_close ();
+}
+
+CASE (test_index_order) {
+	const char *indices[] = {"tracknr", NULL};
+	s4_transaction_t *trans;
+	s4_val_t *ival;
+	int i;
+
+	s4 = s4_open (NULL, indices, S4_MEMORY);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	/* Reverse order splits the first node of every level */
+	trans = s4_begin (s4, 0);
+	for (i = 5000; i > 0; i--) {
+		ival = s4_val_new_int (i);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", ival, "src_a"));
+		s4_val_free (ival);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	check_int_filter (S4_FILTER_GREATER, "tracknr", 4990, 0, 10);
+	check_int_filter (S4_FILTER_SMALLEREQ, "tracknr", 100, 0, 100);
+	check_int_filter (S4_FILTER_GREATEREQ, "id", 2500, S4_COND_PARENT, 2501);
+	check_int_query ("tracknr", 1234, 0, 1);
+
+	/* Empty a range of leaves in the middle */
+	trans = s4_begin (s4, 0);
+	for (i = 1000; i < 4000; i++) {
+		ival = s4_val_new_int (i);
+		CU_ASSERT (s4_del (trans, "id", ival, "tracknr", ival, "src_a"));
+		s4_val_free (ival);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	check_int_query ("tracknr", 1234, 0, 0);
+	check_int_query ("tracknr", 999, 0, 1);
+	check_int_query ("tracknr", 4000, 0, 1);
+	check_int_filter (S4_FILTER_GREATER, "tracknr", 500, 0, 1500);
+	check_int_filter (S4_FILTER_SMALLER, "tracknr", 4010, 0, 1009);
+
+	/* And fill it again */
+	trans = s4_begin (s4, 0);
+	for (i = 3999; i >= 1000; i -= 2) {
+		ival = s4_val_new_int (i);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", ival, "src_a"));
+		s4_val_free (ival);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	check_int_filter (S4_FILTER_GREATER, "tracknr", 500, 0, 3000);
+	check_int_query ("tracknr", 1235, 0, 1);
+	check_int_query ("tracknr", 1234, 0, 0);
+
+	_mem_close ();
+}
+
+static s4_condition_t *_int_filter (s4_filter_type_t type, const char *key, int32_t ival)
+{
+	s4_val_t *val = s4_val_new_int (ival);
+	s4_condition_t *cond = s4_cond_new_filter (type, key, val,
+			NULL, S4_CMP_CASELESS, 0);
+
+	s4_val_free (val);
+	return cond;
+}
+
+static s4_condition_t *_combine (s4_combine_type_t type,
+		s4_condition_t *a, s4_condition_t *b)
+{
+	s4_condition_t *cond = s4_cond_new_combiner (type);
+
+	s4_cond_add_operand (cond, a);
+	s4_cond_unref (a);
+	if (b != NULL) {
+		s4_cond_add_operand (cond, b);
+		s4_cond_unref (b);
+	}
+
+	return cond;
+}
+
+static void check_cond (s4_condition_t *cond, int rows)
+{
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+
+	s4_fetchspec_add (fs, NULL, NULL, S4_FETCH_DATA);
+
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), rows);
+
+	s4_resultset_free (set);
+	s4_fetchspec_free (fs);
+	s4_cond_unref (cond);
+}
+
+CASE (test_query_plan) {
+	const char *indices[] = {"tracknr", "year", NULL};
+	s4_transaction_t *trans;
+	s4_val_t *ival, *tval, *rval;
+	int i;
+
+	s4 = s4_open (NULL, indices, S4_MEMORY);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	trans = s4_begin (s4, 0);
+	for (i = 1; i <= 100; i++) {
+		ival = s4_val_new_int (i);
+		tval = s4_val_new_int (i % 10);
+		rval = s4_val_new_int (i % 3);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", tval, "src_a"));
+		CU_ASSERT (s4_add (trans, "id", ival, "year", ival, "src_a"));
+		CU_ASSERT (s4_add (trans, "id", ival, "rating", rval, "src_a"));
+		s4_val_free (ival);
+		s4_val_free (tval);
+		s4_val_free (rval);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	/* Both operands indexed */
+	check_cond (_combine (S4_COMBINE_AND,
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 3),
+				_int_filter (S4_FILTER_GREATER, "year", 50)), 5);
+	check_cond (_combine (S4_COMBINE_AND,
+				_int_filter (S4_FILTER_GREATER, "year", 90),
+				_int_filter (S4_FILTER_SMALLER, "year", 95)), 4);
+	check_cond (_combine (S4_COMBINE_AND,
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 3),
+				_int_filter (S4_FILTER_EQUAL, "year", 4)), 0);
+	check_cond (_combine (S4_COMBINE_OR,
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 3),
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 4)), 20);
+
+	/* "rating" has no index, the OR has to look at everything */
+	check_cond (_combine (S4_COMBINE_OR,
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 3),
+				_int_filter (S4_FILTER_EQUAL, "rating", 0)), 39);
+
+	/* but the AND can still use the index on "tracknr" */
+	check_cond (_combine (S4_COMBINE_AND,
+				_int_filter (S4_FILTER_EQUAL, "rating", 0),
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 3)), 4);
+	check_cond (_combine (S4_COMBINE_AND,
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 3),
+				_combine (S4_COMBINE_NOT,
+					_int_filter (S4_FILTER_EQUAL, "rating", 0), NULL)), 6);
+	check_cond (_combine (S4_COMBINE_NOT,
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 3), NULL), 90);
+
+	/* The most selective operand is searched first, the rest is
+	 * checked on its candidates
+	 */
+	check_cond (_combine (S4_COMBINE_AND,
+				_int_filter (S4_FILTER_GREATER, "year", 0),
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 3)), 10);
+	check_cond (_combine (S4_COMBINE_AND,
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 5),
+				_int_filter (S4_FILTER_EQUAL, "year", 5)), 1);
+	check_cond (_combine (S4_COMBINE_AND,
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 4),
+				_int_filter (S4_FILTER_EQUAL, "year", 5)), 0);
+
+	_mem_close ();
+}
+
+CASE (test_index_stats) {
+	const char *indices[] = {"tracknr", NULL};
+	s4_index_stats_t stats;
+	s4_transaction_t *trans;
+	s4_val_t *ival, *tval;
+	int i;
+
+	s4 = s4_open (NULL, indices, S4_MEMORY);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 100; i++) {
+		ival = s4_val_new_int (i);
+		tval = s4_val_new_int (i % 10);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", tval, "src_a"));
+		s4_val_free (ival);
+		s4_val_free (tval);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	CU_ASSERT (s4_index_get_stats (s4, "tracknr", 0, &stats));
+	CU_ASSERT_EQUAL (stats.values, 10);
+	CU_ASSERT_EQUAL (stats.entries, 100);
+	CU_ASSERT_EQUAL (stats.histogram[3], 10);
+
+	CU_ASSERT (s4_index_get_stats (s4, "id", 1, &stats));
+	CU_ASSERT_EQUAL (stats.values, 100);
+	CU_ASSERT_EQUAL (stats.entries, 100);
+	CU_ASSERT_EQUAL (stats.histogram[0], 100);
+
+	CU_ASSERT_FALSE (s4_index_get_stats (s4, "tracknr", 1, &stats));
+	CU_ASSERT_FALSE (s4_index_get_stats (s4, "id", 0, &stats));
+
+	/* Remove every entry with tracknr 3 and one with tracknr 4 */
+	trans = s4_begin (s4, 0);
+	for (i = 3; i < 100; i += 10) {
+		ival = s4_val_new_int (i);
+		tval = s4_val_new_int (3);
+		CU_ASSERT (s4_del (trans, "id", ival, "tracknr", tval, "src_a"));
+		s4_val_free (ival);
+		s4_val_free (tval);
+	}
+	ival = s4_val_new_int (4);
+	CU_ASSERT (s4_del (trans, "id", ival, "tracknr", ival, "src_a"));
+	s4_val_free (ival);
+	CU_ASSERT (s4_commit (trans));
+
+	CU_ASSERT (s4_index_get_stats (s4, "tracknr", 0, &stats));
+	CU_ASSERT_EQUAL (stats.values, 9);
+	CU_ASSERT_EQUAL (stats.entries, 89);
+	CU_ASSERT_EQUAL (stats.histogram[3], 9);
+
+	_mem_close ();
+}
+
+CASE (test_index_rebalance) {
+	const char *indices[] = {"tracknr", NULL};
+	s4_index_stats_t stats;
+	s4_transaction_t *trans;
+	s4_val_t *ival;
+	int i;
+
+	s4 = s4_open (NULL, indices, S4_MEMORY);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	/* Shuffled, so the leaves are split in the middle */
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 10000; i++) {
+		ival = s4_val_new_int ((i * 7919) % 10000);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", ival, "src_a"));
+		s4_val_free (ival);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	CU_ASSERT (s4_index_get_stats (s4, "tracknr", 0, &stats));
+	CU_ASSERT (stats.depth >= 3);
+	CU_ASSERT (stats.leaves >= 10000 / 32);
+
+	/* Keep every 100th value, removing the others in another order */
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 10000; i++) {
+		int v = (i * 6007) % 10000;
+
+		if (v % 100 == 0)
+			continue;
+
+		ival = s4_val_new_int (v);
+		CU_ASSERT (s4_del (trans, "id", ival, "tracknr", ival, "src_a"));
+		s4_val_free (ival);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	/* The leaves left are at least half full */
+	CU_ASSERT (s4_index_get_stats (s4, "tracknr", 0, &stats));
+	CU_ASSERT_EQUAL (stats.values, 100);
+	CU_ASSERT (stats.leaves <= 100 / 16);
+	CU_ASSERT (stats.depth <= 2);
+
+	check_int_query ("tracknr", 4200, 0, 1);
+	check_int_query ("tracknr", 4201, 0, 0);
+	check_int_filter (S4_FILTER_GREATEREQ, "tracknr", 5000, 0, 50);
+	check_int_filter (S4_FILTER_SMALLER, "tracknr", 1000, 0, 10);
+	check_int_filter (S4_FILTER_GREATER, "id", 9800, S4_COND_PARENT, 1);
+
+	/* Delete the rest */
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 10000; i += 100) {
+		ival = s4_val_new_int (i);
+		CU_ASSERT (s4_del (trans, "id", ival, "tracknr", ival, "src_a"));
+		s4_val_free (ival);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	CU_ASSERT (s4_index_get_stats (s4, "tracknr", 0, &stats));
+	CU_ASSERT_EQUAL (stats.values, 0);
+	CU_ASSERT_EQUAL (stats.leaves, 1);
+	CU_ASSERT_EQUAL (stats.depth, 1);
+
+	_mem_close ();
+}
+
+CASE (test_index_build) {
+	const char *indices[] = {"tracknr", NULL};
+	s4_index_stats_t stats;
+	s4_transaction_t *trans;
+	s4_val_t *ival, *tval;
+	int i;
+
+	_open (S4_NEW);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 10000; i++) {
+		ival = s4_val_new_int ((i * 7919) % 10000);
+		tval = s4_val_new_int ((i * 7919) % 1000);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", tval, "src_a"));
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", tval, "src_b"));
+		s4_val_free (ival);
+		s4_val_free (tval);
+	}
+	CU_ASSERT (s4_commit (trans));
+	s4_sync (s4);
+	s4_close (s4);
+
+	/* The index is built from the file at once */
+	s4 = s4_open (name, indices, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	CU_ASSERT (s4_index_get_stats (s4, "tracknr", 0, &stats));
+	CU_ASSERT_EQUAL (stats.values, 1000);
+	CU_ASSERT_EQUAL (stats.entries, 10000);
+	CU_ASSERT_EQUAL (stats.histogram[3], 1000);
+	CU_ASSERT_EQUAL (stats.leaves, 1000 / 32 + 1);
+	CU_ASSERT_EQUAL (stats.depth, 2);
+
+	check_int_query ("tracknr", 0, 0, 10);
+	check_int_query ("tracknr", 999, 0, 10);
+	check_int_query ("tracknr", 1000, 0, 0);
+	check_int_filter (S4_FILTER_GREATEREQ, "tracknr", 500, 0, 5000);
+	check_int_filter (S4_FILTER_SMALLER, "tracknr", 100, 0, 1000);
+
+	/* It can still be changed */
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 10000; i++) {
+		if (i % 1000 < 10)
+			continue;
+
+		ival = s4_val_new_int (i);
+		tval = s4_val_new_int (i % 1000);
+		CU_ASSERT (s4_del (trans, "id", ival, "tracknr", tval, "src_a"));
+		CU_ASSERT (s4_del (trans, "id", ival, "tracknr", tval, "src_b"));
+		s4_val_free (ival);
+		s4_val_free (tval);
+	}
+	ival = s4_val_new_int (5000);
+	CU_ASSERT (s4_add (trans, "id", ival, "tracknr", ival, "src_a"));
+	s4_val_free (ival);
+	CU_ASSERT (s4_commit (trans));
+
+	CU_ASSERT (s4_index_get_stats (s4, "tracknr", 0, &stats));
+	CU_ASSERT_EQUAL (stats.values, 11);
+	CU_ASSERT_EQUAL (stats.entries, 101);
+
+	check_int_query ("tracknr", 9, 0, 10);
+	check_int_query ("tracknr", 10, 0, 0);
+	check_int_query ("tracknr", 5000, 0, 1);
+	check_int_filter (S4_FILTER_GREATER, "tracknr", 5, 0, 41);
+
+	_close ();
+}
+
+static GThread *_query_thread;
+static int _other_thread;
+
+/* Matches rating 3, noting if it is ever called from another thread */
+static int _thread_filter (const s4_val_t *value, s4_condition_t *cond)
+{
+	int32_t i;
+
+	if (g_thread_self () != _query_thread)
+		_other_thread = 1;
+
+	return !s4_val_get_int (value, &i) || i != 3;
+}
+
+CASE (test_parallel_query) {
+	const char *indices[] = {"tracknr", NULL};
+	s4_options_t *opts = s4_options_create ();
+	s4_transaction_t *trans;
+	s4_val_t *ival, *tval;
+	int i;
+
+	s4_options_set_query_threads (opts, 4);
+	s4 = s4_open_with_options (NULL, indices, S4_MEMORY, opts);
+	s4_options_free (opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 10000; i++) {
+		ival = s4_val_new_int (i);
+		tval = s4_val_new_int (i % 10);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", tval, "src_a"));
+		CU_ASSERT (s4_add (trans, "id", ival, "rating", tval, "src_a"));
+		s4_val_free (ival);
+		s4_val_free (tval);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	/* Full scans are split up */
+	check_int_filter (S4_FILTER_EQUAL, "rating", 3, 0, 1000);
+	check_int_filter (S4_FILTER_SMALLER, "rating", 5, 0, 5000);
+	check_cond (_combine (S4_COMBINE_NOT,
+				_int_filter (S4_FILTER_EQUAL, "tracknr", 3), NULL), 9000);
+
+	/* and small queries are not */
+	check_int_filter (S4_FILTER_EQUAL, "id", 1234, S4_COND_PARENT, 1);
+
+	/* Custom filters are not */
+	_query_thread = g_thread_self ();
+	_other_thread = 0;
+	check_cond (s4_cond_new_custom_filter (_thread_filter, NULL, NULL,
+				"rating", NULL, S4_CMP_BINARY, 0, 0), 1000);
+	CU_ASSERT_FALSE (_other_thread);
+
+	_mem_close ();
+}
+
+CASE (test_sort_keys) {
+	struct db_struct db[] = {
+		{"a", {"Hello", "wORLD", NULL}, "src_a"},
+		{"b", {"x", NULL}, "src_b"},
+		{NULL, {NULL}, NULL}};
+	s4_options_t *opts = s4_options_create ();
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	const s4_result_t *res;
+	const char *str, *key;
+	s4_val_t *val;
+	char *expected;
+	int found = 0;
+
+	s4_options_set_sort_keys (opts, 1);
+	_open_with_options (S4_NEW, opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	create_db (db);
+	s4_close (s4);
+
+	/* The keys are read back from the file */
+	s4 = s4_open_with_options (name, NULL, S4_EXISTS, opts);
+	s4_options_free (opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	check_db (db);
+
+	/* Filter on one entry, the order of the rows of a query is
+	 * not something this test should depend on
+	 */
+	s4_fetchspec_add (fs, "property", NULL, S4_FETCH_DATA);
+	val = s4_val_new_string ("Hello");
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "property", val, NULL, S4_CMP_BINARY, 0);
+	s4_val_free (val);
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+	CU_ASSERT_EQUAL_FATAL (s4_resultset_get_rowcount (set), 1);
+
+	/* Every value of the entry has its keys, whatever order they are in */
+	for (res = s4_resultset_get_result (set, 0, 0); res != NULL; res = s4_result_next (res)) {
+		CU_ASSERT_FATAL (s4_val_get_str (s4_result_get_val (res), &str));
+		found++;
+
+		expected = s4_string_casefold (str);
+		CU_ASSERT (s4_val_get_casefolded_str (s4_result_get_val (res), &key));
+		CU_ASSERT_STRING_EQUAL (key, expected);
+		g_free (expected);
+
+		expected = s4_string_collate (str);
+		CU_ASSERT (s4_val_get_collated_str (s4_result_get_val (res), &key));
+		CU_ASSERT_STRING_EQUAL (key, expected);
+		g_free (expected);
+	}
+	CU_ASSERT_EQUAL (found, 2);
+
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	_close ();
+}
+
+static int _count_in_file (const char *filename, const char *str)
+{
+	char *data, *p;
+	gsize len;
+	int ret = 0;
+
+	if (!g_file_get_contents (filename, &data, &len, NULL))
+		return -1;
+
+	for (p = data; p + strlen (str) <= data + len; p++) {
+		if (!memcmp (p, str, strlen (str)))
+			ret++;
+	}
+	g_free (data);
+
+	return ret;
+}
+
+/* The number of times the database file is mapped into memory */
+static int _count_mappings (void)
+{
+	char *line = g_strconcat (name, "\n", NULL);
+	char *deleted = g_strconcat (name, " (deleted)", NULL);
+	int ret = _count_in_file ("/proc/self/maps", line);
+
+	if (ret >= 0)
+		ret += _count_in_file ("/proc/self/maps", deleted);
+
+	g_free (line);
+	g_free (deleted);
+	return ret;
+}
+
+CASE (test_reread_mappings) {
+	s4_options_t *opts = s4_options_create ();
+	s4_transaction_t *trans;
+	s4_val_t *ival, *sval;
+	s4_t *writer, *reader;
+	char buf[64];
+	int i, round, mappings = -1;
+
+	s4_options_set_log_size (opts, S4_LOG_MIN_SIZE);
+	_open_with_options (S4_NEW, opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	writer = s4;
+
+	trans = s4_begin (writer, 0);
+	ival = s4_val_new_int (-1);
+	CU_ASSERT (s4_add (trans, "id", ival, "tracknr", ival, "src_a"));
+	s4_val_free (ival);
+	CU_ASSERT (s4_commit (trans));
+	s4_sync (writer);
+
+	reader = s4_open_with_options (name, NULL, S4_EXISTS, opts);
+	s4_options_free (opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (reader);
+
+	/* Every round wraps the log, so the reader reads the file again */
+	for (round = 0; round < 5; round++) {
+		for (i = 0; i < 1000; i++) {
+			trans = s4_begin (writer, 0);
+			ival = s4_val_new_int (round * 1000 + i);
+			sprintf (buf, "round %i value %i", round, i);
+			sval = s4_val_new_string (buf);
+			CU_ASSERT (s4_add (trans, "id", ival, "property", sval, "src_a"));
+			s4_val_free (ival);
+			s4_val_free (sval);
+			CU_ASSERT (s4_commit (trans));
+		}
+		s4_sync (writer);
+
+		s4 = reader;
+		check_int_query ("id", round * 1000 + 999, S4_COND_PARENT, 1);
+		s4 = writer;
+
+		if (round == 0)
+			mappings = _count_mappings ();
+	}
+
+	/* Rereads copy the strings instead of keeping the file mapped */
+	if (mappings >= 0) {
+		CU_ASSERT_EQUAL (_count_mappings (), mappings);
+	}
+
+	s4_close (reader);
+	_close ();
+}
+
+CASE (test_compact_strings) {
+	struct db_struct db[] = {
+		{"file:///music/a/01.mp3", {"file:///music/a/cover.jpg", "Album A", NULL}, "plugin/id3v2"},
+		{"file:///music/a/02.mp3", {"file:///music/a/cover.jpg", "Album A", NULL}, "plugin/id3v2"},
+		{"file:///music/b/01.ogg", {"file:///music/b/", "", NULL}, "plugin/vorbis"},
+		{NULL, {NULL}, NULL}};
+	s4_options_t *opts = s4_options_create ();
+	s4_transaction_t *trans;
+	s4_val_t *name_val, *arg_val;
+	s4_t *writer;
+	char *logname;
+	int i, j;
+
+	s4_options_set_compact_strings (opts, 1);
+	_open_with_options (S4_NEW, opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	logname = g_strconcat (name, ".log", NULL);
+
+	/* One transaction, so the log entries refer to each other's strings */
+	trans = s4_begin (s4, 0);
+	for (i = 0; db[i].name != NULL; i++) {
+		name_val = s4_val_new_string (db[i].name);
+		for (j = 0; db[i].args[j] != NULL; j++) {
+			arg_val = s4_val_new_string (db[i].args[j]);
+			CU_ASSERT (s4_add (trans, "entry", name_val, "property", arg_val, db[i].src));
+			s4_val_free (arg_val);
+		}
+		s4_val_free (name_val);
+	}
+	CU_ASSERT (s4_commit (trans));
+	writer = s4;
+	CU_ASSERT_EQUAL (_count_in_file (logname, "plugin/id3v2"), 1);
+	CU_ASSERT_EQUAL (_count_in_file (logname, "file:///music/a/cover.jpg"), 1);
+	g_free (logname);
+
+	/* The changes are only in the log, another handle has to redo them */
+	s4 = s4_open (name, NULL, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	check_db (db);
+	s4_close (s4);
+	s4_close (writer);
+	CU_ASSERT_EQUAL (_count_in_file (name, "file:///music/"), 1);
+
+	/* Read back from the front-coded file, and written without it */
+	s4 = s4_open (name, NULL, S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	check_db (db);
+	s4_close (s4);
+
+	s4 = s4_open_with_options (name, NULL, S4_EXISTS, opts);
+	s4_options_free (opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	check_db (db);
+
+	_close ();
+}
+
+CASE (test_cursor) {
+	const char *indices[] = {"tracknr", NULL};
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	s4_cursor_t *cursor;
+	const s4_resultrow_t *row, *set_row;
+	const s4_result_t *res, *set_res;
+	s4_val_t *ival, *tval;
+	int i, flags[] = {0, S4_TRANS_READONLY};
+
+	s4 = s4_open (NULL, indices, S4_MEMORY);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 1000; i++) {
+		ival = s4_val_new_int (i);
+		tval = s4_val_new_int (i % 10);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", tval, "src_a"));
+		s4_val_free (ival);
+		s4_val_free (tval);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	s4_fetchspec_add (fs, "id", NULL, S4_FETCH_PARENT);
+	tval = s4_val_new_int (3);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "tracknr", tval, NULL, S4_CMP_BINARY, 0);
+	s4_val_free (tval);
+
+	for (i = 0; i < 2; i++) {
+		int count = 0;
+
+		trans = s4_begin (s4, flags[i]);
+		set = s4_query (trans, fs, cond);
+		CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 100);
+
+		/* The same rows as s4_query, in the same order */
+		cursor = s4_query_cursor (trans, fs, cond, 10, 5);
+		while (s4_cursor_next (cursor, &row)) {
+			s4_resultrow_get_col (row, 0, &res);
+			s4_resultset_get_row (set, 10 + count, &set_row);
+			s4_resultrow_get_col (set_row, 0, &set_res);
+			CU_ASSERT_PTR_EQUAL (s4_result_get_val (res), s4_result_get_val (set_res));
+			count++;
+		}
+		CU_ASSERT_EQUAL (count, 5);
+		s4_cursor_free (cursor);
+
+		cursor = s4_query_cursor (trans, fs, cond, 95, -1);
+		for (count = 0; s4_cursor_next (cursor, &row); count++);
+		CU_ASSERT_EQUAL (count, 5);
+		s4_cursor_free (cursor);
+
+		s4_resultset_free (set);
+		CU_ASSERT (s4_commit (trans));
+	}
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	_mem_close ();
+}
+
+/* Checks that the first rows of two resultsets have the same ids */
+static void _check_same_rows (s4_resultset_t *set, int offset, s4_resultset_t *other, int count)
+{
+	const s4_result_t *res, *other_res;
+	int i;
+
+	CU_ASSERT_EQUAL_FATAL (s4_resultset_get_rowcount (other), count);
+
+	for (i = 0; i < count; i++) {
+		res = s4_resultset_get_result (set, offset + i, 0);
+		other_res = s4_resultset_get_result (other, i, 0);
+		CU_ASSERT_PTR_NOT_NULL_FATAL (res);
+		CU_ASSERT_PTR_NOT_NULL_FATAL (other_res);
+		CU_ASSERT_PTR_EQUAL (s4_result_get_val (res), s4_result_get_val (other_res));
+	}
+}
+
+CASE (test_query_ordered) {
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_order_t *order = s4_order_create ();
+	s4_order_entry_t *entry;
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set, *page;
+	s4_val_t *ival, *tval;
+	int i;
+
+	_mem_open ();
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 1000; i++) {
+		ival = s4_val_new_int (i);
+		tval = s4_val_new_int ((i * 7) % 10);
+		CU_ASSERT (s4_add (trans, "id", ival, "tracknr", tval, "src_a"));
+		s4_val_free (ival);
+		s4_val_free (tval);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	s4_fetchspec_add (fs, "id", NULL, S4_FETCH_PARENT);
+	s4_fetchspec_add (fs, "tracknr", NULL, S4_FETCH_DATA);
+	cond = s4_cond_new_filter (S4_FILTER_EXISTS, "tracknr", NULL, NULL, S4_CMP_BINARY, 0);
+
+	/* Lots of ties, so the order they are broken in matters */
+	entry = s4_order_add_column (order, S4_CMP_BINARY, S4_ORDER_DESCENDING);
+	s4_order_entry_add_choice (entry, 1);
+
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	s4_resultset_sort (set, order);
+
+	page = s4_query_ordered (trans, fs, cond, order, 0, 150);
+	_check_same_rows (set, 0, page, 150);
+	s4_resultset_free (page);
+
+	page = s4_query_ordered (trans, fs, cond, order, 990, 50);
+	_check_same_rows (set, 990, page, 10);
+	s4_resultset_free (page);
+
+	page = s4_query_ordered (trans, fs, cond, order, 0, -1);
+	_check_same_rows (set, 0, page, 1000);
+	s4_resultset_free (page);
+
+	page = s4_query (trans, fs, cond);
+	s4_resultset_sort_limit (page, order, 30);
+	_check_same_rows (set, 0, page, 30);
+	s4_resultset_free (page);
+
+	s4_resultset_free (set);
+	CU_ASSERT (s4_commit (trans));
+
+	s4_order_free (order);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	_mem_close ();
+}
+
+/* Finds the aggregate of the group with a string value, -1 if there is none */
+static int _group_get (s4_resultset_t *set, const char *value)
+{
+	const s4_result_t *res;
+	const char *str;
+	int32_t ret;
+	int i;
+
+	for (i = 0; i < s4_resultset_get_rowcount (set); i++) {
+		res = s4_resultset_get_result (set, i, 0);
+		if (res == NULL || !s4_val_get_str (s4_result_get_val (res), &str) || strcmp (str, value))
+			continue;
+		res = s4_resultset_get_result (set, i, 1);
+		if (res == NULL || !s4_val_get_int (s4_result_get_val (res), &ret))
+			return -2;
+		return ret;
+	}
+
+	return -1;
+}
+
+CASE (test_query_group) {
+	const char *plugin[] = {"plugin", NULL}, *user[] = {"user", "plugin", NULL};
+	const char *glob[] = {"plugin/*", NULL};
+	s4_sourcepref_t *sp_plugin = s4_sourcepref_create (plugin);
+	s4_sourcepref_t *sp_user = s4_sourcepref_create (user);
+	s4_sourcepref_t *sp_glob = s4_sourcepref_create (glob);
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	const s4_result_t *res;
+	s4_val_t *ival, *aval;
+	int32_t ret_i;
+	char artist[32];
+	int i;
+
+	_mem_open ();
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 30; i++) {
+		ival = s4_val_new_int (i);
+		sprintf (artist, "artist%i", i % 3);
+		aval = s4_val_new_string (artist);
+		CU_ASSERT (s4_add (trans, "id", ival, "artist", aval, "plugin"));
+		CU_ASSERT (s4_add (trans, "id", ival, "duration", ival, "plugin"));
+		s4_val_free (aval);
+		if (i < 3) {
+			aval = s4_val_new_string ("override");
+			CU_ASSERT (s4_add (trans, "id", ival, "artist", aval, "user"));
+			s4_val_free (aval);
+		}
+		s4_val_free (ival);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	cond = s4_cond_new_filter (S4_FILTER_EXISTS, "artist", NULL, NULL, S4_CMP_BINARY, 0);
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+
+	CU_ASSERT_EQUAL (s4_query_count (trans, cond), 30);
+
+	set = s4_query_distinct (trans, cond, "artist", sp_plugin);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 3);
+	CU_ASSERT_EQUAL (s4_resultset_get_colcount (set), 2);
+	CU_ASSERT_EQUAL (_group_get (set, "artist0"), 10);
+	CU_ASSERT_EQUAL (_group_get (set, "artist2"), 10);
+	CU_ASSERT_EQUAL (_group_get (set, "override"), -1);
+	s4_resultset_free (set);
+
+	/* The sourcepref picks the value an entry is grouped by */
+	set = s4_query_distinct (trans, cond, "artist", sp_user);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 4);
+	CU_ASSERT_EQUAL (_group_get (set, "artist1"), 9);
+	CU_ASSERT_EQUAL (_group_get (set, "override"), 3);
+	s4_resultset_free (set);
+
+	set = s4_query_group (trans, cond, "artist", sp_plugin,
+			S4_AGGREGATE_SUM, "duration", sp_plugin);
+	CU_ASSERT_EQUAL (_group_get (set, "artist0"), 135);
+	CU_ASSERT_EQUAL (_group_get (set, "artist1"), 145);
+	CU_ASSERT_EQUAL (_group_get (set, "artist2"), 155);
+	s4_resultset_free (set);
+
+	set = s4_query_group (trans, cond, "artist", sp_plugin,
+			S4_AGGREGATE_MIN, "duration", sp_plugin);
+	CU_ASSERT_EQUAL (_group_get (set, "artist1"), 1);
+	s4_resultset_free (set);
+
+	set = s4_query_group (trans, cond, "artist", sp_plugin,
+			S4_AGGREGATE_MAX, "duration", sp_plugin);
+	CU_ASSERT_EQUAL (_group_get (set, "artist2"), 29);
+	s4_resultset_free (set);
+
+	/* No group key, one group */
+	set = s4_query_group (trans, cond, NULL, NULL,
+			S4_AGGREGATE_SUM, "duration", sp_plugin);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	CU_ASSERT_PTR_NULL (s4_resultset_get_result (set, 0, 0));
+	res = s4_resultset_get_result (set, 0, 1);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (res);
+	CU_ASSERT (s4_val_get_int (s4_result_get_val (res), &ret_i));
+	CU_ASSERT_EQUAL (ret_i, 435);
+	CU_ASSERT_STRING_EQUAL (s4_result_get_key (res), "duration");
+	s4_resultset_free (set);
+
+	/* Strings have no minimum */
+	set = s4_query_group (trans, cond, NULL, NULL,
+			S4_AGGREGATE_MIN, "artist", sp_plugin);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	CU_ASSERT_PTR_NULL (s4_resultset_get_result (set, 0, 1));
+	s4_resultset_free (set);
+
+	/* Grouping by the parent key */
+	set = s4_query_group (trans, cond, "id", NULL,
+			S4_AGGREGATE_MAX, "duration", sp_plugin);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 30);
+	for (i = 0; i < s4_resultset_get_rowcount (set); i++) {
+		int32_t id, max;
+		CU_ASSERT (s4_val_get_int (s4_result_get_val (s4_resultset_get_result (set, i, 0)), &id));
+		CU_ASSERT (s4_val_get_int (s4_result_get_val (s4_resultset_get_result (set, i, 1)), &max));
+		CU_ASSERT_EQUAL (id, max);
+	}
+	s4_resultset_free (set);
+
+	CU_ASSERT (s4_commit (trans));
+	s4_cond_free (cond);
+
+	cond = s4_cond_new_filter (S4_FILTER_EXISTS, "nothing", NULL, NULL, S4_CMP_BINARY, 0);
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_EQUAL (s4_query_count (trans, cond), 0);
+	set = s4_query_distinct (trans, cond, "artist", sp_plugin);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 0);
+	s4_resultset_free (set);
+	CU_ASSERT (s4_commit (trans));
+	s4_cond_free (cond);
+
+	/* Sources with the same priority holding the same value count once */
+	trans = s4_begin (s4, 0);
+	for (i = 100; i < 102; i++) {
+		ival = s4_val_new_int (i);
+		aval = s4_val_new_string ("tied");
+		CU_ASSERT (s4_add (trans, "id", ival, "album", aval, "plugin/mad"));
+		s4_val_free (aval);
+		aval = s4_val_new_int (i - 95);
+		CU_ASSERT (s4_add (trans, "id", ival, "length", aval, "plugin/mad"));
+		if (i == 100) {
+			CU_ASSERT (s4_add (trans, "id", ival, "length", aval, "plugin/id3v2"));
+			s4_val_free (aval);
+			aval = s4_val_new_string ("tied");
+			CU_ASSERT (s4_add (trans, "id", ival, "album", aval, "plugin/id3v2"));
+		}
+		s4_val_free (aval);
+		s4_val_free (ival);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	cond = s4_cond_new_filter (S4_FILTER_EXISTS, "album", NULL, NULL, S4_CMP_BINARY, 0);
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT_EQUAL (s4_query_count (trans, cond), 2);
+
+	set = s4_query_distinct (trans, cond, "album", sp_glob);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	CU_ASSERT_EQUAL (_group_get (set, "tied"), 2);
+	s4_resultset_free (set);
+
+	set = s4_query_group (trans, cond, "album", sp_glob,
+			S4_AGGREGATE_SUM, "length", sp_glob);
+	CU_ASSERT_EQUAL (_group_get (set, "tied"), 11);
+	s4_resultset_free (set);
+	CU_ASSERT (s4_commit (trans));
+	s4_cond_free (cond);
+
+	s4_sourcepref_unref (sp_plugin);
+	s4_sourcepref_unref (sp_user);
+	s4_sourcepref_unref (sp_glob);
+	_mem_close ();
+}
+
+/* The ids of the entries a token filter matches, as a bitmask */
+static guint32 _token_ids (s4_t *db, const char *token, s4_cmp_mode_t mode)
+{
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_transaction_t *trans;
+	s4_condition_t *cond;
+	s4_resultset_t *set;
+	s4_val_t *val = s4_val_new_string (token);
+	guint32 ret = 0;
+	int32_t id;
+	int i;
+
+	s4_fetchspec_add (fs, "id", NULL, S4_FETCH_PARENT);
+	cond = s4_cond_new_filter (S4_FILTER_TOKEN, "title", val, NULL, mode, 0);
+
+	trans = s4_begin (db, 0);
+	set = s4_query (trans, fs, cond);
+	for (i = 0; i < s4_resultset_get_rowcount (set); i++) {
+		if (s4_val_get_int (s4_result_get_val (s4_resultset_get_result (set, i, 0)), &id))
+			ret |= 1 << id;
+	}
+	s4_resultset_free (set);
+	CU_ASSERT (s4_commit (trans));
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (val);
+
+	return ret;
+}
+
+static void _token_add (s4_t *db, int id, const char *str, int ival, const char *src, int del)
+{
+	s4_transaction_t *trans = s4_begin (db, 0);
+	s4_val_t *idval = s4_val_new_int (id);
+	s4_val_t *val = (str != NULL)?s4_val_new_string (str):s4_val_new_int (ival);
+
+	if (del) {
+		CU_ASSERT (s4_del (trans, "id", idval, "title", val, src));
+	} else {
+		CU_ASSERT (s4_add (trans, "id", idval, "title", val, src));
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	s4_val_free (idval);
+	s4_val_free (val);
+}
+
+CASE (test_token_index) {
+	struct {
+		const char *str;
+		int ival;
+	} titles[] = {
+		{"Foo bar", 0}, {"foobar", 0}, {"FOO", 0}, {"bar  foo", 0},
+		{"a b", 0}, {"x05", 0}, {"5", 0}, {NULL, 5}, {NULL, 15},
+		{NULL, 150}, {NULL, -5}, {"  ", 0}, {"12 ab ", 0}, {"Straße", 0},
+		{NULL, 0}};
+	const char *tokens[] = {"foo", "Foo", "fo*", "FO*", "bar", "b*", "a b",
+		"5", "05", "1*", "15", "0*", "*", "-5", "12", "x0*", "ab", "",
+		"strasse", "STRASSE*", "stra*e", NULL};
+	const char *indices[] = {"title", NULL};
+	s4_cmp_mode_t modes[] = {S4_CMP_BINARY, S4_CMP_CASELESS};
+	s4_options_t *opts = s4_options_create ();
+	s4_t *plain;
+	int i, j;
+
+	s4_options_set_token_index (opts, 1);
+	_open_with_options (S4_NEW, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	s4_close (s4);
+	s4 = s4_open_with_options (name, indices, S4_EXISTS, opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	plain = s4_open (NULL, indices, S4_MEMORY);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (plain);
+
+	for (i = 0; titles[i].str != NULL || titles[i].ival != 0; i++) {
+		_token_add (s4, i, titles[i].str, titles[i].ival, "src_a", 0);
+		_token_add (plain, i, titles[i].str, titles[i].ival, "src_a", 0);
+	}
+	/* The same value from two sources, then from one */
+	_token_add (s4, 0, "Foo bar", 0, "src_b", 0);
+	_token_add (plain, 0, "Foo bar", 0, "src_b", 0);
+	_token_add (s4, 0, "Foo bar", 0, "src_a", 1);
+	_token_add (plain, 0, "Foo bar", 0, "src_a", 1);
+	_token_add (s4, 2, "FOO", 0, "src_a", 1);
+	_token_add (plain, 2, "FOO", 0, "src_a", 1);
+
+	for (i = 0; tokens[i] != NULL; i++) {
+		for (j = 0; j < 2; j++) {
+			CU_ASSERT_EQUAL (_token_ids (s4, tokens[i], modes[j]),
+					_token_ids (plain, tokens[i], modes[j]));
+		}
+	}
+	CU_ASSERT_EQUAL (_token_ids (s4, "foo", S4_CMP_CASELESS), (1 << 0) | (1 << 3));
+	CU_ASSERT_EQUAL (_token_ids (s4, "fo*", S4_CMP_CASELESS), (1 << 0) | (1 << 1) | (1 << 3));
+
+	/* The token index is built again when the file is read */
+	s4_close (s4);
+	s4 = s4_open_with_options (name, indices, S4_EXISTS, opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	for (i = 0; tokens[i] != NULL; i++) {
+		CU_ASSERT_EQUAL (_token_ids (s4, tokens[i], S4_CMP_CASELESS),
+				_token_ids (plain, tokens[i], S4_CMP_CASELESS));
+	}
+
+	s4_options_free (opts);
+	s4_close (plain);
+	_close ();
+}
+
+CASE (test_token_delete) {
+	const char *indices[] = {"title", NULL};
+	s4_options_t *opts = s4_options_create ();
+	char *str;
+	int i;
+
+	s4_options_set_token_index (opts, 1);
+	s4 = s4_open_with_options (NULL, indices, S4_MEMORY, opts);
+	s4_options_free (opts);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	/* Enough tokens for the token index to get inner nodes */
+	for (i = 0; i < 2000; i++) {
+		str = g_strdup_printf ("w%i", i);
+		_token_add (s4, i % 20, str, 0, "src_a", 0);
+		g_free (str);
+	}
+
+	/* Tokens that are gone must not be left behind in the tree */
+	for (i = 0; i < 2000; i++) {
+		if (i % 20 != 3) {
+			str = g_strdup_printf ("w%i", i);
+			_token_add (s4, i % 20, str, 0, "src_a", 1);
+			g_free (str);
+		}
+	}
+
+	CU_ASSERT_EQUAL (_token_ids (s4, "w*", S4_CMP_CASELESS), 1 << 3);
+	CU_ASSERT_EQUAL (_token_ids (s4, "w3", S4_CMP_CASELESS), 1 << 3);
+	CU_ASSERT_EQUAL (_token_ids (s4, "w4", S4_CMP_CASELESS), 0);
+
+	_token_add (s4, 5, "w4", 0, "src_a", 0);
+	CU_ASSERT_EQUAL (_token_ids (s4, "w4", S4_CMP_CASELESS), 1 << 5);
+	CU_ASSERT_EQUAL (_token_ids (s4, "w*", S4_CMP_CASELESS), (1 << 3) | (1 << 5));
+
+	_mem_close ();
+}
+
+/* The ids of the entries a match filter matches, as a bitmask */
+static guint32 _match_ids (s4_t *db, const char *pattern, s4_cmp_mode_t mode)
+{
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_transaction_t *trans;
+	s4_condition_t *cond;
+	s4_resultset_t *set;
+	s4_val_t *val = s4_val_new_string (pattern);
+	guint32 ret = 0;
+	int32_t id;
+	int i;
+
+	s4_fetchspec_add (fs, "id", NULL, S4_FETCH_PARENT);
+	cond = s4_cond_new_filter (S4_FILTER_MATCH, "title", val, NULL, mode, 0);
+
+	trans = s4_begin (db, 0);
+	set = s4_query (trans, fs, cond);
+	for (i = 0; i < s4_resultset_get_rowcount (set); i++) {
+		if (s4_val_get_int (s4_result_get_val (s4_resultset_get_result (set, i, 0)), &id))
+			ret |= 1 << id;
+	}
+	s4_resultset_free (set);
+	CU_ASSERT (s4_commit (trans));
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (val);
+
+	return ret;
+}
+
+CASE (test_match_prefix) {
+	struct {
+		const char *str;
+		int ival;
+	} titles[] = {
+		{"Beatles", 0}, {"beat it", 0}, {"BEAT", 0}, {"Beast", 0},
+		{"bea", 0}, {"abeat", 0}, {"Straße", 0}, {"strasse", 0},
+		{NULL, 12}, {NULL, 123}, {"12", 0}, {"", 0}, {"Be", 0},
+		{NULL, 0}};
+	const char *patterns[] = {"Beat*", "beat*", "BEAT", "Be?t*", "Bea*t",
+		"strass*", "Straß*", "stra?e", "12*", "1?", "*at", "B*", "", "z*", NULL};
+	const char *indices[] = {"title", NULL};
+	s4_cmp_mode_t modes[] = {S4_CMP_BINARY, S4_CMP_CASELESS};
+	s4_t *plain;
+	int i, j;
+
+	s4 = s4_open (NULL, indices, S4_MEMORY);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	plain = s4_open (NULL, NULL, S4_MEMORY);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (plain);
+
+	for (i = 0; titles[i].str != NULL || titles[i].ival != 0; i++) {
+		_token_add (s4, i, titles[i].str, titles[i].ival, "src_a", 0);
+		_token_add (plain, i, titles[i].str, titles[i].ival, "src_a", 0);
+	}
+
+	/* Searching the range of the prefix finds the same entries
+	 * as checking every entry
+	 */
+	for (i = 0; patterns[i] != NULL; i++) {
+		for (j = 0; j < 2; j++) {
+			CU_ASSERT_EQUAL (_match_ids (s4, patterns[i], modes[j]),
+					_match_ids (plain, patterns[i], modes[j]));
+		}
+	}
+	CU_ASSERT_EQUAL (_match_ids (s4, "beat*", S4_CMP_CASELESS),
+			(1 << 0) | (1 << 1) | (1 << 2));
+	CU_ASSERT_EQUAL (_match_ids (s4, "Beat*", S4_CMP_BINARY), 1 << 0);
+
+	s4_close (plain);
+	_mem_close ();
+}
+
+CASE (test_result_arena) {
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set, *copy;
+	const s4_resultrow_t *row;
+	const s4_result_t *res;
+	s4_val_t *ival, *tval;
+	int32_t ret_i;
+	int i;
+
+	_mem_open ();
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 100; i++) {
+		ival = s4_val_new_int (i);
+		tval = s4_val_new_string ("title");
+		CU_ASSERT (s4_add (trans, "id", ival, "title", tval, "src_a"));
+		s4_val_free (ival);
+		s4_val_free (tval);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	s4_fetchspec_add (fs, "id", NULL, S4_FETCH_PARENT);
+	s4_fetchspec_add (fs, "title", NULL, S4_FETCH_DATA);
+	cond = s4_cond_new_filter (S4_FILTER_EXISTS, "title", NULL, NULL, S4_CMP_BINARY, 0);
+
+	/* Rows moved to another set outlive the set they came from */
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+	copy = s4_resultset_create (2);
+	for (i = 0; s4_resultset_get_row (set, i, &row); i++) {
+		if (i % 2 == 0)
+			s4_resultset_add_row (copy, row);
+	}
+	s4_resultset_free (set);
+
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (copy), 50);
+	for (i = 0; s4_resultset_get_row (copy, i, &row); i++) {
+		CU_ASSERT (s4_resultrow_get_col (row, 0, &res));
+		CU_ASSERT (s4_val_get_int (s4_result_get_val (res), &ret_i));
+		CU_ASSERT (s4_resultrow_get_col (row, 1, &res));
+		CU_ASSERT_STRING_EQUAL (s4_result_get_key (res), "title");
+	}
+	s4_resultset_free (copy);
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	_mem_close ();
+}
+
+CASE (test_bulk) {
+	const char *indices[] = {"tracknr", NULL};
+	struct db_struct db[] = {
+		{"a", {"b", "c", NULL}, "src_a"},
+		{"b", {"x", NULL}, "src_b"},
+		{NULL, {NULL}, NULL}};
+	s4_bulk_t *bulk;
+	char *delta_name;
+	s4_val_t *ival, *tval;
+	int i;
+
+	_open_with_options (S4_NEW | S4_INCREMENTAL, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	create_db (db);
+
+	bulk = s4_bulk_begin (s4);
+	/* Out of order, and every relation twice */
+	for (i = 0; i < 2000; i++) {
+		ival = s4_val_new_int ((i * 7) % 1000);
+		tval = s4_val_new_int ((i * 7) % 10);
+		CU_ASSERT (s4_bulk_add (bulk, "id", ival, "tracknr", tval, "src_a"));
+		s4_val_free (ival);
+		s4_val_free (tval);
+	}
+	CU_ASSERT (s4_bulk_finish (bulk));
+
+	check_db (db);
+	check_int_query ("id", 42, S4_COND_PARENT, 1);
+	check_int_query ("tracknr", 3, 0, 100);
+
+	bulk = s4_bulk_begin (s4);
+	ival = s4_val_new_int (5000);
+	CU_ASSERT (s4_bulk_add (bulk, "id", ival, "tracknr", ival, "src_a"));
+	CU_ASSERT_FALSE (s4_bulk_add (bulk, "id", ival, "tracknr", NULL, "src_a"));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_EXECUTE);
+	CU_ASSERT_FALSE (s4_bulk_add (bulk, "id", ival, NULL, ival, "src_a"));
+	/* No transaction can begin while the load is open */
+	CU_ASSERT_PTR_NULL (s4_begin (s4, 0));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_BULK);
+	s4_val_free (ival);
+	s4_bulk_abort (bulk);
+	check_int_query ("id", 5000, S4_COND_PARENT, 0);
+
+	s4_close (s4);
+
+	s4 = s4_open (name, indices, S4_EXISTS | S4_INCREMENTAL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	check_db (db);
+	check_int_query ("id", 42, S4_COND_PARENT, 1);
+	check_int_query ("tracknr", 3, 0, 100);
+	check_int_filter (S4_FILTER_SMALLER, "tracknr", 5, 0, 500);
+
+	delta_name = g_strconcat (name, ".delta", NULL);
+	g_unlink (delta_name);
+	g_free (delta_name);
+	_close ();
+}
+
+CASE (test_wide_entry) {
+	const char *prefs[] = {"src_a", NULL};
+	s4_sourcepref_t *sp = s4_sourcepref_create (prefs);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	const s4_result_t *res;
+	s4_val_t *id, *val;
+	char key[16];
+	int32_t ival;
+	int i, count;
+
+	_mem_open ();
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	/* More items than fit in the buffers used to check an entry */
+	id = s4_val_new_int (1);
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 40; i++) {
+		sprintf (key, "k%02i", i);
+		val = s4_val_new_int (i);
+		CU_ASSERT (s4_add (trans, "id", id, key, val, "src_a"));
+		s4_val_free (val);
+		val = s4_val_new_int (i + 1000);
+		CU_ASSERT (s4_add (trans, "id", id, key, val, "src_b"));
+		s4_val_free (val);
+	}
+	CU_ASSERT (s4_commit (trans));
+	s4_val_free (id);
+
+	s4_fetchspec_add (fs, NULL, sp, S4_FETCH_DATA);
+	s4_fetchspec_add (fs, "k39", sp, S4_FETCH_DATA);
+	s4_fetchspec_add (fs, "k20", NULL, S4_FETCH_DATA);
+
+	val = s4_val_new_int (39);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "k39", val, sp, S4_CMP_CASELESS, 0);
+	s4_val_free (val);
+
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+	s4_cond_unref (cond);
+	CU_ASSERT_EQUAL_FATAL (s4_resultset_get_rowcount (set), 1);
+
+	count = 0;
+	for (res = s4_resultset_get_result (set, 0, 0); res != NULL; res = s4_result_next (res)) {
+		CU_ASSERT_STRING_EQUAL (s4_result_get_src (res), "src_a");
+		count++;
+	}
+	CU_ASSERT_EQUAL (count, 40);
+
+	res = s4_resultset_get_result (set, 0, 1);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (res);
+	CU_ASSERT (s4_val_get_int (s4_result_get_val (res), &ival));
+	CU_ASSERT_EQUAL (ival, 39);
+	CU_ASSERT_PTR_NULL (s4_result_next (res));
+
+	/* Without a sourcepref every source is as good */
+	count = 0;
+	for (res = s4_resultset_get_result (set, 0, 2); res != NULL; res = s4_result_next (res))
+		count++;
+	CU_ASSERT_EQUAL (count, 2);
+	s4_resultset_free (set);
+
+	/* Only the values from src_a are checked */
+	val = s4_val_new_int (1039);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "k39", val, sp, S4_CMP_CASELESS, 0);
+	check_cond (cond, 0);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, NULL, val, NULL, S4_CMP_CASELESS, 0);
+	check_cond (cond, 1);
+	s4_val_free (val);
+
+	s4_fetchspec_free (fs);
+	s4_sourcepref_unref (sp);
+	_mem_close ();
+}
+
+static int64_t _histogram_sum (const s4_stats_timer_t *timer)
+{
+	int64_t sum = 0;
+	int i;
+
+	for (i = 0; i < S4_STATS_HISTOGRAM_SIZE; i++)
+		sum += timer->histogram[i];
+
+	return sum;
+}
+
+CASE (test_stats) {
+	s4_stats_t before, after;
+	s4_transaction_t *trans;
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_resultset_t *set;
+	s4_val_t *id, *val;
+	char title[8];
+	int i;
+
+	_open (S4_NEW);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 3; i++) {
+		sprintf (title, "t%i", i);
+		id = s4_val_new_int (i);
+		val = s4_val_new_string (title);
+		CU_ASSERT (s4_add (trans, "id", id, "title", val, "src"));
+		s4_val_free (id);
+		s4_val_free (val);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	s4_get_stats (s4, &before);
+	s4_fetchspec_add (fs, "title", NULL, S4_FETCH_DATA);
+
+	/* There is no index on title, so every entry is checked */
+	val = s4_val_new_string ("t1");
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "title", val, NULL, S4_CMP_BINARY, 0);
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	CU_ASSERT (s4_commit (trans));
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+	s4_val_free (val);
+
+	val = s4_val_new_int (2);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "id", val, NULL, S4_CMP_BINARY, S4_COND_PARENT);
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	CU_ASSERT (s4_commit (trans));
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+	s4_val_free (val);
+
+	s4_sync (s4);
+	s4_get_stats (s4, &after);
+
+	/* Syncs query the database without counting it */
+	CU_ASSERT_EQUAL (after.query.count - before.query.count, 2);
+	CU_ASSERT_EQUAL (after.sync.count - before.sync.count, 1);
+	CU_ASSERT (after.plan_indexed - before.plan_indexed >= 1);
+	CU_ASSERT (after.plan_scanned - before.plan_scanned >= 1);
+	CU_ASSERT (after.rows_examined - before.rows_examined >= 4);
+	CU_ASSERT (after.rows_returned - before.rows_returned >= 2);
+	CU_ASSERT_EQUAL (after.deadlocks, 0);
+	CU_ASSERT_EQUAL (after.log_full, 0);
+
+	CU_ASSERT_EQUAL (_histogram_sum (&after.query), after.query.count);
+	CU_ASSERT_EQUAL (_histogram_sum (&after.sync), after.sync.count);
+	CU_ASSERT_EQUAL (_histogram_sum (&after.log_fsync), after.log_fsync.count);
+	CU_ASSERT (after.log_fsync.count > 0);
+	CU_ASSERT (after.log_size > 0);
+	CU_ASSERT (after.log_used >= 0 && after.log_used <= after.log_size);
+
+	s4_fetchspec_free (fs);
+	_close ();
+
+	/* Memory databases have no log */
+	_mem_open ();
+	s4_get_stats (s4, &after);
+	CU_ASSERT_EQUAL (after.log_size, 0);
+	CU_ASSERT_EQUAL (after.sync.count, 0);
+	_mem_close ();
+}
@@ -38,3 +38,113 @@ CASE (test_sourcepref) {
 
 	s4_sourcepref_unref (sp);
 }
+
+/* The number of titles fetched with sp, and the string of the last one */
+static int _fetch_titles (s4_t *s4, s4_sourcepref_t *sp, const char **str)
+{
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	const s4_result_t *res;
+	int ret = 0;
+
+	s4_fetchspec_add (fs, "title", sp, S4_FETCH_DATA);
+	cond = s4_cond_new_filter (S4_FILTER_EXISTS, "title", NULL, sp, S4_CMP_BINARY, 0);
+
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	for (res = s4_resultset_get_result (set, 0, 0); res != NULL; res = s4_result_next (res)) {
+		s4_val_get_str (s4_result_get_val (res), str);
+		ret++;
+	}
+	s4_resultset_free (set);
+	CU_ASSERT (s4_commit (trans));
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+
+	return ret;
+}
+
+CASE (test_sourcepref_query) {
+	const char *first[] = {"src7", "src4*", NULL}, *forty[] = {"src4*", NULL};
+	s4_sourcepref_t *sp_first = s4_sourcepref_create (first);
+	s4_sourcepref_t *sp_forty = s4_sourcepref_create (forty);
+	s4_t *a = s4_open (NULL, NULL, S4_MEMORY);
+	s4_t *b = s4_open (NULL, NULL, S4_MEMORY);
+	s4_transaction_t *trans;
+	s4_val_t *id = s4_val_new_int (1), *val;
+	const char *str;
+	char src[16];
+	int i, j;
+
+	/* The sources are added in a different order, so the
+	 * databases have different ids for them
+	 */
+	for (i = 0; i < 50; i++) {
+		sprintf (src, "src%i", i);
+		val = s4_val_new_string (src + 1);
+		trans = s4_begin (a, 0);
+		CU_ASSERT (s4_add (trans, "id", id, "title", val, src));
+		CU_ASSERT (s4_commit (trans));
+		s4_val_free (val);
+
+		sprintf (src, "src%i", 49 - i);
+		val = s4_val_new_string (src + 1);
+		trans = s4_begin (b, 0);
+		CU_ASSERT (s4_add (trans, "id", id, "title", val, src));
+		CU_ASSERT (s4_commit (trans));
+		s4_val_free (val);
+	}
+
+	/* Both databases use the same sourceprefs */
+	for (j = 0; j < 2; j++) {
+		CU_ASSERT_EQUAL (_fetch_titles (a, sp_first, &str), 1);
+		CU_ASSERT_STRING_EQUAL (str, "rc7");
+		CU_ASSERT_EQUAL (_fetch_titles (b, sp_first, &str), 1);
+		CU_ASSERT_STRING_EQUAL (str, "rc7");
+		CU_ASSERT_EQUAL (_fetch_titles (a, sp_forty, &str), 11);
+		CU_ASSERT_EQUAL (_fetch_titles (b, sp_forty, &str), 11);
+	}
+
+	s4_val_free (id);
+	s4_close (a);
+	s4_close (b);
+	s4_sourcepref_unref (sp_first);
+	s4_sourcepref_unref (sp_forty);
+}
+
+CASE (test_sourcepref_reopen) {
+	const char *first[] = {"src7", "src4*", NULL};
+	s4_sourcepref_t *sp = s4_sourcepref_create (first);
+	s4_transaction_t *trans;
+	s4_val_t *id = s4_val_new_int (1), *val;
+	const char *str;
+	char src[16];
+	int i, j;
+
+	/* A database opened after another one is closed may get the
+	 * same address, but its sources have other ids
+	 */
+	for (j = 0; j < 3; j++) {
+		s4_t *s4 = s4_open (NULL, NULL, S4_MEMORY);
+
+		for (i = 0; i < 50; i++) {
+			sprintf (src, "src%i", (j % 2)?49 - i:i);
+			val = s4_val_new_string (src + 1);
+			trans = s4_begin (s4, 0);
+			CU_ASSERT (s4_add (trans, "id", id, "title", val, src));
+			CU_ASSERT (s4_commit (trans));
+			s4_val_free (val);
+		}
+
+		CU_ASSERT_EQUAL (_fetch_titles (s4, sp, &str), 1);
+		CU_ASSERT_STRING_EQUAL (str, "rc7");
+		s4_close (s4);
+	}
+
+	s4_val_free (id);
+	s4_sourcepref_unref (sp);
+}
@@ -118,3 +118,313 @@ CASE (test_abort) {
 
 	_mem_close ();
 }
+
+/* Counts the values entry a=1 has (0 if it does not match) */
+static int _query_entry (s4_transaction_t *trans)
+{
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, "a", val,
+			NULL, S4_CMP_CASELESS, S4_COND_PARENT);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	const s4_resultrow_t *row;
+	const s4_result_t *res;
+	s4_resultset_t *set;
+	int ret = 0;
+
+	s4_fetchspec_add (fs, NULL, NULL, S4_FETCH_DATA);
+	set = s4_query (trans, fs, cond);
+
+	if (s4_resultset_get_row (set, 0, &row)
+			&& s4_resultrow_get_col (row, 0, &res)) {
+		for (; res != NULL; res = s4_result_next (res))
+			ret++;
+	}
+
+	s4_resultset_free (set);
+	s4_fetchspec_free (fs);
+	s4_cond_free (cond);
+
+	return ret;
+}
+
+static void _writer_thread (const char *key)
+{
+	s4_transaction_t *trans = s4_begin (s4, 0);
+
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, key, val, "src"));
+	CU_ASSERT_TRUE (s4_commit (trans));
+}
+
+CASE (test_snapshot) {
+	s4_transaction_t *trans, *r1, *r2;
+	GThread *t;
+	_mem_open ();
+
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "b", val, "src"));
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	r1 = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT_EQUAL (_query_entry (r1), 1);
+
+	/* Readers do not hold locks, so the writer does not wait */
+	t = g_thread_new ("writer", (GThreadFunc)_writer_thread, "c");
+	g_thread_join (t);
+
+	/* and r1 still sees the entry as it was when it started */
+	CU_ASSERT_EQUAL (_query_entry (r1), 1);
+
+	r2 = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT_EQUAL (_query_entry (r2), 2);
+
+	/* A writer that is still running is not seen */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "d", val, "src"));
+	CU_ASSERT_TRUE (s4_del (trans, "a", val, "b", val, "src"));
+	CU_ASSERT_EQUAL (_query_entry (trans), 2);
+	CU_ASSERT_EQUAL (_query_entry (r1), 1);
+	CU_ASSERT_EQUAL (_query_entry (r2), 2);
+
+	t = g_thread_new ("writer", (GThreadFunc)_writer_thread, "e");
+	s4_abort (trans);
+	g_thread_join (t);
+
+	CU_ASSERT_EQUAL (_query_entry (r1), 1);
+	CU_ASSERT_EQUAL (_query_entry (r2), 2);
+	CU_ASSERT_TRUE (s4_commit (r1));
+	CU_ASSERT_TRUE (s4_commit (r2));
+
+	r1 = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT_EQUAL (_query_entry (r1), 3);
+	CU_ASSERT_TRUE (s4_commit (r1));
+
+	_mem_close ();
+}
+
+static int _count_b (s4_transaction_t *trans, int32_t b)
+{
+	s4_val_t *bval = s4_val_new_int (b);
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, "b", bval,
+			NULL, S4_CMP_CASELESS, 0);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_resultset_t *set;
+	int ret;
+
+	s4_fetchspec_add (fs, NULL, NULL, S4_FETCH_DATA);
+	set = s4_query (trans, fs, cond);
+	ret = s4_resultset_get_rowcount (set);
+
+	s4_resultset_free (set);
+	s4_fetchspec_free (fs);
+	s4_cond_free (cond);
+	s4_val_free (bval);
+
+	return ret;
+}
+
+CASE (test_snapshot_index) {
+	const char *indices[] = {"b", NULL};
+	s4_transaction_t *trans, *r1, *r2;
+	s4_val_t *two = s4_val_new_int (2);
+
+	s4 = s4_open (NULL, indices, S4_MEMORY);
+
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "b", val, "src"));
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	r1 = s4_begin (s4, S4_TRANS_READONLY);
+
+	/* Move the entry to another value in the index */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_TRUE (s4_del (trans, "a", val, "b", val, "src"));
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "b", two, "src"));
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	r2 = s4_begin (s4, S4_TRANS_READONLY);
+
+	CU_ASSERT_EQUAL (_count_b (r1, 1), 1);
+	CU_ASSERT_EQUAL (_count_b (r1, 2), 0);
+	CU_ASSERT_EQUAL (_count_b (r2, 1), 0);
+	CU_ASSERT_EQUAL (_count_b (r2, 2), 1);
+
+	CU_ASSERT_TRUE (s4_commit (r1));
+	CU_ASSERT_TRUE (s4_commit (r2));
+
+	s4_val_free (two);
+	_mem_close ();
+}
+
+static s4_resultset_t *_query_b (s4_transaction_t *trans, int32_t b)
+{
+	s4_val_t *bval = s4_val_new_int (b);
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, "b", bval,
+			NULL, S4_CMP_CASELESS, 0);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_resultset_t *set;
+
+	s4_fetchspec_add (fs, "b", NULL, S4_FETCH_DATA);
+	set = s4_query (trans, fs, cond);
+
+	s4_fetchspec_free (fs);
+	s4_cond_free (cond);
+	s4_val_free (bval);
+
+	return set;
+}
+
+static int64_t _cache_hits (void)
+{
+	s4_stats_t stats;
+
+	s4_get_stats (s4, &stats);
+	return stats.query_cache_hits;
+}
+
+static const s4_resultrow_t *_first_row (const s4_resultset_t *set)
+{
+	const s4_resultrow_t *row = NULL;
+
+	s4_resultset_get_row (set, 0, &row);
+	return row;
+}
+
+CASE (test_query_cache) {
+	s4_options_t *opts = s4_options_create ();
+	s4_transaction_t *trans, *r1, *r2;
+	s4_resultset_t *set, *other;
+	int64_t hits;
+
+	s4_options_set_query_cache (opts, 2);
+	s4 = s4_open_with_options (NULL, NULL, S4_MEMORY, opts);
+	s4_options_free (opts);
+
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "b", val, "src"));
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	/* Queries made the same way get the same rows,
+	 * in a resultset of their own
+	 */
+	r1 = s4_begin (s4, S4_TRANS_READONLY);
+	set = _query_b (r1, 1);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	hits = _cache_hits ();
+	other = _query_b (r1, 1);
+	CU_ASSERT_EQUAL (_cache_hits (), hits + 1);
+	CU_ASSERT_PTR_NOT_EQUAL (set, other);
+	CU_ASSERT_PTR_EQUAL (_first_row (set), _first_row (other));
+	s4_resultset_free (other);
+
+	/* Changing a key the query does not use keeps it */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "c", val, "src"));
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	r2 = s4_begin (s4, S4_TRANS_READONLY);
+	other = _query_b (r2, 1);
+	CU_ASSERT_EQUAL (_cache_hits (), hits + 2);
+	s4_resultset_free (other);
+	CU_ASSERT_TRUE (s4_commit (r2));
+
+	/* Changing one it does use drops it */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_TRUE (s4_del (trans, "a", val, "b", val, "src"));
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	r2 = s4_begin (s4, S4_TRANS_READONLY);
+	other = _query_b (r2, 1);
+	CU_ASSERT_EQUAL (_cache_hits (), hits + 2);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (other), 0);
+	s4_resultset_free (set);
+
+	/* Older snapshots do not see the newer result */
+	set = _query_b (r1, 1);
+	CU_ASSERT_EQUAL (_cache_hits (), hits + 2);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	s4_resultset_free (set);
+	CU_ASSERT_TRUE (s4_commit (r1));
+
+	set = _query_b (r2, 1);
+	CU_ASSERT_EQUAL (_cache_hits (), hits + 3);
+	s4_resultset_free (set);
+
+	/* Transactions that can write do not use the cache */
+	trans = s4_begin (s4, 0);
+	set = _query_b (trans, 1);
+	CU_ASSERT_EQUAL (_cache_hits (), hits + 3);
+	s4_resultset_free (set);
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	/* The least recently used result is dropped */
+	s4_resultset_free (_query_b (r2, 2));
+	s4_resultset_free (_query_b (r2, 3));
+	set = _query_b (r2, 1);
+	CU_ASSERT_EQUAL (_cache_hits (), hits + 3);
+	s4_resultset_free (set);
+	s4_resultset_free (other);
+	CU_ASSERT_TRUE (s4_commit (r2));
+
+	_mem_close ();
+}
+
+CASE (test_query_cache_sort) {
+	s4_options_t *opts = s4_options_create ();
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set, *sorted;
+	s4_order_t *order = s4_order_create ();
+	s4_order_entry_t *entry;
+	s4_val_t *two = s4_val_new_int (2);
+	const s4_resultrow_t *first;
+	int64_t hits;
+	int32_t i;
+
+	s4_options_set_query_cache (opts, 2);
+	s4 = s4_open_with_options (NULL, NULL, S4_MEMORY, opts);
+	s4_options_free (opts);
+
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "b", val, "src"));
+	CU_ASSERT_TRUE (s4_add (trans, "a", two, "b", val, "src"));
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	s4_fetchspec_add (fs, "a", NULL, S4_FETCH_PARENT);
+	cond = s4_cond_new_filter (S4_FILTER_EXISTS, "b", NULL, NULL, S4_CMP_CASELESS, 0);
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL_FATAL (s4_resultset_get_rowcount (set), 2);
+	first = _first_row (set);
+
+	/* Sorted the other way around than the query returned them */
+	CU_ASSERT_TRUE (s4_val_get_int (s4_result_get_val (s4_resultset_get_result (set, 0, 0)), &i));
+	entry = s4_order_add_column (order, S4_CMP_BINARY,
+			(i == 1)?S4_ORDER_DESCENDING:S4_ORDER_ASCENDING);
+	s4_order_entry_add_choice (entry, 0);
+
+	/* Sorting a cached result does not reorder the other ones */
+	hits = _cache_hits ();
+	sorted = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (_cache_hits (), hits + 1);
+	s4_resultset_sort (sorted, order);
+	CU_ASSERT_PTR_NOT_EQUAL (_first_row (sorted), first);
+	s4_resultset_sort_limit (sorted, order, 1);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (sorted), 1);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 2);
+	CU_ASSERT_PTR_EQUAL (_first_row (set), first);
+	s4_resultset_free (sorted);
+
+	sorted = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (sorted), 2);
+	CU_ASSERT_PTR_EQUAL (_first_row (sorted), first);
+	s4_resultset_free (sorted);
+
+	s4_resultset_free (set);
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	s4_order_free (order);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (two);
+	_mem_close ();
+}